@@ -28,30 +28,227 @@
 #include "side_chain.h"
 #include "pool_block.h"
 #include "params.h"
+#include "p2pool_api.h"
 #include <zmq.hpp>
 #include <ctime>
 #include <numeric>
 
 static constexpr char log_category_prefix[] = "BlockTemplate ";
 
+// Time limit for the background search of the optimal transaction selection
+static constexpr uint64_t TX_SELECTION_TIME_LIMIT_MS = 500;
+
 namespace p2pool {
 
+bool BlockTemplate::TxSelectionKey::operator==(const TxSelectionKey& k) const
+{
+	return (prev_id == k.prev_id) &&
+		(median_weight == k.median_weight) &&
+		(miner_tx_weight == k.miner_tx_weight) &&
+		(num_transactions == k.num_transactions) &&
+		(total_fees == k.total_fees);
+}
+
+struct BlockTemplate::TxSelectionJob
+{
+	uv_work_t req;
+	BlockTemplate* owner;
+
+	TxSelectionKey key;
+	std::vector<TxMempoolData> txs;
+	uint64_t base_reward;
+	uint64_t median_weight;
+	uint64_t miner_tx_weight;
+
+	uint64_t greedy_reward;
+	TxSelection result;
+	bool optimal;
+};
+
+struct BlockTemplate::TemplateData
+{
+	TemplateData()
+		: m_templateId(0)
+		, m_blockHeaderSize(0)
+		, m_minerTxOffsetInTemplate(0)
+		, m_minerTxSize(0)
+		, m_nonceOffset(0)
+		, m_extraNonceOffsetInTemplate(0)
+		, m_numTransactionHashes(0)
+		, m_prevId{}
+		, m_height(0)
+		, m_difficulty{}
+		, m_seedHash{}
+		, m_timestamp(0)
+		, m_createdTime(0)
+		, m_finalReward(0)
+	{}
+
+	hash calc_miner_tx_hash(uint32_t extra_nonce) const;
+	void calc_merkle_roots(uint32_t extra_nonce_start, uint32_t count, hash* roots) const;
+
+	uint32_t get_hashing_blob(uint32_t extra_nonce, uint8_t* blob) const;
+	uint32_t write_hashing_blob(const hash& root_hash, uint8_t* blob) const;
+
+	uint32_t m_templateId;
+
+	std::vector<uint8_t> m_blockTemplateBlob;
+	std::vector<uint8_t> m_merkleTreeMainBranch;
+
+	size_t m_blockHeaderSize;
+	size_t m_minerTxOffsetInTemplate;
+	size_t m_minerTxSize;
+	size_t m_nonceOffset;
+	size_t m_extraNonceOffsetInTemplate;
+
+	size_t m_numTransactionHashes;
+	hash m_prevId;
+	uint64_t m_height;
+	difficulty_type m_difficulty;
+	hash m_seedHash;
+
+	uint64_t m_timestamp;
+	time_t m_createdTime;
+
+	PoolBlock m_poolBlockTemplate;
+
+	uint64_t m_finalReward;
+};
+
+struct BlockTemplate::SidechainPrecalc
+{
+	SidechainPrecalc() : m_stateVersion(0), m_txkeySec{}, m_minerWallet(nullptr) {}
+
+	// Can be called from any thread
+	// Output keys and key derivations from "prev" are reused if it was made with the same tx keys
+	void calc(SideChain& side_chain, const Wallet& miner_wallet, const hash& txkey_sec, const SidechainPrecalc* prev)
+	{
+		m_txkeySec = txkey_sec;
+		m_minerWallet = miner_wallet;
+		m_stateVersion = side_chain.fill_sidechain_data(m_block, &m_minerWallet, m_txkeySec, m_shares);
+
+		// Shares point to wallets in sidechain blocks which can be pruned later, so keep a copy
+		m_wallets.clear();
+		m_wallets.reserve(m_shares.size());
+		for (const MinerShare& share : m_shares) {
+			m_wallets.push_back(*share.m_wallet);
+		}
+
+		if (prev && (prev->m_txkeySec != txkey_sec)) {
+			prev = nullptr;
+		}
+
+		// Output key depends on the wallet, tx key and output index. Shares are sorted by wallet,
+		// so when the PPLNS window moves most outputs stay where they were or shift by a few positions.
+		// Key derivation depends only on the wallet and tx key, so it's reused for shifted outputs.
+		m_derivations.clear();
+		m_derivations.reserve(m_shares.size());
+
+		m_ephPublicKeys.resize(m_shares.size());
+
+		size_t num_reused = 0;
+		size_t num_derivations = 0;
+
+		for (size_t i = 0, n = m_shares.size(); i < n; ++i) {
+			const Wallet& w = m_wallets[i];
+			m_shares[i].m_wallet = &m_wallets[i];
+
+			if (prev && (i < prev->m_wallets.size()) && same_wallet(prev->m_wallets[i], w)) {
+				m_ephPublicKeys[i] = prev->m_ephPublicKeys[i];
+				++num_reused;
+				continue;
+			}
+
+			hash derivation;
+			bool found = false;
+
+			if (prev) {
+				auto it = prev->m_derivations.find(w.view_public_key());
+				if (it != prev->m_derivations.end()) {
+					derivation = it->second;
+					found = true;
+				}
+			}
+
+			if (!found) {
+				if (!generate_key_derivation(w.view_public_key(), txkey_sec, derivation)) {
+					LOGERR(1, "generate_key_derivation failed at index " << i);
+				}
+				++num_derivations;
+			}
+
+			m_derivations.emplace(w.view_public_key(), derivation);
+
+			if (!derive_public_key(derivation, i, w.spend_public_key(), m_ephPublicKeys[i])) {
+				LOGERR(1, "derive_public_key failed at index " << i);
+			}
+		}
+
+		// Keep derivations for outputs that were reused too, they'll be needed when these outputs shift
+		if (prev) {
+			for (const Wallet& w : m_wallets) {
+				auto it = prev->m_derivations.find(w.view_public_key());
+				if (it != prev->m_derivations.end()) {
+					m_derivations.emplace(it->first, it->second);
+				}
+			}
+		}
+
+		LOGINFO(5, "output keys: " << m_shares.size() << " outputs, " << num_reused << " reused, " << num_derivations << " new key derivations");
+	}
+
+	static FORCEINLINE bool same_wallet(const Wallet& a, const Wallet& b)
+	{
+		return (a.spend_public_key() == b.spend_public_key()) && (a.view_public_key() == b.view_public_key());
+	}
+
+	bool valid(uint64_t state_version, const hash& txkey_sec, const Wallet& miner_wallet) const
+	{
+		return (m_stateVersion == state_version) && (m_txkeySec == txkey_sec) && same_wallet(m_minerWallet, miner_wallet);
+	}
+
+	void apply(PoolBlock& block) const
+	{
+		block.m_minerWallet = m_block.m_minerWallet;
+		block.m_txkeySec = m_block.m_txkeySec;
+		block.m_parent = m_block.m_parent;
+		block.m_uncles = m_block.m_uncles;
+		block.m_sidechainHeight = m_block.m_sidechainHeight;
+		block.m_difficulty = m_block.m_difficulty;
+		block.m_cumulativeDifficulty = m_block.m_cumulativeDifficulty;
+	}
+
+	uint64_t m_stateVersion;
+	hash m_txkeySec;
+	Wallet m_minerWallet;
+
+	// Only sidechain fields are filled in
+	PoolBlock m_block;
+
+	std::vector<MinerShare> m_shares;
+	std::vector<Wallet> m_wallets;
+	std::vector<hash> m_ephPublicKeys;
+
+	// Wallet's view public key -> key derivation for m_txkeySec
+	unordered_map<hash, hash> m_derivations;
+};
+
+struct BlockTemplate::PrecalcJob
+{
+	uv_work_t req;
+	BlockTemplate* owner;
+	SidechainPrecalc* result;
+};
+
+struct BlockTemplate::TemplateHistory
+{
+	// m_templates[i] has template id m_templates[0]->m_templateId - i
+	std::vector<std::shared_ptr<const TemplateData>> m_templates;
+};
+
 BlockTemplate::BlockTemplate(p2pool* pool)
 	: m_pool(pool)
 	, m_templateId(0)
-	, m_blockHeaderSize(0)
-	, m_minerTxOffsetInTemplate(0)
-	, m_minerTxSize(0)
-	, m_nonceOffset(0)
-	, m_extraNonceOffsetInTemplate(0)
-	, m_numTransactionHashes(0)
-	, m_prevId{}
-	, m_height(0)
-	, m_difficulty{}
-	, m_seedHash{}
-	, m_timestamp(0)
-	, m_poolBlockTemplate(new PoolBlock())
-	, m_finalReward(0)
 {
 	uv_rwlock_init_checked(&m_lock);
 
@@ -60,15 +257,8 @@ BlockTemplate::BlockTemplate(p2pool* pool)
 	m_minerTxExtra.reserve(64);
 	m_transactionHashes.reserve(8192);
 	m_rewards.reserve(100);
-	m_blockTemplateBlob.reserve(65536);
-	m_merkleTreeMainBranch.reserve(HASH_SIZE * 10);
 	m_mempoolTxs.reserve(1024);
-	m_mempoolTxsOrder.reserve(1024);
-	m_shares.reserve(m_pool->side_chain().chain_window_size() * 2);
-
-	for (size_t i = 0; i < array_size(&BlockTemplate::m_oldTemplates); ++i) {
-		m_oldTemplates[i] = new BlockTemplate(*this);
-	}
+	m_txSelection.txs.reserve(1024);
 
 #if TEST_MEMPOOL_PICKING_ALGORITHM
 	m_knapsack.reserve(512 * 309375);
@@ -79,65 +269,45 @@ BlockTemplate::BlockTemplate(p2pool* pool)
 
 BlockTemplate::~BlockTemplate()
 {
-	for (size_t i = 0; i < array_size(&BlockTemplate::m_oldTemplates); ++i) {
-		delete m_oldTemplates[i];
-	}
+	delete m_txSelectionJobPending;
+	delete m_precalc;
 
 	uv_rwlock_destroy(&m_lock);
-
-	delete m_poolBlockTemplate;
 }
 
-BlockTemplate::BlockTemplate(const BlockTemplate& b)
-	: m_poolBlockTemplate(new PoolBlock())
+std::shared_ptr<const BlockTemplate::TemplateHistory> BlockTemplate::get_history() const
 {
-	uv_rwlock_init_checked(&m_lock);
-	*this = b;
+	return std::atomic_load(&m_history);
 }
 
-// cppcheck-suppress operatorEqVarError
-BlockTemplate& BlockTemplate::operator=(const BlockTemplate& b)
+std::shared_ptr<const BlockTemplate::TemplateData> BlockTemplate::get_current() const
 {
-	if (this == &b) {
-		return *this;
+	std::shared_ptr<const TemplateHistory> history = get_history();
+	if (!history) {
+		return nullptr;
 	}
+	return history->m_templates.front();
+}
 
-	WriteLock lock(m_lock);
-
-	m_pool = b.m_pool;
-	m_templateId = b.m_templateId;
-	m_blockTemplateBlob = b.m_blockTemplateBlob;
-	m_merkleTreeMainBranch = b.m_merkleTreeMainBranch;
-	m_blockHeaderSize = b.m_blockHeaderSize;
-	m_minerTxOffsetInTemplate = b.m_minerTxOffsetInTemplate;
-	m_minerTxSize = b.m_minerTxSize;
-	m_nonceOffset = b.m_nonceOffset;
-	m_extraNonceOffsetInTemplate = b.m_extraNonceOffsetInTemplate;
-	m_numTransactionHashes = b.m_numTransactionHashes;
-	m_prevId = b.m_prevId;
-	m_height = b.m_height;
-	m_difficulty = b.m_difficulty;
-	m_seedHash = b.m_seedHash;
-	m_timestamp = b.m_timestamp;
-	m_txkeyPub = b.m_txkeyPub;
-	m_txkeySec = b.m_txkeySec;
-	*m_poolBlockTemplate = *b.m_poolBlockTemplate;
-	m_finalReward = b.m_finalReward;
+std::shared_ptr<const BlockTemplate::TemplateData> BlockTemplate::find_template(uint32_t template_id) const
+{
+	std::shared_ptr<const TemplateHistory> history = get_history();
+	if (!history) {
+		return nullptr;
+	}
 
-	m_minerTx.clear();
-	m_blockHeader.clear();
-	m_minerTxExtra.clear();
-	m_transactionHashes.clear();
-	m_rewards.clear();
-	m_mempoolTxs.clear();
-	m_mempoolTxsOrder.clear();
-	m_shares.clear();
+	// Template ids are sequential, so the position in history is known in advance
+	const uint32_t index = history->m_templates.front()->m_templateId - template_id;
+	if (index >= history->m_templates.size()) {
+		return nullptr;
+	}
 
-#if TEST_MEMPOOL_PICKING_ALGORITHM
-	m_knapsack.clear();
-#endif
+	const std::shared_ptr<const TemplateData>& t = history->m_templates[index];
+	if (t->m_templateId != template_id) {
+		return nullptr;
+	}
 
-	return *this;
+	return t;
 }
 
 static FORCEINLINE uint64_t get_base_reward(uint64_t already_generated_coins)
@@ -148,81 +318,38 @@ static FORCEINLINE uint64_t get_base_reward(uint64_t already_generated_coins)
 	return (result < min_reward) ? min_reward : result;
 }
 
-static FORCEINLINE uint64_t get_block_reward(uint64_t base_reward, uint64_t median_weight, uint64_t fees, uint64_t weight)
-{
-	if (weight <= median_weight) {
-		return base_reward + fees;
-	}
-
-	if (weight > median_weight * 2) {
-		return 0;
-	}
-
-	// This will overflow if median_weight >= 2^32
-	// Maybe fix it later like in Monero code, but it'll be fiiiine for now...
-	// Performance of this code is more important
-
-	uint64_t product[2];
-	product[0] = umul128(base_reward, (median_weight * 2 - weight) * weight, &product[1]);
-
-	uint64_t rem;
-	uint64_t reward = udiv128(product[1], product[0], median_weight * median_weight, &rem);
-
-	return reward + fees;
-}
-
-void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet* miner_wallet)
+void BlockTemplate::update(const MinerData& data, Mempool& mempool, Wallet* miner_wallet)
 {
 	if (data.major_version > HARDFORK_SUPPORTED_VERSION) {
 		LOGERR(1, "got hardfork version " << data.major_version << ", expected <= " << HARDFORK_SUPPORTED_VERSION);
 		return;
 	}
 
-	// Block template construction is relatively slow, but it's better to keep the lock the whole time
-	// instead of using temporary variables and making a quick swap in the end
-	// 
-	// All readers will line up for the new template instead of using the outdated template
-	WriteLock lock(m_lock);
+	// Block template construction is relatively slow, so it's built in a new object without holding any locks
+	// Readers keep using the previous template until the new one is published in the end
+	std::shared_ptr<TemplateData> new_template = std::make_shared<TemplateData>();
+	TemplateData& t = *new_template;
 
-	if (m_templateId > 0) {
-		*m_oldTemplates[m_templateId % array_size(&BlockTemplate::m_oldTemplates)] = *this;
-	}
+	t.m_templateId = m_templateId + 1;
 
-	++m_templateId;
+	{
+		ReadLock lock(m_lock);
+		t.m_poolBlockTemplate.m_txkeyPub = m_txkeyPub;
+		t.m_poolBlockTemplate.m_txkeySec = m_txkeySec;
+	}
 
-	m_height = data.height;
-	m_difficulty = data.difficulty;
-	m_seedHash = data.seed_hash;
+	t.m_height = data.height;
+	t.m_difficulty = data.difficulty;
+	t.m_seedHash = data.seed_hash;
 
 	const time_t cur_time = time(nullptr);
 
 	// Only choose transactions that were received 10 or more seconds ago
-	size_t total_mempool_transactions;
-	{
-		m_mempoolTxs.clear();
-
-		ReadLock mempool_lock(mempool.m_lock);
-
-		total_mempool_transactions = mempool.m_transactions.size();
-
-		for (auto& it : mempool.m_transactions) {
-			if (cur_time >= it.second.time_received + 10) {
-				m_mempoolTxs.emplace_back(it.second);
-			}
-		}
-	}
-
+	//
 	// Safeguard for busy mempool moments
 	// If the block template gets too big, nodes won't be able to send and receive it because of p2p packet size limit
 	// Select 1000 transactions with the highest fee per byte
-	if (m_mempoolTxs.size() > 1000) {
-		std::nth_element(m_mempoolTxs.begin(), m_mempoolTxs.begin() + 1000, m_mempoolTxs.end(),
-			[](const TxMempoolData& tx_a, const TxMempoolData& tx_b)
-			{
-				return tx_a.fee * tx_b.weight > tx_b.fee * tx_a.weight;
-			});
-		m_mempoolTxs.resize(1000);
-	}
+	const size_t total_mempool_transactions = mempool.get_best_transactions(cur_time, 1000, m_mempoolTxs);
 
 	LOGINFO(4, "mempool has " << total_mempool_transactions << " transactions, taking " << m_mempoolTxs.size() << " transactions from it");
 
@@ -243,38 +370,53 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 		", weight = " << log::Gray() << total_tx_weight);
 
 	m_blockHeader.clear();
-	m_poolBlockTemplate->m_verified = false;
+	t.m_poolBlockTemplate.m_verified = false;
 
 	// Major and minor hardfork version
 	m_blockHeader.push_back(data.major_version);
 	m_blockHeader.push_back(HARDFORK_SUPPORTED_VERSION);
-	m_poolBlockTemplate->m_majorVersion = data.major_version;
-	m_poolBlockTemplate->m_minorVersion = HARDFORK_SUPPORTED_VERSION;
+	t.m_poolBlockTemplate.m_majorVersion = data.major_version;
+	t.m_poolBlockTemplate.m_minorVersion = HARDFORK_SUPPORTED_VERSION;
 
 	// Timestamp
-	m_timestamp = cur_time;
-	if (m_timestamp <= data.median_timestamp) {
-		LOGWARN(2, "timestamp adjusted from " << m_timestamp << " to " << data.median_timestamp + 1 << ". Fix your system time!");
-		m_timestamp = data.median_timestamp + 1;
+	t.m_createdTime = cur_time;
+	t.m_timestamp = cur_time;
+	if (t.m_timestamp <= data.median_timestamp) {
+		LOGWARN(2, "timestamp adjusted from " << t.m_timestamp << " to " << data.median_timestamp + 1 << ". Fix your system time!");
+		t.m_timestamp = data.median_timestamp + 1;
 	}
 
-	writeVarint(m_timestamp, m_blockHeader);
-	m_poolBlockTemplate->m_timestamp = m_timestamp;
+	writeVarint(t.m_timestamp, m_blockHeader);
+	t.m_poolBlockTemplate.m_timestamp = t.m_timestamp;
 
 	// Previous block id
 	m_blockHeader.insert(m_blockHeader.end(), data.prev_id.h, data.prev_id.h + HASH_SIZE);
-	m_prevId = data.prev_id;
-	m_poolBlockTemplate->m_prevId = m_prevId;
+	t.m_prevId = data.prev_id;
+	t.m_poolBlockTemplate.m_prevId = t.m_prevId;
 
 	// Miner nonce
-	m_nonceOffset = m_blockHeader.size();
+	t.m_nonceOffset = m_blockHeader.size();
 	m_blockHeader.insert(m_blockHeader.end(), NONCE_SIZE, 0);
-	m_poolBlockTemplate->m_nonce = 0;
+	t.m_poolBlockTemplate.m_nonce = 0;
+
+	t.m_blockHeaderSize = m_blockHeader.size();
+
+	// Sidechain data and output keys don't depend on the mainchain block, reuse them if nothing changed on the sidechain
+	SideChain& side_chain = m_pool->side_chain();
+	if (!m_precalc || !m_precalc->valid(side_chain.state_version(), t.m_poolBlockTemplate.m_txkeySec, *miner_wallet)) {
+		SidechainPrecalc* precalc = new SidechainPrecalc();
+		precalc->calc(side_chain, *miner_wallet, t.m_poolBlockTemplate.m_txkeySec, m_precalc);
+		delete m_precalc;
+		m_precalc = precalc;
+	}
+	else {
+		LOGINFO(5, "using precalculated sidechain data");
+	}
 
-	m_blockHeaderSize = m_blockHeader.size();
+	const SidechainPrecalc& precalc = *m_precalc;
+	precalc.apply(t.m_poolBlockTemplate);
 
-	m_pool->side_chain().fill_sidechain_data(*m_poolBlockTemplate, miner_wallet, m_txkeySec, m_shares);
-	if (!SideChain::split_reward(max_reward, m_shares, m_rewards)) {
+	if (!SideChain::split_reward(max_reward, precalc.m_shares, m_rewards)) {
 		return;
 	}
 
@@ -285,126 +427,61 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 			return a;
 		});
 
-	if (!create_miner_tx(data, m_shares, max_reward_amounts_weight, true)) {
+	if (!create_miner_tx(t, data, precalc, max_reward_amounts_weight, true)) {
 		return;
 	}
 
 	const uint64_t miner_tx_weight = m_minerTx.size();
 
 	// Select transactions from the mempool
-	uint64_t final_reward, final_fees, final_weight;
-
-	m_mempoolTxsOrder.resize(m_mempoolTxs.size());
-	for (size_t i = 0; i < m_mempoolTxs.size(); ++i) {
-		m_mempoolTxsOrder[i] = static_cast<int>(i);
-	}
-
-	// if a block doesn't get into the penalty zone, just pick all transactions
-	if (total_tx_weight + miner_tx_weight <= data.median_weight) {
-		m_numTransactionHashes = 0;
-
-		final_fees = 0;
-		final_weight = miner_tx_weight;
+	select_transactions_greedy(m_mempoolTxs, base_reward, data.median_weight, miner_tx_weight, m_txSelection);
 
-		m_transactionHashes.assign(HASH_SIZE, 0);
-		for (const TxMempoolData& tx : m_mempoolTxs) {
-			m_transactionHashes.insert(m_transactionHashes.end(), tx.id.h, tx.id.h + HASH_SIZE);
-			++m_numTransactionHashes;
-
-			final_fees += tx.fee;
-			final_weight += tx.weight;
-		}
-
-		final_reward = base_reward + final_fees;
-	}
-	else {
-		// Picking all transactions will result in the base reward penalty
-		// Use a heuristic algorithm to pick transactions and get the maximum possible reward
-		// Testing has shown that this algorithm is very close to the optimal selection
-		// Usually no more than 0.5 micronero away from the optimal discrete knapsack solution
-		// Sometimes it even finds the optimal solution
-
-		// Sort all transactions by fee per byte (highest to lowest)
-		std::sort(m_mempoolTxsOrder.begin(), m_mempoolTxsOrder.end(),
-			[this](int a, int b)
-			{
-				const TxMempoolData& tx_a = m_mempoolTxs[a];
-				const TxMempoolData& tx_b = m_mempoolTxs[b];
-				return tx_a.fee * tx_b.weight > tx_b.fee * tx_a.weight;
-			});
-
-		final_reward = base_reward;
-		final_fees = 0;
-		final_weight = miner_tx_weight;
-
-		for (int i = 0; i < static_cast<int>(m_mempoolTxsOrder.size());) {
-			const TxMempoolData& tx = m_mempoolTxs[m_mempoolTxsOrder[i]];
+	m_txSelectionRewardDelta = 0;
 
-			int k = -1;
+	m_txSelectionKey.prev_id = data.prev_id;
+	m_txSelectionKey.median_weight = data.median_weight;
+	m_txSelectionKey.miner_tx_weight = miner_tx_weight;
+	m_txSelectionKey.num_transactions = m_mempoolTxs.size();
+	m_txSelectionKey.total_fees = total_tx_fees;
 
-			const uint64_t reward = get_block_reward(base_reward, data.median_weight, final_fees + tx.fee, final_weight + tx.weight);
-			if (reward > final_reward) {
-				// If simply adding this transaction increases the reward, remember it
-				final_reward = reward;
-				k = i;
-			}
-
-			// Try replacing other transactions when we are above the limit
-			if (final_weight + tx.weight > data.median_weight) {
-				for (int j = 0; j < i; ++j) {
-					const TxMempoolData& prev_tx = m_mempoolTxs[m_mempoolTxsOrder[j]];
-					const uint64_t reward2 = get_block_reward(base_reward, data.median_weight, final_fees + tx.fee - prev_tx.fee, final_weight + tx.weight - prev_tx.weight);
-					if (reward2 > final_reward) {
-						// If replacing some other transaction increases the reward even more, remember it
-						// And keep trying to replace other transactions
-						final_reward = reward2;
-						k = j;
-					}
-				}
-			}
-
-			if (k == i) {
-				// Simply adding this tx improves the reward
-				final_fees += tx.fee;
-				final_weight += tx.weight;
-				++i;
-				continue;
-			}
-
-			if (k >= 0) {
-				// Replacing another tx with this tx improves the reward
-				const TxMempoolData& prev_tx = m_mempoolTxs[m_mempoolTxsOrder[k]];
-				final_fees += tx.fee - prev_tx.fee;
-				final_weight += tx.weight - prev_tx.weight;
-			}
-
-			m_mempoolTxsOrder.erase(m_mempoolTxsOrder.begin() + ((k >= 0) ? k : i));
+	// The greedy algorithm is not always optimal when the block gets into the penalty zone
+	// Use the result of the background search if it was done for exactly the same transactions, or start a new search
+	if (total_tx_weight + miner_tx_weight > data.median_weight) {
+		if (m_optimalTxSelectionKey == m_txSelectionKey) {
+			apply_optimal_tx_selection(base_reward, data.median_weight, miner_tx_weight);
 		}
-
-		final_fees = 0;
-		final_weight = miner_tx_weight;
-
-		m_numTransactionHashes = m_mempoolTxsOrder.size();
-		m_transactionHashes.assign(HASH_SIZE, 0);
-		for (size_t i = 0; i < m_mempoolTxsOrder.size(); ++i) {
-			const TxMempoolData& tx = m_mempoolTxs[m_mempoolTxsOrder[i]];
-			m_transactionHashes.insert(m_transactionHashes.end(), tx.id.h, tx.id.h + HASH_SIZE);
-			final_fees += tx.fee;
-			final_weight += tx.weight;
+		else {
+			TxSelectionJob* job = new TxSelectionJob();
+			job->req.data = job;
+			job->owner = this;
+			job->key = m_txSelectionKey;
+			job->txs = m_mempoolTxs;
+			job->base_reward = base_reward;
+			job->median_weight = data.median_weight;
+			job->miner_tx_weight = miner_tx_weight;
+			job->result = m_txSelection;
+			job->greedy_reward = m_txSelection.reward;
+			start_tx_selection_job(job);
 		}
+	}
 
-		final_reward = get_block_reward(base_reward, data.median_weight, final_fees, final_weight);
+	t.m_numTransactionHashes = m_txSelection.txs.size();
+	m_transactionHashes.assign(HASH_SIZE, 0);
+	for (int i : m_txSelection.txs) {
+		const TxMempoolData& tx = m_mempoolTxs[i];
+		m_transactionHashes.insert(m_transactionHashes.end(), tx.id.h, tx.id.h + HASH_SIZE);
+	}
 
-		if (final_reward < base_reward) {
-			LOGERR(1, "final_reward < base_reward, this should never happen. Fix the code!");
-		}
+	uint64_t final_reward = m_txSelection.reward;
+	const uint64_t final_weight = m_txSelection.weight;
 
 #if TEST_MEMPOOL_PICKING_ALGORITHM
-		LOGINFO(3, "final_reward = " << log::XMRAmount(final_reward) << ", transactions = " << m_numTransactionHashes << ", final_weight = " << final_weight);
+	if (total_tx_weight + miner_tx_weight > data.median_weight) {
+		LOGINFO(3, "final_reward = " << log::XMRAmount(final_reward) << ", transactions = " << t.m_numTransactionHashes << ", final_weight = " << final_weight);
 
-		uint64_t final_reward2;
-		fill_optimal_knapsack(data, base_reward, miner_tx_weight, final_reward2, final_fees, final_weight);
-		LOGINFO(3, "best_reward  = " << log::XMRAmount(final_reward2) << ", transactions = " << m_numTransactionHashes << ", final_weight = " << final_weight);
+		uint64_t final_reward2, final_fees2, final_weight2;
+		fill_optimal_knapsack(data, base_reward, miner_tx_weight, final_reward2, final_fees2, final_weight2);
+		LOGINFO(3, "best_reward  = " << log::XMRAmount(final_reward2) << ", transactions = " << t.m_numTransactionHashes << ", final_weight = " << final_weight2);
 		if (final_reward2 < final_reward) {
 			LOGERR(1, "fill_optimal_knapsack has a bug, found solution is not optimal. Fix it!");
 		}
@@ -413,26 +490,26 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 		{
 			uint64_t fee_check = 0;
 			uint64_t weight_check = miner_tx_weight;
-			for (int i : m_mempoolTxsOrder) {
+			for (int i : m_txSelection.txs) {
 				const TxMempoolData& tx = m_mempoolTxs[i];
 				fee_check += tx.fee;
 				weight_check += tx.weight;
 			}
-			const uint64_t reward_check = get_block_reward(base_reward, data.median_weight, final_fees, final_weight);
-			if ((reward_check != final_reward) || (fee_check != final_fees) || (weight_check != final_weight)) {
+			const uint64_t reward_check = get_block_reward(base_reward, data.median_weight, final_fees2, final_weight2);
+			if ((reward_check != final_reward) || (fee_check != final_fees2) || (weight_check != final_weight2)) {
 				LOGERR(1, "fill_optimal_knapsack has a bug, expected " << final_reward << ", got " << reward_check << " reward. Fix it!");
 			}
 		}
-#endif
 	}
+#endif
 
-	if (!SideChain::split_reward(final_reward, m_shares, m_rewards)) {
+	if (!SideChain::split_reward(final_reward, precalc.m_shares, m_rewards)) {
 		return;
 	}
 
-	m_finalReward = final_reward;
+	t.m_finalReward = final_reward;
 
-	if (!create_miner_tx(data, m_shares, max_reward_amounts_weight, false)) {
+	if (!create_miner_tx(t, data, precalc, max_reward_amounts_weight, false)) {
 		return;
 	}
 
@@ -441,41 +518,41 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 		return;
 	}
 
-	m_blockTemplateBlob = m_blockHeader;
-	m_extraNonceOffsetInTemplate += m_blockHeader.size();
-	m_minerTxOffsetInTemplate = m_blockHeader.size();
-	m_minerTxSize = m_minerTx.size();
-	m_blockTemplateBlob.insert(m_blockTemplateBlob.end(), m_minerTx.begin(), m_minerTx.end());
-	writeVarint(m_numTransactionHashes, m_blockTemplateBlob);
+	t.m_blockTemplateBlob = m_blockHeader;
+	t.m_extraNonceOffsetInTemplate += m_blockHeader.size();
+	t.m_minerTxOffsetInTemplate = m_blockHeader.size();
+	t.m_minerTxSize = m_minerTx.size();
+	t.m_blockTemplateBlob.insert(t.m_blockTemplateBlob.end(), m_minerTx.begin(), m_minerTx.end());
+	writeVarint(t.m_numTransactionHashes, t.m_blockTemplateBlob);
 
 	// Miner tx hash is skipped here because it's not a part of block template
-	m_blockTemplateBlob.insert(m_blockTemplateBlob.end(), m_transactionHashes.begin() + HASH_SIZE, m_transactionHashes.end());
+	t.m_blockTemplateBlob.insert(t.m_blockTemplateBlob.end(), m_transactionHashes.begin() + HASH_SIZE, m_transactionHashes.end());
 
-	m_poolBlockTemplate->m_transactions.clear();
-	m_poolBlockTemplate->m_transactions.resize(1);
-	m_poolBlockTemplate->m_transactions.reserve(m_mempoolTxsOrder.size() + 1);
-	for (size_t i = 0, n = m_mempoolTxsOrder.size(); i < n;  ++i) {
-		m_poolBlockTemplate->m_transactions.push_back(m_mempoolTxs[m_mempoolTxsOrder[i]].id);
+	t.m_poolBlockTemplate.m_transactions.clear();
+	t.m_poolBlockTemplate.m_transactions.resize(1);
+	t.m_poolBlockTemplate.m_transactions.reserve(m_txSelection.txs.size() + 1);
+	for (int i : m_txSelection.txs) {
+		t.m_poolBlockTemplate.m_transactions.push_back(m_mempoolTxs[i].id);
 	}
 
-	m_poolBlockTemplate->m_minerWallet = *miner_wallet;
+	t.m_poolBlockTemplate.m_minerWallet = *miner_wallet;
 
-	m_poolBlockTemplate->serialize_sidechain_data();
-	m_poolBlockTemplate->m_sidechainId = calc_sidechain_hash();
-	const int sidechain_hash_offset = static_cast<int>(m_extraNonceOffsetInTemplate + m_poolBlockTemplate->m_extraNonceSize) + 2;
+	t.m_poolBlockTemplate.serialize_sidechain_data();
+	t.m_poolBlockTemplate.m_sidechainId = calc_sidechain_hash(t);
+	const int sidechain_hash_offset = static_cast<int>(t.m_extraNonceOffsetInTemplate + t.m_poolBlockTemplate.m_extraNonceSize) + 2;
 
-	memcpy(m_blockTemplateBlob.data() + sidechain_hash_offset, m_poolBlockTemplate->m_sidechainId.h, HASH_SIZE);
-	memcpy(m_minerTx.data() + sidechain_hash_offset - m_minerTxOffsetInTemplate, m_poolBlockTemplate->m_sidechainId.h, HASH_SIZE);
+	memcpy(t.m_blockTemplateBlob.data() + sidechain_hash_offset, t.m_poolBlockTemplate.m_sidechainId.h, HASH_SIZE);
+	memcpy(m_minerTx.data() + sidechain_hash_offset - t.m_minerTxOffsetInTemplate, t.m_poolBlockTemplate.m_sidechainId.h, HASH_SIZE);
 
-	m_poolBlockTemplate->serialize_mainchain_data(0, 0, m_poolBlockTemplate->m_sidechainId);
+	t.m_poolBlockTemplate.serialize_mainchain_data(0, 0, t.m_poolBlockTemplate.m_sidechainId);
 
 #if POOL_BLOCK_DEBUG
-	if (m_poolBlockTemplate->m_mainChainData != m_blockTemplateBlob) {
+	if (t.m_poolBlockTemplate.m_mainChainData != t.m_blockTemplateBlob) {
 		LOGERR(1, "serialize_mainchain_data() has a bug, fix it! ");
-		LOGERR(1, "m_poolBlockTemplate->m_mainChainData.size() = " << m_poolBlockTemplate->m_mainChainData.size());
-		LOGERR(1, "m_blockTemplateBlob.size()         = " << m_blockTemplateBlob.size());
-		for (size_t i = 0, n = std::min(m_poolBlockTemplate->m_mainChainData.size(), m_blockTemplateBlob.size()); i < n; ++i) {
-			if (m_poolBlockTemplate->m_mainChainData[i] != m_blockTemplateBlob[i]) {
+		LOGERR(1, "m_poolBlockTemplate->m_mainChainData.size() = " << t.m_poolBlockTemplate.m_mainChainData.size());
+		LOGERR(1, "m_blockTemplateBlob.size()         = " << t.m_blockTemplateBlob.size());
+		for (size_t i = 0, n = std::min(t.m_poolBlockTemplate.m_mainChainData.size(), t.m_blockTemplateBlob.size()); i < n; ++i) {
+			if (t.m_poolBlockTemplate.m_mainChainData[i] != t.m_blockTemplateBlob[i]) {
 				LOGERR(1, "m_poolBlockTemplate->m_mainChainData is different at offset " << i);
 				break;
 			}
@@ -483,8 +560,8 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 	}
 
 	{
-		std::vector<uint8_t> buf = m_blockTemplateBlob;
-		buf.insert(buf.end(), m_poolBlockTemplate->m_sideChainData.begin(), m_poolBlockTemplate->m_sideChainData.end());
+		std::vector<uint8_t> buf = t.m_blockTemplateBlob;
+		buf.insert(buf.end(), t.m_poolBlockTemplate.m_sideChainData.begin(), t.m_poolBlockTemplate.m_sideChainData.end());
 
 		PoolBlock check;
 		const int result = check.deserialize(buf.data(), buf.size(), m_pool->side_chain());
@@ -497,26 +574,198 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 	}
 #endif
 
-	const hash minerTx_hash = calc_miner_tx_hash(0);
+	const hash minerTx_hash = t.calc_miner_tx_hash(0);
 
 	memcpy(m_transactionHashes.data(), minerTx_hash.h, HASH_SIZE);
 
-	calc_merkle_tree_main_branch();
+	calc_merkle_tree_main_branch(t);
+
+	// Publish the new template, previous templates stay alive as long as someone uses them
+	// Keep the last N templates and everything that was replaced less than T seconds ago
+	{
+		const Params& params = m_pool->params();
+		const size_t max_count = std::min<size_t>(params.m_templateHistorySize, MAX_TEMPLATE_HISTORY - 1);
+		const time_t max_age = static_cast<time_t>(params.m_templateHistoryTime);
+
+		std::shared_ptr<const TemplateHistory> old_history = get_history();
+
+		std::shared_ptr<TemplateHistory> history = std::make_shared<TemplateHistory>();
+		history->m_templates.reserve((old_history ? old_history->m_templates.size() : 0) + 1);
+		history->m_templates.emplace_back(new_template);
+
+		if (old_history) {
+			const std::vector<std::shared_ptr<const TemplateData>>& old_templates = old_history->m_templates;
+
+			for (size_t i = 0, n = std::min<size_t>(old_templates.size(), MAX_TEMPLATE_HISTORY - 1); i < n; ++i) {
+				// Time when this template stopped being the current one
+				const time_t replaced_time = (i > 0) ? old_templates[i - 1]->m_createdTime : cur_time;
+
+				if ((i >= max_count) && (cur_time - replaced_time > max_age)) {
+					break;
+				}
+
+				history->m_templates.emplace_back(old_templates[i]);
+			}
+		}
+
+		std::atomic_store(&m_history, std::shared_ptr<const TemplateHistory>(std::move(history)));
+		m_templateId = t.m_templateId;
+	}
 
 	LOGINFO(3, "final reward = " << log::Gray() << log::XMRAmount(final_reward) << log::NoColor() <<
 		", weight = " << log::Gray() << final_weight << log::NoColor() <<
-		", outputs = " << log::Gray() << m_poolBlockTemplate->m_outputs.size() << log::NoColor() <<
-		", " << log::Gray() << m_numTransactionHashes << log::NoColor() <<
+		", outputs = " << log::Gray() << t.m_poolBlockTemplate.m_outputs.size() << log::NoColor() <<
+		", " << log::Gray() << t.m_numTransactionHashes << log::NoColor() <<
 		" of " << log::Gray() << m_mempoolTxs.size() << log::NoColor() << " transactions included");
 
+	if (m_txSelectionRewardDelta) {
+		LOGINFO(3, "optimized transaction selection added " << log::Gray() << log::XMRAmount(m_txSelectionRewardDelta) << log::NoColor() << " to the block reward");
+	}
+
+	if (m_pool->api() && m_pool->params().m_localStats) {
+		const uint64_t height = t.m_height;
+		const uint64_t num_transactions = t.m_numTransactionHashes;
+		const uint64_t num_mempool_transactions = m_mempoolTxs.size();
+		const uint64_t reward_delta = m_txSelectionRewardDelta;
+
+		m_pool->api()->set(p2pool_api::Category::LOCAL, "block_template",
+			[height, final_reward, final_weight, num_transactions, num_mempool_transactions, reward_delta](log::Stream& s)
+			{
+				s << "{\"height\":" << height
+					<< ",\"reward\":" << final_reward
+					<< ",\"weight\":" << final_weight
+					<< ",\"transactions\":" << num_transactions
+					<< ",\"mempool_transactions\":" << num_mempool_transactions
+					<< ",\"tx_selection_reward_delta\":" << reward_delta
+					<< "}";
+			});
+	}
+
 	m_minerTx.clear();
 	m_blockHeader.clear();
 	m_minerTxExtra.clear();
 	m_transactionHashes.clear();
 	m_rewards.clear();
 	m_mempoolTxs.clear();
-	m_mempoolTxsOrder.clear();
-	m_shares.clear();
+	m_txSelection.txs.clear();
+}
+
+void BlockTemplate::start_tx_selection_job(TxSelectionJob* job)
+{
+	// Only one search at a time, the latest request waits for the running one to finish
+	if (m_txSelectionJobRunning) {
+		delete m_txSelectionJobPending;
+		m_txSelectionJobPending = job;
+		return;
+	}
+
+	const int err = uv_queue_work(uv_default_loop_checked(), &job->req,
+		[](uv_work_t* req)
+		{
+			bkg_jobs_tracker.start("BlockTemplate::tx_selection");
+
+			TxSelectionJob* job = reinterpret_cast<TxSelectionJob*>(req->data);
+			job->optimal = select_transactions_optimal(job->txs, job->base_reward, job->median_weight, job->miner_tx_weight, TX_SELECTION_TIME_LIMIT_MS, job->result);
+
+			bkg_jobs_tracker.stop("BlockTemplate::tx_selection");
+		},
+		[](uv_work_t* req, int /*status*/)
+		{
+			TxSelectionJob* job = reinterpret_cast<TxSelectionJob*>(req->data);
+			job->owner->on_tx_selection_job_done(job);
+			delete job;
+		});
+
+	if (err) {
+		LOGERR(1, "start_tx_selection_job: uv_queue_work failed, error " << uv_err_name(err));
+		delete job;
+		return;
+	}
+
+	m_txSelectionJobRunning = true;
+}
+
+void BlockTemplate::on_tx_selection_job_done(TxSelectionJob* job)
+{
+	m_txSelectionJobRunning = false;
+
+	if (m_pool->stopped()) {
+		delete m_txSelectionJobPending;
+		m_txSelectionJobPending = nullptr;
+		return;
+	}
+
+	const TxSelection& result = job->result;
+
+	m_optimalTxSelectionKey = job->key;
+	m_optimalTxSelectionReward = result.reward;
+	m_optimalTxSelection.clear();
+	m_optimalTxSelection.reserve(result.txs.size());
+	for (int i : result.txs) {
+		m_optimalTxSelection.push_back(job->txs[i].id);
+	}
+
+	const uint64_t delta = result.reward - job->greedy_reward;
+
+	LOGINFO(4, "transaction selection search " << (job->optimal ? "finished" : "timed out") <<
+		": greedy reward = " << log::XMRAmount(job->greedy_reward) <<
+		", best reward = " << log::XMRAmount(result.reward) <<
+		", difference = " << log::XMRAmount(delta));
+
+	const bool rebuild_template = (delta > 0) && (m_txSelectionKey == job->key);
+
+	TxSelectionJob* pending = m_txSelectionJobPending;
+	m_txSelectionJobPending = nullptr;
+
+	if (pending) {
+		if (pending->key == job->key) {
+			delete pending;
+		}
+		else {
+			start_tx_selection_job(pending);
+		}
+	}
+
+	// The current block template was built from the same transactions, replace it with a better one
+	if (rebuild_template) {
+		m_pool->update_block_template();
+	}
+}
+
+void BlockTemplate::apply_optimal_tx_selection(uint64_t base_reward, uint64_t median_weight, uint64_t miner_tx_weight)
+{
+	if (m_optimalTxSelectionReward <= m_txSelection.reward) {
+		return;
+	}
+
+	unordered_map<hash, int> tx_index;
+	tx_index.reserve(m_mempoolTxs.size());
+	for (size_t i = 0; i < m_mempoolTxs.size(); ++i) {
+		tx_index.emplace(m_mempoolTxs[i].id, static_cast<int>(i));
+	}
+
+	TxSelection selection;
+	selection.weight = miner_tx_weight;
+	selection.txs.reserve(m_optimalTxSelection.size());
+
+	for (const hash& id : m_optimalTxSelection) {
+		auto it = tx_index.find(id);
+		if (it == tx_index.end()) {
+			return;
+		}
+		const TxMempoolData& tx = m_mempoolTxs[it->second];
+		selection.fees += tx.fee;
+		selection.weight += tx.weight;
+		selection.txs.push_back(it->second);
+	}
+
+	selection.reward = get_block_reward(base_reward, median_weight, selection.fees, selection.weight);
+	if (selection.reward <= m_txSelection.reward) {
+		return;
+	}
+
+	m_txSelectionRewardDelta = selection.reward - m_txSelection.reward;
+	m_txSelection = std::move(selection);
 }
 
 #if TEST_MEMPOOL_PICKING_ALGORITHM
@@ -577,19 +826,16 @@ void BlockTemplate::fill_optimal_knapsack(const MinerData& data, uint64_t base_r
 		}
 	}
 
-	m_numTransactionHashes = 0;
-
 	final_fees = 0;
 	final_weight = miner_tx_weight;
 
-	m_mempoolTxsOrder.clear();
+	m_txSelection.txs.clear();
 	m_transactionHashes.assign(HASH_SIZE, 0);
 	for (int i = static_cast<int>(n); (i > 0) && (best_weight > 0); --i) {
 		if (m_knapsack[i * max_weight + best_weight] > m_knapsack[(i - 1) * max_weight + best_weight]) {
-			m_mempoolTxsOrder.push_back(i - 1);
+			m_txSelection.txs.push_back(i - 1);
 			const TxMempoolData& tx = m_mempoolTxs[i - 1];
 			m_transactionHashes.insert(m_transactionHashes.end(), tx.id.h, tx.id.h + HASH_SIZE);
-			++m_numTransactionHashes;
 			best_weight -= tx.weight;
 			final_fees += tx.fee;
 			final_weight += tx.weight;
@@ -600,12 +846,12 @@ void BlockTemplate::fill_optimal_knapsack(const MinerData& data, uint64_t base_r
 }
 #endif
 
-bool BlockTemplate::create_miner_tx(const MinerData& data, const std::vector<MinerShare>& shares, uint64_t max_reward_amounts_weight, bool dry_run)
+bool BlockTemplate::create_miner_tx(TemplateData& t, const MinerData& data, const SidechainPrecalc& precalc, uint64_t max_reward_amounts_weight, bool dry_run)
 {
 	// Miner transaction (coinbase)
 	m_minerTx.clear();
 
-	const size_t num_outputs = shares.size();
+	const size_t num_outputs = precalc.m_shares.size();
 	m_minerTx.reserve(num_outputs * 39 + 55);
 
 	// tx version
@@ -622,13 +868,13 @@ bool BlockTemplate::create_miner_tx(const MinerData& data, const std::vector<Min
 
 	// txin_gen height
 	writeVarint(data.height, m_minerTx);
-	m_poolBlockTemplate->m_txinGenHeight = data.height;
+	t.m_poolBlockTemplate.m_txinGenHeight = data.height;
 
 	// Number of outputs (1 output per miner)
 	writeVarint(num_outputs, m_minerTx);
 
-	m_poolBlockTemplate->m_outputs.clear();
-	m_poolBlockTemplate->m_outputs.reserve(num_outputs);
+	t.m_poolBlockTemplate.m_outputs.clear();
+	t.m_poolBlockTemplate.m_outputs.reserve(num_outputs);
 
 	uint64_t reward_amounts_weight = 0;
 	for (size_t i = 0; i < num_outputs; ++i) {
@@ -643,12 +889,9 @@ bool BlockTemplate::create_miner_tx(const MinerData& data, const std::vector<Min
 			m_minerTx.insert(m_minerTx.end(), HASH_SIZE, 0);
 		}
 		else {
-			hash eph_public_key;
-			if (!shares[i].m_wallet->get_eph_public_key(m_txkeySec, i, eph_public_key)) {
-				LOGERR(1, "get_eph_public_key failed at index " << i);
-			}
+			const hash& eph_public_key = precalc.m_ephPublicKeys[i];
 			m_minerTx.insert(m_minerTx.end(), eph_public_key.h, eph_public_key.h + HASH_SIZE);
-			m_poolBlockTemplate->m_outputs.emplace_back(m_rewards[i], eph_public_key);
+			t.m_poolBlockTemplate.m_outputs.emplace_back(m_rewards[i], eph_public_key);
 		}
 	}
 
@@ -663,14 +906,11 @@ bool BlockTemplate::create_miner_tx(const MinerData& data, const std::vector<Min
 		return false;
 	}
 
-	m_poolBlockTemplate->m_txkeyPub = m_txkeyPub;
-	m_poolBlockTemplate->m_txkeySec = m_txkeySec;
-
 	// TX_EXTRA begin
 	m_minerTxExtra.clear();
 
 	m_minerTxExtra.push_back(TX_EXTRA_TAG_PUBKEY);
-	m_minerTxExtra.insert(m_minerTxExtra.end(), m_txkeyPub.h, m_txkeyPub.h + HASH_SIZE);
+	m_minerTxExtra.insert(m_minerTxExtra.end(), t.m_poolBlockTemplate.m_txkeyPub.h, t.m_poolBlockTemplate.m_txkeyPub.h + HASH_SIZE);
 
 	m_minerTxExtra.push_back(TX_EXTRA_NONCE);
 
@@ -683,7 +923,7 @@ bool BlockTemplate::create_miner_tx(const MinerData& data, const std::vector<Min
 	uint64_t extraNonceOffsetInMinerTx = m_minerTxExtra.size();
 	m_minerTxExtra.insert(m_minerTxExtra.end(), corrected_extra_nonce_size, 0);
 
-	m_poolBlockTemplate->m_extraNonceSize = corrected_extra_nonce_size;
+	t.m_poolBlockTemplate.m_extraNonceSize = corrected_extra_nonce_size;
 
 	m_minerTxExtra.push_back(TX_EXTRA_MERGE_MINING_TAG);
 	writeVarint(HASH_SIZE, m_minerTxExtra);
@@ -692,7 +932,7 @@ bool BlockTemplate::create_miner_tx(const MinerData& data, const std::vector<Min
 
 	writeVarint(m_minerTxExtra.size(), m_minerTx);
 	extraNonceOffsetInMinerTx += m_minerTx.size();
-	m_extraNonceOffsetInTemplate = extraNonceOffsetInMinerTx;
+	t.m_extraNonceOffsetInTemplate = extraNonceOffsetInMinerTx;
 	m_minerTx.insert(m_minerTx.end(), m_minerTxExtra.begin(), m_minerTxExtra.end());
 
 	m_minerTxExtra.clear();
@@ -704,57 +944,44 @@ bool BlockTemplate::create_miner_tx(const MinerData& data, const std::vector<Min
 	return true;
 }
 
-hash BlockTemplate::calc_sidechain_hash() const
+hash BlockTemplate::calc_sidechain_hash(const TemplateData& t) const
 {
 	// Calculate side-chain hash (all block template bytes + all side-chain bytes + consensus ID, replacing NONCE, EXTRA_NONCE and HASH itself with 0's)
 	hash sidechain_hash;
-	const int sidechain_hash_offset = static_cast<int>(m_extraNonceOffsetInTemplate + m_poolBlockTemplate->m_extraNonceSize) + 2;
-	const int blob_size = static_cast<int>(m_blockTemplateBlob.size());
 
+	const size_t sidechain_hash_offset = t.m_extraNonceOffsetInTemplate + t.m_poolBlockTemplate.m_extraNonceSize + 2;
 	const std::vector<uint8_t>& consensus_id = m_pool->side_chain().consensus_id();
-
-	keccak_custom([this, sidechain_hash_offset, blob_size, consensus_id](int offset) -> uint8_t {
-			uint32_t k = static_cast<uint32_t>(offset - static_cast<int>(m_nonceOffset));
-			if (k < NONCE_SIZE) {
-				return 0;
-			}
-
-			k = static_cast<uint32_t>(offset - static_cast<int>(m_extraNonceOffsetInTemplate));
-			if (k < EXTRA_NONCE_SIZE) {
-				return 0;
-			}
-
-			k = static_cast<uint32_t>(offset - sidechain_hash_offset);
-			if (k < HASH_SIZE) {
-				return 0;
-			}
-
-			if (offset < blob_size) {
-				return m_blockTemplateBlob[offset];
-			}
-
-			const int side_chain_data_offsset = offset - blob_size;
-			const int side_chain_data_size = static_cast<int>(m_poolBlockTemplate->m_sideChainData.size());
-			if (side_chain_data_offsset < side_chain_data_size) {
-				return m_poolBlockTemplate->m_sideChainData[side_chain_data_offsset];
-			}
-
-			const int consensus_id_offset = side_chain_data_offsset - side_chain_data_size;
-			return consensus_id[consensus_id_offset];
-		},
-		static_cast<int>(m_blockTemplateBlob.size() + m_poolBlockTemplate->m_sideChainData.size() + consensus_id.size()), sidechain_hash.h, HASH_SIZE);
+	const std::vector<uint8_t>& sidechain_data = t.m_poolBlockTemplate.m_sideChainData;
+	const uint8_t* blob = t.m_blockTemplateBlob.data();
+
+	KeccakStream k;
+	k.absorb(blob, t.m_nonceOffset);
+	k.absorb_zeros(NONCE_SIZE);
+	k.absorb(blob + t.m_nonceOffset + NONCE_SIZE, t.m_extraNonceOffsetInTemplate - t.m_nonceOffset - NONCE_SIZE);
+	k.absorb_zeros(EXTRA_NONCE_SIZE);
+	k.absorb(blob + t.m_extraNonceOffsetInTemplate + EXTRA_NONCE_SIZE, sidechain_hash_offset - t.m_extraNonceOffsetInTemplate - EXTRA_NONCE_SIZE);
+	k.absorb_zeros(HASH_SIZE);
+	k.absorb(blob + sidechain_hash_offset + HASH_SIZE, t.m_blockTemplateBlob.size() - sidechain_hash_offset - HASH_SIZE);
+	k.absorb(sidechain_data.data(), sidechain_data.size());
+	k.absorb(consensus_id.data(), consensus_id.size());
+	k.finalize(sidechain_hash.h);
 
 	return sidechain_hash;
 }
 
-hash BlockTemplate::calc_miner_tx_hash(uint32_t extra_nonce) const
+// Hash of the base RCT part of miner tx (single 0 byte)
+static constexpr uint8_t known_second_hash[HASH_SIZE] = {
+	188,54,120,158,122,30,40,20,54,70,66,41,130,143,129,125,102,18,247,180,119,214,101,145,255,150,169,224,100,188,201,138
+};
+
+hash BlockTemplate::TemplateData::calc_miner_tx_hash(uint32_t extra_nonce) const
 {
 	// Calculate 3 partial hashes
 	uint8_t hashes[HASH_SIZE * 3];
 
 	const uint8_t* data = m_blockTemplateBlob.data() + m_minerTxOffsetInTemplate;
 
-	const int extra_nonce_offset = static_cast<int>(m_extraNonceOffsetInTemplate - m_minerTxOffsetInTemplate);
+	const size_t extra_nonce_offset = m_extraNonceOffsetInTemplate - m_minerTxOffsetInTemplate;
 	const uint8_t extra_nonce_buf[EXTRA_NONCE_SIZE] = {
 		static_cast<uint8_t>(extra_nonce >> 0),
 		static_cast<uint8_t>(extra_nonce >> 8),
@@ -764,20 +991,13 @@ hash BlockTemplate::calc_miner_tx_hash(uint32_t extra_nonce) const
 
 	// 1. Prefix (everything except vin_rct_type byte in the end)
 	// Apply extra_nonce in-place because we can't write to the block template here
-	keccak_custom([data, extra_nonce_offset, &extra_nonce_buf](int offset)
-		{
-			const uint32_t k = static_cast<uint32_t>(offset - extra_nonce_offset);
-			if (k < EXTRA_NONCE_SIZE) {
-				return extra_nonce_buf[k];
-			}
-			return data[offset];
-		},
-		static_cast<int>(m_minerTxSize) - 1, hashes, HASH_SIZE);
+	KeccakStream k;
+	k.absorb(data, extra_nonce_offset);
+	k.absorb(extra_nonce_buf, EXTRA_NONCE_SIZE);
+	k.absorb(data + extra_nonce_offset + EXTRA_NONCE_SIZE, m_minerTxSize - 1 - extra_nonce_offset - EXTRA_NONCE_SIZE);
+	k.finalize(hashes);
 
 	// 2. Base RCT, single 0 byte in miner tx
-	static constexpr uint8_t known_second_hash[HASH_SIZE] = {
-		188,54,120,158,122,30,40,20,54,70,66,41,130,143,129,125,102,18,247,180,119,214,101,145,255,150,169,224,100,188,201,138
-	};
 	memcpy(hashes + HASH_SIZE, known_second_hash, HASH_SIZE);
 
 	// 3. Prunable RCT, empty in miner tx
@@ -790,11 +1010,11 @@ hash BlockTemplate::calc_miner_tx_hash(uint32_t extra_nonce) const
 	return result;
 }
 
-void BlockTemplate::calc_merkle_tree_main_branch()
+void BlockTemplate::calc_merkle_tree_main_branch(TemplateData& t)
 {
-	m_merkleTreeMainBranch.clear();
+	t.m_merkleTreeMainBranch.clear();
 
-	const uint64_t count = m_numTransactionHashes + 1;
+	const uint64_t count = t.m_numTransactionHashes + 1;
 	const uint8_t* h = m_transactionHashes.data();
 
 	hash root_hash;
@@ -803,7 +1023,7 @@ void BlockTemplate::calc_merkle_tree_main_branch()
 		memcpy(root_hash.h, h, HASH_SIZE);
 	}
 	else if (count == 2) {
-		m_merkleTreeMainBranch.insert(m_merkleTreeMainBranch.end(), h + HASH_SIZE, h + HASH_SIZE * 2);
+		t.m_merkleTreeMainBranch.insert(t.m_merkleTreeMainBranch.end(), h + HASH_SIZE, h + HASH_SIZE * 2);
 		keccak(h, HASH_SIZE * 2, root_hash.h, HASH_SIZE);
 	}
 	else {
@@ -814,94 +1034,123 @@ void BlockTemplate::calc_merkle_tree_main_branch()
 		cnt >>= 1;
 
 		std::vector<uint8_t> ints(cnt * HASH_SIZE);
-		memcpy(ints.data(), h, (cnt * 2 - count) * HASH_SIZE);
 
-		for (i = cnt * 2 - count, j = cnt * 2 - count; j < cnt; i += 2, ++j) {
-			if (i == 0) {
-				m_merkleTreeMainBranch.insert(m_merkleTreeMainBranch.end(), h + HASH_SIZE, h + HASH_SIZE * 2);
-			}
-			keccak(h + i * HASH_SIZE, HASH_SIZE * 2, ints.data() + j * HASH_SIZE, HASH_SIZE);
+		j = cnt * 2 - count;
+		memcpy(ints.data(), h, j * HASH_SIZE);
+
+		if (j == 0) {
+			t.m_merkleTreeMainBranch.insert(t.m_merkleTreeMainBranch.end(), h + HASH_SIZE, h + HASH_SIZE * 2);
 		}
 
+		// All hashes on the same level are independent, so they can be calculated in parallel
+		keccak_batch(h + j * HASH_SIZE, HASH_SIZE * 2, HASH_SIZE * 2, ints.data() + j * HASH_SIZE, HASH_SIZE, HASH_SIZE, static_cast<int>(cnt - j));
+
 		while (cnt > 2) {
 			cnt >>= 1;
-			for (i = 0, j = 0; j < cnt; i += 2, ++j) {
-				if (i == 0) {
-					m_merkleTreeMainBranch.insert(m_merkleTreeMainBranch.end(), ints.data() + HASH_SIZE, ints.data() + HASH_SIZE * 2);
-				}
-				keccak(ints.data() + i * HASH_SIZE, HASH_SIZE * 2, ints.data() + j * HASH_SIZE, HASH_SIZE);
-			}
+			t.m_merkleTreeMainBranch.insert(t.m_merkleTreeMainBranch.end(), ints.data() + HASH_SIZE, ints.data() + HASH_SIZE * 2);
+			keccak_batch(ints.data(), HASH_SIZE * 2, HASH_SIZE * 2, ints.data(), HASH_SIZE, HASH_SIZE, static_cast<int>(cnt));
 		}
 
-		m_merkleTreeMainBranch.insert(m_merkleTreeMainBranch.end(), ints.data() + HASH_SIZE, ints.data() + HASH_SIZE * 2);
+		t.m_merkleTreeMainBranch.insert(t.m_merkleTreeMainBranch.end(), ints.data() + HASH_SIZE, ints.data() + HASH_SIZE * 2);
 		keccak(ints.data(), HASH_SIZE * 2, root_hash.h, HASH_SIZE);
 	}
 }
 
 bool BlockTemplate::get_difficulties(const uint32_t template_id, difficulty_type& mainchain_difficulty, difficulty_type& sidechain_difficulty) const
 {
-	ReadLock lock(m_lock);
+	std::shared_ptr<const TemplateData> t = find_template(template_id);
+	if (!t) {
+		return false;
+	}
 
-	if (template_id == m_templateId) {
-		mainchain_difficulty = m_difficulty;
-		sidechain_difficulty = m_poolBlockTemplate->m_difficulty;
-		return true;
+	mainchain_difficulty = t->m_difficulty;
+	sidechain_difficulty = t->m_poolBlockTemplate.m_difficulty;
+	return true;
+}
+
+uint32_t BlockTemplate::get_hashing_blob(const uint32_t template_id, uint32_t extra_nonce, uint8_t (&blob)[128], uint64_t& height, difficulty_type& difficulty, difficulty_type& sidechain_difficulty, hash& seed_hash, size_t& nonce_offset) const
+{
+	std::shared_ptr<const TemplateData> t = find_template(template_id);
+	if (!t) {
+		return 0;
 	}
 
-	const BlockTemplate* old = m_oldTemplates[template_id % array_size(&BlockTemplate::m_oldTemplates)];
+	height = t->m_height;
+	difficulty = t->m_difficulty;
+	sidechain_difficulty = t->m_poolBlockTemplate.m_difficulty;
+	seed_hash = t->m_seedHash;
+	nonce_offset = t->m_nonceOffset;
+
+	return t->get_hashing_blob(extra_nonce, blob);
+}
 
-	if (old && (template_id == old->m_templateId)) {
-		return old->get_difficulties(template_id, mainchain_difficulty, sidechain_difficulty);
+uint32_t BlockTemplate::get_hashing_blob(uint32_t extra_nonce, uint8_t (&blob)[128], uint64_t& height, difficulty_type& difficulty, difficulty_type& sidechain_difficulty, hash& seed_hash, size_t& nonce_offset, uint32_t& template_id) const
+{
+	std::shared_ptr<const TemplateData> t = get_current();
+	if (!t) {
+		return 0;
 	}
 
-	return false;
+	height = t->m_height;
+	difficulty = t->m_difficulty;
+	sidechain_difficulty = t->m_poolBlockTemplate.m_difficulty;
+	seed_hash = t->m_seedHash;
+	nonce_offset = t->m_nonceOffset;
+	template_id = t->m_templateId;
+
+	return t->get_hashing_blob(extra_nonce, blob);
 }
 
-uint32_t BlockTemplate::get_hashing_blob(const uint32_t template_id, uint32_t extra_nonce, uint8_t (&blob)[128], uint64_t& height, difficulty_type& difficulty, difficulty_type& sidechain_difficulty, hash& seed_hash, size_t& nonce_offset) const
+void BlockTemplate::TemplateData::calc_merkle_roots(uint32_t extra_nonce_start, uint32_t count, hash* roots) const
 {
-	ReadLock lock(m_lock);
+	// Same as calc_miner_tx_hash() and the merkle tree branch in get_hashing_blob(), but for many extra nonces at once
+	// Miner transactions for different extra nonces are independent inputs of the same size, so they're hashed in parallel
+	const uint32_t lanes = std::min<uint32_t>(count, static_cast<uint32_t>(keccak_batch_lanes()));
 
-	if (template_id == m_templateId) {
-		height = m_height;
-		difficulty = m_difficulty;
-		sidechain_difficulty = m_poolBlockTemplate->m_difficulty;
-		seed_hash = m_seedHash;
-		nonce_offset = m_nonceOffset;
+	const uint8_t* data = m_blockTemplateBlob.data() + m_minerTxOffsetInTemplate;
+	const size_t miner_tx_size = m_minerTxSize - 1;
+	const size_t extra_nonce_offset = m_extraNonceOffsetInTemplate - m_minerTxOffsetInTemplate;
 
-		return get_hashing_blob_nolock(extra_nonce, blob);
+	std::vector<uint8_t> miner_txs(miner_tx_size * lanes);
+	for (uint32_t k = 0; k < lanes; ++k) {
+		memcpy(miner_txs.data() + miner_tx_size * k, data, miner_tx_size);
 	}
 
-	const BlockTemplate* old = m_oldTemplates[template_id % array_size(&BlockTemplate::m_oldTemplates)];
-
-	if (old && (template_id == old->m_templateId)) {
-		return old->get_hashing_blob(template_id, extra_nonce, blob, height, difficulty, sidechain_difficulty, seed_hash, nonce_offset);
+	uint8_t hashes[KeccakParams::BATCH_MAX_LANES][HASH_SIZE * 3];
+	for (uint32_t k = 0; k < lanes; ++k) {
+		memcpy(hashes[k] + HASH_SIZE, known_second_hash, HASH_SIZE);
+		memset(hashes[k] + HASH_SIZE * 2, 0, HASH_SIZE);
 	}
 
-	return 0;
-}
+	uint8_t h[KeccakParams::BATCH_MAX_LANES][HASH_SIZE * 2];
 
-uint32_t BlockTemplate::get_hashing_blob(uint32_t extra_nonce, uint8_t (&blob)[128], uint64_t& height, difficulty_type& difficulty, difficulty_type& sidechain_difficulty, hash& seed_hash, size_t& nonce_offset, uint32_t& template_id) const
-{
-	ReadLock lock(m_lock);
+	for (uint32_t i = 0; i < count; i += lanes) {
+		const uint32_t n = std::min(count - i, lanes);
+
+		for (uint32_t k = 0; k < n; ++k) {
+			const uint32_t extra_nonce = extra_nonce_start + i + k;
+			uint8_t* p = miner_txs.data() + miner_tx_size * k + extra_nonce_offset;
+			p[0] = static_cast<uint8_t>(extra_nonce >> 0);
+			p[1] = static_cast<uint8_t>(extra_nonce >> 8);
+			p[2] = static_cast<uint8_t>(extra_nonce >> 16);
+			p[3] = static_cast<uint8_t>(extra_nonce >> 24);
+		}
 
-	height = m_height;
-	difficulty = m_difficulty;
-	sidechain_difficulty = m_poolBlockTemplate->m_difficulty;
-	seed_hash = m_seedHash;
-	nonce_offset = m_nonceOffset;
-	template_id = m_templateId;
+		keccak_batch(miner_txs.data(), miner_tx_size, static_cast<int>(miner_tx_size), hashes[0], sizeof(hashes[0]), HASH_SIZE, static_cast<int>(n));
+		keccak_batch(hashes[0], sizeof(hashes[0]), sizeof(hashes[0]), roots[i].h, sizeof(hash), HASH_SIZE, static_cast<int>(n));
 
-	return get_hashing_blob_nolock(extra_nonce, blob);
+		for (size_t j = 0; j < m_merkleTreeMainBranch.size(); j += HASH_SIZE) {
+			for (uint32_t k = 0; k < n; ++k) {
+				memcpy(h[k], roots[i + k].h, HASH_SIZE);
+				memcpy(h[k] + HASH_SIZE, m_merkleTreeMainBranch.data() + j, HASH_SIZE);
+			}
+			keccak_batch(h[0], sizeof(h[0]), sizeof(h[0]), roots[i].h, sizeof(hash), HASH_SIZE, static_cast<int>(n));
+		}
+	}
 }
 
-uint32_t BlockTemplate::get_hashing_blob_nolock(uint32_t extra_nonce, uint8_t* blob) const
+uint32_t BlockTemplate::TemplateData::get_hashing_blob(uint32_t extra_nonce, uint8_t* blob) const
 {
-	uint8_t* p = blob;
-
-	// Block header
-	memcpy(p, m_blockTemplateBlob.data(), m_blockHeaderSize);
-	p += m_blockHeaderSize;
-
 	// Merkle tree hash
 	hash root_hash = calc_miner_tx_hash(extra_nonce);
 
@@ -914,6 +1163,18 @@ uint32_t BlockTemplate::get_hashing_blob_nolock(uint32_t extra_nonce, uint8_t* b
 		keccak(h, HASH_SIZE * 2, root_hash.h, HASH_SIZE);
 	}
 
+	return write_hashing_blob(root_hash, blob);
+}
+
+uint32_t BlockTemplate::TemplateData::write_hashing_blob(const hash& root_hash, uint8_t* blob) const
+{
+	uint8_t* p = blob;
+
+	// Block header
+	memcpy(p, m_blockTemplateBlob.data(), m_blockHeaderSize);
+	p += m_blockHeaderSize;
+
+	// Merkle tree hash
 	memcpy(p, root_hash.h, HASH_SIZE);
 	p += HASH_SIZE;
 
@@ -934,33 +1195,39 @@ uint32_t BlockTemplate::get_hashing_blobs(uint32_t extra_nonce_start, uint32_t c
 
 	uint32_t blob_size = 0;
 
-	ReadLock lock(m_lock);
+	std::shared_ptr<const TemplateData> t = get_current();
+	if (!t) {
+		return 0;
+	}
 
-	height = m_height;
-	difficulty = m_difficulty;
-	sidechain_difficulty = m_poolBlockTemplate->m_difficulty;
-	seed_hash = m_seedHash;
-	nonce_offset = m_nonceOffset;
-	template_id = m_templateId;
+	height = t->m_height;
+	difficulty = t->m_difficulty;
+	sidechain_difficulty = t->m_poolBlockTemplate.m_difficulty;
+	seed_hash = t->m_seedHash;
+	nonce_offset = t->m_nonceOffset;
+	template_id = t->m_templateId;
 
-	for (uint32_t i = 0; i < count; ++i) {
-		uint8_t blob[128];
-		uint32_t n = get_hashing_blob_nolock(extra_nonce_start + i, blob);
+	if (count == 0) {
+		return 0;
+	}
 
-		if (n > sizeof(blob)) {
-			LOGERR(1, "internal error: get_hashing_blob_nolock returned too large blob size " << n << ", expected <= " << sizeof(blob));
-			n = sizeof(blob);
-		}
-		else if (n < 76) {
-			LOGERR(1, "internal error: get_hashing_blob_nolock returned too little blob size " << n << ", expected >= 76");
-		}
+	// Hashing blobs differ only in the merkle root hash
+	std::vector<hash> roots(count);
+	t->calc_merkle_roots(extra_nonce_start, count, roots.data());
 
-		if (blob_size == 0) {
-			blob_size = n;
-		}
-		else if (n != blob_size) {
-			LOGERR(1, "internal error: get_hashing_blob_nolock returned different blob size " << n << ", expected " << blob_size);
-		}
+	uint8_t blob[128];
+	blob_size = t->write_hashing_blob(roots[0], blob);
+
+	if (blob_size > sizeof(blob)) {
+		LOGERR(1, "internal error: write_hashing_blob returned too large blob size " << blob_size << ", expected <= " << sizeof(blob));
+		blob_size = sizeof(blob);
+	}
+	else if (blob_size < 76) {
+		LOGERR(1, "internal error: write_hashing_blob returned too little blob size " << blob_size << ", expected >= 76");
+	}
+
+	for (uint32_t i = 0; i < count; ++i) {
+		memcpy(blob + t->m_blockHeaderSize, roots[i].h, HASH_SIZE);
 		blobs.insert(blobs.end(), blob, blob + blob_size);
 	}
 
@@ -969,22 +1236,16 @@ uint32_t BlockTemplate::get_hashing_blobs(uint32_t extra_nonce_start, uint32_t c
 
 std::vector<uint8_t> BlockTemplate::get_block_template_blob(uint32_t template_id, size_t& nonce_offset, size_t& extra_nonce_offset) const
 {
-	ReadLock lock(m_lock);
-
-	if (template_id != m_templateId) {
-		const BlockTemplate* old = m_oldTemplates[template_id % array_size(&BlockTemplate::m_oldTemplates)];
-		if (old && (template_id == old->m_templateId)) {
-			return old->get_block_template_blob(template_id, nonce_offset, extra_nonce_offset);
-		}
-
+	std::shared_ptr<const TemplateData> t = find_template(template_id);
+	if (!t) {
 		nonce_offset = 0;
 		extra_nonce_offset = 0;
 		return std::vector<uint8_t>();
 	}
 
-	nonce_offset = m_nonceOffset;
-	extra_nonce_offset = m_extraNonceOffsetInTemplate;
-	return m_blockTemplateBlob;
+	nonce_offset = t->m_nonceOffset;
+	extra_nonce_offset = t->m_extraNonceOffsetInTemplate;
+	return t->m_blockTemplateBlob;
 }
 
 void BlockTemplate::update_tx_keys()
@@ -994,53 +1255,145 @@ void BlockTemplate::update_tx_keys()
 	generate_keys(m_txkeyPub, m_txkeySec);
 }
 
-void BlockTemplate::submit_sidechain_block(uint32_t template_id, uint32_t nonce, uint32_t extra_nonce)
+void BlockTemplate::start_precalc_job()
 {
-	WriteLock lock(m_lock);
-
-	if (template_id == m_templateId) {
-		m_poolBlockTemplate->m_nonce = nonce;
-		m_poolBlockTemplate->m_extraNonce = extra_nonce;
-		memcpy(m_poolBlockTemplate->m_mainChainData.data() + m_nonceOffset, &nonce, NONCE_SIZE);
-		memcpy(m_poolBlockTemplate->m_mainChainData.data() + m_extraNonceOffsetInTemplate, &extra_nonce, EXTRA_NONCE_SIZE);
+	if (m_precalcJobRunning || m_pool->stopped()) {
+		return;
+	}
 
-		SideChain& side_chain = m_pool->side_chain();
+	PrecalcJob* job = new PrecalcJob();
+	job->req.data = job;
+	job->owner = this;
+	job->result = new SidechainPrecalc();
 
-#if POOL_BLOCK_DEBUG
+	const int err = uv_queue_work(uv_default_loop_checked(), &job->req,
+		[](uv_work_t* req)
 		{
-			std::vector<uint8_t> buf = m_poolBlockTemplate->m_mainChainData;
-			buf.insert(buf.end(), m_poolBlockTemplate->m_sideChainData.begin(), m_poolBlockTemplate->m_sideChainData.end());
+			bkg_jobs_tracker.start("BlockTemplate::precalc");
 
-			PoolBlock check;
-			const int result = check.deserialize(buf.data(), buf.size(), side_chain);
-			if (result != 0) {
-				LOGERR(1, "pool block blob generation and/or parsing is broken, error " << result);
-			}
+			PrecalcJob* job = reinterpret_cast<PrecalcJob*>(req->data);
+			BlockTemplate* owner = job->owner;
 
-			hash pow_hash;
-			if (!check.get_pow_hash(m_pool->hasher(), check.m_txinGenHeight, m_seedHash, pow_hash)) {
-				LOGERR(1, "PoW check failed for the sidechain block. Fix it! ");
-			}
-			else if (!check.m_difficulty.check_pow(pow_hash)) {
-				LOGERR(1, "Sidechain block has wrong PoW. Fix it! ");
+			hash txkey_sec;
+			{
+				ReadLock lock(owner->m_lock);
+				txkey_sec = owner->m_txkeySec;
 			}
-		}
-#endif
 
-		m_poolBlockTemplate->m_verified = true;
-		if (!side_chain.block_seen(*m_poolBlockTemplate)) {
-			m_poolBlockTemplate->m_wantBroadcast = true;
-			side_chain.add_block(*m_poolBlockTemplate);
-		}
+			// Tx keys have just changed, so there's nothing to reuse from the current precalc
+			job->result->calc(owner->m_pool->side_chain(), owner->m_pool->params().m_wallet, txkey_sec, nullptr);
+
+			bkg_jobs_tracker.stop("BlockTemplate::precalc");
+		},
+		[](uv_work_t* req, int /*status*/)
+		{
+			PrecalcJob* job = reinterpret_cast<PrecalcJob*>(req->data);
+			job->owner->on_precalc_job_done(job);
+			delete job->result;
+			delete job;
+		});
+
+	if (err) {
+		LOGERR(1, "start_precalc_job: uv_queue_work failed, error " << uv_err_name(err));
+		delete job->result;
+		delete job;
 		return;
 	}
 
-	BlockTemplate* old = m_oldTemplates[template_id % array_size(&BlockTemplate::m_oldTemplates)];
+	m_precalcJobRunning = true;
+}
 
-	if (old && (template_id == old->m_templateId)) {
-		old->submit_sidechain_block(template_id, nonce, extra_nonce);
+void BlockTemplate::on_precalc_job_done(PrecalcJob* job)
+{
+	m_precalcJobRunning = false;
+
+	LOGINFO(5, "precalculated sidechain data: " << job->result->m_shares.size() << " shares, sidechain state " << job->result->m_stateVersion);
+
+	// update() could have already made a newer one for the same tx keys
+	if (m_precalc && (m_precalc->m_txkeySec == job->result->m_txkeySec) && (m_precalc->m_stateVersion >= job->result->m_stateVersion)) {
 		return;
 	}
+
+	delete m_precalc;
+	m_precalc = job->result;
+	job->result = nullptr;
+}
+
+uint32_t BlockTemplate::template_id() const
+{
+	std::shared_ptr<const TemplateData> t = get_current();
+	return t ? t->m_templateId : 0;
+}
+
+uint64_t BlockTemplate::height() const
+{
+	std::shared_ptr<const TemplateData> t = get_current();
+	return t ? t->m_height : 0;
+}
+
+time_t BlockTemplate::timestamp() const
+{
+	std::shared_ptr<const TemplateData> t = get_current();
+	return t ? static_cast<time_t>(t->m_timestamp) : 0;
+}
+
+difficulty_type BlockTemplate::difficulty() const
+{
+	std::shared_ptr<const TemplateData> t = get_current();
+	return t ? t->m_difficulty : difficulty_type();
+}
+
+uint64_t BlockTemplate::final_reward() const
+{
+	std::shared_ptr<const TemplateData> t = get_current();
+	return t ? t->m_finalReward : 0;
+}
+
+void BlockTemplate::submit_sidechain_block(uint32_t template_id, uint32_t nonce, uint32_t extra_nonce)
+{
+	std::shared_ptr<const TemplateData> t = find_template(template_id);
+	if (!t) {
+		return;
+	}
+
+	// Published templates are immutable, fill in nonce and extra_nonce in a copy
+	PoolBlock* block = new PoolBlock(t->m_poolBlockTemplate);
+
+	block->m_nonce = nonce;
+	block->m_extraNonce = extra_nonce;
+	memcpy(block->m_mainChainData.data() + t->m_nonceOffset, &nonce, NONCE_SIZE);
+	memcpy(block->m_mainChainData.data() + t->m_extraNonceOffsetInTemplate, &extra_nonce, EXTRA_NONCE_SIZE);
+
+	SideChain& side_chain = m_pool->side_chain();
+
+#if POOL_BLOCK_DEBUG
+	{
+		std::vector<uint8_t> buf = block->m_mainChainData;
+		buf.insert(buf.end(), block->m_sideChainData.begin(), block->m_sideChainData.end());
+
+		PoolBlock check;
+		const int result = check.deserialize(buf.data(), buf.size(), side_chain);
+		if (result != 0) {
+			LOGERR(1, "pool block blob generation and/or parsing is broken, error " << result);
+		}
+
+		hash pow_hash;
+		if (!check.get_pow_hash(m_pool->hasher(), check.m_txinGenHeight, t->m_seedHash, pow_hash)) {
+			LOGERR(1, "PoW check failed for the sidechain block. Fix it! ");
+		}
+		else if (!check.m_difficulty.check_pow(pow_hash)) {
+			LOGERR(1, "Sidechain block has wrong PoW. Fix it! ");
+		}
+	}
+#endif
+
+	if (side_chain.block_seen(*block)) {
+		delete block;
+		return;
+	}
+
+	// Shares, outputs and difficulty were taken from the sidechain when this template was built, no need to verify them again
+	side_chain.add_local_block(block);
 }
 
 } // namespace p2pool
@@ -18,6 +18,8 @@
 #pragma once
 
 #include "uv_util.h"
+#include "tx_selection.h"
+#include <memory>
 
 #define TEST_MEMPOOL_PICKING_ALGORITHM 0
 
@@ -29,16 +31,16 @@ class Wallet;
 struct PoolBlock;
 struct MinerShare;
 
-class BlockTemplate
+class BlockTemplate : public nocopy_nomove
 {
 public:
+	// Current template and up to MAX_TEMPLATE_HISTORY - 1 previous templates
+	static constexpr uint32_t MAX_TEMPLATE_HISTORY = 64;
+
 	explicit BlockTemplate(p2pool* pool);
 	~BlockTemplate();
 
-	BlockTemplate(const BlockTemplate& b);
-	BlockTemplate& operator=(const BlockTemplate& b);
-
-	void update(const MinerData& data, const Mempool& mempool, Wallet* miner_wallet);
+	void update(const MinerData& data, Mempool& mempool, Wallet* miner_wallet);
 
 	bool get_difficulties(const uint32_t template_id, difficulty_type& mainchain_difficulty, difficulty_type& sidechain_difficulty) const;
 	uint32_t get_hashing_blob(const uint32_t template_id, uint32_t extra_nonce, uint8_t (&blob)[128], uint64_t& height, difficulty_type& difficulty, difficulty_type& sidechain_difficulty, hash& seed_hash, size_t& nonce_offset) const;
@@ -49,64 +51,100 @@ public:
 	std::vector<uint8_t> get_block_template_blob(uint32_t template_id, size_t& nonce_offset, size_t& extra_nonce_offset) const;
 	void update_tx_keys();
 
-	FORCEINLINE uint64_t height() const { return m_height; }
-	FORCEINLINE time_t timestamp() const { return m_timestamp; }
-	FORCEINLINE difficulty_type difficulty() const { return m_difficulty; }
+	// Prepares sidechain data and miner tx output keys for the next template in background
+	// Call it from the main thread when they're about to change, for example after changing tx keys
+	void start_precalc_job();
+
+	uint32_t template_id() const;
+	uint64_t height() const;
+	time_t timestamp() const;
+	difficulty_type difficulty() const;
 
 	void submit_sidechain_block(uint32_t template_id, uint32_t nonce, uint32_t extra_nonce);
 
-	FORCEINLINE uint64_t final_reward() const { return m_finalReward; }
+	uint64_t final_reward() const;
+	FORCEINLINE uint64_t tx_selection_reward_delta() const { return m_txSelectionRewardDelta; }
 
 private:
 	p2pool* m_pool;
 
+	// Everything miners and share validation need from a block template
+	// It's immutable after it's published, so readers never wait for update()
+	struct TemplateData;
+
+	// Current template and a few previous ones, replaced as a whole on every update
+	struct TemplateHistory;
+
+	std::shared_ptr<const TemplateHistory> get_history() const;
+	std::shared_ptr<const TemplateData> get_current() const;
+	std::shared_ptr<const TemplateData> find_template(uint32_t template_id) const;
+
+	// Access only through std::atomic_load/std::atomic_store
+	std::shared_ptr<const TemplateHistory> m_history;
+
 private:
-	bool create_miner_tx(const MinerData& data, const std::vector<MinerShare>& shares, uint64_t max_reward_amounts_weight, bool dry_run);
-	hash calc_sidechain_hash() const;
-	hash calc_miner_tx_hash(uint32_t extra_nonce) const;
-	void calc_merkle_tree_main_branch();
+	// Everything in the template that doesn't depend on the mainchain: PPLNS shares, sidechain data and miner tx output keys
+	// It's reused until the sidechain gets a new block or tx keys change
+	struct SidechainPrecalc;
+	struct PrecalcJob;
 
-	uint32_t get_hashing_blob_nolock(uint32_t extra_nonce, uint8_t* blob) const;
+	void on_precalc_job_done(PrecalcJob* job);
 
+	SidechainPrecalc* m_precalc = nullptr;
+	bool m_precalcJobRunning = false;
+
+	bool create_miner_tx(TemplateData& t, const MinerData& data, const SidechainPrecalc& precalc, uint64_t max_reward_amounts_weight, bool dry_run);
+	hash calc_sidechain_hash(const TemplateData& t) const;
+	void calc_merkle_tree_main_branch(TemplateData& t);
+
+	// Protects tx keys, everything below is accessed only by update() which runs on the main thread
 	mutable uv_rwlock_t m_lock;
 
 	uint32_t m_templateId;
 
-	std::vector<uint8_t> m_blockTemplateBlob;
-	std::vector<uint8_t> m_merkleTreeMainBranch;
+	hash m_txkeyPub;
+	hash m_txkeySec;
 
-	size_t m_blockHeaderSize;
-	size_t m_minerTxOffsetInTemplate;
-	size_t m_minerTxSize;
-	size_t m_nonceOffset;
-	size_t m_extraNonceOffsetInTemplate;
+	// Everything that affects the optimal transaction selection
+	struct TxSelectionKey
+	{
+		TxSelectionKey() : prev_id(), median_weight(0), miner_tx_weight(0), num_transactions(0), total_fees(0) {}
 
-	size_t m_numTransactionHashes;
-	hash m_prevId;
-	uint64_t m_height;
-	difficulty_type m_difficulty;
-	hash m_seedHash;
+		bool operator==(const TxSelectionKey& k) const;
 
-	uint64_t m_timestamp;
+		hash prev_id;
+		uint64_t median_weight;
+		uint64_t miner_tx_weight;
+		uint64_t num_transactions;
+		uint64_t total_fees;
+	};
 
-	hash m_txkeyPub;
-	hash m_txkeySec;
+	// Background search for a better transaction selection than the one found by select_transactions_greedy()
+	// Runs on the UV thread pool, everything else is accessed only from the main thread
+	struct TxSelectionJob;
+
+	void start_tx_selection_job(TxSelectionJob* job);
+	void on_tx_selection_job_done(TxSelectionJob* job);
+	void apply_optimal_tx_selection(uint64_t base_reward, uint64_t median_weight, uint64_t miner_tx_weight);
 
-	PoolBlock* m_poolBlockTemplate;
+	TxSelectionKey m_txSelectionKey;
+	bool m_txSelectionJobRunning = false;
+	TxSelectionJob* m_txSelectionJobPending = nullptr;
 
-	BlockTemplate* m_oldTemplates[4] = {};
+	TxSelectionKey m_optimalTxSelectionKey;
+	uint64_t m_optimalTxSelectionReward = 0;
+	std::vector<hash> m_optimalTxSelection;
 
-	uint64_t m_finalReward;
+	uint64_t m_txSelectionRewardDelta = 0;
 
-	// Temp vectors, will be cleaned up after use and skipped in copy constructor/assignment operators
+	// Temp vectors, will be cleaned up after use
 	std::vector<uint8_t> m_minerTx;
 	std::vector<uint8_t> m_blockHeader;
 	std::vector<uint8_t> m_minerTxExtra;
 	std::vector<uint8_t> m_transactionHashes;
 	std::vector<uint64_t> m_rewards;
 	std::vector<TxMempoolData> m_mempoolTxs;
-	std::vector<int> m_mempoolTxsOrder;
-	std::vector<MinerShare> m_shares;
+	TxSelection m_txSelection;
 
 #if TEST_MEMPOOL_PICKING_ALGORITHM
 	void fill_optimal_knapsack(const MinerData& data, uint64_t base_reward, uint64_t miner_tx_weight, uint64_t& best_reward, uint64_t& final_fees, uint64_t& final_weight);
@@ -25,6 +25,7 @@
 #include "miner.h"
 #endif
 #include "side_chain.h"
+#include "pow_hash.h"
 #include <iostream>
 
 static constexpr char log_category_prefix[] = "ConsoleCommands ";
@@ -119,6 +120,7 @@ static int do_status(p2pool *m_pool, const char * /* args */)
 		m_pool->miner()->print_status();
 	}
 #endif
+	m_pool->hasher()->print_status();
 	bkg_jobs_tracker.print_status();
 	return 0;
 }
@@ -0,0 +1,400 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "io_uring.h"
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static constexpr char log_category_prefix[] = "IoUring ";
+
+namespace p2pool {
+
+static int io_uring_setup(uint32_t entries, io_uring_params* p)
+{
+	return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags)
+{
+	return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+static int io_uring_register(int fd, uint32_t opcode, const void* arg, uint32_t nr_args)
+{
+	return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+IoUring::IoUring()
+	: m_fd(-1)
+	, m_eventFd(-1)
+	, m_poll{}
+	, m_pollInitialized(false)
+	, m_shutdown(false)
+	, m_callback(nullptr)
+	, m_callbackData(nullptr)
+	, m_sqRing(MAP_FAILED)
+	, m_sqRingSize(0)
+	, m_cqRing(MAP_FAILED)
+	, m_cqRingSize(0)
+	, m_sqes(reinterpret_cast<io_uring_sqe*>(MAP_FAILED))
+	, m_sqesSize(0)
+	, m_sqHead(nullptr)
+	, m_sqTail(nullptr)
+	, m_sqMask(0)
+	, m_sqEntries(0)
+	, m_sqArray(nullptr)
+	, m_cqHead(nullptr)
+	, m_cqTail(nullptr)
+	, m_cqMask(0)
+	, m_cqEntries(0)
+	, m_cqes(nullptr)
+	, m_numQueued(0)
+	, m_numInFlight(0)
+	, m_numSubmitCalls(0)
+	, m_numRequests(0)
+{
+}
+
+IoUring::~IoUring()
+{
+	if (m_sqes != MAP_FAILED) {
+		munmap(m_sqes, m_sqesSize);
+	}
+	if ((m_cqRing != MAP_FAILED) && (m_cqRing != m_sqRing)) {
+		munmap(m_cqRing, m_cqRingSize);
+	}
+	if (m_sqRing != MAP_FAILED) {
+		munmap(m_sqRing, m_sqRingSize);
+	}
+	if (m_eventFd >= 0) {
+		close(m_eventFd);
+	}
+	if (m_fd >= 0) {
+		close(m_fd);
+	}
+}
+
+bool IoUring::init(uv_loop_t* loop, uint32_t entries, completion_callback callback, void* callback_data)
+{
+	m_callback = callback;
+	m_callbackData = callback_data;
+
+	io_uring_params params{};
+
+	m_fd = io_uring_setup(entries, &params);
+	if (m_fd < 0) {
+		LOGWARN(1, "io_uring_setup failed, error " << errno);
+		return false;
+	}
+
+	// IORING_FEAT_NODROP: completions are never lost when the completion queue is full (Linux 5.5+)
+	// IORING_FEAT_SUBMIT_STABLE: request data can be reused as soon as it's submitted (Linux 5.5+)
+	constexpr uint32_t required_features = IORING_FEAT_NODROP | IORING_FEAT_SUBMIT_STABLE;
+	if ((params.features & required_features) != required_features) {
+		LOGWARN(1, "io_uring doesn't have all required features, kernel is too old");
+		return false;
+	}
+
+	m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		m_sqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+		m_cqRingSize = m_sqRingSize;
+	}
+
+	m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+	if (m_sqRing == MAP_FAILED) {
+		LOGWARN(1, "failed to map io_uring submission queue, error " << errno);
+		return false;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		m_cqRing = m_sqRing;
+	}
+	else {
+		m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+		if (m_cqRing == MAP_FAILED) {
+			LOGWARN(1, "failed to map io_uring completion queue, error " << errno);
+			return false;
+		}
+	}
+
+	m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	m_sqes = reinterpret_cast<io_uring_sqe*>(mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES));
+	if (m_sqes == MAP_FAILED) {
+		LOGWARN(1, "failed to map io_uring submission queue entries, error " << errno);
+		return false;
+	}
+
+	uint8_t* sq = reinterpret_cast<uint8_t*>(m_sqRing);
+	m_sqHead = reinterpret_cast<uint32_t*>(sq + params.sq_off.head);
+	m_sqTail = reinterpret_cast<uint32_t*>(sq + params.sq_off.tail);
+	m_sqMask = *reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+	m_sqEntries = *reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_entries);
+	m_sqArray = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+
+	uint8_t* cq = reinterpret_cast<uint8_t*>(m_cqRing);
+	m_cqHead = reinterpret_cast<uint32_t*>(cq + params.cq_off.head);
+	m_cqTail = reinterpret_cast<uint32_t*>(cq + params.cq_off.tail);
+	m_cqMask = *reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+	m_cqEntries = *reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_entries);
+	m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+	m_eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_eventFd < 0) {
+		LOGWARN(1, "failed to create eventfd, error " << errno);
+		return false;
+	}
+
+	if (io_uring_register(m_fd, IORING_REGISTER_EVENTFD, &m_eventFd, 1) < 0) {
+		LOGWARN(1, "failed to register eventfd with io_uring, error " << errno);
+		return false;
+	}
+
+	int err = uv_poll_init(loop, &m_poll, m_eventFd);
+	if (err) {
+		LOGWARN(1, "failed to create poll handle, error " << uv_err_name(err));
+		return false;
+	}
+	m_poll.data = this;
+	m_pollInitialized = true;
+
+	err = uv_poll_start(&m_poll, UV_READABLE, on_completion);
+	if (err) {
+		LOGWARN(1, "failed to start poll handle, error " << uv_err_name(err));
+		close_poll_handle();
+		return false;
+	}
+
+	LOGINFO(1, "initialized with " << m_sqEntries << " entries");
+	return true;
+}
+
+bool IoUring::sendmsg(int fd, const msghdr* msg, uint64_t user_data)
+{
+	if (m_shutdown) {
+		return false;
+	}
+
+	// Don't let the completion queue overflow
+	if (m_numInFlight + m_numQueued >= m_cqEntries) {
+		return false;
+	}
+
+	uint32_t tail = *m_sqTail;
+
+	if (tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries) {
+		submit();
+		tail = *m_sqTail;
+		if (tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries) {
+			return false;
+		}
+	}
+
+	const uint32_t index = tail & m_sqMask;
+
+	io_uring_sqe* sqe = m_sqes + index;
+	memset(sqe, 0, sizeof(io_uring_sqe));
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<uint64_t>(msg);
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = user_data;
+
+	m_sqArray[index] = index;
+	__atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+
+	++m_numQueued;
+	++m_numRequests;
+
+	return true;
+}
+
+bool IoUring::submit()
+{
+	while (m_numQueued > 0) {
+		const int result = io_uring_enter(m_fd, m_numQueued, 0, 0);
+		++m_numSubmitCalls;
+
+		if (result < 0) {
+			if ((errno == EINTR) || (errno == EAGAIN) || (errno == EBUSY)) {
+				// Not enough resources right now, requests will be submitted next time
+				return false;
+			}
+			LOGERR(1, "io_uring_enter failed, error " << errno);
+			return false;
+		}
+
+		const uint32_t n = static_cast<uint32_t>(result);
+		m_numQueued -= std::min(n, m_numQueued);
+		m_numInFlight += n;
+
+		if (n == 0) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void IoUring::fail_queued(int fd)
+{
+	// The kernel reads submission queue entries only in io_uring_enter(), so everything between head and tail is not submitted yet
+	const uint32_t tail = *m_sqTail;
+
+	for (uint32_t i = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE); i != tail; ++i) {
+		io_uring_sqe* sqe = m_sqes + m_sqArray[i & m_sqMask];
+		if ((sqe->opcode == IORING_OP_SENDMSG) && (sqe->fd == fd)) {
+			sqe->fd = -1;
+		}
+	}
+}
+
+void IoUring::shutdown()
+{
+	if (m_shutdown) {
+		return;
+	}
+
+	submit();
+	m_shutdown = true;
+
+	if (m_numInFlight == 0) {
+		close_poll_handle();
+		return;
+	}
+
+#ifdef IORING_ASYNC_CANCEL_ANY
+	const uint32_t tail = *m_sqTail;
+	if (tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) < m_sqEntries) {
+		const uint32_t index = tail & m_sqMask;
+
+		io_uring_sqe* sqe = m_sqes + index;
+		memset(sqe, 0, sizeof(io_uring_sqe));
+
+		// Cancellation result is reported with user_data = 0, process_completions() checks it
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+
+		m_sqArray[index] = index;
+		__atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+
+		if (io_uring_enter(m_fd, 1, 0, 0) == 1) {
+			++m_numInFlight;
+			return;
+		}
+	}
+#endif
+
+	// Sends to a stalled peer can stay in flight forever, don't wait for them
+	abandon_in_flight();
+}
+
+void IoUring::abandon_in_flight()
+{
+	LOGWARN(4, "couldn't cancel " << m_numInFlight << " requests in flight, closing io_uring");
+
+	// The kernel cancels the remaining requests when the rings are unmapped in the destructor
+	// They are never reported back, so their memory must stay allocated
+	close(m_fd);
+	m_fd = -1;
+	m_numInFlight = 0;
+
+	close_poll_handle();
+}
+
+void IoUring::on_completion(uv_poll_t* handle, int status, int /*events*/)
+{
+	IoUring* pThis = reinterpret_cast<IoUring*>(handle->data);
+
+	if (status < 0) {
+		LOGWARN(1, "eventfd poll failed, error " << uv_err_name(status));
+		return;
+	}
+
+	uint64_t value;
+	while (read(pThis->m_eventFd, &value, sizeof(value)) > 0) {}
+
+	pThis->process_completions();
+}
+
+void IoUring::process_completions()
+{
+	uint32_t head = *m_cqHead;
+	bool cancel_failed = false;
+
+	for (;;) {
+		const uint32_t tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			break;
+		}
+
+		do {
+			const io_uring_cqe& cqe = m_cqes[head & m_cqMask];
+			const uint64_t user_data = cqe.user_data;
+			const int32_t result = cqe.res;
+			++head;
+
+			if (m_numInFlight > 0) {
+				--m_numInFlight;
+			}
+
+			if (user_data) {
+				m_callback(m_callbackData, user_data, result);
+			}
+			else if ((result < 0) && (result != -ENOENT)) {
+				// IORING_ASYNC_CANCEL_ANY is not supported by this kernel (Linux 5.19+)
+				cancel_failed = true;
+			}
+		} while (head != tail);
+
+		__atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+	}
+
+	if (m_shutdown) {
+		if (m_numInFlight == 0) {
+			close_poll_handle();
+		}
+		else if (cancel_failed) {
+			abandon_in_flight();
+		}
+	}
+}
+
+void IoUring::close_poll_handle()
+{
+	if (!m_pollInitialized) {
+		return;
+	}
+
+	uv_handle_t* h = reinterpret_cast<uv_handle_t*>(&m_poll);
+	if (!uv_is_closing(h)) {
+		uv_poll_stop(&m_poll);
+		uv_close(h, nullptr);
+	}
+}
+
+} // namespace p2pool
@@ -0,0 +1,102 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "uv_util.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct msghdr;
+
+namespace p2pool {
+
+// Minimal io_uring wrapper (Linux 5.6+, no liburing dependency) used by TCPServer to send data
+// Requests are queued with sendmsg() and submitted to the kernel in one system call by submit()
+// Completions are reported through an eventfd which is polled by the libuv event loop
+// All functions must be called from the thread running the event loop
+class IoUring : public nocopy_nomove
+{
+public:
+	typedef void (*completion_callback)(void* data, uint64_t user_data, int32_t result);
+
+	IoUring();
+	~IoUring();
+
+	bool init(uv_loop_t* loop, uint32_t entries, completion_callback callback, void* callback_data);
+
+	// "msg" and all memory it points to must stay valid until the request is completed
+	// Returns false if there are too many requests in flight, try again after the next completion
+	bool sendmsg(int fd, const msghdr* msg, uint64_t user_data);
+
+	// Returns false if some requests are still queued, they will be submitted next time
+	bool submit();
+
+	// Queued requests for this file descriptor will fail with EBADF instead of going to a socket which reuses it after it's closed
+	void fail_queued(int fd);
+
+	// Cancels all requests in flight and stops polling for completions when the last one is reported
+	// If they can't be cancelled, they're abandoned: their callbacks are never called, and their memory must not be freed
+	void shutdown();
+
+	uint32_t num_in_flight() const { return m_numInFlight; }
+	uint64_t num_submit_calls() const { return m_numSubmitCalls; }
+	uint64_t num_requests() const { return m_numRequests; }
+
+private:
+	static void on_completion(uv_poll_t* handle, int status, int events);
+	void process_completions();
+	void abandon_in_flight();
+	void close_poll_handle();
+
+	int m_fd;
+	int m_eventFd;
+
+	uv_poll_t m_poll;
+	bool m_pollInitialized;
+	bool m_shutdown;
+
+	completion_callback m_callback;
+	void* m_callbackData;
+
+	void* m_sqRing;
+	size_t m_sqRingSize;
+	void* m_cqRing;
+	size_t m_cqRingSize;
+	io_uring_sqe* m_sqes;
+	size_t m_sqesSize;
+
+	uint32_t* m_sqHead;
+	uint32_t* m_sqTail;
+	uint32_t m_sqMask;
+	uint32_t m_sqEntries;
+	uint32_t* m_sqArray;
+
+	uint32_t* m_cqHead;
+	uint32_t* m_cqTail;
+	uint32_t m_cqMask;
+	uint32_t m_cqEntries;
+	io_uring_cqe* m_cqes;
+
+	uint32_t m_numQueued;
+	uint32_t m_numInFlight;
+
+	uint64_t m_numSubmitCalls;
+	uint64_t m_numRequests;
+};
+
+} // namespace p2pool
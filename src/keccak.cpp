@@ -18,6 +18,17 @@
 #include "common.h"
 #include "keccak.h"
 
+#if defined(__x86_64__) || defined(_M_AMD64)
+#define KECCAK_SIMD 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#else
+#define KECCAK_SIMD 0
+#endif
+
 namespace p2pool {
 
 #ifndef ROTL64
@@ -182,4 +193,260 @@ void keccak(const uint8_t *in, int inlen, uint8_t (&md)[200])
 	keccak(in, inlen, md, 200);
 }
 
+KeccakStream::KeccakStream(int mdlen)
+	: m_mdlen(mdlen)
+	, m_rsiz(sizeof(m_state) == static_cast<size_t>(mdlen) ? KeccakParams::HASH_DATA_AREA : 200 - 2 * mdlen)
+	, m_pos(0)
+{
+	memset(m_state, 0, sizeof(m_state));
+}
+
+void KeccakStream::absorb(const uint8_t* data, size_t size)
+{
+	uint8_t* st = reinterpret_cast<uint8_t*>(m_state);
+
+	// Finish the partially filled block first
+	if (m_pos) {
+		const size_t n = std::min(size, m_rsiz - m_pos);
+		for (size_t i = 0; i < n; ++i) {
+			st[m_pos + i] ^= data[i];
+		}
+
+		data += n;
+		size -= n;
+		m_pos += n;
+
+		if (m_pos < m_rsiz) {
+			return;
+		}
+
+		keccakf(m_state);
+		m_pos = 0;
+	}
+
+	const size_t rsizw = m_rsiz / 8;
+
+	for (; size >= m_rsiz; size -= m_rsiz, data += m_rsiz) {
+		for (size_t i = 0; i < rsizw; ++i) {
+			uint64_t k;
+			memcpy(&k, data + i * 8, sizeof(k));
+			m_state[i] ^= k;
+		}
+		keccakf(m_state);
+	}
+
+	for (size_t i = 0; i < size; ++i) {
+		st[i] ^= data[i];
+	}
+	m_pos = size;
+}
+
+void KeccakStream::absorb_zeros(size_t size)
+{
+	// XOR with zeros doesn't change the state, only full blocks need to be permuted
+	m_pos += size;
+	while (m_pos >= m_rsiz) {
+		keccakf(m_state);
+		m_pos -= m_rsiz;
+	}
+}
+
+void KeccakStream::finalize(uint8_t* md)
+{
+	// padding
+	uint8_t* st = reinterpret_cast<uint8_t*>(m_state);
+	st[m_pos] ^= 1;
+	st[m_rsiz - 1] ^= 0x80;
+
+	keccakf(m_state);
+
+	memcpy(md, m_state, m_mdlen);
+}
+
+#if KECCAK_SIMD
+
+// Multi-buffer permutations, see keccak_avx2.cpp and keccak_avx512.cpp
+// State layout is interleaved: st[i * lanes + lane] is the i-th word of the lane's state
+void keccakf_x4_avx2(uint64_t* st);
+void keccakf_x8_avx512(uint64_t* st);
+
+typedef void (*keccakf_multi_func)(uint64_t* st);
+
+struct KeccakBatchImpl
+{
+	int lanes;
+	keccakf_multi_func func;
+};
+
+static void cpuid(uint32_t leaf, uint32_t (&result)[4])
+{
+#ifdef _MSC_VER
+	int r[4];
+	__cpuidex(r, static_cast<int>(leaf), 0);
+	memcpy(result, r, sizeof(result));
+#else
+	__cpuid_count(leaf, 0, result[0], result[1], result[2], result[3]);
+#endif
+}
+
+static uint64_t xgetbv()
+{
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	uint32_t lo, hi;
+	__asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return (static_cast<uint64_t>(hi) << 32) | lo;
+#endif
+}
+
+static KeccakBatchImpl detect_keccak_batch_impl()
+{
+	KeccakBatchImpl result{ 1, nullptr };
+
+	uint32_t r[4];
+	cpuid(0, r);
+	const uint32_t max_leaf = r[0];
+	if (max_leaf < 7) {
+		return result;
+	}
+
+	// OSXSAVE and AVX must be present, and the OS must save YMM registers
+	cpuid(1, r);
+	constexpr uint32_t OSXSAVE_AVX = (1U << 27) | (1U << 28);
+	if ((r[2] & OSXSAVE_AVX) != OSXSAVE_AVX) {
+		return result;
+	}
+
+	const uint64_t xcr0 = xgetbv();
+	if ((xcr0 & 0x6) != 0x6) {
+		return result;
+	}
+
+	cpuid(7, r);
+
+	// AVX-512F + OS support for opmask and ZMM registers
+	if ((r[1] & (1U << 16)) && ((xcr0 & 0xE6) == 0xE6)) {
+		result.lanes = 8;
+		result.func = keccakf_x8_avx512;
+	}
+	else if (r[1] & (1U << 5)) {
+		result.lanes = 4;
+		result.func = keccakf_x4_avx2;
+	}
+
+	return result;
+}
+
+static const KeccakBatchImpl& keccak_batch_impl()
+{
+	static const KeccakBatchImpl impl = detect_keccak_batch_impl();
+	return impl;
+}
+
+template<int N>
+static void keccak_multi(keccakf_multi_func f, const uint8_t* const (&in)[N], int inlen, uint8_t* const (&md)[N], int mdlen)
+{
+	alignas(64) uint64_t st[25 * N];
+
+	const int rsiz = 200 == mdlen ? KeccakParams::HASH_DATA_AREA : 200 - 2 * mdlen;
+	const int rsizw = rsiz / 8;
+
+	memset(st, 0, sizeof(st));
+
+	int offset = 0;
+
+	for (; inlen >= rsiz; inlen -= rsiz, offset += rsiz) {
+		for (int i = 0; i < rsizw; ++i) {
+			for (int lane = 0; lane < N; ++lane) {
+				uint64_t k;
+				memcpy(&k, in[lane] + offset + i * 8, sizeof(k));
+				st[i * N + lane] ^= k;
+			}
+		}
+		f(st);
+	}
+
+	// last block and padding
+	for (int lane = 0; lane < N; ++lane) {
+		alignas(8) uint8_t temp[144];
+
+		memcpy(temp, in[lane] + offset, inlen);
+		temp[inlen] = 1;
+		memset(temp + inlen + 1, 0, rsiz - inlen - 1);
+		temp[rsiz - 1] |= 0x80;
+
+		for (int i = 0; i < rsizw; ++i) {
+			st[i * N + lane] ^= reinterpret_cast<uint64_t*>(temp)[i];
+		}
+	}
+
+	f(st);
+
+	for (int lane = 0; lane < N; ++lane) {
+		uint64_t out[25];
+		for (int i = 0; i < 25; ++i) {
+			out[i] = st[i * N + lane];
+		}
+		memcpy(md[lane], out, mdlen);
+	}
+}
+
+template<int N>
+static void keccak_batch_group(keccakf_multi_func f, const uint8_t* in, size_t in_stride, int inlen, uint8_t* md, size_t md_stride, int mdlen, int count)
+{
+	const uint8_t* inputs[N];
+	uint8_t* outputs[N];
+
+	// Unused lanes (when count < N) hash the last input again and write to a scratch buffer
+	uint8_t scratch[200];
+
+	for (int lane = 0; lane < N; ++lane) {
+		const int k = std::min(lane, count - 1);
+		inputs[lane] = in + k * in_stride;
+		outputs[lane] = (lane < count) ? (md + lane * md_stride) : scratch;
+	}
+
+	keccak_multi<N>(f, inputs, inlen, outputs, mdlen);
+}
+
+#endif
+
+void keccak_batch(const uint8_t* in, size_t in_stride, int inlen, uint8_t* md, size_t md_stride, int mdlen, int count)
+{
+#if KECCAK_SIMD
+	const KeccakBatchImpl& impl = keccak_batch_impl();
+
+	if (impl.lanes > 1) {
+		while (count > 1) {
+			const int n = std::min(count, impl.lanes);
+
+			if (impl.lanes == 8) {
+				keccak_batch_group<8>(impl.func, in, in_stride, inlen, md, md_stride, mdlen, n);
+			}
+			else {
+				keccak_batch_group<4>(impl.func, in, in_stride, inlen, md, md_stride, mdlen, n);
+			}
+
+			in += n * in_stride;
+			md += n * md_stride;
+			count -= n;
+		}
+	}
+#endif
+
+	for (int i = 0; i < count; ++i) {
+		keccak(in + i * in_stride, inlen, md + i * md_stride, mdlen);
+	}
+}
+
+int keccak_batch_lanes()
+{
+#if KECCAK_SIMD
+	return keccak_batch_impl().lanes;
+#else
+	return 1;
+#endif
+}
+
 } // namespace p2pool
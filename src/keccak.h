@@ -22,53 +22,42 @@ namespace p2pool {
 enum KeccakParams {
 	HASH_DATA_AREA = 136,
 	ROUNDS = 24,
+	BATCH_MAX_LANES = 8,
 };
 
+extern const uint64_t keccakf_rndc[24];
+
 void keccakf(uint64_t* st);
 void keccak(const uint8_t *in, int inlen, uint8_t *md, int mdlen);
 void keccak(const uint8_t* in, int inlen, uint8_t (&md)[200]);
 
-template<typename T>
-FORCEINLINE void keccak_custom(T&& in, int inlen, uint8_t* md, int mdlen)
-{
-	uint64_t st[25];
-
-	const int rsiz = sizeof(st) == mdlen ? KeccakParams::HASH_DATA_AREA : 200 - 2 * mdlen;
-	const int rsizw = rsiz / 8;
-
-	memset(st, 0, sizeof(st));
-
-	int offset = 0;
-
-	for (; inlen >= rsiz; inlen -= rsiz, offset += rsiz) {
-		for (int i = 0; i < rsizw; ++i) {
-			uint64_t k = 0;
-			for (int j = 0; j < 8; ++j) {
-				k |= static_cast<uint64_t>(in(offset + i * 8 + j)) << (j * 8);
-			}
-			st[i] ^= k;
-		}
-		keccakf(st);
-	}
+// Calculates "count" hashes of independent inputs of the same length "inlen"
+// Input i is at in + i * in_stride, its hash is written to md + i * md_stride
+// Uses multi-buffer AVX2 (4 lanes) or AVX-512 (8 lanes) keccak-f[1600] when the CPU supports it
+//
+// Inputs are fully read before the corresponding outputs are written, so it's safe to compute
+// a level of a merkle tree in-place (md == in, md_stride < in_stride)
+void keccak_batch(const uint8_t* in, size_t in_stride, int inlen, uint8_t* md, size_t md_stride, int mdlen, int count);
 
-	// last block and padding
-	alignas(8) uint8_t temp[144];
+// Number of hashes keccak_batch() calculates in parallel on this CPU (1 if there is no SIMD support)
+int keccak_batch_lanes();
 
-	for (int i = 0; i < inlen; ++i) {
-		temp[i] = in(offset + i);
-	}
-
-	temp[inlen++] = 1;
-	memset(temp + inlen, 0, rsiz - inlen);
-	temp[rsiz - 1] |= 0x80;
-
-	for (int i = 0; i < rsizw; i++) {
-		st[i] ^= reinterpret_cast<uint64_t*>(temp)[i];
-	}
-
-	keccakf(st);
-
-	memcpy(md, st, mdlen);
-}
+// Incremental keccak hashing
+// Input is absorbed in contiguous segments directly from the caller's buffers, runs of zero bytes don't need a buffer at all
+class KeccakStream
+{
+public:
+	explicit KeccakStream(int mdlen = HASH_SIZE);
+
+	void absorb(const uint8_t* data, size_t size);
+	void absorb_zeros(size_t size);
+	void finalize(uint8_t* md);
+
+private:
+	uint64_t m_state[25];
+	int m_mdlen;
+	size_t m_rsiz;
+	size_t m_pos;
+};
 
 } // namespace p2pool
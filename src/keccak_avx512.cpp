@@ -0,0 +1,109 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "common.h"
+#include "keccak.h"
+
+#if defined(__x86_64__) || defined(_M_AMD64)
+
+#include <immintrin.h>
+
+namespace p2pool {
+
+// Not _mm512_rol_epi64(): GCC 12 headers implement it with an intentionally uninitialized variable, which breaks -Werror=uninitialized
+// The zero-masked version with all lanes enabled compiles to the same vprolq instruction
+#define ROTL64_X8(x, y) _mm512_maskz_rol_epi64(0xFF, (x), (y))
+
+// 8 independent keccak-f[1600] states, interleaved: st[i * 8 + lane]
+// Same structure as the scalar keccakf() in keccak.cpp
+void keccakf_x8_avx512(uint64_t* st)
+{
+	__m512i s[25];
+
+	for (int i = 0; i < 25; ++i) {
+		s[i] = _mm512_loadu_si512(st + i * 8);
+	}
+
+	for (int round = 0; round < KeccakParams::ROUNDS; ++round) {
+		__m512i bc[5];
+
+		// Theta
+		// 0x96 = a ^ b ^ c
+		for (int i = 0; i < 5; ++i) {
+			bc[i] = _mm512_xor_si512(_mm512_ternarylogic_epi64(s[i], s[i + 5], s[i + 10], 0x96), _mm512_xor_si512(s[i + 15], s[i + 20]));
+		}
+
+		for (int i = 0; i < 5; ++i) {
+			const __m512i t = _mm512_xor_si512(bc[(i + 4) % 5], ROTL64_X8(bc[(i + 1) % 5], 1));
+			s[i +  0] = _mm512_xor_si512(s[i +  0], t);
+			s[i +  5] = _mm512_xor_si512(s[i +  5], t);
+			s[i + 10] = _mm512_xor_si512(s[i + 10], t);
+			s[i + 15] = _mm512_xor_si512(s[i + 15], t);
+			s[i + 20] = _mm512_xor_si512(s[i + 20], t);
+		}
+
+		// Rho Pi
+		const __m512i t = s[1];
+		s[ 1] = ROTL64_X8(s[ 6], 44);
+		s[ 6] = ROTL64_X8(s[ 9], 20);
+		s[ 9] = ROTL64_X8(s[22], 61);
+		s[22] = ROTL64_X8(s[14], 39);
+		s[14] = ROTL64_X8(s[20], 18);
+		s[20] = ROTL64_X8(s[ 2], 62);
+		s[ 2] = ROTL64_X8(s[12], 43);
+		s[12] = ROTL64_X8(s[13], 25);
+		s[13] = ROTL64_X8(s[19],  8);
+		s[19] = ROTL64_X8(s[23], 56);
+		s[23] = ROTL64_X8(s[15], 41);
+		s[15] = ROTL64_X8(s[ 4], 27);
+		s[ 4] = ROTL64_X8(s[24], 14);
+		s[24] = ROTL64_X8(s[21],  2);
+		s[21] = ROTL64_X8(s[ 8], 55);
+		s[ 8] = ROTL64_X8(s[16], 45);
+		s[16] = ROTL64_X8(s[ 5], 36);
+		s[ 5] = ROTL64_X8(s[ 3], 28);
+		s[ 3] = ROTL64_X8(s[18], 21);
+		s[18] = ROTL64_X8(s[17], 15);
+		s[17] = ROTL64_X8(s[11], 10);
+		s[11] = ROTL64_X8(s[ 7],  6);
+		s[ 7] = ROTL64_X8(s[10],  3);
+		s[10] = ROTL64_X8(t, 1);
+
+		// Chi
+		// 0xD2 = a ^ (~b & c)
+		for (int j = 0; j < 25; j += 5) {
+			for (int i = 0; i < 5; ++i) {
+				bc[i] = s[j + i];
+			}
+			for (int i = 0; i < 5; ++i) {
+				s[j + i] = _mm512_ternarylogic_epi64(bc[i], bc[(i + 1) % 5], bc[(i + 2) % 5], 0xD2);
+			}
+		}
+
+		// Iota
+		s[0] = _mm512_xor_si512(s[0], _mm512_set1_epi64(static_cast<int64_t>(keccakf_rndc[round])));
+	}
+
+	for (int i = 0; i < 25; ++i) {
+		_mm512_storeu_si512(st + i * 8, s[i]);
+	}
+}
+
+} // namespace p2pool
+
+#endif
@@ -41,9 +41,15 @@ void p2pool_usage()
 		"--no-cache           Disable p2pool.cache\n"
 		"--no-color           Disable colors in console output\n"
 		"--no-randomx         Disable internal RandomX hasher: p2pool will use RPC calls to monerod to check PoW hashes\n"
+		"--rpc-pow-jobs N     Maximum number of parallel PoW RPC calls to monerod when RandomX is disabled (any value between 1 and 64, default 4)\n"
 		"--out-peers N        Maximum number of outgoing connections for p2p server (any value between 10 and 1000)\n"
 		"--in-peers N         Maximum number of incoming connections for p2p server (any value between 10 and 1000)\n"
 		"--start-mining N     Start built-in miner using N threads (any value between 1 and 64)\n"
+		"--miner-numa         Built-in miner: use a separate RandomX dataset (2 GB) on every NUMA node and keep mining threads on their node\n"
+		"--miner-affinity A   Built-in miner: pin mining threads to CPUs from hex mask A, or use \"auto\" to place them by L3 cache (2 MB per thread)\n"
+		"--miner-dedicated    Built-in miner: don't yield CPU after every hash, use it if nothing else runs on this machine\n"
+		"--template-history N Accept shares for N previous block templates (any value between 1 and 63, default 4)\n"
+		"--template-time T    Also accept shares for block templates replaced less than T seconds ago (up to 63 templates, T between 0 and 600)\n"
 		"--mini               Connect to p2pool-mini sidechain. Note that it will also change default p2p port from %d to %d.\n"
 		"--help               Show this help message\n\n"
 		"Example command line:\n\n"
@@ -33,13 +33,30 @@ Mempool::~Mempool()
 	uv_rwlock_destroy(&m_lock);
 }
 
+bool Mempool::FeeRateOrder::operator()(const TxMempoolData& a, const TxMempoolData& b) const
+{
+	const uint64_t fee_rate_a = a.fee * b.weight;
+	const uint64_t fee_rate_b = b.fee * a.weight;
+
+	if (fee_rate_a != fee_rate_b) {
+		return fee_rate_a > fee_rate_b;
+	}
+
+	return a.id < b.id;
+}
+
 void Mempool::add(const TxMempoolData& tx)
 {
+	const time_t cur_time = time(nullptr);
+
 	WriteLock lock(m_lock);
 
 	if (!m_transactions.emplace(tx.id, tx).second) {
 		LOGWARN(1, "duplicate transaction with id = " << tx.id << ", skipped");
+		return;
 	}
+
+	add_nolock(tx, cur_time);
 }
 
 void Mempool::swap(std::vector<TxMempoolData>& transactions)
@@ -60,10 +77,56 @@ void Mempool::swap(std::vector<TxMempoolData>& transactions)
 	}
 
 	m_transactions.clear();
+	m_feeIndex.clear();
+	m_youngTransactions.clear();
 
 	for (TxMempoolData& data : transactions) {
-		m_transactions.emplace(data.id, data);
+		if (m_transactions.emplace(data.id, data).second) {
+			add_nolock(data, cur_time);
+		}
 	}
 }
 
+size_t Mempool::get_best_transactions(time_t cur_time, size_t max_count, std::vector<TxMempoolData>& transactions)
+{
+	WriteLock lock(m_lock);
+
+	promote_transactions(cur_time);
+
+	transactions.clear();
+	transactions.reserve(std::min(max_count, m_feeIndex.size()));
+
+	for (auto it = m_feeIndex.begin(); (it != m_feeIndex.end()) && (transactions.size() < max_count); ++it) {
+		transactions.emplace_back(*it);
+	}
+
+	return m_transactions.size();
+}
+
+void Mempool::add_nolock(const TxMempoolData& tx, time_t cur_time)
+{
+	if (cur_time >= tx.time_received + MIN_TX_AGE) {
+		m_feeIndex.insert(tx);
+	}
+	else {
+		m_youngTransactions[tx.time_received].push_back(tx.id);
+	}
+}
+
+void Mempool::promote_transactions(time_t cur_time)
+{
+	auto it = m_youngTransactions.begin();
+
+	for (; (it != m_youngTransactions.end()) && (cur_time >= it->first + MIN_TX_AGE); ++it) {
+		for (const hash& id : it->second) {
+			auto tx = m_transactions.find(id);
+			if (tx != m_transactions.end()) {
+				m_feeIndex.insert(tx->second);
+			}
+		}
+	}
+
+	m_youngTransactions.erase(m_youngTransactions.begin(), it);
+}
+
 } // namespace p2pool
@@ -18,6 +18,8 @@
 #pragma once
 
 #include "uv_util.h"
+#include <map>
+#include <set>
 
 namespace p2pool {
 
@@ -29,12 +31,34 @@ public:
 	Mempool();
 	~Mempool();
 
+	// Only transactions received this many seconds ago or earlier can be included in block templates
+	static constexpr time_t MIN_TX_AGE = 10;
+
 	void add(const TxMempoolData& tx);
 	void swap(std::vector<TxMempoolData>& transactions);
 
+	// Copies up to max_count transactions with the highest fee per byte, skipping transactions younger than MIN_TX_AGE
+	// Returns the total number of transactions in the mempool
+	size_t get_best_transactions(time_t cur_time, size_t max_count, std::vector<TxMempoolData>& transactions);
+
 public:
 	mutable uv_rwlock_t m_lock;
 	unordered_map<hash, TxMempoolData> m_transactions;
+
+private:
+	struct FeeRateOrder
+	{
+		bool operator()(const TxMempoolData& a, const TxMempoolData& b) const;
+	};
+
+	void add_nolock(const TxMempoolData& tx, time_t cur_time);
+	void promote_transactions(time_t cur_time);
+
+	// Transactions old enough to be included in block templates, sorted by fee per byte (highest to lowest)
+	std::set<TxMempoolData, FeeRateOrder> m_feeIndex;
+
+	// Recently received transactions, bucketed by time_received
+	std::map<time_t, std::vector<hash>> m_youngTransactions;
 };
 
 } // namespace p2pool
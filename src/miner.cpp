@@ -22,6 +22,7 @@
 #include "block_template.h"
 #include "pow_hash.h"
 #include "randomx.h"
+#include "configuration.h"
 #include "params.h"
 #include "p2pool_api.h"
 #include <thread>
@@ -46,10 +47,29 @@ Miner::Miner(p2pool* pool, uint32_t threads)
 {
 	on_block(m_pool->block_template());
 
+	if (m_pool->params().m_minerNuma) {
+		init_numa_nodes();
+	}
+
+	const std::vector<int> cpus = get_cpu_layout(threads);
+
 	m_minerThreads.reserve(threads);
 
 	for (uint32_t i = 0; i < threads; ++i) {
-		WorkerData* data = new WorkerData{ this, i + 1, threads, {} };
+		int numa_node = m_numaNodes.empty() ? -1 : static_cast<int>(i % m_numaNodes.size());
+
+		// Pinned threads must use the dataset of their CPU's node
+		if (cpus[i] >= 0) {
+			for (size_t j = 0; j < m_numaNodes.size(); ++j) {
+				const std::vector<uint32_t>& node_cpus = m_numaNodes[j]->m_cpus;
+				if (std::find(node_cpus.begin(), node_cpus.end(), static_cast<uint32_t>(cpus[i])) != node_cpus.end()) {
+					numa_node = static_cast<int>(j);
+					break;
+				}
+			}
+		}
+
+		WorkerData* data = new WorkerData{ this, i + 1, threads, {}, numa_node, cpus[i] };
 		const int err = uv_thread_create(&data->m_worker, run, data);
 		if (err) {
 			LOGERR(1, "failed to start worker thread " << data->m_index << '/' << threads << ", error " << uv_err_name(err));
@@ -68,6 +88,173 @@ Miner::~Miner()
 		uv_thread_join(&data->m_worker);
 		delete data;
 	}
+
+	for (NumaNode* node : m_numaNodes) {
+		if (node->m_dataset) {
+			randomx_release_dataset(node->m_dataset);
+		}
+		uv_mutex_destroy(&node->m_lock);
+		delete node;
+	}
+}
+
+void Miner::init_numa_nodes()
+{
+	if (!m_pool->hasher()->dataset()) {
+		LOGWARN(1, "NUMA mode requires RandomX dataset, it will be disabled");
+		return;
+	}
+
+	std::vector<std::vector<uint32_t>> nodes = get_numa_nodes();
+	if (nodes.size() < 2) {
+		LOGINFO(1, "found " << nodes.size() << " NUMA node(s), NUMA mode will be disabled");
+		return;
+	}
+
+	m_numaNodes.reserve(nodes.size());
+
+	for (std::vector<uint32_t>& cpus : nodes) {
+		NumaNode* node = new NumaNode{ std::move(cpus), {}, nullptr, 0, false };
+		uv_mutex_init_checked(&node->m_lock);
+		m_numaNodes.push_back(node);
+	}
+
+	LOGINFO(1, "NUMA mode: " << m_numaNodes.size() << " nodes, each will have its own copy of RandomX dataset");
+}
+
+std::vector<int> Miner::get_cpu_layout(uint32_t threads) const
+{
+	std::vector<int> result(threads, -1);
+
+	const std::string& affinity = m_pool->params().m_minerAffinity;
+	if (affinity.empty()) {
+		return result;
+	}
+
+	std::vector<uint32_t> cpus;
+
+	if (affinity == "auto") {
+		// Every thread needs 2 MB of L3 cache for its scratchpad, so don't put more threads on one L3 cache than it can fit
+		// Threads are spread over all L3 caches, and physical cores are used before hyperthreads
+		constexpr uint64_t SCRATCHPAD_SIZE = 2 << 20;
+
+		const std::vector<L3CacheGroup> groups = get_l3_cache_groups();
+		if (groups.empty()) {
+			LOGWARN(1, "couldn't get L3 cache topology, mining threads won't be pinned");
+			return result;
+		}
+
+		std::vector<size_t> capacity(groups.size());
+		size_t total_capacity = 0;
+
+		for (size_t i = 0; i < groups.size(); ++i) {
+			capacity[i] = std::min<size_t>(std::max<uint64_t>(groups[i].m_size / SCRATCHPAD_SIZE, 1), groups[i].m_cpus.size());
+			total_capacity += capacity[i];
+		}
+
+		for (size_t k = 0; cpus.size() < total_capacity; ++k) {
+			for (size_t i = 0; i < groups.size(); ++i) {
+				if (k < capacity[i]) {
+					cpus.push_back(groups[i].m_cpus[k]);
+				}
+			}
+		}
+
+		if (threads > total_capacity) {
+			LOGWARN(1, threads << " mining threads don't fit in L3 cache (enough for " << total_capacity << " threads), hashrate per thread will be lower");
+
+			// Oversubscribe L3 caches with the remaining CPUs
+			for (size_t k = 0;; ++k) {
+				bool found = false;
+				for (size_t i = 0; i < groups.size(); ++i) {
+					if (capacity[i] + k < groups[i].m_cpus.size()) {
+						cpus.push_back(groups[i].m_cpus[capacity[i] + k]);
+						found = true;
+					}
+				}
+				if (!found) {
+					break;
+				}
+			}
+		}
+	}
+	else {
+		const char* s = affinity.c_str();
+		if ((s[0] == '0') && ((s[1] == 'x') || (s[1] == 'X'))) {
+			s += 2;
+		}
+
+		// Hex mask, the lowest bit is CPU 0
+		const size_t n = strlen(s);
+		for (size_t i = 0; i < n; ++i) {
+			const char c = s[n - 1 - i];
+			uint32_t d;
+			if ((c >= '0') && (c <= '9')) {
+				d = c - '0';
+			}
+			else if ((c >= 'a') && (c <= 'f')) {
+				d = c - 'a' + 10;
+			}
+			else if ((c >= 'A') && (c <= 'F')) {
+				d = c - 'A' + 10;
+			}
+			else {
+				LOGWARN(1, "invalid affinity mask " << affinity << ", mining threads won't be pinned");
+				return result;
+			}
+
+			for (uint32_t j = 0; j < 4; ++j) {
+				if (d & (1U << j)) {
+					cpus.push_back(static_cast<uint32_t>(i * 4 + j));
+				}
+			}
+		}
+
+		std::sort(cpus.begin(), cpus.end());
+	}
+
+	if (cpus.empty()) {
+		LOGWARN(1, "no CPUs to pin mining threads to");
+		return result;
+	}
+
+	for (uint32_t i = 0; i < threads; ++i) {
+		result[i] = static_cast<int>(cpus[i % cpus.size()]);
+	}
+
+	return result;
+}
+
+randomx_dataset* Miner::get_numa_dataset(int node, uint32_t seed_counter)
+{
+	randomx_dataset* dataset = m_pool->hasher()->dataset();
+	if ((node < 0) || !dataset) {
+		return dataset;
+	}
+
+	NumaNode* n = m_numaNodes[node];
+	MutexLock lock(n->m_lock);
+
+	if (!n->m_dataset) {
+		// The calling thread is pinned to this node, so the memory will be placed there when it's first touched
+		n->m_dataset = randomx_alloc_dataset(RANDOMX_FLAG_LARGE_PAGES);
+		if (!n->m_dataset) {
+			n->m_dataset = randomx_alloc_dataset(RANDOMX_FLAG_DEFAULT);
+			if (!n->m_dataset) {
+				LOGWARN(1, "couldn't allocate RandomX dataset for NUMA node " << node << ", using the shared dataset");
+				return dataset;
+			}
+		}
+	}
+
+	if (!n->m_ready || (n->m_seedCounter != seed_counter)) {
+		LOGINFO(4, "copying RandomX dataset to NUMA node " << node);
+		memcpy(randomx_get_dataset_memory(n->m_dataset), randomx_get_dataset_memory(dataset), RANDOMX_DATASET_BASE_SIZE + RANDOMX_DATASET_EXTRA_SIZE);
+		n->m_seedCounter = seed_counter;
+		n->m_ready = true;
+	}
+
+	return n->m_dataset;
 }
 
 void Miner::print_status()
@@ -79,7 +266,8 @@ void Miner::print_status()
 
 	LOGINFO(0, "status" <<
 		"\nThreads  = " << m_threads <<
-		"\nHashrate = " << log::Hashrate(hr)
+		"\nHashrate = " << log::Hashrate(hr) <<
+		"\nNUMA     = " << (m_numaNodes.empty() ? "off" : "on") << " (" << m_numaNodes.size() << " nodes)"
 	);
 }
 
@@ -100,8 +288,17 @@ void Miner::on_block(const BlockTemplate& block)
 	m_totalHashes += hash_count;
 
 	if (m_pool->api() && m_pool->params().m_localStats) {
+		std::vector<uint64_t> thread_hashrates;
+		thread_hashrates.reserve(m_minerThreads.size());
+
+		for (WorkerData* data : m_minerThreads) {
+			const uint64_t hashes = data->m_hashes.load(std::memory_order_relaxed);
+			thread_hashrates.push_back((dt > 0.0) ? static_cast<uint64_t>((hashes - data->m_prevHashes) / dt) : 0);
+			data->m_prevHashes = hashes;
+		}
+
 		m_pool->api()->set(p2pool_api::Category::LOCAL, "miner",
-			[cur_ts, hash_count, dt, this](log::Stream& s)
+			[cur_ts, hash_count, dt, this, thread_hashrates](log::Stream& s)
 			{
 				const uint64_t hr = (dt > 0.0) ? static_cast<uint64_t>(hash_count / dt) : 0;
 				const double time_running = static_cast<double>(duration_cast<milliseconds>(cur_ts - m_startTimestamp).count()) / 1e3;
@@ -111,7 +308,16 @@ void Miner::on_block(const BlockTemplate& block)
 					<< ",\"time_running\":" << time_running
 					<< ",\"shares_found\":" << m_sharesFound.load()
 					<< ",\"threads\":" << m_threads
-					<< "}";
+					<< ",\"thread_hashrates\":[";
+
+				for (size_t i = 0; i < thread_hashrates.size(); ++i) {
+					if (i) {
+						s << ',';
+					}
+					s << thread_hashrates[i];
+				}
+
+				s << "]}";
 			});
 	}
 }
@@ -121,6 +327,21 @@ void Miner::run(void* data)
 	WorkerData* d = static_cast<WorkerData*>(data);
 	LOGINFO(1, "worker thread " << d->m_index << '/' << d->m_count << " started");
 	make_thread_background();
+
+	if (d->m_cpu >= 0) {
+		if (set_thread_affinity({ static_cast<uint32_t>(d->m_cpu) })) {
+			LOGINFO(4, "worker thread " << d->m_index << '/' << d->m_count << " pinned to CPU " << d->m_cpu);
+		}
+		else {
+			LOGWARN(1, "worker thread " << d->m_index << '/' << d->m_count << " couldn't be pinned to CPU " << d->m_cpu);
+		}
+	}
+	else if (d->m_numaNode >= 0) {
+		if (!set_thread_affinity(d->m_miner->m_numaNodes[d->m_numaNode]->m_cpus)) {
+			LOGWARN(1, "worker thread " << d->m_index << '/' << d->m_count << " couldn't be pinned to NUMA node " << d->m_numaNode);
+		}
+	}
+
 	d->m_miner->run(d);
 	LOGINFO(1, "worker thread " << d->m_index << '/' << d->m_count << " stopped");
 }
@@ -128,8 +349,13 @@ void Miner::run(void* data)
 void Miner::run(WorkerData* data)
 {
 	RandomX_Hasher_Base* hasher = m_pool->hasher();
+
+	// The dataset can still be initializing when mining starts right after sync, it must not be copied to the NUMA node before it's ready
+	hasher->sync_wait();
+	uint32_t seed_counter = hasher->seed_counter();
+
 	randomx_cache* cache = hasher->cache();
-	randomx_dataset* dataset = hasher->dataset();
+	randomx_dataset* dataset = get_numa_dataset(data->m_numaNode, seed_counter);
 
 	if (!cache && !dataset) {
 		LOGERR(1, "worker thread " << data->m_index << '/' << data->m_count << ": RandomX cache and dataset are not ready");
@@ -154,18 +380,20 @@ void Miner::run(WorkerData* data)
 	uint32_t index = 0;
 	Job job[2];
 
-	uint32_t seed_counter = 0;
 	bool first = true;
 
 	Miner* miner = data->m_miner;
 
+	// Yielding after every hash lets other threads run, it's not needed when the machine is dedicated to mining
+	const bool yield = !m_pool->params().m_minerDedicated;
+
 	while (!m_stopped) {
 		if (hasher->seed_counter() != seed_counter) {
 			LOGINFO(5, "worker thread " << data->m_index << '/' << data->m_count << " paused (waiting for RandomX cache/dataset update)");
 			hasher->sync_wait();
 			seed_counter = hasher->seed_counter();
 			if (flags & RANDOMX_FLAG_FULL_MEM) {
-				dataset = hasher->dataset();
+				dataset = get_numa_dataset(data->m_numaNode, seed_counter);
 				randomx_vm_set_dataset(vm, dataset);
 			}
 			else {
@@ -189,11 +417,12 @@ void Miner::run(WorkerData* data)
 
 		hash h;
 		randomx_calculate_hash_next(vm, job[index].m_blob, job[index].m_blobSize, &h);
+		data->m_hashes.fetch_add(1, std::memory_order_relaxed);
 
 		if (j.m_diff.check_pow(h)) {
 			LOGINFO(0, log::Green() << "worker thread " << data->m_index << '/' << data->m_count << " found a mainchain block, submitting it");
-			m_pool->submit_block_async(j.m_templateId, j.m_nonce, j.m_extraNonce);
 			m_pool->block_template().update_tx_keys();
+			m_pool->submit_block_async(j.m_templateId, j.m_nonce, j.m_extraNonce);
 		}
 
 		if (j.m_sidechainDiff.check_pow(h)) {
@@ -202,7 +431,9 @@ void Miner::run(WorkerData* data)
 			++m_sharesFound;
 		}
 
-		std::this_thread::yield();
+		if (yield) {
+			std::this_thread::yield();
+		}
 	}
 
 	randomx_destroy_vm(vm);
@@ -20,6 +20,8 @@
 #include "uv_util.h"
 #include <chrono>
 
+struct randomx_dataset;
+
 namespace p2pool {
 
 class p2pool;
@@ -46,9 +48,34 @@ private:
 		uint32_t m_index;
 		uint32_t m_count;
 		uv_thread_t m_worker;
+
+		// Index in m_numaNodes, -1 if NUMA mode is off
+		int m_numaNode;
+
+		// CPU this thread is pinned to, -1 if it's not pinned to a single CPU
+		int m_cpu;
+
+		std::atomic<uint64_t> m_hashes{ 0 };
+		uint64_t m_prevHashes = 0;
 	};
 
 	std::vector<WorkerData*> m_minerThreads;
+
+	// Local copy of the RandomX dataset for worker threads pinned to this NUMA node
+	struct NumaNode
+	{
+		std::vector<uint32_t> m_cpus;
+		uv_mutex_t m_lock;
+		randomx_dataset* m_dataset;
+		uint32_t m_seedCounter;
+		bool m_ready;
+	};
+
+	std::vector<NumaNode*> m_numaNodes;
+
+	void init_numa_nodes();
+	std::vector<int> get_cpu_layout(uint32_t threads) const;
+	randomx_dataset* get_numa_dataset(int node, uint32_t seed_counter);
 	volatile bool m_stopped;
 
 	std::chrono::time_point<std::chrono::high_resolution_clock> m_startTimestamp;
@@ -37,12 +37,98 @@ static const char* seed_nodes_mini[] = { "seeds-mini.p2pool.io", "" };
 static constexpr int DEFAULT_BACKLOG = 16;
 static constexpr uint64_t DEFAULT_BAN_TIME = 600;
 
+// Peer scores are in [0, 1] range, unknown peers start in the middle
+static constexpr double PEER_DEFAULT_SCORE = 0.5;
+
+// Weight of the current score when it's merged into the saved score (once a minute)
+static constexpr double PEER_SCORE_UPDATE_WEIGHT = 0.2;
+
+// Outgoing connections are picked as the best of this many random peers
+static constexpr uint32_t PEER_SELECTION_CANDIDATES = 3;
+
+// How often the worst outgoing peer is disconnected to make room for a new one, and how long it must have been connected
+static constexpr uint32_t PEER_ROTATION_INTERVAL = 600;
+static constexpr time_t PEER_ROTATION_MIN_UPTIME = 600;
+
 #include "tcp_server.inl"
 
 namespace p2pool {
 
+typedef uint8_t challenge_bytes[P2PServer::P2PClient::CHALLENGE_SIZE];
+
+static FORCEINLINE void write_challenge(uint64_t k, challenge_bytes& buf)
+{
+	for (uint8_t& b : buf) {
+		b = k & 0xFF;
+		k >>= 8;
+	}
+}
+
+// High 32 bits of the accepting peer's CHALLENGE, they show that it supports session tokens
+static uint32_t session_marker(uint32_t k, const std::vector<uint8_t>& consensus_id)
+{
+	static constexpr char domain[] = "session";
+
+	hash h;
+	KeccakStream stream;
+	stream.absorb(reinterpret_cast<const uint8_t*>(&k), sizeof(k));
+	stream.absorb(consensus_id.data(), consensus_id.size());
+	stream.absorb(reinterpret_cast<const uint8_t*>(domain), sizeof(domain) - 1);
+	stream.finalize(h.h);
+
+	uint32_t result;
+	memcpy(&result, h.h, sizeof(result));
+	return result;
+}
+
+static FORCEINLINE bool has_session_marker(uint64_t challenge, const std::vector<uint8_t>& consensus_id)
+{
+	return (challenge >> 32) == session_marker(static_cast<uint32_t>(challenge), consensus_id);
+}
+
+// TOKEN which the accepting peer gives to the connecting peer as its SALT
+// It depends on a secret only this node knows, so it can't be calculated from the peer ID and challenges alone
+// It's still sent unencrypted, so anyone who sees this handshake can use it until it expires
+static uint64_t session_token(const hash& secret, uint64_t peer_id, uint64_t outgoing_challenge, uint64_t incoming_challenge)
+{
+	hash h;
+	KeccakStream stream;
+	stream.absorb(secret.h, HASH_SIZE);
+	stream.absorb(reinterpret_cast<const uint8_t*>(&peer_id), sizeof(peer_id));
+	stream.absorb(reinterpret_cast<const uint8_t*>(&outgoing_challenge), sizeof(outgoing_challenge));
+	stream.absorb(reinterpret_cast<const uint8_t*>(&incoming_challenge), sizeof(incoming_challenge));
+	stream.finalize(h.h);
+
+	uint64_t result;
+	memcpy(&result, h.h, sizeof(result));
+	return result;
+}
+
+// SALT which the connecting peer uses instead of PoW to prove that it has a session token
+static void session_token_proof(uint64_t token, const challenge_bytes& challenge, challenge_bytes& salt)
+{
+	hash h;
+	KeccakStream stream;
+	stream.absorb(reinterpret_cast<const uint8_t*>(&token), sizeof(token));
+	stream.absorb(challenge, sizeof(challenge));
+	stream.finalize(h.h);
+
+	memcpy(salt, h.h, sizeof(salt));
+}
+
+static hash handshake_hash(const challenge_bytes& challenge, const std::vector<uint8_t>& consensus_id, const challenge_bytes& salt)
+{
+	hash h;
+	KeccakStream stream;
+	stream.absorb(challenge, sizeof(challenge));
+	stream.absorb(consensus_id.data(), consensus_id.size());
+	stream.absorb(salt, sizeof(salt));
+	stream.finalize(h.h);
+	return h;
+}
+
 P2PServer::P2PServer(p2pool* pool)
-	: TCPServer(P2PClient::allocate)
+	: TCPServer(P2PClient::allocate, P2P_WRITE_QUEUE_HIGH_WATER_MARK, P2P_WRITE_QUEUE_MAX_SIZE)
 	, m_pool(pool)
 	, m_cache(pool->params().m_blockCache ? new BlockCache() : nullptr)
 	, m_cacheLoaded(false)
@@ -55,6 +141,7 @@ P2PServer::P2PServer(p2pool* pool)
 	, m_timerInterval(2)
 	, m_peerId(m_rng())
 	, m_peerListLastSaved(0)
+	, m_numBroadcastsSkipped(0)
 {
 	set_max_outgoing_peers(pool->params().m_maxOutgoingPeers);
 	set_max_incoming_peers(pool->params().m_maxIncomingPeers);
@@ -64,6 +151,13 @@ P2PServer::P2PServer(p2pool* pool)
 	uv_mutex_init_checked(&m_peerListLock);
 	uv_mutex_init_checked(&m_broadcastLock);
 	uv_mutex_init_checked(&m_missingBlockRequestsLock);
+	uv_mutex_init_checked(&m_sessionTokensLock);
+
+	// m_rng's output is visible to other peers (peer ID, challenges), so it can't be used for the session token secret
+	for (size_t i = 0; i < HASH_SIZE; i += sizeof(uint32_t)) {
+		const uint32_t k = m_rd();
+		memcpy(m_sessionSecret.h + i, &k, sizeof(k));
+	}
 	uv_rwlock_init_checked(&m_cachedBlocksLock);
 
 	int err = uv_async_init(&m_loop, &m_broadcastAsync, on_broadcast);
@@ -110,6 +204,7 @@ P2PServer::~P2PServer()
 	uv_mutex_destroy(&m_peerListLock);
 	uv_mutex_destroy(&m_broadcastLock);
 	uv_mutex_destroy(&m_missingBlockRequestsLock);
+	uv_mutex_destroy(&m_sessionTokensLock);
 
 	clear_cached_blocks();
 	uv_rwlock_destroy(&m_cachedBlocksLock);
@@ -179,11 +274,13 @@ void P2PServer::update_peer_connections()
 
 	bool has_good_peers = false;
 
-	std::vector<raw_ip> connected_clients;
+	std::vector<P2PClient*> clients;
+	get_clients(clients, false);
+
+	unordered_set<raw_ip> connected_clients;
 	{
-		MutexLock lock(m_clientsListLock);
-		connected_clients.reserve(m_numConnections);
-		for (P2PClient* client = static_cast<P2PClient*>(m_connectedClientsList->m_next); client != m_connectedClientsList; client = static_cast<P2PClient*>(client->m_next)) {
+		connected_clients.reserve(clients.size());
+		for (P2PClient* client : clients) {
 			bool disconnected = false;
 
 			const int timeout = client->m_handshakeComplete ? 300 : 10;
@@ -210,7 +307,7 @@ void P2PServer::update_peer_connections()
 			}
 
 			if (!disconnected) {
-				connected_clients.emplace_back(client->m_addr);
+				connected_clients.insert(client->m_addr);
 				if (client->m_handshakeComplete && !client->m_handshakeInvalid && (client->m_listenPort >= 0)) {
 					has_good_peers = true;
 				}
@@ -223,11 +320,23 @@ void P2PServer::update_peer_connections()
 		MutexLock lock(m_peerListLock);
 
 		if ((m_timerCounter % 30) == 1) {
-			// Update last seen time for currently connected peers
+			unordered_map<raw_ip, double> scores;
+			for (const P2PClient* client : clients) {
+				if (!client->m_isIncoming && client->m_handshakeComplete && !client->m_handshakeInvalid) {
+					scores.emplace(client->m_addr, client->score(cur_time));
+				}
+			}
+
+			// Update last seen time and score for currently connected peers
 			for (Peer& p : m_peerList) {
-				if (std::find_if(connected_clients.begin(), connected_clients.end(), [&p](const raw_ip& addr) { return p.m_addr == addr; }) != connected_clients.end()) {
+				if (connected_clients.find(p.m_addr) != connected_clients.end()) {
 					p.m_lastSeen = cur_time;
 				}
+
+				auto it = scores.find(p.m_addr);
+				if (it != scores.end()) {
+					p.m_score = p.m_score * (1.0 - PEER_SCORE_UPDATE_WEIGHT) + it->second * PEER_SCORE_UPDATE_WEIGHT;
+				}
 			}
 
 			// Remove all peers that weren't seen for more than 1 hour
@@ -249,18 +358,25 @@ void P2PServer::update_peer_connections()
 		N = static_cast<uint32_t>(peer_list.size());
 	}
 
-	// Try to have at least N outgoing connections (N defaults to 10, can be set via --out-peers command line parameter)
-	for (uint32_t i = m_numConnections - m_numIncomingConnections; (i < N) && !peer_list.empty();) {
-		const uint64_t k = get_random64() % peer_list.size();
-		const Peer& peer = peer_list[k];
+	const uint32_t num_outgoing = m_numConnections - m_numIncomingConnections;
 
-		bool already_connected = false;
-		for (const raw_ip& ip : connected_clients) {
-			if (ip == peer.m_addr) {
-				already_connected = true;
-				break;
+	if (has_good_peers && (num_outgoing >= N) && ((m_timerCounter % (PEER_ROTATION_INTERVAL / m_timerInterval)) == 3)) {
+		rotate_worst_peer(clients, peer_list.size() - std::min(peer_list.size(), connected_clients.size()));
+	}
+
+	// Try to have at least N outgoing connections (N defaults to 10, can be set via --out-peers command line parameter)
+	// Each connection goes to the best scoring of a few random peers, so fast peers are preferred but new peers still get a chance
+	for (uint32_t i = num_outgoing; (i < N) && !peer_list.empty();) {
+		uint64_t k = get_random64() % peer_list.size();
+		for (uint32_t j = 1; j < PEER_SELECTION_CANDIDATES; ++j) {
+			const uint64_t k1 = get_random64() % peer_list.size();
+			if (peer_list[k1].m_score > peer_list[k].m_score) {
+				k = k1;
 			}
 		}
+		const Peer& peer = peer_list[k];
+
+		const bool already_connected = (connected_clients.find(peer.m_addr) != connected_clients.end());
 
 		if (!already_connected && connect_to_peer(peer.m_isV6, peer.m_addr, peer.m_port)) {
 			++i;
@@ -280,16 +396,42 @@ void P2PServer::update_peer_connections()
 	}
 }
 
+void P2PServer::rotate_worst_peer(const std::vector<P2PClient*>& clients, size_t num_candidates)
+{
+	if (num_candidates == 0) {
+		return;
+	}
+
+	const time_t cur_time = time(nullptr);
+
+	P2PClient* worst = nullptr;
+	double worst_score = 0.0;
+
+	for (P2PClient* client : clients) {
+		if (client->m_isIncoming || !client->m_handshakeComplete || client->m_handshakeInvalid || (cur_time < client->m_handshakeTime + PEER_ROTATION_MIN_UPTIME)) {
+			continue;
+		}
+
+		const double score = client->score(cur_time);
+		if (!worst || (score < worst_score)) {
+			worst = client;
+			worst_score = score;
+		}
+	}
+
+	if (worst) {
+		LOGINFO(5, "peer " << static_cast<char*>(worst->m_addrString) << " has the lowest score (" << worst_score << "), disconnecting to try another peer");
+		worst->close();
+	}
+}
+
 void P2PServer::update_peer_list()
 {
 	{
-		MutexLock lock(m_clientsListLock);
-
-		for (P2PClient* client = static_cast<P2PClient*>(m_connectedClientsList->m_next); client != m_connectedClientsList; client = static_cast<P2PClient*>(client->m_next)) {
-			if (!client->m_handshakeComplete || !client->m_handshakeSolutionSent) {
-				continue;
-			}
+		std::vector<P2PClient*> clients;
+		get_clients(clients, true);
 
+		for (P2PClient* client : clients) {
 			if (m_timerCounter >= client->m_nextOutgoingPeerListRequest) {
 				// Send peer list requests at random intervals (60-120 seconds)
 				client->m_nextOutgoingPeerListRequest = m_timerCounter + (60 + (get_random64() % 61)) / m_timerInterval;
@@ -370,7 +512,7 @@ void P2PServer::save_peer_list()
 			memcpy(addr.s6_addr, p.m_addr.data, sizeof(addr.s6_addr));
 			addr_str = inet_ntop(AF_INET6, &addr, addr_str_buf, sizeof(addr_str_buf));
 			if (addr_str) {
-				f << '[' << addr_str << "]:" << p.m_port << '\n';
+				f << '[' << addr_str << "]:" << p.m_port << ' ' << p.m_score << '\n';
 			}
 		}
 		else {
@@ -378,7 +520,7 @@ void P2PServer::save_peer_list()
 			memcpy(&addr.s_addr, p.m_addr.data + 12, sizeof(addr.s_addr));
 			addr_str = inet_ntop(AF_INET, &addr, addr_str_buf, sizeof(addr_str_buf));
 			if (addr_str) {
-				f << addr_str << ':' << p.m_port << '\n';
+				f << addr_str << ':' << p.m_port << ' ' << p.m_score << '\n';
 			}
 		}
 	}
@@ -451,11 +593,24 @@ void P2PServer::load_peer_list()
 	}
 
 	// Finally load peers from p2pool_peers.txt
+	// Each line is "IP:port" optionally followed by the peer's score
+	unordered_map<std::string, double> saved_scores;
+
 	std::ifstream f(saved_peer_list_file_name);
 	if (f.is_open()) {
 		std::string address;
 		while (!f.eof()) {
 			std::getline(f, address);
+
+			const size_t k = address.find(' ');
+			if (k != std::string::npos) {
+				const double score = strtod(address.c_str() + k + 1, nullptr);
+				address.resize(k);
+				if ((score >= 0.0) && (score <= 1.0)) {
+					saved_scores[address] = score;
+				}
+			}
+
 			if (!address.empty()) {
 				if (!saved_list.empty()) {
 					saved_list += ',';
@@ -473,7 +628,7 @@ void P2PServer::load_peer_list()
 	MutexLock lock(m_peerListLock);
 
 	parse_address_list(saved_list,
-		[this](bool is_v6, const std::string& /*address*/, const std::string& ip, int port)
+		[this, &saved_scores](bool is_v6, const std::string& address, const std::string& ip, int port)
 		{
 			Peer p;
 			if (is_v6) {
@@ -512,6 +667,9 @@ void P2PServer::load_peer_list()
 			p.m_numFailedConnections = 0;
 			p.m_lastSeen = time(nullptr);
 
+			auto it = saved_scores.find(address);
+			p.m_score = (it != saved_scores.end()) ? it->second : PEER_DEFAULT_SCORE;
+
 			if (!already_added && !is_banned(p.m_addr)) {
 				m_peerList.push_back(p);
 			}
@@ -596,6 +754,7 @@ void P2PServer::load_monerod_peer_list()
 
 				p.m_port = port;
 				p.m_numFailedConnections = 0;
+				p.m_score = PEER_DEFAULT_SCORE;
 
 				if (!is_banned(p.m_addr)) {
 					m_peerListMonero.push_back(p);
@@ -631,7 +790,7 @@ void P2PServer::update_peer_in_list(bool is_v6, const raw_ip& ip, int port)
 	}
 
 	if (!is_banned(ip)) {
-		m_peerList.emplace_back(Peer{ is_v6, ip, port, 0, cur_time });
+		m_peerList.emplace_back(Peer{ is_v6, ip, port, 0, cur_time, PEER_DEFAULT_SCORE });
 	}
 }
 
@@ -697,6 +856,8 @@ void P2PServer::broadcast(const PoolBlock& block)
 	data->pruned_blob.insert(data->pruned_blob.end(), block.m_mainChainData.begin() + block.m_mainChainOutputsOffset + block.m_mainChainOutputsBlobSize, block.m_mainChainData.end());
 	data->pruned_blob.insert(data->pruned_blob.end(), block.m_sideChainData.begin(), block.m_sideChainData.end());
 
+	data->id = block.m_sidechainId;
+
 	data->ancestor_hashes.reserve(block.m_uncles.size() + 1);
 	data->ancestor_hashes = block.m_uncles;
 	data->ancestor_hashes.push_back(block.m_parent);
@@ -735,12 +896,15 @@ void P2PServer::broadcast(const PoolBlock& block)
 
 void P2PServer::on_broadcast()
 {
-	std::vector<Broadcast*> broadcast_queue;
+	// Blobs are shared by all pending writes and freed when the last one is finished
+	std::vector<std::shared_ptr<const Broadcast>> broadcast_queue;
 	broadcast_queue.reserve(2);
 
 	{
 		MutexLock lock(m_broadcastLock);
-		broadcast_queue = m_broadcastQueue;
+		for (Broadcast* data : m_broadcastQueue) {
+			broadcast_queue.emplace_back(data);
+		}
 		m_broadcastQueue.clear();
 	}
 
@@ -748,60 +912,59 @@ void P2PServer::on_broadcast()
 		return;
 	}
 
-	ON_SCOPE_LEAVE([&broadcast_queue]()
-		{
-			for (Broadcast* data : broadcast_queue) {
-				delete data;
+	std::vector<P2PClient*> clients;
+	get_clients(clients, true);
+
+	for (P2PClient* client : clients) {
+		for (const std::shared_ptr<const Broadcast>& data : broadcast_queue) {
+			// Don't send blocks this peer already has: it sent or requested them, or we sent them before
+			if (client->m_knownBlocks.contains(data->id)) {
+				LOGINFO(6, "skipping BLOCK_BROADCAST to " << log::Gray() << static_cast<char*>(client->m_addrString) << log::NoColor() << " (peer already has this block)");
+				++m_numBroadcastsSkipped;
+				continue;
 			}
-		});
 
-	MutexLock lock(m_clientsListLock);
+			bool send_pruned = true;
 
-	for (P2PClient* client = static_cast<P2PClient*>(m_connectedClientsList->m_next); client != m_connectedClientsList; client = static_cast<P2PClient*>(client->m_next)) {
-		if (!client->m_handshakeComplete || !client->m_handshakeSolutionSent) {
-			continue;
-		}
-
-		for (Broadcast* data : broadcast_queue) {
-			send(client, [client, data](void* buf) {
-				uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
-				uint8_t* p = p0;
+			const hash* a = client->m_broadcastedHashes;
+			const hash* b = client->m_broadcastedHashes + array_size(&P2PClient::m_broadcastedHashes);
 
-				bool send_pruned = true;
+			for (const hash& id : data->ancestor_hashes) {
+				if (std::find(a, b, id) == b) {
+					send_pruned = false;
+					break;
+				}
+			}
 
-				const hash* a = client->m_broadcastedHashes;
-				const hash* b = client->m_broadcastedHashes + array_size(&P2PClient::m_broadcastedHashes);
+			const std::vector<uint8_t>& blob = send_pruned ? data->pruned_blob : data->blob;
+			const uint32_t blob_size = static_cast<uint32_t>(blob.size());
 
-				for (const hash& id : data->ancestor_hashes) {
-					if (std::find(a, b, id) == b) {
-						send_pruned = false;
-						break;
-					}
-				}
+			const bool queued = send(client, [client, send_pruned, blob_size](void* buf) {
+				uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
+				uint8_t* p = p0;
 
 				if (send_pruned) {
 					LOGINFO(6, "sending BLOCK_BROADCAST (pruned) to " << log::Gray() << static_cast<char*>(client->m_addrString));
-					*(p++) = static_cast<uint8_t>(MessageId::BLOCK_BROADCAST);
-
-					*reinterpret_cast<uint32_t*>(p) = static_cast<uint32_t>(data->pruned_blob.size());
-					p += sizeof(uint32_t);
-
-					memcpy(p, data->pruned_blob.data(), data->pruned_blob.size());
-					p += data->pruned_blob.size();
 				}
 				else {
 					LOGINFO(5, "sending BLOCK_BROADCAST (full)   to " << log::Gray() << static_cast<char*>(client->m_addrString));
-					*(p++) = static_cast<uint8_t>(MessageId::BLOCK_BROADCAST);
+				}
 
-					*reinterpret_cast<uint32_t*>(p) = static_cast<uint32_t>(data->blob.size());
-					p += sizeof(uint32_t);
+				*(p++) = static_cast<uint8_t>(MessageId::BLOCK_BROADCAST);
 
-					memcpy(p, data->blob.data(), data->blob.size());
-					p += data->blob.size();
-				}
+				*reinterpret_cast<uint32_t*>(p) = blob_size;
+				p += sizeof(uint32_t);
 
 				return p - p0;
-			});
+			},
+			{ uv_buf_init(const_cast<char*>(reinterpret_cast<const char*>(blob.data())), blob_size) }, data,
+			// Broadcasts can be dropped for peers that don't keep up, they will request missing blocks later
+			true);
+
+			// Dropped broadcasts can be sent to this peer again later
+			if (queued) {
+				client->m_knownBlocks.add(data->id);
+			}
 		}
 	}
 }
@@ -829,20 +992,31 @@ void P2PServer::print_status()
 	}
 	s1 << h << "h " << m << "m " << s << 's';
 
+	size_t num_session_tokens;
+	{
+		MutexLock lock(m_sessionTokensLock);
+		num_session_tokens = m_sessionTokens.size();
+	}
+
 	LOGINFO(0, "status" <<
-		"\nConnections    = " << m_numConnections << " (" << m_numIncomingConnections << " incoming)" <<
-		"\nPeer list size = " << m_peerList.size() <<
-		"\nUptime         = " << log::const_buf(buf, s1.m_pos)
+		"\nConnections        = " << m_numConnections << " (" << m_numIncomingConnections << " incoming)" <<
+		"\nPeer list size     = " << m_peerList.size() <<
+		"\nSession tokens     = " << num_session_tokens <<
+		"\nBroadcasts skipped = " << m_numBroadcastsSkipped <<
+		"\nUptime             = " << log::const_buf(buf, s1.m_pos)
 	);
 }
 
 void P2PServer::show_peers()
 {
+	const time_t cur_time = time(nullptr);
+
 	MutexLock lock(m_clientsListLock);
 
-	for (P2PClient* client = static_cast<P2PClient*>(m_connectedClientsList->m_next); client != m_connectedClientsList; client = static_cast<P2PClient*>(client->m_next)) {
-		if (client->m_listenPort >= 0) {
-			LOGINFO(0, (client->m_isIncoming ? "I " : "O ") << client->m_pingTime << " ms\t" << static_cast<char*>(client->m_addrString));
+	for (Client* c : m_clientSlots) {
+		P2PClient* client = static_cast<P2PClient*>(c);
+		if (client && (client->m_listenPort >= 0)) {
+			LOGINFO(0, (client->m_isIncoming ? "I " : "O ") << client->m_pingTime << " ms\t" << client->score(cur_time) << '\t' << static_cast<char*>(client->m_addrString));
 		}
 	}
 }
@@ -862,6 +1036,7 @@ void P2PServer::on_timer()
 	save_peer_list_async();
 	update_peer_connections();
 	check_zmq();
+	prune_session_tokens();
 }
 
 void P2PServer::flush_cache()
@@ -909,22 +1084,8 @@ void P2PServer::download_missing_blocks()
 		return;
 	}
 
-	MutexLock lock(m_clientsListLock);
-
-	if (m_numConnections == 0) {
-		return;
-	}
-
 	std::vector<P2PClient*> clients;
-	clients.reserve(m_numConnections);
-
-	for (P2PClient* client = static_cast<P2PClient*>(m_connectedClientsList->m_next); client != m_connectedClientsList; client = static_cast<P2PClient*>(client->m_next)) {
-		if (!client->m_handshakeComplete || !client->m_handshakeSolutionSent) {
-			continue;
-		}
-
-		clients.emplace_back(client);
-	}
+	get_clients(clients, true);
 
 	if (clients.empty()) {
 		return;
@@ -962,6 +1123,7 @@ void P2PServer::download_missing_blocks()
 
 		if (result) {
 			++client->m_blockPendingRequests;
+			++client->m_numBlockRequests;
 		}
 	}
 }
@@ -981,10 +1143,84 @@ void P2PServer::check_zmq()
 	}
 }
 
+bool P2PServer::get_session_token(uint64_t peer_id, bool outgoing, uint64_t& token)
+{
+	MutexLock lock(m_sessionTokensLock);
+
+	auto it = m_sessionTokens.find(peer_id);
+	if ((it == m_sessionTokens.end()) || (it->second.m_outgoing != outgoing)) {
+		return false;
+	}
+
+	// The connecting peer stops using a token a minute early, so the other peer still has it when it arrives
+	const time_t expires = it->second.m_expires - (outgoing ? 60 : 0);
+
+	if (time(nullptr) >= expires) {
+		return false;
+	}
+
+	token = it->second.m_token;
+	return true;
+}
+
+void P2PServer::set_session_token(uint64_t peer_id, bool outgoing, uint64_t token)
+{
+	const time_t cur_time = time(nullptr);
+
+	MutexLock lock(m_sessionTokensLock);
+
+	auto it = m_sessionTokens.find(peer_id);
+	if (it != m_sessionTokens.end()) {
+		it->second = { token, cur_time + SESSION_TOKEN_LIFETIME, outgoing };
+		return;
+	}
+
+	// Forget the token which expires first to make room for the new one
+	if (m_sessionTokens.size() >= SESSION_TOKENS_MAX) {
+		auto oldest = m_sessionTokens.begin();
+		for (auto i = m_sessionTokens.begin(); i != m_sessionTokens.end(); ++i) {
+			if (i->second.m_expires < oldest->second.m_expires) {
+				oldest = i;
+			}
+		}
+		m_sessionTokens.erase(oldest);
+	}
+
+	m_sessionTokens.insert({ peer_id, { token, cur_time + SESSION_TOKEN_LIFETIME, outgoing } });
+}
+
+void P2PServer::remove_session_token(uint64_t peer_id)
+{
+	MutexLock lock(m_sessionTokensLock);
+	m_sessionTokens.erase(peer_id);
+}
+
+void P2PServer::prune_session_tokens()
+{
+	if ((m_timerCounter % 30) != 4) {
+		return;
+	}
+
+	const time_t cur_time = time(nullptr);
+
+	MutexLock lock(m_sessionTokensLock);
+
+	for (auto it = m_sessionTokens.begin(); it != m_sessionTokens.end();) {
+		if (cur_time >= it->second.m_expires) {
+			it = m_sessionTokens.erase(it);
+		}
+		else {
+			++it;
+		}
+	}
+}
+
 P2PServer::P2PClient::P2PClient()
 	: m_peerId(0)
 	, m_expectedMessage(MessageId::HANDSHAKE_CHALLENGE)
 	, m_handshakeChallenge(0)
+	, m_peerHandshakeChallenge(0)
+	, m_sessionTokenUsed(false)
 	, m_handshakeSolutionSent(false)
 	, m_handshakeComplete(false)
 	, m_handshakeInvalid(false)
@@ -999,6 +1235,11 @@ P2PServer::P2PClient::P2PClient()
 	, m_lastAlive(0)
 	, m_lastBroadcastTimestamp(0)
 	, m_lastBlockrequestTimestamp(0)
+	, m_handshakeTime(0)
+	, m_numBroadcasts(0)
+	, m_numFirstBroadcasts(0)
+	, m_numBlockRequests(0)
+	, m_numBlockResponses(0)
 	, m_broadcastedHashes{}
 {
 }
@@ -1014,6 +1255,8 @@ void P2PServer::P2PClient::reset()
 	m_peerId = 0;
 	m_expectedMessage = MessageId::HANDSHAKE_CHALLENGE;
 	m_handshakeChallenge = 0;
+	m_peerHandshakeChallenge = 0;
+	m_sessionTokenUsed = false;
 	m_handshakeSolutionSent = false;
 	m_handshakeComplete = false;
 	m_handshakeInvalid = false;
@@ -1028,11 +1271,17 @@ void P2PServer::P2PClient::reset()
 	m_lastAlive = 0;
 	m_lastBroadcastTimestamp = 0;
 	m_lastBlockrequestTimestamp = 0;
+	m_handshakeTime = 0;
+	m_numBroadcasts = 0;
+	m_numFirstBroadcasts = 0;
+	m_numBlockRequests = 0;
+	m_numBlockResponses = 0;
 
 	for (hash& h : m_broadcastedHashes) {
 		h = {};
 	}
 	m_broadcastedHashesIndex = 0;
+	m_knownBlocks.clear();
 }
 
 bool P2PServer::P2PClient::on_connect()
@@ -1048,13 +1297,11 @@ bool P2PServer::P2PClient::on_connect()
 		return false;
 	}
 
-	// Don't allow multiple connections to/from the same IP
+	// Don't allow multiple connections to/from the same IP (this connection is already counted)
 	// server->m_clientsListLock is already locked here
-	for (P2PClient* client = static_cast<P2PClient*>(server->m_connectedClientsList->m_next); client != server->m_connectedClientsList; client = static_cast<P2PClient*>(client->m_next)) {
-		if ((client != this) && (client->m_addr == m_addr)) {
-			LOGINFO(5, "peer " << static_cast<char*>(m_addrString) << " is already connected as " << static_cast<char*>(client->m_addrString));
-			return false;
-		}
+	if (server->get_num_connections_nolock(m_addr) > 1) {
+		LOGINFO(5, "peer " << static_cast<char*>(m_addrString) << " is already connected");
+		return false;
 	}
 
 	m_lastAlive = time(nullptr);
@@ -1068,7 +1315,7 @@ bool P2PServer::P2PClient::on_read(char* data, uint32_t size)
 		return false;
 	}
 
-	if ((data != m_readBuf + m_numRead) || (data + size > m_readBuf + sizeof(m_readBuf))) {
+	if ((data != m_readBuf + m_numRead) || (data + size > m_readBuf + m_readBufSize)) {
 		LOGERR(1, "peer " << static_cast<char*>(m_addrString) << " invalid data pointer or size in on_read()");
 		ban(DEFAULT_BAN_TIME);
 		server->remove_peer_from_list(this);
@@ -1295,11 +1542,22 @@ void P2PServer::P2PClient::on_read_failed(int /*err*/)
 
 void P2PServer::P2PClient::on_disconnected()
 {
+	P2PServer* server = static_cast<P2PServer*>(m_owner);
+
+	// The other peer might have closed the connection because it doesn't know our session token anymore (restart, too many tokens)
+	// Its handshake solution arrives before it checks ours, so the handshake can be already complete here. Do PoW next time
+	if (m_sessionTokenUsed && !m_isIncoming) {
+		LOGINFO(5, "peer " << static_cast<char*>(m_addrString) << " closed the connection, forgetting session token");
+		if (server) {
+			server->remove_session_token(m_peerId);
+		}
+		return;
+	}
+
 	if (!m_handshakeComplete) {
 		LOGWARN(5, "peer " << static_cast<char*>(m_addrString) << " disconnected before finishing handshake");
 
 		ban(DEFAULT_BAN_TIME);
-		P2PServer* server = static_cast<P2PServer*>(m_owner);
 		if (server) {
 			server->remove_peer_from_list(this);
 		}
@@ -1311,6 +1569,12 @@ bool P2PServer::P2PClient::send_handshake_challenge()
 	P2PServer* owner = static_cast<P2PServer*>(m_owner);
 	m_handshakeChallenge = owner->get_random64();
 
+	// Accepting peer marks its challenge to show that it supports session tokens
+	if (m_isIncoming) {
+		const uint32_t k = static_cast<uint32_t>(m_handshakeChallenge);
+		m_handshakeChallenge = k | (static_cast<uint64_t>(session_marker(k, owner->m_pool->side_chain().consensus_id())) << 32);
+	}
+
 	return owner->send(this,
 		[this, owner](void* buf)
 		{
@@ -1338,6 +1602,27 @@ void P2PServer::P2PClient::send_handshake_solution(const uint8_t (&challenge)[CH
 {
 	P2PServer* server = static_cast<P2PServer*>(m_owner);
 
+	const std::vector<uint8_t>& consensus_id = server->m_pool->side_chain().consensus_id();
+	uint8_t solution_salt[CHALLENGE_SIZE];
+
+	// Accepting peer doesn't need PoW: it's only one hash to calculate, so don't bother with the thread pool
+	// Its SALT is the session token it offers to the connecting peer
+	if (m_isIncoming) {
+		write_challenge(session_token(server->m_sessionSecret, m_peerId, m_peerHandshakeChallenge, m_handshakeChallenge), solution_salt);
+		on_handshake_solution_ready(handshake_hash(challenge, consensus_id, solution_salt), solution_salt);
+		return;
+	}
+
+	// Neither does connecting peer if it has a session token
+	uint64_t token;
+	if (has_session_marker(m_peerHandshakeChallenge, consensus_id) && server->get_session_token(m_peerId, true, token)) {
+		LOGINFO(5, "using session token for " << static_cast<char*>(m_addrString));
+		session_token_proof(token, challenge, solution_salt);
+		m_sessionTokenUsed = true;
+		on_handshake_solution_ready(handshake_hash(challenge, consensus_id, solution_salt), solution_salt);
+		return;
+	}
+
 	struct Work
 	{
 		uv_work_t req;
@@ -1367,48 +1652,51 @@ void P2PServer::P2PClient::send_handshake_solution(const uint8_t (&challenge)[CH
 
 			Work* work = reinterpret_cast<Work*>(req->data);
 			const std::vector<uint8_t>& consensus_id = work->server->m_pool->side_chain().consensus_id();
-			const int consensus_id_size = static_cast<int>(consensus_id.size());
-
-			for (size_t iter = 1;; ++iter, ++work->salt) {
-				uint64_t k = work->salt;
-				for (size_t i = 0; i < CHALLENGE_SIZE; ++i) {
-					work->solution_salt[i] = k & 0xFF;
-					k >>= 8;
-				}
+			const size_t consensus_id_size = consensus_id.size();
+			const size_t input_size = CHALLENGE_SIZE * 2 + consensus_id_size;
+			const size_t salt_offset = CHALLENGE_SIZE + consensus_id_size;
+
+			// Check several salts at once, keccak_batch() hashes them in parallel
+			const int lanes = keccak_batch_lanes();
+
+			std::vector<uint8_t> inputs(input_size * lanes);
+			for (int k = 0; k < lanes; ++k) {
+				uint8_t* p = inputs.data() + input_size * k;
+				memcpy(p, work->challenge, CHALLENGE_SIZE);
+				memcpy(p + CHALLENGE_SIZE, consensus_id.data(), consensus_id_size);
+			}
 
-				keccak_custom(
-					[work, &consensus_id, consensus_id_size](int offset) -> uint8_t
-					{
-						if (offset < CHALLENGE_SIZE) {
-							return work->challenge[offset];
-						}
-						offset -= CHALLENGE_SIZE;
+			hash solutions[KeccakParams::BATCH_MAX_LANES];
 
-						if (offset < consensus_id_size) {
-							return consensus_id[offset];
-						}
+			for (size_t iter = 1;; iter += lanes, work->salt += lanes) {
+				for (int k = 0; k < lanes; ++k) {
+					uint8_t* p = inputs.data() + input_size * k + salt_offset;
+					uint64_t salt = work->salt + k;
+					for (size_t i = 0; i < CHALLENGE_SIZE; ++i) {
+						p[i] = salt & 0xFF;
+						salt >>= 8;
+					}
+				}
 
-						return work->solution_salt[offset - consensus_id_size];
-					}, CHALLENGE_SIZE * 2 + static_cast<int>(consensus_id.size()), work->solution.h, HASH_SIZE);
+				keccak_batch(inputs.data(), input_size, static_cast<int>(input_size), solutions[0].h, sizeof(hash), HASH_SIZE, lanes);
 
 				// We might've been disconnected while working on the challenge, do nothing in this case
 				if (work->client->m_resetCounter.load() != work->reset_counter) {
 					return;
 				}
 
-				if (work->client->m_isIncoming) {
-					// This is an incoming connection, so it must do PoW, not us
-					return;
-				}
-
-				uint64_t* value = reinterpret_cast<uint64_t*>(work->solution.h);
+				for (int k = 0; k < lanes; ++k) {
+					const uint64_t* value = reinterpret_cast<const uint64_t*>(solutions[k].h);
 
-				uint64_t high;
-				umul128(value[HASH_SIZE / sizeof(uint64_t) - 1], CHALLENGE_DIFFICULTY, &high);
+					uint64_t high;
+					umul128(value[HASH_SIZE / sizeof(uint64_t) - 1], CHALLENGE_DIFFICULTY, &high);
 
-				if (high == 0) {
-					LOGINFO(5, "found handshake challenge solution after " << iter << " iterations");
-					return;
+					if (high == 0) {
+						work->solution = solutions[k];
+						memcpy(work->solution_salt, inputs.data() + input_size * k + salt_offset, CHALLENGE_SIZE);
+						LOGINFO(5, "found handshake challenge solution after " << iter + k << " iterations");
+						return;
+					}
 				}
 			}
 		},
@@ -1428,45 +1716,56 @@ void P2PServer::P2PClient::send_handshake_solution(const uint8_t (&challenge)[CH
 				return;
 			}
 
-			const bool result = work->server->send(work->client,
-				[work](void* buf)
-				{
-					uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
-					uint8_t* p = p0;
+			work->client->on_handshake_solution_ready(work->solution, work->solution_salt);
+		});
 
-					LOGINFO(5, "sending HANDSHAKE_SOLUTION");
-					*(p++) = static_cast<uint8_t>(MessageId::HANDSHAKE_SOLUTION);
+	if (err) {
+		LOGERR(1, "send_handshake_solution: uv_queue_work failed, error " << uv_err_name(err));
+		delete work;
+	}
+}
 
-					memcpy(p, work->solution.h, HASH_SIZE);
-					p += HASH_SIZE;
+void P2PServer::P2PClient::on_handshake_solution_ready(const hash& solution, const uint8_t (&solution_salt)[CHALLENGE_SIZE])
+{
+	P2PServer* server = static_cast<P2PServer*>(m_owner);
 
-					memcpy(p, work->solution_salt, CHALLENGE_SIZE);
-					p += CHALLENGE_SIZE;
+	const bool result = server->send(this,
+		[this, &solution, &solution_salt](void* buf)
+		{
+			uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
+			uint8_t* p = p0;
 
-					if (work->client->m_handshakeComplete && !work->client->m_handshakeInvalid) {
-						work->client->on_after_handshake(p);
-					}
+			LOGINFO(5, "sending HANDSHAKE_SOLUTION");
+			*(p++) = static_cast<uint8_t>(MessageId::HANDSHAKE_SOLUTION);
 
-					return p - p0;
-				});
+			memcpy(p, solution.h, HASH_SIZE);
+			p += HASH_SIZE;
 
-			if (result) {
-				work->client->m_handshakeSolutionSent = true;
+			memcpy(p, solution_salt, CHALLENGE_SIZE);
+			p += CHALLENGE_SIZE;
 
-				if (work->client->m_handshakeComplete && work->client->m_handshakeInvalid) {
-					work->client->ban(DEFAULT_BAN_TIME);
-					work->server->remove_peer_from_list(work->client);
-					work->client->close();
-				}
-			}
-			else {
-				work->client->close();
+			if (m_handshakeComplete && !m_handshakeInvalid) {
+				on_after_handshake(p);
 			}
+
+			return p - p0;
 		});
 
-	if (err) {
-		LOGERR(1, "send_handshake_solution: uv_queue_work failed, error " << uv_err_name(err));
-		delete work;
+	if (result) {
+		m_handshakeSolutionSent = true;
+
+		if (m_handshakeComplete) {
+			server->set_client_ready(this);
+		}
+
+		if (m_handshakeComplete && m_handshakeInvalid) {
+			ban(DEFAULT_BAN_TIME);
+			server->remove_peer_from_list(this);
+			close();
+		}
+	}
+	else {
+		close();
 	}
 }
 
@@ -1474,34 +1773,36 @@ bool P2PServer::P2PClient::check_handshake_solution(const hash& solution, const
 {
 	P2PServer* owner = static_cast<P2PServer*>(m_owner);
 
-	const std::vector<uint8_t>& consensus_id = owner->m_pool->side_chain().consensus_id();
-	const int consensus_id_size = static_cast<int>(consensus_id.size());
-
 	uint8_t challenge[CHALLENGE_SIZE];
+	write_challenge(m_handshakeChallenge, challenge);
 
-	uint64_t k = m_handshakeChallenge;
-	for (size_t i = 0; i < CHALLENGE_SIZE; ++i) {
-		challenge[i] = k & 0xFF;
-		k >>= 8;
+	return solution == handshake_hash(challenge, owner->m_pool->side_chain().consensus_id(), solution_salt);
+}
+
+void P2PServer::P2PClient::update_session_token(const uint8_t (&solution_salt)[CHALLENGE_SIZE])
+{
+	// Tokens are given out only after a handshake with PoW, reconnecting with a token doesn't extend its lifetime
+	if (m_sessionTokenUsed) {
+		return;
 	}
 
-	hash check{};
-	keccak_custom(
-		[&challenge, &solution_salt, &consensus_id, consensus_id_size](int offset) -> uint8_t
-		{
-			if (offset < CHALLENGE_SIZE) {
-				return challenge[offset];
-			}
-			offset -= CHALLENGE_SIZE;
+	P2PServer* server = static_cast<P2PServer*>(m_owner);
 
-			if (offset < consensus_id_size) {
-				return consensus_id[offset];
-			}
+	if (m_isIncoming) {
+		server->set_session_token(m_peerId, false, session_token(server->m_sessionSecret, m_peerId, m_peerHandshakeChallenge, m_handshakeChallenge));
+		return;
+	}
+
+	// Don't use session tokens with peers that don't support them, they would ban us for not doing PoW
+	if (!has_session_marker(m_peerHandshakeChallenge, server->m_pool->side_chain().consensus_id())) {
+		server->remove_session_token(m_peerId);
+		return;
+	}
 
-			return solution_salt[offset - consensus_id_size];
-		}, CHALLENGE_SIZE * 2 + static_cast<int>(consensus_id.size()), check.h, HASH_SIZE);
+	uint64_t token;
+	memcpy(&token, solution_salt, sizeof(token));
 
-	return solution == check;
+	server->set_session_token(m_peerId, true, token);
 }
 
 bool P2PServer::P2PClient::on_handshake_challenge(const uint8_t* buf)
@@ -1514,6 +1815,8 @@ bool P2PServer::P2PClient::on_handshake_challenge(const uint8_t* buf)
 	uint64_t peer_id;
 	memcpy(&peer_id, buf + CHALLENGE_SIZE, sizeof(uint64_t));
 
+	memcpy(&m_peerHandshakeChallenge, challenge, CHALLENGE_SIZE);
+
 	if (peer_id == server->get_peerId()) {
 		LOGWARN(5, "tried to connect to self at " << static_cast<const char*>(m_addrString));
 		return false;
@@ -1524,8 +1827,9 @@ bool P2PServer::P2PClient::on_handshake_challenge(const uint8_t* buf)
 	bool same_peer = false;
 	{
 		MutexLock lock(server->m_clientsListLock);
-		for (const P2PClient* client = static_cast<P2PClient*>(server->m_connectedClientsList->m_next); client != server->m_connectedClientsList; client = static_cast<P2PClient*>(client->m_next)) {
-			if ((client != this) && (client->m_peerId == peer_id)) {
+		for (const Client* c : server->m_clientSlots) {
+			const P2PClient* client = static_cast<const P2PClient*>(c);
+			if (client && (client != this) && (client->m_peerId == peer_id)) {
 				LOGWARN(5, "tried to connect to the same peer twice: current connection " << static_cast<const char*>(client->m_addrString) << ", new connection " << static_cast<const char*>(m_addrString));
 				same_peer = true;
 				break;
@@ -1549,7 +1853,7 @@ bool P2PServer::P2PClient::on_handshake_solution(const uint8_t* buf)
 	memcpy(&solution, buf, HASH_SIZE);
 	memcpy(solution_salt, buf + HASH_SIZE, CHALLENGE_SIZE);
 
-	// Check that incoming connection provided enough PoW
+	// Check that incoming connection provided enough PoW or a valid session token
 	if (m_isIncoming) {
 		uint64_t* value = reinterpret_cast<uint64_t*>(solution.h);
 
@@ -1557,8 +1861,29 @@ bool P2PServer::P2PClient::on_handshake_solution(const uint8_t* buf)
 		umul128(value[HASH_SIZE / sizeof(uint64_t) - 1], CHALLENGE_DIFFICULTY, &high);
 
 		if (high) {
-			LOGWARN(5, "peer " << static_cast<char*>(m_addrString) << " handshake doesn't have enough PoW");
-			m_handshakeInvalid = true;
+			P2PServer* server = static_cast<P2PServer*>(m_owner);
+
+			uint64_t token;
+			if (!server->get_session_token(m_peerId, false, token)) {
+				// It might be a token we've already forgotten (restart, too many tokens), the peer will do PoW when it reconnects
+				LOGINFO(5, "peer " << static_cast<char*>(m_addrString) << " handshake doesn't have enough PoW and there is no session token for it");
+				close();
+				return true;
+			}
+
+			uint8_t challenge[CHALLENGE_SIZE];
+			write_challenge(m_handshakeChallenge, challenge);
+
+			uint8_t proof[CHALLENGE_SIZE];
+			session_token_proof(token, challenge, proof);
+
+			if (memcmp(solution_salt, proof, CHALLENGE_SIZE) != 0) {
+				LOGWARN(5, "peer " << static_cast<char*>(m_addrString) << " handshake doesn't have enough PoW or a valid session token");
+				m_handshakeInvalid = true;
+			}
+			else {
+				m_sessionTokenUsed = true;
+			}
 		}
 	}
 
@@ -1568,9 +1893,15 @@ bool P2PServer::P2PClient::on_handshake_solution(const uint8_t* buf)
 	}
 
 	m_handshakeComplete = true;
+	m_handshakeTime = time(nullptr);
+
+	if (m_handshakeSolutionSent) {
+		static_cast<P2PServer*>(m_owner)->set_client_ready(this);
+	}
 
 	if (!m_handshakeInvalid) {
-		LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " handshake completed");
+		LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " handshake completed" << (m_sessionTokenUsed ? " (session token)" : ""));
+		update_session_token(solution_salt);
 	}
 
 	if (m_handshakeSolutionSent) {
@@ -1608,6 +1939,7 @@ void P2PServer::P2PClient::on_after_handshake(uint8_t* &p)
 	p += HASH_SIZE;
 
 	++m_blockPendingRequests;
+	++m_numBlockRequests;
 	m_lastBroadcastTimestamp = time(nullptr);
 }
 
@@ -1636,13 +1968,20 @@ bool P2PServer::P2PClient::on_block_request(const uint8_t* buf)
 
 	P2PServer* server = static_cast<P2PServer*>(m_owner);
 
-	std::vector<uint8_t> blob;
-	if (!server->m_pool->side_chain().get_block_blob(id, blob) && !id.empty()) {
+	std::shared_ptr<std::vector<uint8_t>> blob = std::make_shared<std::vector<uint8_t>>();
+	if (server->m_pool->side_chain().get_block_blob(id, *blob)) {
+		if (!id.empty()) {
+			m_knownBlocks.add(id);
+		}
+	}
+	else if (!id.empty()) {
 		LOGWARN(5, "got a request for block with id " << id << " but couldn't find it");
 	}
 
+	const uint32_t blob_size = static_cast<uint32_t>(blob->size());
+
 	return server->send(this,
-		[&blob](void* buf)
+		[blob_size](void* buf)
 		{
 			uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
 			uint8_t* p = p0;
@@ -1650,14 +1989,28 @@ bool P2PServer::P2PClient::on_block_request(const uint8_t* buf)
 			LOGINFO(5, "sending BLOCK_RESPONSE");
 			*(p++) = static_cast<uint8_t>(MessageId::BLOCK_RESPONSE);
 
-			*reinterpret_cast<uint32_t*>(p) = static_cast<uint32_t>(blob.size());
+			*reinterpret_cast<uint32_t*>(p) = blob_size;
 			p += sizeof(uint32_t);
 
-			memcpy(p, blob.data(), blob.size());
-			p += blob.size();
-
 			return p - p0;
-		});
+		}, { uv_buf_init(reinterpret_cast<char*>(blob->data()), blob_size) }, blob);
+}
+
+double P2PServer::P2PClient::score(time_t cur_time) const
+{
+	// Round trip time: 1.0 for 0 ms, 0.5 for 100 ms, 0.25 for 300 ms
+	const double rtt = (m_pingTime > 0) ? (100.0 / (100.0 + m_pingTime)) : 0.5;
+
+	// How often this peer was the first to send us a new block
+	const double timeliness = (m_numFirstBroadcasts + 1.0) / (m_numBroadcasts + 2.0);
+
+	// How many of our block requests were answered with a block
+	const double responses = std::min((m_numBlockResponses + 1.0) / (m_numBlockRequests + 1.0), 1.0);
+
+	// Reaches 1.0 after an hour
+	const double uptime = m_handshakeTime ? std::min(static_cast<double>(cur_time - m_handshakeTime) / 3600.0, 1.0) : 0.0;
+
+	return rtt * 0.4 + timeliness * 0.3 + responses * 0.2 + uptime * 0.1;
 }
 
 bool P2PServer::P2PClient::on_block_response(const uint8_t* buf, uint32_t size)
@@ -1667,16 +2020,25 @@ bool P2PServer::P2PClient::on_block_response(const uint8_t* buf, uint32_t size)
 		return true;
 	}
 
+	++m_numBlockResponses;
+
 	P2PServer* server = static_cast<P2PServer*>(m_owner);
 
 	MutexLock lock(server->m_blockLock);
 
-	const int result = server->m_block->deserialize(buf, size, server->m_pool->side_chain());
-	if (result != 0) {
+	const int result = server->m_block->deserialize(buf, size, server->m_pool->side_chain(), true);
+	if ((result != 0) && (result != PoolBlock::DESERIALIZE_SKIPPED)) {
 		LOGWARN(3, "peer " << static_cast<char*>(m_addrString) << " sent an invalid block, error " << result);
 		return false;
 	}
 
+	// Block ID is not verified when the block is skipped, so only blocks which were fully deserialized are remembered
+	if (result == PoolBlock::DESERIALIZE_SKIPPED) {
+		return true;
+	}
+
+	m_knownBlocks.add(server->m_block->m_sidechainId);
+
 	return handle_incoming_block_async(server->m_block);
 }
 
@@ -1691,13 +2053,24 @@ bool P2PServer::P2PClient::on_block_broadcast(const uint8_t* buf, uint32_t size)
 
 	MutexLock lock(server->m_blockLock);
 
-	const int result = server->m_block->deserialize(buf, size, server->m_pool->side_chain());
-	if (result != 0) {
+	// Cheap checks (difficulty, mainchain height, known blocks) are done before the expensive part of deserialization
+	const int result = server->m_block->deserialize(buf, size, server->m_pool->side_chain(), true);
+	if ((result != 0) && (result != PoolBlock::DESERIALIZE_SKIPPED)) {
 		LOGWARN(3, "peer " << static_cast<char*>(m_addrString) << " sent an invalid block, error " << result);
 		return false;
 	}
 
+	++m_numBroadcasts;
+
+	// Block ID is not verified when the block is skipped: the peer could claim to have blocks it doesn't have,
+	// so only blocks which were fully deserialized are used for pruned broadcasts and for the known blocks filter
+	if (result == PoolBlock::DESERIALIZE_SKIPPED) {
+		m_lastBroadcastTimestamp = time(nullptr);
+		return true;
+	}
+
 	m_broadcastedHashes[m_broadcastedHashesIndex.fetch_add(1) % array_size(&P2PClient::m_broadcastedHashes)] = server->m_block->m_sidechainId;
+	m_knownBlocks.add(server->m_block->m_sidechainId);
 
 	const MinerData& miner_data = server->m_pool->miner_data();
 
@@ -1737,7 +2110,7 @@ bool P2PServer::P2PClient::on_block_broadcast(const uint8_t* buf, uint32_t size)
 
 	m_lastBroadcastTimestamp = time(nullptr);
 
-	return handle_incoming_block_async(server->m_block);
+	return handle_incoming_block_async(server->m_block, true);
 }
 
 bool P2PServer::P2PClient::on_peer_list_request(const uint8_t*)
@@ -1761,18 +2134,19 @@ bool P2PServer::P2PClient::on_peer_list_request(const uint8_t*)
 	Peer peers[PEER_LIST_RESPONSE_MAX_PEERS];
 	uint32_t num_selected_peers = 0;
 	{
-		MutexLock lock(server->m_clientsListLock);
+		std::vector<P2PClient*> clients;
+		server->get_clients(clients, false);
 
 		// Send every 4th peer on average, selected at random
-		const uint32_t peers_to_send_target = std::min<uint32_t>(PEER_LIST_RESPONSE_MAX_PEERS, std::max<uint32_t>(1, server->m_numConnections / 4));
+		const uint32_t peers_to_send_target = std::min<uint32_t>(PEER_LIST_RESPONSE_MAX_PEERS, std::max<uint32_t>(1, static_cast<uint32_t>(clients.size() / 4)));
 		uint32_t n = 0;
 
-		for (P2PClient* client = static_cast<P2PClient*>(server->m_connectedClientsList->m_next); client != server->m_connectedClientsList; client = static_cast<P2PClient*>(client->m_next)) {
+		for (const P2PClient* client : clients) {
 			if ((client->m_listenPort < 0) || (client->m_addr == m_addr)) {
 				continue;
 			}
 
-			const Peer p{ client->m_isV6, client->m_addr, client->m_listenPort, 0, 0 };
+			const Peer p{ client->m_isV6, client->m_addr, client->m_listenPort, 0, 0, PEER_DEFAULT_SCORE };
 			++n;
 
 			// Use https://en.wikipedia.org/wiki/Reservoir_sampling algorithm
@@ -1852,14 +2226,14 @@ bool P2PServer::P2PClient::on_peer_list_response(const uint8_t* buf) const
 		}
 
 		if (!already_added && !server->is_banned(ip)) {
-			server->m_peerList.emplace_back(Peer{ is_v6, ip, port, 0, cur_time });
+			server->m_peerList.emplace_back(Peer{ is_v6, ip, port, 0, cur_time, PEER_DEFAULT_SCORE });
 		}
 	}
 
 	return true;
 }
 
-bool P2PServer::P2PClient::handle_incoming_block_async(PoolBlock* block)
+bool P2PServer::P2PClient::handle_incoming_block_async(PoolBlock* block, bool broadcast)
 {
 	P2PServer* server = static_cast<P2PServer*>(m_owner);
 
@@ -1868,6 +2242,10 @@ bool P2PServer::P2PClient::handle_incoming_block_async(PoolBlock* block)
 		return true;
 	}
 
+	if (broadcast) {
+		++m_numFirstBroadcasts;
+	}
+
 	struct Work
 	{
 		uv_work_t req;
@@ -1969,6 +2347,7 @@ void P2PServer::P2PClient::post_handle_incoming_block(const uint32_t reset_count
 		}
 
 		++m_blockPendingRequests;
+		++m_numBlockRequests;
 	}
 }
 
@@ -27,7 +27,11 @@ struct PoolBlock;
 class BlockCache;
 
 static constexpr size_t P2P_BUF_SIZE = 128 * 1024;
+static constexpr size_t P2P_WRITE_QUEUE_HIGH_WATER_MARK = P2P_BUF_SIZE * 4;
+static constexpr size_t P2P_WRITE_QUEUE_MAX_SIZE = P2P_BUF_SIZE * 16;
 static constexpr size_t PEER_LIST_RESPONSE_MAX_PEERS = 16;
+static constexpr size_t SESSION_TOKENS_MAX = 4096;
+static constexpr time_t SESSION_TOKEN_LIFETIME = 3600;
 static constexpr int DEFAULT_P2P_PORT = 37889;
 static constexpr int DEFAULT_P2P_PORT_MINI = 37888;
 
@@ -79,6 +83,19 @@ public:
 		// - Both peers send their H and SALT, calculate H of the other peer and check if it matches with what other peer calculated
 		// - Peer that initiated the connection must also provide enough PoW in H (difficulty = 10000, 5-10 ms on modern CPU)
 		// - If H doesn't match or doesn't have enough PoW, connection is closed immediately
+		//
+		// Session tokens (reconnecting without PoW):
+		//
+		// - Peer that accepted the connection shows that it supports session tokens with its CHALLENGE: high 32 bits = first 4 bytes of KECCAK(low 32 bits|CONSENSUS_ID|"session")
+		// - It doesn't need PoW, so it uses SALT = TOKEN = first 8 bytes of KECCAK(SECRET|PEER_ID|CHALLENGE of the connecting peer|CHALLENGE of the accepting peer)
+		//   SECRET is random and known only to the accepting peer, PEER_ID is the connecting peer's ID
+		//   TOKEN is sent unencrypted, so anyone who sees this handshake can reuse it until it expires: it only saves PoW, it doesn't authenticate the peer
+		// - After a successful handshake with PoW, both peers remember TOKEN for SESSION_TOKEN_LIFETIME seconds
+		// - When connecting to the same peer ID again before TOKEN expires, the connecting peer uses SALT = first 8 bytes of KECCAK(TOKEN|CHALLENGE) instead of PoW
+		// - Handshakes with TOKEN don't extend its lifetime, the connecting peer does PoW again when it expires
+		// - Handshake without PoW and with an unknown TOKEN is closed without a ban (the accepting peer might have restarted or forgotten it),
+		//   the connecting peer forgets TOKEN when the accepting peer closes the connection and does PoW next time
+		// - Handshake without PoW and with a wrong proof for a known TOKEN is invalid, and the connecting peer is banned
 		enum {
 			CHALLENGE_SIZE = 8,
 			CHALLENGE_DIFFICULTY = 10000,
@@ -86,7 +103,9 @@ public:
 
 		bool send_handshake_challenge();
 		void send_handshake_solution(const uint8_t (&challenge)[CHALLENGE_SIZE]);
+		void on_handshake_solution_ready(const hash& solution, const uint8_t (&solution_salt)[CHALLENGE_SIZE]);
 		bool check_handshake_solution(const hash& solution, const uint8_t (&solution_salt)[CHALLENGE_SIZE]);
+		void update_session_token(const uint8_t (&solution_salt)[CHALLENGE_SIZE]);
 
 		bool on_handshake_challenge(const uint8_t* buf);
 		bool on_handshake_solution(const uint8_t* buf);
@@ -98,13 +117,17 @@ public:
 		bool on_peer_list_request(const uint8_t* buf);
 		bool on_peer_list_response(const uint8_t* buf) const;
 
-		bool handle_incoming_block_async(PoolBlock* block);
+		bool handle_incoming_block_async(PoolBlock* block, bool broadcast = false);
 		void handle_incoming_block(p2pool* pool, PoolBlock& block, const uint32_t reset_counter, const raw_ip& addr, std::vector<hash>& missing_blocks);
 		void post_handle_incoming_block(const uint32_t reset_counter, std::vector<hash>& missing_blocks);
 
+		double score(time_t cur_time) const;
+
 		uint64_t m_peerId;
 		MessageId m_expectedMessage;
 		uint64_t m_handshakeChallenge;
+		uint64_t m_peerHandshakeChallenge;
+		bool m_sessionTokenUsed;
 		bool m_handshakeSolutionSent;
 		bool m_handshakeComplete;
 		bool m_handshakeInvalid;
@@ -123,8 +146,18 @@ public:
 		time_t m_lastBroadcastTimestamp;
 		time_t m_lastBlockrequestTimestamp;
 
+		// Used to calculate peer score
+		time_t m_handshakeTime;
+		uint32_t m_numBroadcasts;
+		uint32_t m_numFirstBroadcasts;
+		uint32_t m_numBlockRequests;
+		uint32_t m_numBlockResponses;
+
 		hash m_broadcastedHashes[8];
 		std::atomic<uint32_t> m_broadcastedHashesIndex{ 0 };
+
+		// Recent blocks this peer is known to have, they're not broadcasted to it again
+		RollingBloomFilter m_knownBlocks;
 	};
 
 	void broadcast(const PoolBlock& block);
@@ -160,6 +193,7 @@ private:
 	void download_missing_blocks();
 	void check_zmq();
 	void update_peer_connections();
+	void rotate_worst_peer(const std::vector<P2PClient*>& clients, size_t num_candidates);
 	void update_peer_list();
 	void save_peer_list_async();
 	void save_peer_list();
@@ -191,6 +225,9 @@ private:
 		int m_port;
 		uint32_t m_numFailedConnections;
 		time_t m_lastSeen;
+
+		// Higher is better, see P2PClient::score()
+		double m_score;
 	};
 
 	std::vector<Peer> m_peerList;
@@ -199,6 +236,7 @@ private:
 
 	struct Broadcast
 	{
+		hash id;
 		std::vector<uint8_t> blob;
 		std::vector<uint8_t> pruned_blob;
 		std::vector<hash> ancestor_hashes;
@@ -207,10 +245,28 @@ private:
 	uv_mutex_t m_broadcastLock;
 	uv_async_t m_broadcastAsync;
 	std::vector<Broadcast*> m_broadcastQueue;
+	uint64_t m_numBroadcastsSkipped;
 
 	uv_mutex_t m_missingBlockRequestsLock;
 	unordered_set<std::pair<uint64_t, uint64_t>> m_missingBlockRequests;
 
+	struct SessionToken
+	{
+		uint64_t m_token;
+		time_t m_expires;
+		bool m_outgoing;
+	};
+
+	// Peer ID -> session token from the last handshake with PoW with this peer
+	uv_mutex_t m_sessionTokensLock;
+	unordered_map<uint64_t, SessionToken> m_sessionTokens;
+	hash m_sessionSecret;
+
+	bool get_session_token(uint64_t peer_id, bool outgoing, uint64_t& token);
+	void set_session_token(uint64_t peer_id, bool outgoing, uint64_t token);
+	void remove_session_token(uint64_t peer_id);
+	void prune_session_tokens();
+
 	static void on_broadcast(uv_async_t* handle) { reinterpret_cast<P2PServer*>(handle->data)->on_broadcast(); }
 	void on_broadcast();
 };
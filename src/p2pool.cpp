@@ -475,6 +475,11 @@ void p2pool::submit_block() const
 	}
 	request.append("\"]}");
 
+	// Tx keys have been changed after finding this block, prepare miner tx outputs for the next block while monerod processes this one
+	if (!is_external) {
+		m_blockTemplate->start_precalc_job();
+	}
+
 	JSONRPCRequest::call(m_params->m_host.c_str(), m_params->m_rpcPort, request.c_str(),
 		[height, diff, template_id, nonce, extra_nonce, is_external](const char* data, size_t size)
 		{
@@ -552,6 +557,22 @@ void p2pool::update_block_template()
 	if (m_updateSeed) {
 		m_hasher->set_seed_async(m_minerData.seed_hash);
 		m_updateSeed = false;
+
+		// The next seed block is known up to SEEDHASH_EPOCH_LAG blocks before the epoch changes
+		const uint64_t next_seed_height = get_seed_height(m_minerData.height) + SEEDHASH_EPOCH_BLOCKS;
+		if (next_seed_height < m_minerData.height) {
+			hash next_seed;
+			{
+				ReadLock lock(m_mainchainLock);
+				auto it = m_mainchainByHeight.find(next_seed_height);
+				if (it != m_mainchainByHeight.end()) {
+					next_seed = it->second.id;
+				}
+			}
+			if (!next_seed.empty()) {
+				m_hasher->set_next_seed_async(next_seed);
+			}
+		}
 	}
 	m_blockTemplate->update(m_minerData, *m_mempool, &m_params->m_wallet);
 	stratum_on_block();
@@ -105,6 +105,11 @@ Params::Params(int argc, char* argv[])
 			ok = true;
 		}
 
+		if ((strcmp(argv[i], "--rpc-pow-jobs") == 0) && (i + 1 < argc)) {
+			m_rpcPowJobs = std::min(std::max(strtoul(argv[++i], nullptr, 10), 1UL), 64UL);
+			ok = true;
+		}
+
 		if ((strcmp(argv[i], "--out-peers") == 0) && (i + 1 < argc)) {
 			m_maxOutgoingPeers = std::min(std::max(strtoul(argv[++i], nullptr, 10), 10UL), 1000UL);
 			ok = true;
@@ -120,11 +125,36 @@ Params::Params(int argc, char* argv[])
 			ok = true;
 		}
 
+		if (strcmp(argv[i], "--miner-numa") == 0) {
+			m_minerNuma = true;
+			ok = true;
+		}
+
+		if ((strcmp(argv[i], "--miner-affinity") == 0) && (i + 1 < argc)) {
+			m_minerAffinity = argv[++i];
+			ok = true;
+		}
+
+		if (strcmp(argv[i], "--miner-dedicated") == 0) {
+			m_minerDedicated = true;
+			ok = true;
+		}
+
 		if (strcmp(argv[i], "--mini") == 0) {
 			m_mini = true;
 			ok = true;
 		}
 
+		if ((strcmp(argv[i], "--template-history") == 0) && (i + 1 < argc)) {
+			m_templateHistorySize = std::min(std::max(strtoul(argv[++i], nullptr, 10), 1UL), 63UL);
+			ok = true;
+		}
+
+		if ((strcmp(argv[i], "--template-time") == 0) && (i + 1 < argc)) {
+			m_templateHistoryTime = std::min(strtoul(argv[++i], nullptr, 10), 600UL);
+			ok = true;
+		}
+
 		if (!ok) {
 			fprintf(stderr, "Unknown command line parameter %s\n\n", argv[i]);
 			p2pool_usage();
@@ -47,7 +47,13 @@ struct Params
 	uint32_t m_maxOutgoingPeers = 10;
 	uint32_t m_maxIncomingPeers = 1000;
 	uint32_t m_minerThreads = 0;
+	bool m_minerNuma = false;
+	std::string m_minerAffinity;
+	bool m_minerDedicated = false;
 	bool m_mini = false;
+	uint32_t m_templateHistorySize = 4;
+	uint32_t m_templateHistoryTime = 0;
+	uint32_t m_rpcPowJobs = 4;
 };
 
 } // namespace p2pool
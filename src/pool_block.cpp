@@ -275,17 +275,15 @@ bool PoolBlock::get_pow_hash(RandomX_Hasher_Base* hasher, uint64_t height, const
 			cnt >>= 1;
 
 			std::vector<uint8_t> tmp_ints(cnt * HASH_SIZE);
-			memcpy(tmp_ints.data(), h, (cnt * 2 - count) * HASH_SIZE);
 
-			for (i = cnt * 2 - count, j = cnt * 2 - count; j < cnt; i += 2, ++j) {
-				keccak(h + i * HASH_SIZE, HASH_SIZE * 2, tmp_ints.data() + j * HASH_SIZE, HASH_SIZE);
-			}
+			j = cnt * 2 - count;
+			memcpy(tmp_ints.data(), h, j * HASH_SIZE);
+
+			keccak_batch(h + j * HASH_SIZE, HASH_SIZE * 2, HASH_SIZE * 2, tmp_ints.data() + j * HASH_SIZE, HASH_SIZE, HASH_SIZE, static_cast<int>(cnt - j));
 
 			while (cnt > 2) {
 				cnt >>= 1;
-				for (i = 0, j = 0; j < cnt; i += 2, ++j) {
-					keccak(tmp_ints.data() + i * HASH_SIZE, HASH_SIZE * 2, tmp_ints.data() + j * HASH_SIZE, HASH_SIZE);
-				}
+				keccak_batch(tmp_ints.data(), HASH_SIZE * 2, HASH_SIZE * 2, tmp_ints.data(), HASH_SIZE, HASH_SIZE, static_cast<int>(cnt));
 			}
 
 			keccak(tmp_ints.data(), HASH_SIZE * 2, blob + blob_size, HASH_SIZE);
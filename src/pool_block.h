@@ -135,7 +135,10 @@ struct PoolBlock
 	void serialize_mainchain_data(uint32_t nonce, uint32_t extra_nonce, const hash& sidechain_hash);
 	void serialize_sidechain_data();
 
-	int deserialize(const uint8_t* data, size_t size, SideChain& sidechain);
+	// Returned by deserialize() when the block was skipped by the precheck, it's not an error
+	static constexpr int DESERIALIZE_SKIPPED = -1;
+
+	int deserialize(const uint8_t* data, size_t size, SideChain& sidechain, bool precheck = false);
 	bool get_pow_hash(RandomX_Hasher_Base* hasher, uint64_t height, const hash& seed_hash, hash& pow_hash);
 
 	uint64_t get_payout(const Wallet& w) const;
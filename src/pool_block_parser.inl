@@ -23,7 +23,10 @@ namespace p2pool {
 // Since data here can come from external and possibly malicious sources, check everything
 // Only the syntax (i.e. the serialized block binary format) and the keccak hash are checked here
 // Semantics must also be checked elsewhere before accepting the block (PoW, reward split between miners, difficulty calculation and so on)
-int PoolBlock::deserialize(const uint8_t* data, size_t size, SideChain& sidechain)
+//
+// If "precheck" is set, SideChain::precheck_external_block() is called right after the syntax is checked,
+// before the expensive part: tx key check, outputs derivation for blocks without outputs and the sidechain ID hash
+int PoolBlock::deserialize(const uint8_t* data, size_t size, SideChain& sidechain, bool precheck)
 {
 	try {
 		// Sanity check
@@ -240,10 +243,6 @@ int PoolBlock::deserialize(const uint8_t* data, size_t size, SideChain& sidechai
 
 		READ_BUF(m_txkeySec.h, HASH_SIZE);
 
-		if (!check_keys(m_txkeyPub, m_txkeySec)) {
-			return __LINE__;
-		}
-
 		READ_BUF(m_parent.h, HASH_SIZE);
 
 		uint64_t num_uncles;
@@ -278,6 +277,20 @@ int PoolBlock::deserialize(const uint8_t* data, size_t size, SideChain& sidechai
 			return __LINE__;
 		}
 
+		if (precheck) {
+			bool skip;
+			if (!sidechain.precheck_external_block(*this, skip)) {
+				return __LINE__;
+			}
+			if (skip) {
+				return DESERIALIZE_SKIPPED;
+			}
+		}
+
+		if (!check_keys(m_txkeyPub, m_txkeySec)) {
+			return __LINE__;
+		}
+
 		if ((num_outputs == 0) && !sidechain.get_outputs_blob(this, total_reward, outputs_blob)) {
 			return __LINE__;
 		}
@@ -290,42 +303,21 @@ int PoolBlock::deserialize(const uint8_t* data, size_t size, SideChain& sidechai
 
 		hash check;
 		const std::vector<uint8_t>& consensus_id = sidechain.consensus_id();
-		keccak_custom(
-			[this, nonce_offset, extra_nonce_offset, sidechain_hash_offset, data_begin, data_end, &consensus_id, &outputs_blob, outputs_blob_size_diff](int offset) -> uint8_t
-			{
-				uint32_t k = static_cast<uint32_t>(offset - nonce_offset);
-				if (k < NONCE_SIZE) {
-					return 0;
-				}
-
-				k = static_cast<uint32_t>(offset - extra_nonce_offset);
-				if (k < EXTRA_NONCE_SIZE) {
-					return 0;
-				}
-
-				k = static_cast<uint32_t>(offset - sidechain_hash_offset);
-				if (k < HASH_SIZE) {
-					return 0;
-				}
-
-				const int data_size = static_cast<int>((data_end - data_begin) + outputs_blob_size_diff);
-				if (offset < data_size) {
-					if (offset < m_mainChainOutputsOffset) {
-						return data_begin[offset];
-					}
-					else if (offset < m_mainChainOutputsOffset + m_mainChainOutputsBlobSize) {
-						const int tmp = offset - m_mainChainOutputsOffset;
-						return outputs_blob[tmp];
-					}
-					else {
-						return data_begin[offset - outputs_blob_size_diff];
-					}
-				}
-				offset -= data_size;
-
-				return consensus_id[offset];
-			},
-			static_cast<int>(size + outputs_blob_size_diff + consensus_id.size()), check.h, HASH_SIZE);
+		// Side-chain hash covers main chain data (with NONCE, EXTRA_NONCE and the hash itself zeroed), side-chain data and consensus ID
+		const uint8_t* main_data = m_mainChainData.data();
+		const size_t main_size = m_mainChainData.size();
+
+		KeccakStream k;
+		k.absorb(main_data, nonce_offset);
+		k.absorb_zeros(NONCE_SIZE);
+		k.absorb(main_data + nonce_offset + NONCE_SIZE, extra_nonce_offset - nonce_offset - NONCE_SIZE);
+		k.absorb_zeros(EXTRA_NONCE_SIZE);
+		k.absorb(main_data + extra_nonce_offset + EXTRA_NONCE_SIZE, sidechain_hash_offset - extra_nonce_offset - EXTRA_NONCE_SIZE);
+		k.absorb_zeros(HASH_SIZE);
+		k.absorb(main_data + sidechain_hash_offset + HASH_SIZE, main_size - sidechain_hash_offset - HASH_SIZE);
+		k.absorb(sidechain_data_begin, data_end - sidechain_data_begin);
+		k.absorb(consensus_id.data(), consensus_id.size());
+		k.finalize(check.h);
 
 		if (check != m_sidechainId) {
 			return __LINE__;
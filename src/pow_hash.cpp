@@ -34,6 +34,166 @@ static constexpr char log_category_prefix[] = "RandomX_Hasher ";
 namespace p2pool {
 
 #ifdef WITH_RANDOMX
+static randomx_vm* create_vm(randomx_cache* cache, randomx_dataset* dataset)
+{
+	randomx_flags flags = randomx_get_flags();
+	if (dataset) {
+		flags |= RANDOMX_FLAG_FULL_MEM;
+	}
+
+	randomx_vm* vm = randomx_create_vm(flags | RANDOMX_FLAG_LARGE_PAGES, cache, dataset);
+	if (!vm) {
+		LOGWARN(1, "couldn't allocate RandomX " << (dataset ? "" : "light ") << "VM using large pages");
+		vm = randomx_create_vm(flags, cache, dataset);
+		if (!vm) {
+			LOGERR(1, "couldn't allocate RandomX " << (dataset ? "" : "light ") << "VM");
+		}
+	}
+
+	return vm;
+}
+
+// Hashes are calculated in libuv threadpool (incoming blocks, stratum shares) and in the main thread
+static uint32_t get_vm_pool_size()
+{
+	uint32_t result = 4;
+
+	const char* s = getenv("UV_THREADPOOL_SIZE");
+	if (s) {
+		const uint32_t n = strtoul(s, nullptr, 10);
+		if (n > 0) {
+			result = std::min(n, 128U);
+		}
+	}
+
+	return result + 1;
+}
+
+RandomX_Hasher::VMPool::VMPool()
+	: m_maxSize(1)
+	, m_numAcquired(0)
+	, m_numWaited(0)
+	, m_totalWaitTime(0)
+	, m_numWaiting(0)
+	, m_maxWaiting(0)
+{
+	uv_mutex_init_checked(&m_mutex);
+
+	const int err = uv_cond_init(&m_cond);
+	if (err) {
+		LOGERR(1, "failed to create cond, error " << uv_err_name(err));
+		panic();
+	}
+}
+
+RandomX_Hasher::VMPool::~VMPool()
+{
+	{
+		MutexLock lock(m_mutex);
+
+		if (m_freeVMs.size() != m_vms.size()) {
+			LOGERR(1, "destroying VM pool while some VMs are still in use. Fix the code!");
+		}
+
+		for (randomx_vm* vm : m_vms) {
+			randomx_destroy_vm(vm);
+		}
+	}
+
+	uv_cond_destroy(&m_cond);
+	uv_mutex_destroy(&m_mutex);
+}
+
+randomx_vm* RandomX_Hasher::VMPool::acquire(randomx_cache* cache, randomx_dataset* dataset)
+{
+	MutexLock lock(m_mutex);
+
+	if (m_vms.empty()) {
+		return nullptr;
+	}
+
+	++m_numAcquired;
+
+	if (m_freeVMs.empty() && (m_vms.size() < m_maxSize)) {
+		randomx_vm* vm = create_vm(cache, dataset);
+		if (vm) {
+			m_vms.push_back(vm);
+			LOGINFO(4, "VM pool grew to " << m_vms.size() << " VMs");
+			return vm;
+		}
+	}
+
+	if (m_freeVMs.empty()) {
+		++m_numWaited;
+		++m_numWaiting;
+		m_maxWaiting = std::max(m_maxWaiting, m_numWaiting);
+
+		const uint64_t t = uv_hrtime();
+		do {
+			uv_cond_wait(&m_cond, &m_mutex);
+		} while (m_freeVMs.empty());
+
+		m_totalWaitTime += uv_hrtime() - t;
+		--m_numWaiting;
+	}
+
+	randomx_vm* vm = m_freeVMs.back();
+	m_freeVMs.pop_back();
+	return vm;
+}
+
+void RandomX_Hasher::VMPool::release(randomx_vm* vm)
+{
+	{
+		MutexLock lock(m_mutex);
+		m_freeVMs.push_back(vm);
+	}
+	uv_cond_signal(&m_cond);
+}
+
+void RandomX_Hasher::VMPool::init(randomx_cache* cache, randomx_dataset* dataset)
+{
+	MutexLock lock(m_mutex);
+
+	if (m_vms.empty()) {
+		randomx_vm* vm = create_vm(cache, dataset);
+		if (!vm) {
+			if (!dataset) {
+				LOGERR(1, "couldn't allocate RandomX light VM, aborting");
+				panic();
+			}
+			return;
+		}
+		m_vms.push_back(vm);
+		m_freeVMs.push_back(vm);
+		return;
+	}
+
+	for (randomx_vm* vm : m_vms) {
+		if (cache) {
+			vm->setCache(cache);
+		}
+		if (dataset) {
+			randomx_vm_set_dataset(vm, dataset);
+		}
+	}
+}
+
+void RandomX_Hasher::VMPool::print_status(const char* name) const
+{
+	MutexLock lock(m_mutex);
+
+	if (m_vms.empty()) {
+		return;
+	}
+
+	const double avg_wait_ms = m_numWaited ? (static_cast<double>(m_totalWaitTime) / m_numWaited / 1e6) : 0.0;
+
+	LOGINFO(0, name << ": " << m_vms.size() << '/' << m_maxSize << " VMs, " << m_vms.size() - m_freeVMs.size() << " busy" <<
+		", hashes = " << m_numAcquired <<
+		", queued = " << m_numWaited << " (now " << m_numWaiting << ", max " << m_maxWaiting << ", avg wait " << avg_wait_ms << " ms)");
+}
+
 RandomX_Hasher::RandomX_Hasher(p2pool* pool)
 	: m_pool(pool)
 	, m_cache{}
@@ -41,6 +201,13 @@ RandomX_Hasher::RandomX_Hasher(p2pool* pool)
 	, m_seed{}
 	, m_index(0)
 	, m_seedCounter(0)
+	, m_nextCache(nullptr)
+	, m_nextDataset(nullptr)
+	, m_nextSeed{}
+	, m_nextSeedReady(false)
+	, m_nextDatasetFailed(false)
+	, m_nextSeedInProgress{}
+	, m_nextSeedRequested{}
 {
 	uint64_t memory_allocated = 0;
 
@@ -75,48 +242,50 @@ RandomX_Hasher::RandomX_Hasher(p2pool* pool)
 
 	uv_rwlock_init_checked(&m_datasetLock);
 	uv_rwlock_init_checked(&m_cacheLock);
+	uv_mutex_init_checked(&m_nextSeedLock);
+	uv_mutex_init_checked(&m_nextSeedInProgressLock);
 
+	const uint32_t vm_pool_size = get_vm_pool_size();
 	for (size_t i = 0; i < array_size(&RandomX_Hasher::m_vm); ++i) {
-		uv_mutex_init_checked(&m_vm[i].mutex);
-		m_vm[i].vm = nullptr;
+		m_vm[i].set_max_size(vm_pool_size);
 	}
 
-
 	memory_allocated = (memory_allocated + (1 << 20) - 1) >> 20;
-	LOGINFO(1, "allocated " << memory_allocated << " MB");
+	LOGINFO(1, "allocated " << memory_allocated << " MB, up to " << vm_pool_size << " VMs per seed");
 }
 
 RandomX_Hasher::~RandomX_Hasher()
 {
 	m_stopped.exchange(1);
 	{
+		MutexLock lock0(m_nextSeedLock);
 		WriteLock lock(m_datasetLock);
 		WriteLock lock2(m_cacheLock);
 	}
 
 	uv_rwlock_destroy(&m_datasetLock);
 	uv_rwlock_destroy(&m_cacheLock);
-
-	for (size_t i = 0; i < array_size(&RandomX_Hasher::m_vm); ++i) {
-		{
-			MutexLock lock(m_vm[i].mutex);
-			if (m_vm[i].vm) {
-				randomx_destroy_vm(m_vm[i].vm);
-			}
-		}
-		uv_mutex_destroy(&m_vm[i].mutex);
-	}
+	uv_mutex_destroy(&m_nextSeedLock);
+	uv_mutex_destroy(&m_nextSeedInProgressLock);
 
 	if (m_dataset) {
 		randomx_release_dataset(m_dataset);
 	}
 
+	if (m_nextDataset) {
+		randomx_release_dataset(m_nextDataset);
+	}
+
 	for (size_t i = 0; i < array_size(&RandomX_Hasher::m_cache); ++i) {
 		if (m_cache[i]) {
 			randomx_release_cache(m_cache[i]);
 		}
 	}
 
+	if (m_nextCache) {
+		randomx_release_cache(m_nextCache);
+	}
+
 	LOGINFO(1, "stopped");
 }
 
@@ -168,6 +337,34 @@ void RandomX_Hasher::set_seed(const hash& seed)
 		return;
 	}
 
+	// If this seed is being prepared right now, wait for it without blocking hashing: it's faster than starting over
+	// If it's some other seed, don't wait: hashing would be blocked until it's done. set_next_seed() will drop its result if it's not needed anymore
+	bool wait_for_next;
+	{
+		MutexLock lock(m_nextSeedInProgressLock);
+		wait_for_next = (m_nextSeedInProgress == seed);
+	}
+
+	bool next_locked;
+	if (wait_for_next) {
+		uv_mutex_lock(&m_nextSeedLock);
+		next_locked = true;
+	}
+	else {
+		next_locked = (uv_mutex_trylock(&m_nextSeedLock) == 0);
+	}
+
+	// cppcheck-suppress unreadVariable
+	ON_SCOPE_LEAVE([&]()
+		{
+			if (next_locked) {
+				uv_mutex_unlock(&m_nextSeedLock);
+			}
+		});
+
+	// Spare cache and dataset can only be used when m_nextSeedLock is held
+	const bool use_next = next_locked && m_nextSeedReady && (m_nextSeed == seed);
+
 	WriteLock lock(m_datasetLock);
 	uv_rwlock_wrlock(&m_cacheLock);
 
@@ -178,6 +375,10 @@ void RandomX_Hasher::set_seed(const hash& seed)
 		return;
 	}
 
+	if (next_locked) {
+		m_nextSeedReady = false;
+	}
+
 	{
 		// cppcheck-suppress unreadVariable
 		ON_SCOPE_LEAVE([this]() { uv_rwlock_wrunlock(&m_cacheLock); });
@@ -189,85 +390,201 @@ void RandomX_Hasher::set_seed(const hash& seed)
 		m_index ^= 1;
 		m_seed[m_index] = seed;
 
-		LOGINFO(1, "new seed " << log::LightBlue() << seed);
-		randomx_init_cache(m_cache[m_index], m_seed[m_index].h, HASH_SIZE);
+		if (use_next) {
+			LOGINFO(1, "new seed " << log::LightBlue() << seed << log::NoColor() << " (prepared in advance)");
+			std::swap(m_cache[m_index], m_nextCache);
+		}
+		else {
+			LOGINFO(1, "new seed " << log::LightBlue() << seed);
+			randomx_init_cache(m_cache[m_index], m_seed[m_index].h, HASH_SIZE);
+		}
 
-		MutexLock lock2(m_vm[m_index].mutex);
+		m_vm[m_index].init(m_cache[m_index], nullptr);
+	}
 
-		if (m_vm[m_index].vm) {
-			m_vm[m_index].vm->setCache(m_cache[m_index]);
+	LOGINFO(1, log::LightCyan() << "cache updated");
+
+	if (m_dataset) {
+		if (use_next && m_nextDataset) {
+			std::swap(m_dataset, m_nextDataset);
 		}
 		else {
-			const randomx_flags flags = randomx_get_flags();
-
-			m_vm[m_index].vm = randomx_create_vm(flags | RANDOMX_FLAG_LARGE_PAGES, m_cache[m_index], nullptr);
-			if (!m_vm[m_index].vm) {
-				LOGWARN(1, "couldn't allocate RandomX light VM using large pages");
-				m_vm[m_index].vm = randomx_create_vm(flags, m_cache[m_index], nullptr);
-				if (!m_vm[m_index].vm) {
-					LOGERR(1, "couldn't allocate RandomX light VM, aborting");
-					panic();
-				}
+			uint32_t numThreads = std::thread::hardware_concurrency();
+
+			// Use only half the cores to let other threads do their stuff in the meantime
+			if (numThreads > 1) {
+				numThreads /= 2;
 			}
+
+			LOGINFO(1, log::LightCyan() << "running " << numThreads << " threads to update dataset");
+
+			ReadLock lock2(m_cacheLock);
+			init_dataset(m_dataset, m_cache[m_index], numThreads);
 		}
+
+		m_vm[FULL_DATASET_VM].init(nullptr, m_dataset);
+
+		LOGINFO(1, log::LightCyan() << "dataset updated");
 	}
+}
 
-	LOGINFO(1, log::LightCyan() << "cache updated");
+void RandomX_Hasher::init_dataset(randomx_dataset* dataset, randomx_cache* cache, uint32_t numThreads)
+{
+	const uint32_t numItems = randomx_dataset_item_count();
+
+	if (numThreads > 1) {
+		std::vector<std::thread> threads;
+		threads.reserve(numThreads);
+
+		for (uint32_t i = 0; i < numThreads; ++i) {
+			const uint32_t a = (numItems * i) / numThreads;
+			const uint32_t b = (numItems * (i + 1)) / numThreads;
+
+			threads.emplace_back([dataset, cache, a, b]()
+				{
+					// Background doesn't work very well with xmrig mining on all cores
+					//make_thread_background();
+					randomx_init_dataset(dataset, cache, a, b - a);
+				});
+		}
 
-	if (m_dataset) {
-		const uint32_t numItems = randomx_dataset_item_count();
-		uint32_t numThreads = std::thread::hardware_concurrency();
+		for (std::thread& t : threads) {
+			t.join();
+		}
+	}
+	else {
+		randomx_init_dataset(dataset, cache, 0, numItems);
+	}
+}
+
+void RandomX_Hasher::set_next_seed_async(const hash& seed)
+{
+	if (m_nextSeedRequested == seed) {
+		return;
+	}
+	m_nextSeedRequested = seed;
+
+	struct Work
+	{
+		p2pool* pool;
+		RandomX_Hasher* hasher;
+		hash seed;
+		uv_work_t req;
+	};
+
+	Work* work = new Work{ m_pool, this, seed, {} };
+	work->req.data = work;
 
-		// Use only half the cores to let other threads do their stuff in the meantime
-		if (numThreads > 1) {
-			numThreads /= 2;
+	const int err = uv_queue_work(uv_default_loop_checked(), &work->req,
+		[](uv_work_t* req)
+		{
+			bkg_jobs_tracker.start("RandomX_Hasher::set_next_seed_async");
+			Work* work = reinterpret_cast<Work*>(req->data);
+			if (!work->pool->stopped()) {
+				work->hasher->set_next_seed(work->seed);
+			}
+		},
+		[](uv_work_t* req, int)
+		{
+			delete reinterpret_cast<Work*>(req->data);
+			bkg_jobs_tracker.stop("RandomX_Hasher::set_next_seed_async");
 		}
+	);
 
-		LOGINFO(1, log::LightCyan() << "running " << numThreads << " threads to update dataset");
+	if (err) {
+		LOGERR(1, "uv_queue_work failed, error " << uv_err_name(err));
+		delete work;
+	}
+}
 
-		ReadLock lock2(m_cacheLock);
+void RandomX_Hasher::set_next_seed(const hash& seed)
+{
+	if (m_stopped.load()) {
+		return;
+	}
 
-		if (numThreads > 1) {
-			std::vector<std::thread> threads;
-			threads.reserve(numThreads);
+	MutexLock lock(m_nextSeedLock);
 
-			for (uint32_t i = 0; i < numThreads; ++i) {
-				const uint32_t a = (numItems * i) / numThreads;
-				const uint32_t b = (numItems * (i + 1)) / numThreads;
+	if ((m_nextSeedReady && (m_nextSeed == seed)) || (m_seed[m_index] == seed)) {
+		return;
+	}
 
-				threads.emplace_back([this, a, b]()
-					{
-						// Background doesn't work very well with xmrig mining on all cores
-						//make_thread_background();
-						randomx_init_dataset(m_dataset, m_cache[m_index], a, b - a);
-					});
+	m_nextSeedReady = false;
+
+	{
+		MutexLock lock2(m_nextSeedInProgressLock);
+		m_nextSeedInProgress = seed;
+	}
+
+	// cppcheck-suppress unreadVariable
+	ON_SCOPE_LEAVE([this]()
+		{
+			MutexLock lock2(m_nextSeedInProgressLock);
+			m_nextSeedInProgress = {};
+		});
+
+	if (!m_nextCache) {
+		const randomx_flags flags = randomx_get_flags();
+
+		m_nextCache = randomx_alloc_cache(flags | RANDOMX_FLAG_LARGE_PAGES);
+		if (!m_nextCache) {
+			m_nextCache = randomx_alloc_cache(flags);
+			if (!m_nextCache) {
+				LOGWARN(1, "couldn't allocate RandomX cache for the next seed");
+				return;
 			}
+		}
+	}
+
+	// The second dataset is optional, don't allocate it if it doesn't fit in free memory
+	if (m_dataset && !m_nextDataset && !m_nextDatasetFailed) {
+		constexpr uint64_t dataset_size = RANDOMX_DATASET_BASE_SIZE + RANDOMX_DATASET_EXTRA_SIZE;
+		constexpr uint64_t min_free_memory = dataset_size + (256ULL << 20);
 
-			for (std::thread& t : threads) {
-				t.join();
+		const uint64_t free_memory = uv_get_free_memory();
+		if (free_memory >= min_free_memory) {
+			m_nextDataset = randomx_alloc_dataset(RANDOMX_FLAG_LARGE_PAGES);
+			if (!m_nextDataset) {
+				m_nextDataset = randomx_alloc_dataset(RANDOMX_FLAG_DEFAULT);
 			}
 		}
-		else {
-			randomx_init_dataset(m_dataset, m_cache[m_index], 0, numItems);
+
+		if (!m_nextDataset) {
+			LOGWARN(1, "not enough memory for the second RandomX dataset (" << (free_memory >> 20) << " MB free), dataset will be updated in place when the seed changes");
+			m_nextDatasetFailed = true;
 		}
+	}
 
-		MutexLock lock3(m_vm[FULL_DATASET_VM].mutex);
+	LOGINFO(1, "preparing next seed " << log::LightBlue() << seed);
 
-		if (!m_vm[FULL_DATASET_VM].vm) {
-			const randomx_flags flags = randomx_get_flags() | RANDOMX_FLAG_FULL_MEM;
+	randomx_init_cache(m_nextCache, seed.h, HASH_SIZE);
 
-			m_vm[FULL_DATASET_VM].vm = randomx_create_vm(flags | RANDOMX_FLAG_LARGE_PAGES, nullptr, m_dataset);
-			if (!m_vm[FULL_DATASET_VM].vm) {
-				LOGWARN(1, "couldn't allocate RandomX VM using large pages");
-				m_vm[FULL_DATASET_VM].vm = randomx_create_vm(flags, nullptr, m_dataset);
-				if (!m_vm[FULL_DATASET_VM].vm) {
-					LOGERR(1, "couldn't allocate RandomX VM");
-				}
-			}
-		}
+	if (m_nextDataset) {
+		// It's done in advance, so use fewer threads than set_seed() to not slow down mining too much
+		uint32_t numThreads = std::thread::hardware_concurrency();
+		numThreads = std::max(numThreads / 4, 1U);
 
-		LOGINFO(1, log::LightCyan() << "dataset updated");
+		LOGINFO(1, log::LightCyan() << "running " << numThreads << " threads to prepare the next dataset");
+		init_dataset(m_nextDataset, m_nextCache, numThreads);
 	}
+
+	if (m_stopped.load()) {
+		return;
+	}
+
+	// set_seed() didn't wait for this seed and has already switched to it
+	{
+		ReadLock lock2(m_cacheLock);
+		if (m_seed[m_index] == seed) {
+			LOGINFO(1, "next seed " << log::LightBlue() << seed << log::NoColor() << " is already the current seed, dropping it");
+			return;
+		}
+	}
+
+	m_nextSeed = seed;
+	m_nextSeedReady = true;
+
+	LOGINFO(1, log::LightCyan() << "next seed is ready");
 }
 
 void RandomX_Hasher::set_old_seed(const hash& seed)
@@ -287,24 +604,7 @@ void RandomX_Hasher::set_old_seed(const hash& seed)
 
 		randomx_init_cache(m_cache[old_index], m_seed[old_index].h, HASH_SIZE);
 
-		MutexLock lock2(m_vm[old_index].mutex);
-
-		if (m_vm[old_index].vm) {
-			m_vm[old_index].vm->setCache(m_cache[old_index]);
-		}
-		else {
-			const randomx_flags flags = randomx_get_flags();
-
-			m_vm[old_index].vm = randomx_create_vm(flags | RANDOMX_FLAG_LARGE_PAGES, m_cache[old_index], nullptr);
-			if (!m_vm[old_index].vm) {
-				LOGWARN(1, "couldn't allocate RandomX light VM using large pages");
-				m_vm[old_index].vm = randomx_create_vm(flags, m_cache[old_index], nullptr);
-				if (!m_vm[old_index].vm) {
-					LOGERR(1, "couldn't allocate RandomX light VM, aborting");
-					panic();
-				}
-			}
-		}
+		m_vm[old_index].init(m_cache[old_index], nullptr);
 	}
 	LOGINFO(1, log::LightCyan() << "old cache updated");
 }
@@ -315,6 +615,13 @@ void RandomX_Hasher::sync_wait()
 	ReadLock lock2(m_cacheLock);
 }
 
+void RandomX_Hasher::print_status() const
+{
+	m_vm[FULL_DATASET_VM].print_status("full dataset VMs");
+	m_vm[m_index].print_status("light VMs (current seed)");
+	m_vm[m_index ^ 1].print_status("light VMs (previous seed)");
+}
+
 bool RandomX_Hasher::calculate(const void* data, size_t size, uint64_t /*height*/, const hash& seed, hash& result)
 {
 	// First try to use the dataset if it's ready
@@ -326,11 +633,14 @@ bool RandomX_Hasher::calculate(const void* data, size_t size, uint64_t /*height*
 			return false;
 		}
 
-		MutexLock lock(m_vm[FULL_DATASET_VM].mutex);
-
-		if (m_vm[FULL_DATASET_VM].vm && (seed == m_seed[m_index])) {
-			randomx_calculate_hash(m_vm[FULL_DATASET_VM].vm, data, size, &result);
-			return true;
+		if (seed == m_seed[m_index]) {
+			VMPool& pool = m_vm[FULL_DATASET_VM];
+			randomx_vm* vm = pool.acquire(nullptr, m_dataset);
+			if (vm) {
+				randomx_calculate_hash(vm, data, size, &result);
+				pool.release(vm);
+				return true;
+			}
 		}
 	}
 
@@ -341,29 +651,30 @@ bool RandomX_Hasher::calculate(const void* data, size_t size, uint64_t /*height*
 		return false;
 	}
 
-	{
-		MutexLock lock2(m_vm[m_index].mutex);
-		if (m_vm[m_index].vm && (seed == m_seed[m_index])) {
-			randomx_calculate_hash(m_vm[m_index].vm, data, size, &result);
-			return true;
+	for (uint32_t index : { m_index, m_index ^ 1 }) {
+		if (seed == m_seed[index]) {
+			VMPool& pool = m_vm[index];
+			randomx_vm* vm = pool.acquire(m_cache[index], nullptr);
+			if (vm) {
+				randomx_calculate_hash(vm, data, size, &result);
+				pool.release(vm);
+				return true;
+			}
 		}
 	}
 
-	const uint32_t prev_index = m_index ^ 1;
-
-	MutexLock lock2(m_vm[prev_index].mutex);
-
-	if (m_vm[prev_index].vm && (seed == m_seed[prev_index])) {
-		randomx_calculate_hash(m_vm[prev_index].vm, data, size, &result);
-		return true;
-	}
-
 	return false;
 }
 #endif
 
 RandomX_Hasher_RPC::RandomX_Hasher_RPC(p2pool* pool)
 	: m_pool(pool)
+	, m_requestsInFlight(0)
+	, m_maxRequestsInFlight(pool->params().m_rpcPowJobs)
+	, m_numRequests(0)
+	, m_numFailed(0)
+	, m_totalTime(0)
+	, m_maxPending(0)
 	, m_loopThread{}
 {
 	int err = uv_loop_init(&m_loop);
@@ -373,8 +684,9 @@ RandomX_Hasher_RPC::RandomX_Hasher_RPC(p2pool* pool)
 	}
 
 	uv_async_init(&m_loop, &m_shutdownAsync, on_shutdown);
-	uv_async_init(&m_loop, &m_kickTheLoopAsync, nullptr);
+	uv_async_init(&m_loop, &m_kickTheLoopAsync, on_kick);
 	m_shutdownAsync.data = this;
+	m_kickTheLoopAsync.data = this;
 
 	uv_mutex_init_checked(&m_requestMutex);
 	uv_mutex_init_checked(&m_condMutex);
@@ -390,6 +702,8 @@ RandomX_Hasher_RPC::RandomX_Hasher_RPC(p2pool* pool)
 		LOGERR(1, "failed to start event loop thread, error " << uv_err_name(err));
 		panic();
 	}
+
+	LOGINFO(1, "up to " << m_maxRequestsInFlight << " parallel calc_pow requests");
 }
 
 RandomX_Hasher_RPC::~RandomX_Hasher_RPC()
@@ -415,8 +729,6 @@ void RandomX_Hasher_RPC::loop(void* data)
 
 bool RandomX_Hasher_RPC::calculate(const void* data_ptr, size_t size, uint64_t height, const hash& /*seed*/, hash& h)
 {
-	MutexLock lock(m_requestMutex);
-
 	const uint8_t* data = reinterpret_cast<const uint8_t*>(data_ptr);
 	const uint8_t major_version = data[0];
 
@@ -427,42 +739,95 @@ bool RandomX_Hasher_RPC::calculate(const void* data_ptr, size_t size, uint64_t h
 		",\"block_blob\":\"" << log::hex_buf(data, size) << '"' <<
 		",\"seed_hash\":\"\"}}";
 
-	volatile int result = 0;
-	volatile bool done = false;
-
-	JSONRPCRequest::call(m_pool->params().m_host.c_str(), m_pool->params().m_rpcPort, buf,
-		[&result, &h](const char* data, size_t size)
-		{
-			rapidjson::Document doc;
-			if (doc.Parse(data, size).HasParseError() || !parseValue(doc, "result", h)) {
-				LOGWARN(3, "RPC calc_pow: invalid JSON response (parse error)");
-				result = -1;
-				return;
-			}
-			result = 1;
-		},
-		[this, &result, &done](const char* data, size_t size)
-		{
-			if (size > 0) {
-				LOGWARN(3, "RPC calc_pow: server returned error " << log::const_buf(data, size));
-				result = -1;
-			}
+	Request req{ std::string(buf, s.m_pos), &h, 0, false, std::chrono::steady_clock::now() };
 
-			MutexLock lock2(m_condMutex);
-			done = true;
-			uv_cond_signal(&m_cond);
-		}, &m_loop);
+	// Callers from different threads don't wait for each other: all queued hashes are sent
+	// to monerod as soon as a slot is free, up to m_maxRequestsInFlight at the same time
+	{
+		MutexLock lock(m_requestMutex);
+		m_pendingRequests.push_back(&req);
+		m_maxPending = std::max(m_maxPending, static_cast<uint32_t>(m_pendingRequests.size()));
+	}
 
 	uv_async_send(&m_kickTheLoopAsync);
 
 	{
-		MutexLock lock2(m_condMutex);
-		while (!done) {
+		MutexLock lock(m_condMutex);
+		while (!req.m_done) {
 			uv_cond_wait(&m_cond, &m_condMutex);
 		}
 	}
 
-	return result > 0;
+	return req.m_status > 0;
+}
+
+void RandomX_Hasher_RPC::start_requests()
+{
+	for (;;) {
+		Request* req;
+		{
+			MutexLock lock(m_requestMutex);
+
+			if (m_pendingRequests.empty() || (m_requestsInFlight >= m_maxRequestsInFlight)) {
+				return;
+			}
+
+			req = m_pendingRequests.front();
+			m_pendingRequests.erase(m_pendingRequests.begin());
+			++m_requestsInFlight;
+		}
+
+		JSONRPCRequest::call(m_pool->params().m_host.c_str(), m_pool->params().m_rpcPort, req->m_body.c_str(),
+			[req](const char* data, size_t size)
+			{
+				rapidjson::Document doc;
+				if (doc.Parse(data, size).HasParseError() || !parseValue(doc, "result", *req->m_result)) {
+					LOGWARN(3, "RPC calc_pow: invalid JSON response (parse error)");
+					req->m_status = -1;
+					return;
+				}
+				req->m_status = 1;
+			},
+			[this, req](const char* data, size_t size)
+			{
+				if (size > 0) {
+					LOGWARN(3, "RPC calc_pow: server returned error " << log::const_buf(data, size));
+					req->m_status = -1;
+				}
+
+				using namespace std::chrono;
+				const uint64_t dt = duration_cast<nanoseconds>(steady_clock::now() - req->m_queuedTime).count();
+				{
+					MutexLock lock(m_requestMutex);
+					--m_requestsInFlight;
+					++m_numRequests;
+					if (req->m_status <= 0) {
+						++m_numFailed;
+					}
+					m_totalTime += dt;
+				}
+
+				{
+					MutexLock lock2(m_condMutex);
+					req->m_done = true;
+					uv_cond_broadcast(&m_cond);
+				}
+
+				// "req" can't be used after this point, the waiting thread has already returned
+				start_requests();
+			}, &m_loop);
+	}
+}
+
+void RandomX_Hasher_RPC::print_status() const
+{
+	MutexLock lock(m_requestMutex);
+
+	const double avg_time_ms = m_numRequests ? (static_cast<double>(m_totalTime) / m_numRequests / 1e6) : 0.0;
+
+	LOGINFO(0, "calc_pow RPC: " << m_requestsInFlight << '/' << m_maxRequestsInFlight << " in flight, " <<
+		m_pendingRequests.size() << " queued (max " << m_maxPending << "), hashes = " << m_numRequests <<
+		", failed = " << m_numFailed << ", avg time " << avg_time_ms << " ms");
 }
 
 } // namespace p2pool
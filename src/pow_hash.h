@@ -34,11 +34,13 @@ public:
 
 	virtual void set_seed_async(const hash&) {}
 	virtual void set_old_seed(const hash&) {}
+	virtual void set_next_seed_async(const hash&) {}
 
 	virtual randomx_cache* cache() const { return nullptr; }
 	virtual randomx_dataset* dataset() const { return nullptr; }
 	virtual uint32_t seed_counter() const { return 0; }
 	virtual void sync_wait() {}
+	virtual void print_status() const {}
 
 	virtual bool calculate(const void* data, size_t size, uint64_t height, const hash& seed, hash& result) = 0;
 };
@@ -55,19 +57,53 @@ public:
 
 	void set_old_seed(const hash& seed) override;
 
+	// Prepares cache and dataset for the next epoch in the background, set_seed() then only swaps them in
+	void set_next_seed_async(const hash& seed) override;
+	void set_next_seed(const hash& seed);
+
 	randomx_cache* cache() const override { return m_cache[m_index]; }
 	randomx_dataset* dataset() const override { return m_dataset; }
 	uint32_t seed_counter() const override { return m_seedCounter.load(); }
 	void sync_wait() override;
+	void print_status() const override;
 
 	bool calculate(const void* data, size_t size, uint64_t height, const hash& seed, hash& result) override;
 
 private:
-
-	struct ThreadSafeVM
+	// VMs for the same cache or dataset which can be used in parallel
+	// The first VM is created when the cache/dataset is ready, the rest are created on demand up to the maximum size
+	// When all VMs are busy, callers wait in a queue
+	class VMPool : public nocopy_nomove
 	{
-		uv_mutex_t mutex{};
-		randomx_vm* vm = nullptr;
+	public:
+		VMPool();
+		~VMPool();
+
+		void set_max_size(uint32_t max_size) { m_maxSize = max_size; }
+
+		// Returns nullptr if the pool is not initialized yet
+		randomx_vm* acquire(randomx_cache* cache, randomx_dataset* dataset);
+		void release(randomx_vm* vm);
+
+		// Creates the first VM, or switches all existing VMs to the new cache or dataset
+		// Must be called when none of VMs are in use
+		void init(randomx_cache* cache, randomx_dataset* dataset);
+
+		void print_status(const char* name) const;
+
+	private:
+		mutable uv_mutex_t m_mutex;
+		uv_cond_t m_cond;
+
+		uint32_t m_maxSize;
+		std::vector<randomx_vm*> m_vms;
+		std::vector<randomx_vm*> m_freeVMs;
+
+		uint64_t m_numAcquired;
+		uint64_t m_numWaited;
+		uint64_t m_totalWaitTime;
+		uint32_t m_numWaiting;
+		uint32_t m_maxWaiting;
 	};
 
 	p2pool* m_pool;
@@ -80,16 +116,34 @@ private:
 	uv_rwlock_t m_datasetLock;
 	randomx_dataset* m_dataset;
 
-	// 0: light VM for the current seed
-	// 1: light VM for the previous seed
-	// 2: full dataset VM for the current seed
+	// 0: light VMs for m_cache[0]
+	// 1: light VMs for m_cache[1]
+	// 2: full dataset VMs for the current seed
 	enum { FULL_DATASET_VM = 2 };
-	ThreadSafeVM m_vm[3]{};
+	VMPool m_vm[3];
 
 	hash m_seed[2];
 	uint32_t m_index;
 
 	std::atomic<uint32_t> m_seedCounter;
+
+	static void init_dataset(randomx_dataset* dataset, randomx_cache* cache, uint32_t numThreads);
+
+	// Spare cache and dataset for the next seed, they're swapped with the current ones when the epoch changes
+	// m_nextDataset stays nullptr if there's not enough memory for the second dataset, it's rebuilt in place then
+	uv_mutex_t m_nextSeedLock;
+	randomx_cache* m_nextCache;
+	randomx_dataset* m_nextDataset;
+	hash m_nextSeed;
+	bool m_nextSeedReady;
+	bool m_nextDatasetFailed;
+
+	// Seed which set_next_seed() is preparing right now (m_nextSeedLock is held all this time), set_seed() waits only for this seed
+	uv_mutex_t m_nextSeedInProgressLock;
+	hash m_nextSeedInProgress;
+
+	// Only accessed from the main thread
+	hash m_nextSeedRequested;
 };
 #endif
 
@@ -101,12 +155,36 @@ public:
 
 	bool calculate(const void* data, size_t size, uint64_t height, const hash& seed, hash& result) override;
 
+	void print_status() const override;
+
 private:
 	static void loop(void* data);
 
 	p2pool* m_pool;
 
-	uv_mutex_t m_requestMutex;
+	// Hashes requested by calculate() callers, waiting for a free RPC slot
+	// Requests are started only in the event loop thread because libuv handles can't be created from other threads
+	struct Request
+	{
+		std::string m_body;
+		hash* m_result;
+		int m_status;
+		bool m_done;
+		std::chrono::steady_clock::time_point m_queuedTime;
+	};
+
+	mutable uv_mutex_t m_requestMutex;
+	std::vector<Request*> m_pendingRequests;
+	uint32_t m_requestsInFlight;
+	uint32_t m_maxRequestsInFlight;
+
+	uint64_t m_numRequests;
+	uint64_t m_numFailed;
+	uint64_t m_totalTime;
+	uint32_t m_maxPending;
+
+	void start_requests();
+
 	uv_loop_t m_loop;
 
 	uv_thread_t m_loopThread;
@@ -122,6 +200,11 @@ private:
 		uv_close(reinterpret_cast<uv_handle_t*>(&server->m_shutdownAsync), nullptr);
 		uv_close(reinterpret_cast<uv_handle_t*>(&server->m_kickTheLoopAsync), nullptr);
 	}
+
+	static void on_kick(uv_async_t* async)
+	{
+		reinterpret_cast<RandomX_Hasher_RPC*>(async->data)->start_requests();
+	}
 };
 
 } // namespace p2pool
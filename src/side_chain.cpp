@@ -61,6 +61,7 @@ SideChain::SideChain(p2pool* pool, NetworkType type, const char* pool_name)
 	: m_pool(pool)
 	, m_networkType(type)
 	, m_chainTip(nullptr)
+	, m_stateVersion(0)
 	, m_poolName(pool_name ? pool_name : "default")
 	, m_targetBlockTime(10)
 	, m_minDifficulty(MIN_DIFFICULTY, 0)
@@ -168,10 +169,12 @@ SideChain::~SideChain()
 	}
 }
 
-void SideChain::fill_sidechain_data(PoolBlock& block, Wallet* w, const hash& txkeySec, std::vector<MinerShare>& shares)
+uint64_t SideChain::fill_sidechain_data(PoolBlock& block, Wallet* w, const hash& txkeySec, std::vector<MinerShare>& shares)
 {
 	MutexLock lock(m_sidechainLock);
 
+	const uint64_t state_version = m_stateVersion.load();
+
 	block.m_minerWallet = *w;
 	block.m_txkeySec = txkeySec;
 	block.m_uncles.clear();
@@ -183,7 +186,7 @@ void SideChain::fill_sidechain_data(PoolBlock& block, Wallet* w, const hash& txk
 		block.m_cumulativeDifficulty = m_minDifficulty;
 
 		get_shares(&block, shares);
-		return;
+		return state_version;
 	}
 
 	block.m_parent = m_chainTip->m_sidechainId;
@@ -273,6 +276,7 @@ void SideChain::fill_sidechain_data(PoolBlock& block, Wallet* w, const hash& txk
 	}
 
 	get_shares(&block, shares);
+	return state_version;
 }
 
 P2PServer* SideChain::p2pServer() const
@@ -362,6 +366,57 @@ bool SideChain::get_shares(PoolBlock* tip, std::vector<MinerShare>& shares) cons
 	return true;
 }
 
+bool SideChain::precheck_external_block(const PoolBlock& block, bool& skip)
+{
+	skip = false;
+
+	if (block.m_difficulty < m_minDifficulty) {
+		LOGWARN(3, "precheck_external_block: block has invalid difficulty " << block.m_difficulty << ", expected >= " << m_minDifficulty);
+		return false;
+	}
+
+	{
+		MutexLock lock(m_sidechainLock);
+
+		// Block ID is not verified yet, but a forged ID can only make us skip this block
+		if (m_blocksById.find(block.m_sidechainId) != m_blocksById.end()) {
+			LOGINFO(6, "precheck_external_block: block " << block.m_sidechainId << " is already added");
+			skip = true;
+			return true;
+		}
+
+		const PoolBlock* tip = m_chainTip;
+		if (tip && (tip->m_sidechainHeight > block.m_sidechainHeight + m_chainWindowSize * 2) && (block.m_cumulativeDifficulty < tip->m_cumulativeDifficulty)) {
+			LOGINFO(6, "precheck_external_block: block " << block.m_sidechainId << " is too old");
+			skip = true;
+			return true;
+		}
+
+		if (is_too_low_difficulty(block.m_difficulty)) {
+			LOGWARN(4, "precheck_external_block: block has too low difficulty " << block.m_difficulty << ", expected >= ~" << m_curDifficulty << ". Ignoring it.");
+			skip = true;
+			return true;
+		}
+	}
+
+	{
+		MutexLock lock(m_seenBlocksLock);
+		if (m_seenBlocks.find(block.m_sidechainId) != m_seenBlocks.end()) {
+			LOGINFO(6, "precheck_external_block: block " << block.m_sidechainId << " was received before");
+			skip = true;
+			return true;
+		}
+	}
+
+	ChainMain data;
+	if (m_pool->chainmain_get_by_hash(block.m_prevId, data) && (data.height + 1 != block.m_txinGenHeight)) {
+		LOGWARN(3, "precheck_external_block: wrong mainchain height " << block.m_txinGenHeight << ", expected " << data.height + 1);
+		return false;
+	}
+
+	return true;
+}
+
 bool SideChain::block_seen(const PoolBlock& block)
 {
 	// Check if it's some old block
@@ -391,7 +446,7 @@ bool SideChain::add_external_block(PoolBlock& block, std::vector<hash>& missing_
 		return false;
 	}
 
-	bool too_low_diff = (block.m_difficulty < m_curDifficulty);
+	bool too_low_diff;
 	{
 		MutexLock lock(m_sidechainLock);
 		if (m_blocksById.find(block.m_sidechainId) != m_blocksById.end()) {
@@ -399,19 +454,7 @@ bool SideChain::add_external_block(PoolBlock& block, std::vector<hash>& missing_
 			return true;
 		}
 
-		// This is mainly an anti-spam measure, not an actual verification step
-		if (too_low_diff) {
-			// Reduce required diff by 50% (by doubling this block's diff) to account for alternative chains
-			difficulty_type diff2 = block.m_difficulty;
-			diff2 += block.m_difficulty;
-
-			for (PoolBlock* tmp = m_chainTip; tmp && (tmp->m_sidechainHeight + m_chainWindowSize > m_chainTip->m_sidechainHeight); tmp = get_parent(tmp)) {
-				if (diff2 >= tmp->m_difficulty) {
-					too_low_diff = false;
-					break;
-				}
-			}
-		}
+		too_low_diff = is_too_low_difficulty(block.m_difficulty);
 	}
 
 	LOGINFO(4, "add_external_block: height = " << block.m_sidechainHeight << ", id = " << block.m_sidechainId << ", mainchain height = " << block.m_txinGenHeight);
@@ -534,6 +577,7 @@ void SideChain::add_block(const PoolBlock& block)
 	}
 
 	m_blocksByHeight[new_block->m_sidechainHeight].push_back(new_block);
+	++m_stateVersion;
 
 	update_depths(new_block);
 
@@ -549,6 +593,52 @@ void SideChain::add_block(const PoolBlock& block)
 	m_seenWallets[new_block->m_minerWallet.spend_public_key()] = new_block->m_localTimestamp;
 }
 
+void SideChain::add_local_block(PoolBlock* block)
+{
+	LOGINFO(3, "add_local_block: height = " << block->m_sidechainHeight <<
+		", id = " << block->m_sidechainId <<
+		", mainchain height = " << block->m_txinGenHeight
+	);
+
+	block->m_verified = true;
+	block->m_invalid = false;
+	block->m_wantBroadcast = true;
+
+	if (p2pServer()) {
+		p2pServer()->store_in_cache(*block);
+	}
+
+	MutexLock lock(m_sidechainLock);
+
+	auto result = m_blocksById.insert({ block->m_sidechainId, block });
+	if (!result.second) {
+		LOGWARN(3, "add_local_block: trying to add the same block twice, id = " << block->m_sidechainId);
+		delete block;
+		return;
+	}
+
+	m_blocksByHeight[block->m_sidechainHeight].push_back(block);
+	++m_stateVersion;
+
+	// A block on top of the current chain tip always has higher cumulative difficulty,
+	// so it will become the new tip: send it to peers before doing anything else
+	const bool broadcasted_early = m_chainTip && (block->m_parent == m_chainTip->m_sidechainId) && p2pServer();
+	if (broadcasted_early) {
+		block->m_broadcasted = true;
+		p2pServer()->broadcast(*block);
+	}
+
+	update_depths(block);
+	update_chain_tip(block);
+
+	// update_chain_tip() can still reject it (difficulty calculation failed, or the chain is not longer after all)
+	if (broadcasted_early && (m_chainTip != block)) {
+		LOGWARN(3, "add_local_block: block at height = " << block->m_sidechainHeight << ", id = " << block->m_sidechainId << " was broadcasted, but it didn't become the new chain tip");
+	}
+
+	m_seenWallets[block->m_minerWallet.spend_public_key()] = block->m_localTimestamp;
+}
+
 PoolBlock* SideChain::find_block(const hash& id)
 {
 	MutexLock lock(m_sidechainLock);
@@ -1410,6 +1500,27 @@ void SideChain::update_chain_tip(PoolBlock* block)
 	}
 }
 
+// This is mainly an anti-spam measure, not an actual verification step
+// m_sidechainLock must be held
+bool SideChain::is_too_low_difficulty(const difficulty_type& diff)
+{
+	if (diff >= m_curDifficulty) {
+		return false;
+	}
+
+	// Reduce required diff by 50% (by doubling this block's diff) to account for alternative chains
+	difficulty_type diff2 = diff;
+	diff2 += diff;
+
+	for (const PoolBlock* tmp = m_chainTip; tmp && (tmp->m_sidechainHeight + m_chainWindowSize > m_chainTip->m_sidechainHeight); tmp = get_parent(tmp)) {
+		if (diff2 >= tmp->m_difficulty) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
 PoolBlock* SideChain::get_parent(const PoolBlock* block)
 {
 	if (block) {
@@ -43,12 +43,22 @@ public:
 	SideChain(p2pool* pool, NetworkType type, const char* pool_name = nullptr);
 	~SideChain();
 
-	void fill_sidechain_data(PoolBlock& block, Wallet* w, const hash& txkeySec, std::vector<MinerShare>& shares);
+	// Returns state_version() at the moment the data was filled in
+	uint64_t fill_sidechain_data(PoolBlock& block, Wallet* w, const hash& txkeySec, std::vector<MinerShare>& shares);
+
+	// Cheap checks for a block received from a peer, done before the expensive part of PoolBlock::deserialize()
+	// Only the syntax has been checked at this point, ID, keys and outputs are not verified yet
+	// Returns false if the block is invalid, sets "skip" if it's not worth verifying (known, old or too low difficulty)
+	bool precheck_external_block(const PoolBlock& block, bool& skip);
 
 	bool block_seen(const PoolBlock& block);
 	void unsee_block(const PoolBlock& block);
 	bool add_external_block(PoolBlock& block, std::vector<hash>& missing_blocks);
 	void add_block(const PoolBlock& block);
+
+	// Adds a block built from our own block template, takes ownership of it
+	// It's trusted to be valid and it's broadcasted before updating the chain tip if it extends the current one
+	void add_local_block(PoolBlock* block);
 	void get_missing_blocks(std::vector<hash>& missing_blocks);
 
 	PoolBlock* find_block(const hash& id);
@@ -75,6 +85,9 @@ public:
 
 	const PoolBlock* chainTip() const { return m_chainTip; }
 
+	// Changes every time a block is added, sidechain data for block templates stays the same until then
+	uint64_t state_version() const { return m_stateVersion.load(); }
+
 	static bool split_reward(uint64_t reward, const std::vector<MinerShare>& shares, std::vector<uint64_t>& rewards);
 
 private:
@@ -88,6 +101,7 @@ private:
 	void verify_loop(PoolBlock* block);
 	void verify(PoolBlock* block);
 	void update_chain_tip(PoolBlock* block);
+	bool is_too_low_difficulty(const difficulty_type& diff);
 	PoolBlock* get_parent(const PoolBlock* block);
 
 	// Checks if "candidate" has longer (higher difficulty) chain than "block"
@@ -100,6 +114,7 @@ private:
 
 	mutable uv_mutex_t m_sidechainLock;
 	PoolBlock* m_chainTip;
+	std::atomic<uint64_t> m_stateVersion;
 	std::map<uint64_t, std::vector<PoolBlock*>> m_blocksByHeight;
 	unordered_map<hash, PoolBlock*> m_blocksById;
 	unordered_map<hash, time_t> m_seenWallets;
@@ -35,10 +35,13 @@ static constexpr uint64_t TARGET_4_BYTES_LIMIT = std::numeric_limits<uint64_t>::
 
 namespace p2pool {
 
+static_assert(array_size(&StratumServer::StratumClient::m_jobs) >= BlockTemplate::MAX_TEMPLATE_HISTORY, "Stratum clients must be able to submit shares for all block templates in history");
+
 StratumServer::StratumServer(p2pool* pool)
-	: TCPServer(StratumClient::allocate)
+	: TCPServer(StratumClient::allocate, STRATUM_WRITE_QUEUE_HIGH_WATER_MARK, STRATUM_WRITE_QUEUE_MAX_SIZE)
 	, m_pool(pool)
 	, m_extraNonce(0)
+	, m_connectionSequence(0)
 	, m_rd{}
 	, m_rng(m_rd())
 	, m_cumulativeHashes(0)
@@ -49,10 +52,16 @@ StratumServer::StratumServer(p2pool* pool)
 	, m_hashrateDataTail_24h(0)
 	, m_cumulativeFoundSharesDiff(0.0)
 	, m_totalFoundShares(0)
+	, m_staleShares{}
+	, m_sharesOnOldTemplates(0)
 	, m_apiLastUpdateTime(0)
 {
 	m_hashrateData[0] = { time(nullptr), 0 };
 
+#ifdef P2POOL_STRATUM_BENCHMARK
+	LOGWARN(0, "built with WITH_STRATUM_BENCHMARK: PoW of submitted shares is not checked and found shares are not submitted. Don't use this build for mining!");
+#endif
+
 	uv_mutex_init_checked(&m_blobsQueueLock);
 	uv_mutex_init_checked(&m_rngLock);
 	uv_mutex_init_checked(&m_submittedSharesPoolLock);
@@ -101,14 +110,15 @@ void StratumServer::on_block(const BlockTemplate& block)
 	}
 
 	BlobsData* blobs_data = new BlobsData{};
+	blobs_data->m_onBlockTime = std::chrono::steady_clock::now();
 
 	difficulty_type difficulty;
 	difficulty_type sidechain_difficulty;
 	size_t nonce_offset;
 
 	// More clients might connect between now and when we actually go through clients list - get_hashing_blobs() and async send take some time
-	// Even if they do, they'll be added to the beginning of the list and will get their block template in on_login()
-	// We'll iterate through the list backwards so when we get to the beginning and run out of extra_nonce values, it'll be only new clients left
+	// Even if they do, they'll get their block template in on_login()
+	// Clients are sorted by connection time before sending jobs, so if we run out of extra_nonce values, it'll be only new clients left
 	blobs_data->m_numClientsExpected = num_connections;
 	m_extraNonce.exchange(blobs_data->m_numClientsExpected);
 
@@ -350,6 +360,7 @@ bool StratumServer::on_submit(StratumClient* client, uint32_t id, const char* jo
 
 		if (!block.get_difficulties(template_id, mainchain_diff, sidechain_diff)) {
 			LOGWARN(4, "client " << static_cast<char*>(client->m_addrString) << " got a stale share");
+			++m_staleShares[STALE_TEMPLATE_EXPIRED];
 			return send(client,
 				[id](void* buf)
 				{
@@ -359,12 +370,14 @@ bool StratumServer::on_submit(StratumClient* client, uint32_t id, const char* jo
 				});
 		}
 
+#ifndef P2POOL_STRATUM_BENCHMARK
 		if (mainchain_diff.check_pow(resultHash)) {
 			const std::string& s = client->m_customUser;
 			LOGINFO(0, log::Green() << "client " << static_cast<char*>(client->m_addrString) << (!s.empty() ? " user " : "") << s << " found a mainchain block, submitting it");
-			m_pool->submit_block_async(template_id, nonce, extra_nonce);
 			block.update_tx_keys();
+			m_pool->submit_block_async(template_id, nonce, extra_nonce);
 		}
+#endif
 
 		SubmittedShare* share;
 
@@ -393,6 +406,7 @@ bool StratumServer::on_submit(StratumClient* client, uint32_t id, const char* jo
 		share->m_target = target;
 		share->m_resultHash = resultHash;
 		share->m_sidechainDifficulty = sidechain_diff;
+		share->m_oldTemplate = (template_id != block.template_id());
 
 		// If this share is below sidechain difficulty, process it in this thread because it'll be quick
 		if (!share->m_sidechainDifficulty.check_pow(share->m_resultHash)) {
@@ -415,6 +429,7 @@ bool StratumServer::on_submit(StratumClient* client, uint32_t id, const char* jo
 	}
 
 	LOGWARN(4, "client " << static_cast<char*>(client->m_addrString) << " got a share with invalid job id");
+	++m_staleShares[STALE_UNKNOWN_JOB];
 
 	const bool result = send(client,
 		[id](void* buf)
@@ -444,6 +459,11 @@ void StratumServer::reset_share_counters()
 	m_cumulativeHashesAtLastShare = 0;
 	m_cumulativeFoundSharesDiff = 0.0;
 	m_totalFoundShares = 0;
+
+	for (std::atomic<uint32_t>& n : m_staleShares) {
+		n = 0;
+	}
+	m_sharesOnOldTemplates = 0;
 }
 
 void StratumServer::print_stratum_status() const
@@ -491,6 +511,10 @@ void StratumServer::print_stratum_status() const
 		"\nHashrate (24h est) = " << log::Hashrate(hashrate_24h) <<
 		"\nTotal hashes       = " << total_hashes <<
 		"\nShares found       = " << m_totalFoundShares <<
+		"\nStale shares       = " << m_staleShares[STALE_TEMPLATE_EXPIRED] + m_staleShares[STALE_EXPIRED_DURING_CHECK] + m_staleShares[STALE_UNKNOWN_JOB] <<
+			" (expired template " << m_staleShares[STALE_TEMPLATE_EXPIRED] + m_staleShares[STALE_EXPIRED_DURING_CHECK] <<
+			", unknown job " << m_staleShares[STALE_UNKNOWN_JOB].load() <<
+			", accepted on old templates " << m_sharesOnOldTemplates.load() << ')' <<
 		"\nAverage effort     = " << average_effort << '%' <<
 		"\nCurrent effort     = " << static_cast<double>(hashes_since_last_share) * 100.0 / m_pool->side_chain().difficulty().to_double() << '%' <<
 		"\nConnections        = " << m_numConnections << " (" << m_numIncomingConnections << " incoming)"
@@ -527,9 +551,12 @@ void StratumServer::on_blobs_ready()
 
 	const time_t cur_time = time(nullptr);
 	{
-		MutexLock lock2(m_clientsListLock);
+		std::vector<StratumClient*> clients;
+		get_clients(clients, false);
 
-		for (StratumClient* client = static_cast<StratumClient*>(m_connectedClientsList->m_prev); client != m_connectedClientsList; client = static_cast<StratumClient*>(client->m_prev)) {
+		std::sort(clients.begin(), clients.end(), [](const StratumClient* a, const StratumClient* b) { return a->m_connectionSequence < b->m_connectionSequence; });
+
+		for (StratumClient* client : clients) {
 			++numClientsProcessed;
 
 			if (!client->m_rpcId) {
@@ -594,13 +621,10 @@ void StratumServer::on_blobs_ready()
 				client->close();
 			}
 		}
-
-		if (numClientsProcessed != m_numConnections) {
-			LOGWARN(1, "client list is broken, expected " << m_numConnections << ", got " << numClientsProcessed << " clients");
-		}
 	}
 
-	LOGINFO(3, "sent new job to " << extra_nonce << '/' << numClientsProcessed << " clients");
+	const double dt = static_cast<double>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - data->m_onBlockTime).count()) / 1e3;
+	LOGINFO(3, "sent new job to " << extra_nonce << '/' << numClientsProcessed << " clients in " << dt << " ms");
 }
 
 void StratumServer::update_hashrate_data(uint64_t hashes, time_t timestamp)
@@ -666,6 +690,7 @@ void StratumServer::on_share_found(uv_work_t* req)
 		const uint32_t blob_size = pool->block_template().get_hashing_blob(share->m_templateId, share->m_extraNonce, blob, height, difficulty, sidechain_difficulty, seed_hash, nonce_offset);
 		if (!blob_size) {
 			LOGWARN(4, "client " << static_cast<char*>(client->m_addrString) << " got a stale share");
+			++server->m_staleShares[STALE_EXPIRED_DURING_CHECK];
 			share->m_result = SubmittedShare::Result::STALE;
 			return;
 		}
@@ -675,6 +700,10 @@ void StratumServer::on_share_found(uv_work_t* req)
 			nonce >>= 8;
 		}
 
+#ifdef P2POOL_STRATUM_BENCHMARK
+		// Shares from the stratum benchmark have random PoW hashes: skip the check and don't submit them
+		LOGINFO(5, "client " << static_cast<char*>(client->m_addrString) << " submitted a sidechain share at height " << height << ", not checking it");
+#else
 		hash pow_hash;
 		if (!pool->calculate_hash(blob, blob_size, height, seed_hash, pow_hash)) {
 			LOGWARN(3, "client " << static_cast<char*>(client->m_addrString) << " couldn't check share PoW");
@@ -699,6 +728,7 @@ void StratumServer::on_share_found(uv_work_t* req)
 		const std::string& s = client->m_customUser;
 		LOGINFO(0, log::Green() << "SHARE FOUND: mainchain height " << height << ", diff " << sidechain_difficulty << ", client " << static_cast<char*>(client->m_addrString) << (!s.empty() ? " user " : "") << s << ", effort " << effort << '%');
 		pool->submit_sidechain_block(share->m_templateId, share->m_nonce, share->m_extraNonce);
+#endif
 	}
 
 	// Send the response to miner
@@ -709,6 +739,10 @@ void StratumServer::on_share_found(uv_work_t* req)
 		server->update_hashrate_data(hashes, timestamp);
 		server->api_update_local_stats(timestamp);
 		share->m_result = SubmittedShare::Result::OK;
+
+		if (share->m_oldTemplate) {
+			++server->m_sharesOnOldTemplates;
+		}
 	}
 	else {
 		LOGWARN(4, "client " << static_cast<char*>(client->m_addrString) << " got a low diff share");
@@ -776,6 +810,7 @@ void StratumServer::on_after_share_found(uv_work_t* req, int /*status*/)
 StratumServer::StratumClient::StratumClient()
 	: m_rpcId(0)
 	, m_connectedTime(0)
+	, m_connectionSequence(0)
 	, m_jobs{}
 	, m_perConnectionJobId(0)
 	, m_customDiff{}
@@ -793,6 +828,7 @@ void StratumServer::StratumClient::reset()
 	Client::reset();
 	m_rpcId = 0;
 	m_connectedTime = 0;
+	m_connectionSequence = 0;
 	memset(m_jobs, 0, sizeof(m_jobs));
 	m_perConnectionJobId = 0;
 	m_customDiff = {};
@@ -802,12 +838,13 @@ void StratumServer::StratumClient::reset()
 bool StratumServer::StratumClient::on_connect()
 {
 	m_connectedTime = time(nullptr);
+	m_connectionSequence = ++static_cast<StratumServer*>(m_owner)->m_connectionSequence;
 	return true;
 }
 
 bool StratumServer::StratumClient::on_read(char* data, uint32_t size)
 {
-	if ((data != m_readBuf + m_numRead) || (data + size > m_readBuf + sizeof(m_readBuf))) {
+	if ((data != m_readBuf + m_numRead) || (data + size > m_readBuf + m_readBufSize)) {
 		LOGERR(1, "client: invalid data pointer or size in on_read()");
 		ban(DEFAULT_BAN_TIME);
 		return false;
@@ -1048,8 +1085,14 @@ void StratumServer::api_update_local_stats(time_t timestamp)
 	int connections = m_numConnections;
 	int incoming_connections = m_numIncomingConnections;
 
+	const uint32_t stale_unknown_job = m_staleShares[STALE_UNKNOWN_JOB];
+	const uint32_t stale_expired = m_staleShares[STALE_TEMPLATE_EXPIRED];
+	const uint32_t stale_expired_during_check = m_staleShares[STALE_EXPIRED_DURING_CHECK];
+	const uint32_t shares_on_old_templates = m_sharesOnOldTemplates;
+
 	m_pool->api()->set(p2pool_api::Category::LOCAL, "stats",
-		[hashrate_15m, hashrate_1h, hashrate_24h, total_hashes, shares_found, average_effort, current_effort, connections, incoming_connections](log::Stream& s)
+		[hashrate_15m, hashrate_1h, hashrate_24h, total_hashes, shares_found, average_effort, current_effort, connections, incoming_connections,
+		stale_unknown_job, stale_expired, stale_expired_during_check, shares_on_old_templates](log::Stream& s)
 		{
 			s << "{\"hashrate_15m\":" << hashrate_15m
 				<< ",\"hashrate_1h\":" << hashrate_1h
@@ -1060,6 +1103,10 @@ void StratumServer::api_update_local_stats(time_t timestamp)
 				<< ",\"current_effort\":" << current_effort
 				<< ",\"connections\":" << connections
 				<< ",\"incoming_connections\":" << incoming_connections
+				<< ",\"stale_shares\":{\"unknown_job\":" << stale_unknown_job
+				<< ",\"template_expired\":" << stale_expired
+				<< ",\"expired_during_check\":" << stale_expired_during_check
+				<< "},\"shares_on_old_templates\":" << shares_on_old_templates
 				<< "}";
 		});
 }
@@ -27,6 +27,10 @@ class p2pool;
 class BlockTemplate;
 
 static constexpr size_t STRATUM_BUF_SIZE = log::Stream::BUF_SIZE + 1;
+
+// Stratum messages can't be dropped, so the limit is high enough to ride out a miner's socket being full for a while
+static constexpr size_t STRATUM_WRITE_QUEUE_HIGH_WATER_MARK = 64 * 1024;
+static constexpr size_t STRATUM_WRITE_QUEUE_MAX_SIZE = 256 * 1024;
 static constexpr int DEFAULT_STRATUM_PORT = 3333;
 
 class StratumServer : public TCPServer<STRATUM_BUF_SIZE, STRATUM_BUF_SIZE>
@@ -55,14 +59,18 @@ public:
 		uint32_t m_rpcId;
 		time_t m_connectedTime;
 
+		// Clients are ordered by it when new jobs are sent, so only the newest clients can run out of extra_nonce values
+		uint64_t m_connectionSequence;
+
 		uv_mutex_t m_jobsLock;
 
+		// As many jobs as there can be block templates in BlockTemplate history
 		struct SavedJob {
 			uint32_t job_id;
 			uint32_t extra_nonce;
 			uint32_t template_id;
 			uint64_t target;
-		} m_jobs[4];
+		} m_jobs[64];
 
 		uint32_t m_perConnectionJobId;
 		difficulty_type m_customDiff;
@@ -97,6 +105,7 @@ private:
 		uint32_t m_templateId;
 		uint64_t m_height;
 		hash m_seedHash;
+		std::chrono::steady_clock::time_point m_onBlockTime;
 	};
 
 	uv_mutex_t m_blobsQueueLock;
@@ -108,6 +117,9 @@ private:
 
 	std::atomic<uint32_t> m_extraNonce;
 
+	// Only accessed from the event loop thread
+	uint64_t m_connectionSequence;
+
 	uv_mutex_t m_rngLock;
 	std::random_device m_rd;
 	std::mt19937_64 m_rng;
@@ -127,6 +139,7 @@ private:
 		uint64_t m_target;
 		hash m_resultHash;
 		difficulty_type m_sidechainDifficulty;
+		bool m_oldTemplate;
 
 		enum class Result {
 			STALE,
@@ -159,6 +172,21 @@ private:
 	double m_cumulativeFoundSharesDiff;
 	uint32_t m_totalFoundShares;
 
+	enum StaleReason {
+		// Job id is not in the client's saved jobs anymore (or never was)
+		STALE_UNKNOWN_JOB,
+		// Block template was removed from history before the share was submitted
+		STALE_TEMPLATE_EXPIRED,
+		// Block template was removed from history while the share's PoW was being checked
+		STALE_EXPIRED_DURING_CHECK,
+		NUM_STALE_REASONS
+	};
+
+	std::atomic<uint32_t> m_staleShares[NUM_STALE_REASONS];
+
+	// Shares that were accepted for a block template that wasn't the current one anymore
+	std::atomic<uint32_t> m_sharesOnOldTemplates;
+
 	time_t m_apiLastUpdateTime;
 
 	void update_hashrate_data(uint64_t hashes, time_t timestamp);
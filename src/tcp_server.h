@@ -18,6 +18,12 @@
 #pragma once
 
 #include "uv_util.h"
+#include <memory>
+
+#ifdef WITH_IO_URING
+#include "io_uring.h"
+#include <sys/socket.h>
+#endif
 
 namespace p2pool {
 
@@ -26,9 +32,16 @@ class TCPServer : public nocopy_nomove
 {
 public:
 	struct Client;
+	struct WriteBuf;
 	typedef Client* (*allocate_client_callback)();
 
-	explicit TCPServer(allocate_client_callback allocate_new_client);
+	// Small messages sent in the same event loop iteration are coalesced into one write up to this size (or up to the write queue limit if it's smaller)
+	static constexpr size_t COALESCED_WRITE_MAX_SIZE = 64 * 1024;
+
+	// Per-client write queue limits (bytes not yet sent to the socket):
+	// - Above the high-water mark, messages that can be dropped (broadcasts) are dropped
+	// - Above the maximum, the client is too slow and it's disconnected
+	TCPServer(allocate_client_callback allocate_new_client, size_t write_queue_high_water_mark, size_t write_queue_max_size);
 	virtual ~TCPServer();
 
 	template<typename T>
@@ -42,14 +55,25 @@ public:
 
 	uv_loop_t* get_loop() { return &m_loop; }
 
+#ifdef WITH_IO_URING
+	bool io_uring_enabled() const { return m_ioUring != nullptr; }
+#endif
+
 	int listen_port() const { return m_listenPort; }
 
 	bool connect_to_peer(bool is_v6, const raw_ip& ip, int port);
 	virtual void on_connect_failed(bool is_v6, const raw_ip& ip, int port);
 
+	// Called in the event loop thread when the server is shutting down, derived classes close their own handles here
+	virtual void on_shutdown() {}
+
 	void ban(const raw_ip& ip, uint64_t seconds);
 	virtual void print_bans();
 
+	static constexpr uint32_t INVALID_SLOT = std::numeric_limits<uint32_t>::max();
+
+	static constexpr uint32_t SMALL_READ_BUF_SIZE = (READ_BUF_SIZE < 4096) ? static_cast<uint32_t>(READ_BUF_SIZE) : 4096;
+
 	struct Client
 	{
 		Client();
@@ -72,9 +96,8 @@ public:
 
 		TCPServer* m_owner;
 
-		// Used to maintain connected clients list
-		Client* m_prev;
-		Client* m_next;
+		// Index in the connected clients table, INVALID_SLOT if the client is not in the table
+		uint32_t m_slot;
 
 		uv_tcp_t m_socket;
 		uv_connect_t m_connectRequest;
@@ -85,13 +108,27 @@ public:
 		int m_port;
 		char m_addrString[64];
 
+		// Idle connections read into m_smallReadBuf, a full READ_BUF_SIZE buffer is taken from the server's pool
+		// only when a message doesn't fit there, and it's returned as soon as the remaining data fits again
 		bool m_readBufInUse;
-		char m_readBuf[READ_BUF_SIZE];
+		char* m_readBuf;
+		uint32_t m_readBufSize;
 		uint32_t m_numRead;
+		char m_smallReadBuf[SMALL_READ_BUF_SIZE];
 
 		std::atomic<uint32_t> m_resetCounter{ 0 };
 
 		uv_mutex_t m_sendLock;
+
+		// Small messages waiting for the end of the current event loop iteration
+		WriteBuf* m_pendingWrite;
+
+#ifdef WITH_IO_URING
+		// Writes waiting to be sent with io_uring, only the first one is in flight because writes to the same socket can't be reordered
+		WriteBuf* m_uringQueueHead;
+		WriteBuf* m_uringQueueTail;
+		size_t m_uringQueuedBytes;
+#endif
 	};
 
 	struct WriteBuf
@@ -99,6 +136,18 @@ public:
 		Client* m_client = nullptr;
 		uv_write_t m_write = {};
 		std::vector<uint8_t> m_data;
+
+		// Keeps payload segments of a scatter-gather send alive until the write is finished
+		std::shared_ptr<const void> m_payloadOwner;
+
+#ifdef WITH_IO_URING
+		std::vector<iovec> m_iov;
+		size_t m_iovIndex = 0;
+		size_t m_bytesLeft = 0;
+		msghdr m_msg = {};
+		bool m_inFlight = false;
+		WriteBuf* m_next = nullptr;
+#endif
 	};
 
 	uv_mutex_t m_writeBuffersLock;
@@ -123,7 +172,16 @@ public:
 	};
 
 	template<typename T>
-	FORCEINLINE bool send(Client* client, T&& callback) { return send_internal(client, SendCallback<T>(std::move(callback))); }
+	FORCEINLINE bool send(Client* client, T&& callback) { return send_internal(client, SendCallback<T>(std::move(callback)), nullptr, 0, nullptr, false); }
+
+	// Scatter-gather send: the callback writes only the message header, payload segments go to the socket as is, without copying
+	// Payload memory must be owned by "payload_owner", it's released when the write is finished
+	// "can_drop" messages are silently dropped when the client's write queue is above the high-water mark, send() returns false then
+	template<typename T>
+	FORCEINLINE bool send(Client* client, T&& callback, std::initializer_list<uv_buf_t> payload, std::shared_ptr<const void> payload_owner, bool can_drop = false)
+	{
+		return send_internal(client, SendCallback<T>(std::move(callback)), payload.begin(), payload.size(), std::move(payload_owner), can_drop);
+	}
 
 private:
 	static void loop(void* data);
@@ -135,10 +193,53 @@ private:
 
 	bool connect_to_peer_nolock(Client* client, bool is_v6, const sockaddr* addr);
 
-	bool send_internal(Client* client, SendCallbackBase&& callback);
+	bool send_internal(Client* client, SendCallbackBase&& callback, const uv_buf_t* payload, size_t payload_count, std::shared_ptr<const void>&& payload_owner, bool can_drop);
+
+	// Used only in the event loop thread
+	std::vector<uint8_t> m_callbackBuf;
+
+	WriteBuf* get_write_buf();
+	void return_write_buf(WriteBuf* buf);
+
+	// Full size read buffers, used only in the event loop thread
+	std::vector<char*> m_readBuffers;
+	uint64_t m_numReadBuffersAllocated;
+
+	bool grow_read_buf(Client* client);
+	void shrink_read_buf(Client* client);
+
+	// Writes coalesced messages of this client to the socket
+	void flush_pending_write(Client* client);
+
+	// Starts writing "bufs" to the client's socket, "buf" will be returned to the pool when it's done
+	int start_write(Client* client, WriteBuf* buf, const uv_buf_t* bufs, uint32_t num_bufs);
+
+#ifdef WITH_IO_URING
+	// nullptr if io_uring is not available, libuv is used to send data then
+	IoUring* m_ioUring;
+	IoUring* m_failedIoUring;
+	std::vector<Client*> m_uringWaitingClients;
+
+	bool submit_uring_write(Client* client);
+	void release_uring_queue(Client* client);
+	void submit_uring_before_close(Client* client);
+	static void on_uring_write(void* data, uint64_t user_data, int32_t result);
+#endif
+
+	std::vector<Client*> m_clientsWithPendingWrites;
+	uv_check_t m_flushWritesCheck;
+	static void on_flush_writes(uv_check_t* handle);
+
+	uint64_t m_numWrites;
+	uint64_t m_numMessagesSent;
+	uint64_t m_numMessagesDropped;
+	uint64_t m_numSlowClientsDropped;
 
 	allocate_client_callback m_allocateNewClient;
 
+	const size_t m_writeQueueHighWaterMark;
+	const size_t m_writeQueueMaxSize;
+
 	void close_sockets(bool listen_sockets);
 
 	std::vector<uv_tcp_t*> m_listenSockets6;
@@ -156,10 +257,29 @@ protected:
 
 	uv_mutex_t m_clientsListLock;
 	std::vector<Client*> m_preallocatedClients;
-	Client* m_connectedClientsList;
+
+	// Connected clients table, a client keeps its slot until the connection is closed and free slots are reused
+	// m_readyClients has a bit set for every slot where the client has finished the handshake in both directions (P2P)
+	// Stratum doesn't use it: on_blobs_ready() goes through all clients anyway to close the ones which didn't log in
+	std::vector<Client*> m_clientSlots;
+	std::vector<uint32_t> m_freeClientSlots;
+	std::vector<uint64_t> m_readyClients;
+	unordered_map<raw_ip, uint32_t> m_connectionsByIP;
+
 	uint32_t m_numConnections;
 	uint32_t m_numIncomingConnections;
 
+	void add_client_nolock(Client* client);
+	void remove_client_nolock(Client* client);
+
+	void set_client_ready(Client* client);
+	uint32_t get_num_connections_nolock(const raw_ip& ip) const;
+
+	// Copies pointers to connected clients, so they can be iterated without holding m_clientsListLock
+	// Must be used only in the event loop thread: clients are returned to the pool in on_connection_close() which runs there too
+	template<typename T>
+	void get_clients(std::vector<T*>& clients, bool ready_only);
+
 	uv_mutex_t m_bansLock;
 	unordered_map<raw_ip, std::chrono::steady_clock::time_point> m_bans;
 
@@ -179,6 +299,15 @@ protected:
 
 		uv_close(reinterpret_cast<uv_handle_t*>(&server->m_dropConnectionsAsync), nullptr);
 		uv_close(reinterpret_cast<uv_handle_t*>(&server->m_shutdownAsync), nullptr);
+		uv_close(reinterpret_cast<uv_handle_t*>(&server->m_flushWritesCheck), nullptr);
+
+		server->on_shutdown();
+
+#ifdef WITH_IO_URING
+		if (server->m_ioUring) {
+			server->m_ioUring->shutdown();
+		}
+#endif
 	}
 };
 
@@ -22,8 +22,20 @@ static thread_local bool server_event_loop_thread = false;
 namespace p2pool {
 
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
-TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::TCPServer(allocate_client_callback allocate_new_client)
-	: m_allocateNewClient(allocate_new_client)
+TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::TCPServer(allocate_client_callback allocate_new_client, size_t write_queue_high_water_mark, size_t write_queue_max_size)
+	: m_numReadBuffersAllocated(0)
+#ifdef WITH_IO_URING
+	, m_ioUring(nullptr)
+	, m_failedIoUring(nullptr)
+#endif
+	, m_flushWritesCheck{}
+	, m_numWrites(0)
+	, m_numMessagesSent(0)
+	, m_numMessagesDropped(0)
+	, m_numSlowClientsDropped(0)
+	, m_allocateNewClient(allocate_new_client)
+	, m_writeQueueHighWaterMark(write_queue_high_water_mark)
+	, m_writeQueueMaxSize(write_queue_max_size)
 	, m_loopThread{}
 	, m_finished(0)
 	, m_listenPort(-1)
@@ -43,6 +55,23 @@ TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::TCPServer(allocate_client_callback all
 	uv_async_init(&m_loop, &m_shutdownAsync, on_shutdown);
 	m_shutdownAsync.data = this;
 
+	// Runs after all I/O callbacks in every loop iteration, it doesn't keep the loop alive
+	uv_check_init(&m_loop, &m_flushWritesCheck);
+	m_flushWritesCheck.data = this;
+	uv_check_start(&m_flushWritesCheck, on_flush_writes);
+	uv_unref(reinterpret_cast<uv_handle_t*>(&m_flushWritesCheck));
+
+#ifdef WITH_IO_URING
+	m_ioUring = new IoUring();
+	if (!m_ioUring->init(&m_loop, 4096, on_uring_write, this)) {
+		LOGWARN(1, "io_uring is not available, using libuv to send data");
+
+		// init() can leave its poll handle closing in the event loop, so it's deleted only after the loop has stopped
+		m_failedIoUring = m_ioUring;
+		m_ioUring = nullptr;
+	}
+#endif
+
 	uv_mutex_init_checked(&m_clientsListLock);
 	uv_mutex_init_checked(&m_bansLock);
 	uv_mutex_init_checked(&m_pendingConnectionsLock);
@@ -58,9 +87,8 @@ TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::TCPServer(allocate_client_callback all
 		m_preallocatedClients.emplace_back(m_allocateNewClient());
 	}
 
-	m_connectedClientsList = m_allocateNewClient();
-	m_connectedClientsList->m_next = m_connectedClientsList;
-	m_connectedClientsList->m_prev = m_connectedClientsList;
+	m_clientSlots.reserve(DEFAULT_BACKLOG);
+	m_freeClientSlots.reserve(DEFAULT_BACKLOG);
 }
 
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
@@ -71,7 +99,6 @@ TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::~TCPServer()
 		shutdown_tcp();
 	}
 
-	delete m_connectedClientsList;
 }
 
 
@@ -413,9 +440,15 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::close_sockets(bool listen_sockets
 
 	size_t numClosed = 0;
 
-	for (Client* c = m_connectedClientsList->m_next; c != m_connectedClientsList; c = c->m_next) {
+	for (Client* c : m_clientSlots) {
+		if (!c) {
+			continue;
+		}
 		uv_handle_t* h = reinterpret_cast<uv_handle_t*>(&c->m_socket);
 		if (!uv_is_closing(h)) {
+#ifdef WITH_IO_URING
+			submit_uring_before_close(c);
+#endif
 			uv_close(h, on_connection_close);
 			++numClosed;
 		}
@@ -465,10 +498,22 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::shutdown_tcp()
 
 	uv_thread_join(&m_loopThread);
 
+#ifdef WITH_IO_URING
+	delete m_ioUring;
+	m_ioUring = nullptr;
+
+	delete m_failedIoUring;
+	m_failedIoUring = nullptr;
+#endif
+
 	for (Client* c : m_preallocatedClients) {
 		delete c;
 	}
 
+	for (char* buf : m_readBuffers) {
+		delete[] buf;
+	}
+
 	uv_mutex_destroy(&m_clientsListLock);
 	uv_mutex_destroy(&m_bansLock);
 	uv_mutex_destroy(&m_pendingConnectionsLock);
@@ -488,8 +533,17 @@ template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
 void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::print_status()
 {
 	LOGINFO(0, "status" <<
-		"\nConnections = " << m_numConnections << " (" << m_numIncomingConnections << " incoming)"
+		"\nConnections = " << m_numConnections << " (" << m_numIncomingConnections << " incoming)" <<
+		"\nSent        = " << m_numMessagesSent << " messages in " << m_numWrites << " writes" <<
+		"\nDropped     = " << m_numMessagesDropped << " messages, " << m_numSlowClientsDropped << " slow clients" <<
+		"\nRead bufs   = " << m_numReadBuffersAllocated << " allocated, " << m_readBuffers.size() << " free"
 	);
+
+#ifdef WITH_IO_URING
+	if (m_ioUring) {
+		LOGINFO(0, "io_uring: " << m_ioUring->num_requests() << " requests in " << m_ioUring->num_submit_calls() << " system calls, " << m_ioUring->num_in_flight() << " in flight");
+	}
+#endif
 }
 
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
@@ -526,68 +580,531 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::print_bans()
 }
 
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
-bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::send_internal(Client* client, SendCallbackBase&& callback)
+typename TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::WriteBuf* TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::get_write_buf()
+{
+	{
+		MutexLock lock(m_writeBuffersLock);
+		if (!m_writeBuffers.empty()) {
+			WriteBuf* buf = m_writeBuffers.back();
+			m_writeBuffers.pop_back();
+			return buf;
+		}
+	}
+
+	return new WriteBuf();
+}
+
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::return_write_buf(WriteBuf* buf)
+{
+	buf->m_payloadOwner.reset();
+
+	MutexLock lock(m_writeBuffersLock);
+	m_writeBuffers.push_back(buf);
+}
+
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::add_client_nolock(Client* client)
+{
+	uint32_t slot;
+
+	if (!m_freeClientSlots.empty()) {
+		slot = m_freeClientSlots.back();
+		m_freeClientSlots.pop_back();
+		m_clientSlots[slot] = client;
+	}
+	else {
+		slot = static_cast<uint32_t>(m_clientSlots.size());
+		m_clientSlots.push_back(client);
+		if (m_readyClients.size() * 64 < m_clientSlots.size()) {
+			m_readyClients.push_back(0);
+		}
+	}
+
+	client->m_slot = slot;
+	++m_connectionsByIP[client->m_addr];
+}
+
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::remove_client_nolock(Client* client)
+{
+	const uint32_t slot = client->m_slot;
+	if (slot == INVALID_SLOT) {
+		return;
+	}
+
+	if ((slot >= m_clientSlots.size()) || (m_clientSlots[slot] != client)) {
+		LOGERR(1, "internal error: client " << static_cast<char*>(client->m_addrString) << " has invalid slot " << slot);
+		return;
+	}
+
+	m_clientSlots[slot] = nullptr;
+	m_freeClientSlots.push_back(slot);
+	m_readyClients[slot / 64] &= ~(1ULL << (slot % 64));
+
+	auto it = m_connectionsByIP.find(client->m_addr);
+	if (it != m_connectionsByIP.end()) {
+		if (--it->second == 0) {
+			m_connectionsByIP.erase(it);
+		}
+	}
+
+	client->m_slot = INVALID_SLOT;
+}
+
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::set_client_ready(Client* client)
+{
+	MutexLock lock(m_clientsListLock);
+
+	const uint32_t slot = client->m_slot;
+	if ((slot < m_clientSlots.size()) && (m_clientSlots[slot] == client)) {
+		m_readyClients[slot / 64] |= (1ULL << (slot % 64));
+	}
+}
+
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+uint32_t TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::get_num_connections_nolock(const raw_ip& ip) const
+{
+	auto it = m_connectionsByIP.find(ip);
+	return (it != m_connectionsByIP.end()) ? it->second : 0;
+}
+
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+template<typename T>
+void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::get_clients(std::vector<T*>& clients, bool ready_only)
 {
 	if (!server_event_loop_thread) {
-		LOGERR(1, "sending data from another thread, this is not thread safe");
+		LOGERR(1, "getting clients list from another thread, this is not thread safe");
 	}
 
-	MutexLock lock0(client->m_sendLock);
+	clients.clear();
 
-	WriteBuf* buf = nullptr;
+	MutexLock lock(m_clientsListLock);
 
-	{
-		MutexLock lock(m_writeBuffersLock);
-		if (!m_writeBuffers.empty()) {
-			buf = m_writeBuffers.back();
-			m_writeBuffers.pop_back();
+	if (!ready_only) {
+		clients.reserve(m_numConnections);
+		for (Client* client : m_clientSlots) {
+			if (client) {
+				clients.push_back(static_cast<T*>(client));
+			}
 		}
+		return;
 	}
 
-	if (!buf) {
-		buf = new WriteBuf();
+	for (size_t i = 0, n = m_readyClients.size(); i < n; ++i) {
+		uint64_t mask = m_readyClients[i];
+		for (size_t j = i * 64; mask; ++j, mask >>= 1) {
+			if (mask & 1) {
+				clients.push_back(static_cast<T*>(m_clientSlots[j]));
+			}
+		}
+	}
+}
+
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::grow_read_buf(Client* client)
+{
+	if (client->m_readBufSize >= READ_BUF_SIZE) {
+		return false;
+	}
+
+	char* buf;
+	if (!m_readBuffers.empty()) {
+		buf = m_readBuffers.back();
+		m_readBuffers.pop_back();
+	}
+	else {
+		buf = new char[READ_BUF_SIZE];
+		++m_numReadBuffersAllocated;
+	}
+
+	memcpy(buf, client->m_readBuf, client->m_numRead);
+
+	client->m_readBuf = buf;
+	client->m_readBufSize = static_cast<uint32_t>(READ_BUF_SIZE);
+
+	return true;
+}
+
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::shrink_read_buf(Client* client)
+{
+	char* buf = client->m_readBuf;
+	if ((buf == client->m_smallReadBuf) || (client->m_numRead > SMALL_READ_BUF_SIZE)) {
+		return;
+	}
+
+	memcpy(client->m_smallReadBuf, buf, client->m_numRead);
+
+	client->m_readBuf = client->m_smallReadBuf;
+	client->m_readBufSize = SMALL_READ_BUF_SIZE;
+
+	// Don't keep more spare buffers than it's needed to handle a burst of big messages from all preallocated clients
+	if (m_readBuffers.size() < DEFAULT_BACKLOG) {
+		m_readBuffers.push_back(buf);
+	}
+	else {
+		delete[] buf;
+		--m_numReadBuffersAllocated;
 	}
+}
 
-	// callback_buf is used in only 1 thread, so it's safe
-	static uint8_t callback_buf[WRITE_BUF_SIZE];
-	const size_t bytes_written = callback(callback_buf);
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::send_internal(Client* client, SendCallbackBase&& callback, const uv_buf_t* payload, size_t payload_count, std::shared_ptr<const void>&& payload_owner, bool can_drop)
+{
+	if (!server_event_loop_thread) {
+		LOGERR(1, "sending data from another thread, this is not thread safe");
+	}
+
+	MutexLock lock0(client->m_sendLock);
+
+	if (m_callbackBuf.empty()) {
+		m_callbackBuf.resize(WRITE_BUF_SIZE);
+	}
+
+	const size_t bytes_written = callback(m_callbackBuf.data());
+
+	size_t payload_size = 0;
+	for (size_t i = 0; i < payload_count; ++i) {
+		payload_size += payload[i].len;
+	}
 
 	if (bytes_written > WRITE_BUF_SIZE) {
 		LOGERR(0, "send callback wrote " << bytes_written << " bytes, expected no more than " << WRITE_BUF_SIZE << " bytes");
 		panic();
 	}
 
-	if (bytes_written == 0) {
+	const size_t message_size = bytes_written + payload_size;
+
+	if (message_size > WRITE_BUF_SIZE) {
+		LOGERR(1, "trying to send " << message_size << " bytes, the limit is " << WRITE_BUF_SIZE << " bytes");
+		return false;
+	}
+
+	if (message_size == 0) {
 		LOGWARN(1, "send callback wrote 0 bytes, nothing to do");
-		{
-			MutexLock lock(m_writeBuffersLock);
-			m_writeBuffers.push_back(buf);
+		return true;
+	}
+
+	// Backpressure: libuv keeps the bytes it couldn't write to the socket yet in the write queue
+	size_t queued = client->m_socket.write_queue_size + (client->m_pendingWrite ? client->m_pendingWrite->m_data.size() : 0);
+#ifdef WITH_IO_URING
+	queued += client->m_uringQueuedBytes;
+#endif
+
+	if (queued + message_size > m_writeQueueMaxSize) {
+		LOGWARN(4, "client " << static_cast<const char*>(client->m_addrString) << " is too slow (" << queued << " bytes queued), disconnecting");
+		++m_numSlowClientsDropped;
+
+		// Nothing will be sent to this client anymore, and close() must not try to flush it (m_sendLock is already locked here)
+		if (client->m_pendingWrite) {
+			return_write_buf(client->m_pendingWrite);
+			client->m_pendingWrite = nullptr;
+		}
+
+		client->close();
+		return false;
+	}
+
+	if (can_drop && (queued + message_size > m_writeQueueHighWaterMark)) {
+		LOGINFO(5, "client " << static_cast<const char*>(client->m_addrString) << " has " << queued << " bytes queued, dropping a message");
+		++m_numMessagesDropped;
+		return false;
+	}
+
+	++m_numMessagesSent;
+
+	// Small messages without payload are coalesced and written in on_flush_writes() at the end of this loop iteration
+	if (payload_count == 0) {
+		WriteBuf* buf = client->m_pendingWrite;
+		const size_t coalesced_max_size = (m_writeQueueMaxSize < COALESCED_WRITE_MAX_SIZE) ? m_writeQueueMaxSize : COALESCED_WRITE_MAX_SIZE;
+		if (buf && (buf->m_data.size() + bytes_written > coalesced_max_size)) {
+			flush_pending_write(client);
+			buf = nullptr;
+		}
+
+		if (!buf) {
+			buf = get_write_buf();
+			buf->m_client = client;
+			buf->m_write.data = buf;
+			buf->m_data.clear();
+			buf->m_data.reserve(round_up(bytes_written, 64));
+			client->m_pendingWrite = buf;
+			m_clientsWithPendingWrites.push_back(client);
 		}
+
+		buf->m_data.insert(buf->m_data.end(), m_callbackBuf.data(), m_callbackBuf.data() + bytes_written);
 		return true;
 	}
 
+	// Keep the order of messages
+	flush_pending_write(client);
+
+	WriteBuf* buf = get_write_buf();
+
 	buf->m_client = client;
 	buf->m_write.data = buf;
 	buf->m_data.reserve(round_up(bytes_written, 64));
-	buf->m_data.assign(callback_buf, callback_buf + bytes_written);
+	buf->m_data.assign(m_callbackBuf.data(), m_callbackBuf.data() + bytes_written);
+	buf->m_payloadOwner = std::move(payload_owner);
+
+	// libuv copies the array of buffers, only the memory they point to must stay valid
+	uv_buf_t bufs_local[4];
+	std::vector<uv_buf_t> bufs_heap;
+
+	uv_buf_t* bufs = bufs_local;
+	if (payload_count + 1 > array_size(bufs_local)) {
+		bufs_heap.resize(payload_count + 1);
+		bufs = bufs_heap.data();
+	}
+
+	uint32_t num_bufs = 0;
+
+	if (bytes_written) {
+		bufs[num_bufs++] = uv_buf_init(reinterpret_cast<char*>(buf->m_data.data()), static_cast<uint32_t>(bytes_written));
+	}
+
+	for (size_t i = 0; i < payload_count; ++i) {
+		if (payload[i].len) {
+			bufs[num_bufs++] = payload[i];
+		}
+	}
+
+	const int err = start_write(client, buf, bufs, num_bufs);
+	if (err) {
+		return_write_buf(buf);
+		LOGWARN(1, "failed to start writing data to client connection " << static_cast<const char*>(client->m_addrString) << ", error " << uv_err_name(err));
+		return false;
+	}
+
+	return true;
+}
+
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::flush_pending_write(Client* client)
+{
+	WriteBuf* buf = client->m_pendingWrite;
+	if (!buf) {
+		return;
+	}
+
+	client->m_pendingWrite = nullptr;
 
 	uv_buf_t bufs[1];
 	bufs[0].base = reinterpret_cast<char*>(buf->m_data.data());
-	bufs[0].len = static_cast<int>(bytes_written);
+	bufs[0].len = static_cast<uint32_t>(buf->m_data.size());
 
-	const int err = uv_write(&buf->m_write, reinterpret_cast<uv_stream_t*>(&client->m_socket), bufs, 1, Client::on_write);
+	const int err = start_write(client, buf, bufs, 1);
 	if (err) {
-		{
-			MutexLock lock(m_writeBuffersLock);
-			m_writeBuffers.push_back(buf);
-		}
+		return_write_buf(buf);
 		LOGWARN(1, "failed to start writing data to client connection " << static_cast<const char*>(client->m_addrString) << ", error " << uv_err_name(err));
+	}
+}
+
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::on_flush_writes(uv_check_t* handle)
+{
+	TCPServer* server = reinterpret_cast<TCPServer*>(handle->data);
+
+	if (!server->m_clientsWithPendingWrites.empty()) {
+		// flush_pending_write() can't add new clients to the list, so it's safe to iterate over it
+		for (Client* client : server->m_clientsWithPendingWrites) {
+			MutexLock lock(client->m_sendLock);
+			server->flush_pending_write(client);
+		}
+
+		server->m_clientsWithPendingWrites.clear();
+	}
+
+#ifdef WITH_IO_URING
+	if (server->m_ioUring) {
+		// All writes from this loop iteration go to the kernel in one system call
+		server->m_ioUring->submit();
+	}
+#endif
+}
+
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+int TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::start_write(Client* client, WriteBuf* buf, const uv_buf_t* bufs, uint32_t num_bufs)
+{
+	++m_numWrites;
+
+#ifdef WITH_IO_URING
+	if (m_ioUring) {
+		if (uv_is_closing(reinterpret_cast<uv_handle_t*>(&client->m_socket))) {
+			return UV_ECANCELED;
+		}
+
+		buf->m_iov.resize(num_bufs);
+		buf->m_iovIndex = 0;
+		buf->m_bytesLeft = 0;
+
+		for (uint32_t i = 0; i < num_bufs; ++i) {
+			buf->m_iov[i].iov_base = bufs[i].base;
+			buf->m_iov[i].iov_len = bufs[i].len;
+			buf->m_bytesLeft += bufs[i].len;
+		}
+
+		buf->m_inFlight = false;
+		buf->m_next = nullptr;
+
+		client->m_uringQueuedBytes += buf->m_bytesLeft;
+
+		if (client->m_uringQueueTail) {
+			client->m_uringQueueTail->m_next = buf;
+			client->m_uringQueueTail = buf;
+			return 0;
+		}
+
+		client->m_uringQueueHead = buf;
+		client->m_uringQueueTail = buf;
+
+		if (!submit_uring_write(client)) {
+			// Too many requests in flight, try again after the next completion
+			m_uringWaitingClients.push_back(client);
+		}
+		return 0;
+	}
+#endif
+
+	return uv_write(&buf->m_write, reinterpret_cast<uv_stream_t*>(&client->m_socket), bufs, num_bufs, Client::on_write);
+}
+
+#ifdef WITH_IO_URING
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::submit_uring_write(Client* client)
+{
+	WriteBuf* buf = client->m_uringQueueHead;
+	if (!buf || buf->m_inFlight) {
+		return true;
+	}
+
+	uv_os_fd_t fd;
+	if (uv_fileno(reinterpret_cast<uv_handle_t*>(&client->m_socket), &fd) != 0) {
+		return true;
+	}
+
+	buf->m_msg = {};
+	buf->m_msg.msg_iov = buf->m_iov.data() + buf->m_iovIndex;
+	buf->m_msg.msg_iovlen = buf->m_iov.size() - buf->m_iovIndex;
+
+	if (!m_ioUring->sendmsg(fd, &buf->m_msg, reinterpret_cast<uint64_t>(buf))) {
 		return false;
 	}
 
+	buf->m_inFlight = true;
 	return true;
 }
 
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::release_uring_queue(Client* client)
+{
+	WriteBuf* buf = client->m_uringQueueHead;
+
+	while (buf) {
+		WriteBuf* next = buf->m_next;
+
+		// The kernel still owns this one, on_uring_write() will return it to the pool
+		if (!buf->m_inFlight) {
+			return_write_buf(buf);
+		}
+
+		buf = next;
+	}
+
+	client->m_uringQueueHead = nullptr;
+	client->m_uringQueueTail = nullptr;
+	client->m_uringQueuedBytes = 0;
+}
+
+// uv_close() closes the socket immediately and its file descriptor can be reused by a new connection right away (on any thread),
+// so requests queued for it must go to the kernel first. If they can't be submitted now, they fail instead of writing to the wrong socket
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::submit_uring_before_close(Client* client)
+{
+	if (!m_ioUring || m_ioUring->submit()) {
+		return;
+	}
+
+	uv_os_fd_t fd;
+	if (uv_fileno(reinterpret_cast<uv_handle_t*>(&client->m_socket), &fd) == 0) {
+		m_ioUring->fail_queued(fd);
+	}
+}
+
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::on_uring_write(void* data, uint64_t user_data, int32_t result)
+{
+	TCPServer* server = reinterpret_cast<TCPServer*>(data);
+	WriteBuf* buf = reinterpret_cast<WriteBuf*>(user_data);
+	Client* client = buf->m_client;
+
+	buf->m_inFlight = false;
+
+	if (client->m_uringQueueHead != buf) {
+		// The connection was closed while this write was in flight
+		server->return_write_buf(buf);
+	}
+	else if (result < 0) {
+		LOGWARN(5, "client " << static_cast<const char*>(client->m_addrString) << " failed to write data to client connection, error " << -result);
+		server->release_uring_queue(client);
+		client->close();
+	}
+	else {
+		size_t n = static_cast<size_t>(result);
+		n = std::min(n, buf->m_bytesLeft);
+
+		buf->m_bytesLeft -= n;
+		client->m_uringQueuedBytes -= n;
+
+		if (buf->m_bytesLeft > 0) {
+			// Partial write, send the rest
+			while (n > 0) {
+				iovec& v = buf->m_iov[buf->m_iovIndex];
+				if (n >= v.iov_len) {
+					n -= v.iov_len;
+					++buf->m_iovIndex;
+				}
+				else {
+					v.iov_base = reinterpret_cast<uint8_t*>(v.iov_base) + n;
+					v.iov_len -= n;
+					n = 0;
+				}
+			}
+		}
+		else {
+			client->m_uringQueueHead = buf->m_next;
+			if (!client->m_uringQueueHead) {
+				client->m_uringQueueTail = nullptr;
+			}
+			server->return_write_buf(buf);
+		}
+
+		if (uv_is_closing(reinterpret_cast<uv_handle_t*>(&client->m_socket))) {
+			// The socket is already closed, nothing else can be sent
+			server->release_uring_queue(client);
+		}
+		else if (!server->submit_uring_write(client)) {
+			server->m_uringWaitingClients.push_back(client);
+		}
+	}
+
+	// One request has completed, so there is space for at least one waiting client
+	std::vector<Client*>& waiting = server->m_uringWaitingClients;
+	if (!waiting.empty()) {
+		size_t i = 0;
+		for (; i < waiting.size(); ++i) {
+			Client* c = waiting[i];
+			if (!uv_is_closing(reinterpret_cast<uv_handle_t*>(&c->m_socket)) && !server->submit_uring_write(c)) {
+				break;
+			}
+		}
+		waiting.erase(waiting.begin(), waiting.begin() + i);
+	}
+}
+#endif
+
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
 void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::loop(void* data)
 {
@@ -630,15 +1147,22 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::on_connection_close(uv_handle_t*
 	if (owner) {
 		MutexLock lock(owner->m_clientsListLock);
 
-		Client* prev_in_list = client->m_prev;
-		Client* next_in_list = client->m_next;
-
 		const bool is_incoming = client->m_isIncoming;
 
-		client->reset();
+		if (client->m_pendingWrite) {
+			owner->return_write_buf(client->m_pendingWrite);
+			client->m_pendingWrite = nullptr;
+		}
+
+		client->m_numRead = 0;
+		owner->shrink_read_buf(client);
 
-		prev_in_list->m_next = next_in_list;
-		next_in_list->m_prev = prev_in_list;
+#ifdef WITH_IO_URING
+		owner->release_uring_queue(client);
+#endif
+
+		owner->remove_client_nolock(client);
+		client->reset();
 
 		owner->m_preallocatedClients.push_back(client);
 
@@ -738,11 +1262,6 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::on_new_client(uv_stream_t* server
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
 void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::on_new_client_nolock(uv_stream_t* server, Client* client)
 {
-	client->m_prev = m_connectedClientsList;
-	client->m_next = m_connectedClientsList->m_next;
-	m_connectedClientsList->m_next->m_prev = client;
-	m_connectedClientsList->m_next = client;
-
 	++m_numConnections;
 	client->m_isIncoming = false;
 
@@ -778,6 +1297,8 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::on_new_client_nolock(uv_stream_t*
 
 	client->init_addr_string(is_v6, &peer_addr);
 
+	add_client_nolock(client);
+
 	if (server) {
 		LOGINFO(5, "new connection from " << log::Gray() << static_cast<char*>(client->m_addrString));
 		client->m_isIncoming = true;
@@ -813,7 +1334,7 @@ TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::Client::Client()
 
 	uv_mutex_init_checked(&m_sendLock);
 
-	m_readBuf[0] = '\0';
+	m_smallReadBuf[0] = '\0';
 }
 
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
@@ -828,8 +1349,7 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::Client::reset()
 	m_resetCounter.fetch_add(1);
 
 	m_owner = nullptr;
-	m_prev = nullptr;
-	m_next = nullptr;
+	m_slot = INVALID_SLOT;
 	memset(&m_socket, 0, sizeof(m_socket));
 	memset(&m_connectRequest, 0, sizeof(m_connectRequest));
 	m_isV6 = false;
@@ -838,7 +1358,16 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::Client::reset()
 	m_port = -1;
 	m_addrString[0] = '\0';
 	m_readBufInUse = false;
+	m_readBuf = m_smallReadBuf;
+	m_readBufSize = SMALL_READ_BUF_SIZE;
 	m_numRead = 0;
+	m_pendingWrite = nullptr;
+
+#ifdef WITH_IO_URING
+	m_uringQueueHead = nullptr;
+	m_uringQueueTail = nullptr;
+	m_uringQueuedBytes = 0;
+#endif
 }
 
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
@@ -853,14 +1382,14 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::Client::on_alloc(uv_handle_t* han
 		return;
 	}
 
-	if (pThis->m_numRead >= sizeof(pThis->m_readBuf)) {
+	if ((pThis->m_numRead >= pThis->m_readBufSize) && (!pThis->m_owner || !pThis->m_owner->grow_read_buf(pThis))) {
 		LOGWARN(4, "client " << static_cast<const char*>(pThis->m_addrString) << " read buffer is full");
 		buf->len = 0;
 		buf->base = nullptr;
 		return;
 	}
 
-	buf->len = sizeof(pThis->m_readBuf) - pThis->m_numRead;
+	buf->len = pThis->m_readBufSize - pThis->m_numRead;
 	buf->base = pThis->m_readBuf + pThis->m_numRead;
 	pThis->m_readBufInUse = true;
 }
@@ -876,6 +1405,9 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::Client::on_read(uv_stream_t* stre
 			if (!pThis->on_read(buf->base, static_cast<uint32_t>(nread))) {
 				pThis->close();
 			}
+			else {
+				pThis->m_owner->shrink_read_buf(pThis);
+			}
 		}
 	}
 	else if (nread < 0) {
@@ -899,8 +1431,10 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::Client::on_write(uv_write_t* req,
 	TCPServer* server = client->m_owner;
 
 	if (server) {
-		MutexLock lock(server->m_writeBuffersLock);
-		server->m_writeBuffers.push_back(buf);
+		server->return_write_buf(buf);
+	}
+	else {
+		buf->m_payloadOwner.reset();
 	}
 
 	if (status != 0) {
@@ -917,6 +1451,16 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::Client::close()
 		return;
 	}
 
+	// Messages sent right before closing the connection still have a chance to go out
+	if (m_pendingWrite) {
+		MutexLock lock(m_sendLock);
+		m_owner->flush_pending_write(this);
+	}
+
+#ifdef WITH_IO_URING
+	m_owner->submit_uring_before_close(this);
+#endif
+
 	uv_read_stop(reinterpret_cast<uv_stream_t*>(&m_socket));
 
 	uv_tcp_t* s = &m_socket;
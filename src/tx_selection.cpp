@@ -0,0 +1,331 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "tx_selection.h"
+#include <chrono>
+
+static constexpr char log_category_prefix[] = "TxSelection ";
+
+namespace p2pool {
+
+uint64_t get_block_reward(uint64_t base_reward, uint64_t median_weight, uint64_t fees, uint64_t weight)
+{
+	if (weight <= median_weight) {
+		return base_reward + fees;
+	}
+
+	if (weight > median_weight * 2) {
+		return 0;
+	}
+
+	// This will overflow if median_weight >= 2^32
+	// Maybe fix it later like in Monero code, but it'll be fiiiine for now...
+	// Performance of this code is more important
+
+	uint64_t product[2];
+	product[0] = umul128(base_reward, (median_weight * 2 - weight) * weight, &product[1]);
+
+	uint64_t rem;
+	uint64_t reward = udiv128(product[1], product[0], median_weight * median_weight, &rem);
+
+	return reward + fees;
+}
+
+static FORCEINLINE bool higher_fee_per_byte(const TxMempoolData& tx_a, const TxMempoolData& tx_b)
+{
+	return tx_a.fee * tx_b.weight > tx_b.fee * tx_a.weight;
+}
+
+void select_transactions_greedy(const std::vector<TxMempoolData>& txs, uint64_t base_reward, uint64_t median_weight, uint64_t miner_tx_weight, TxSelection& result)
+{
+	std::vector<int>& order = result.txs;
+
+	order.resize(txs.size());
+	for (size_t i = 0; i < txs.size(); ++i) {
+		order[i] = static_cast<int>(i);
+	}
+
+	uint64_t total_tx_weight = 0;
+	for (const TxMempoolData& tx : txs) {
+		total_tx_weight += tx.weight;
+	}
+
+	// if a block doesn't get into the penalty zone, just pick all transactions
+	if (total_tx_weight + miner_tx_weight <= median_weight) {
+		result.fees = 0;
+		result.weight = miner_tx_weight;
+
+		for (const TxMempoolData& tx : txs) {
+			result.fees += tx.fee;
+			result.weight += tx.weight;
+		}
+
+		result.reward = base_reward + result.fees;
+		return;
+	}
+
+	// Picking all transactions will result in the base reward penalty
+	// Use a heuristic algorithm to pick transactions and get the maximum possible reward
+	// Testing has shown that this algorithm is very close to the optimal selection
+	// Usually no more than 0.5 micronero away from the optimal discrete knapsack solution
+	// Sometimes it even finds the optimal solution
+
+	// Sort all transactions by fee per byte (highest to lowest)
+	std::sort(order.begin(), order.end(), [&txs](int a, int b) { return higher_fee_per_byte(txs[a], txs[b]); });
+
+	uint64_t final_reward = base_reward;
+	uint64_t final_fees = 0;
+	uint64_t final_weight = miner_tx_weight;
+
+	for (int i = 0; i < static_cast<int>(order.size());) {
+		const TxMempoolData& tx = txs[order[i]];
+
+		int k = -1;
+
+		const uint64_t reward = get_block_reward(base_reward, median_weight, final_fees + tx.fee, final_weight + tx.weight);
+		if (reward > final_reward) {
+			// If simply adding this transaction increases the reward, remember it
+			final_reward = reward;
+			k = i;
+		}
+
+		// Try replacing other transactions when we are above the limit
+		if (final_weight + tx.weight > median_weight) {
+			for (int j = 0; j < i; ++j) {
+				const TxMempoolData& prev_tx = txs[order[j]];
+				const uint64_t reward2 = get_block_reward(base_reward, median_weight, final_fees + tx.fee - prev_tx.fee, final_weight + tx.weight - prev_tx.weight);
+				if (reward2 > final_reward) {
+					// If replacing some other transaction increases the reward even more, remember it
+					// And keep trying to replace other transactions
+					final_reward = reward2;
+					k = j;
+				}
+			}
+		}
+
+		if (k == i) {
+			// Simply adding this tx improves the reward
+			final_fees += tx.fee;
+			final_weight += tx.weight;
+			++i;
+			continue;
+		}
+
+		if (k >= 0) {
+			// Replacing another tx with this tx improves the reward
+			const TxMempoolData& prev_tx = txs[order[k]];
+			final_fees += tx.fee - prev_tx.fee;
+			final_weight += tx.weight - prev_tx.weight;
+		}
+
+		order.erase(order.begin() + ((k >= 0) ? k : i));
+	}
+
+	result.fees = 0;
+	result.weight = miner_tx_weight;
+
+	for (int i : order) {
+		result.fees += txs[i].fee;
+		result.weight += txs[i].weight;
+	}
+
+	result.reward = get_block_reward(base_reward, median_weight, result.fees, result.weight);
+
+	if (result.reward < base_reward) {
+		LOGERR(1, "final_reward < base_reward, this should never happen. Fix the code!");
+	}
+}
+
+namespace {
+
+class TxSelectionSearch
+{
+public:
+	TxSelectionSearch(const std::vector<TxMempoolData>& txs, uint64_t base_reward, uint64_t median_weight, uint64_t miner_tx_weight)
+		: m_txs(txs)
+		, m_baseReward(base_reward)
+		, m_medianWeight(median_weight)
+		, m_minerTxWeight(miner_tx_weight)
+		, m_baseRewardD(static_cast<double>(base_reward))
+		, m_medianWeightD(static_cast<double>(median_weight))
+	{
+		// Transactions that don't fit even in an empty block can never be selected
+		m_order.reserve(txs.size());
+		for (size_t i = 0; i < txs.size(); ++i) {
+			if (miner_tx_weight + txs[i].weight <= median_weight * 2) {
+				m_order.push_back(static_cast<int>(i));
+			}
+		}
+
+		std::sort(m_order.begin(), m_order.end(), [&txs](int a, int b) { return higher_fee_per_byte(txs[a], txs[b]); });
+
+		// For every transaction, the block weight above which adding even a fraction of it
+		// can't increase the reward because the penalty grows faster than the fees
+		// d(reward)/d(weight) = fee_per_byte + base_reward * 2 * (median_weight - weight) / median_weight^2
+		m_density.resize(m_order.size());
+		m_cutoffWeight.resize(m_order.size());
+		for (size_t i = 0; i < m_order.size(); ++i) {
+			const TxMempoolData& tx = txs[m_order[i]];
+			const double density = static_cast<double>(tx.fee) / static_cast<double>(tx.weight);
+			const double cutoff = m_medianWeightD + density * m_medianWeightD * m_medianWeightD / (m_baseRewardD * 2.0);
+
+			m_density[i] = density;
+			m_cutoffWeight[i] = std::min(cutoff, m_medianWeightD * 2.0);
+		}
+	}
+
+	bool run(uint64_t time_limit_ms, TxSelection& result)
+	{
+		using namespace std::chrono;
+
+		const steady_clock::time_point deadline = steady_clock::now() + milliseconds(time_limit_ms);
+
+		const int n = static_cast<int>(m_order.size());
+		const uint64_t max_weight = m_medianWeight * 2;
+
+		uint64_t best_reward = result.reward;
+
+		const uint64_t empty_block_reward = get_block_reward(m_baseReward, m_medianWeight, 0, m_minerTxWeight);
+		if (empty_block_reward > best_reward) {
+			best_reward = empty_block_reward;
+			result.reward = empty_block_reward;
+			result.fees = 0;
+			result.weight = m_minerTxWeight;
+			result.txs.clear();
+		}
+
+		// Depth-first search, always trying to include the next transaction first
+		// "path" contains positions (in m_order) of currently included transactions
+		std::vector<int> path;
+		path.reserve(n);
+
+		uint64_t fees = 0;
+		uint64_t weight = m_minerTxWeight;
+		uint64_t num_nodes = 0;
+		int i = 0;
+
+		for (;;) {
+			while (i < n) {
+				if (((++num_nodes & 255) == 0) && (steady_clock::now() >= deadline)) {
+					LOGINFO(5, "search timed out after " << num_nodes << " nodes");
+					return false;
+				}
+
+				// The reward is an integer (rounded down), so an upper bound below best_reward + 1 means there is nothing to improve in this branch
+				if (calc_upper_bound(i, fees, weight) < static_cast<double>(best_reward) + 1.0) {
+					break;
+				}
+
+				const TxMempoolData& tx = m_txs[m_order[i]];
+				if (weight + tx.weight <= max_weight) {
+					fees += tx.fee;
+					weight += tx.weight;
+					path.push_back(i);
+
+					const uint64_t reward = get_block_reward(m_baseReward, m_medianWeight, fees, weight);
+					if (reward > best_reward) {
+						best_reward = reward;
+						result.reward = reward;
+						result.fees = fees;
+						result.weight = weight;
+						result.txs.clear();
+						for (int k : path) {
+							result.txs.push_back(m_order[k]);
+						}
+					}
+				}
+				++i;
+			}
+
+			// Backtrack: exclude the last included transaction and continue from the next one
+			if (path.empty()) {
+				break;
+			}
+
+			const int k = path.back();
+			path.pop_back();
+
+			const TxMempoolData& tx = m_txs[m_order[k]];
+			fees -= tx.fee;
+			weight -= tx.weight;
+			i = k + 1;
+		}
+
+		LOGINFO(5, "search finished after " << num_nodes << " nodes");
+		return true;
+	}
+
+private:
+	// Continuous relaxation: transactions can be taken partially, and the base reward penalty is a smooth concave function of weight
+	// The sum of two concave functions is concave, so following transactions in fee-per-byte order until the marginal gain becomes negative gives the maximum
+	double calc_upper_bound(int i, uint64_t fees, uint64_t weight) const
+	{
+		double f = static_cast<double>(fees);
+		double w = static_cast<double>(weight);
+
+		for (int n = static_cast<int>(m_order.size()); i < n; ++i) {
+			const double cutoff = m_cutoffWeight[i];
+			if (w >= cutoff) {
+				break;
+			}
+
+			const double tx_weight = static_cast<double>(m_txs[m_order[i]].weight);
+			const double x = std::min(tx_weight, cutoff - w);
+
+			f += m_density[i] * x;
+			w += x;
+
+			if (x < tx_weight) {
+				break;
+			}
+		}
+
+		if (w <= m_medianWeightD) {
+			return m_baseRewardD + f;
+		}
+
+		return m_baseRewardD * (m_medianWeightD * 2.0 - w) * w / (m_medianWeightD * m_medianWeightD) + f;
+	}
+
+	const std::vector<TxMempoolData>& m_txs;
+
+	uint64_t m_baseReward;
+	uint64_t m_medianWeight;
+	uint64_t m_minerTxWeight;
+
+	double m_baseRewardD;
+	double m_medianWeightD;
+
+	std::vector<int> m_order;
+	std::vector<double> m_density;
+	std::vector<double> m_cutoffWeight;
+};
+
+} // namespace
+
+bool select_transactions_optimal(const std::vector<TxMempoolData>& txs, uint64_t base_reward, uint64_t median_weight, uint64_t miner_tx_weight, uint64_t time_limit_ms, TxSelection& result)
+{
+	if (!median_weight || !base_reward) {
+		return false;
+	}
+
+	TxSelectionSearch search(txs, base_reward, median_weight, miner_tx_weight);
+	return search.run(time_limit_ms, result);
+}
+
+} // namespace p2pool
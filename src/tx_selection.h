@@ -0,0 +1,47 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+namespace p2pool {
+
+uint64_t get_block_reward(uint64_t base_reward, uint64_t median_weight, uint64_t fees, uint64_t weight);
+
+struct TxSelection
+{
+	TxSelection() : reward(0), fees(0), weight(0) {}
+
+	uint64_t reward;
+
+	// Total fees and weight of the selected transactions, weight includes miner tx
+	uint64_t fees;
+	uint64_t weight;
+
+	// Indices of the selected transactions in the input vector
+	std::vector<int> txs;
+};
+
+// Fast heuristic, usually within 0.5 micronero of the optimal selection
+// Picks all transactions if the block doesn't get into the penalty zone
+void select_transactions_greedy(const std::vector<TxMempoolData>& txs, uint64_t base_reward, uint64_t median_weight, uint64_t miner_tx_weight, TxSelection& result);
+
+// Branch and bound search for the selection with the maximum block reward
+// "result" must contain a valid selection on input (for example, from select_transactions_greedy), it will only be replaced by a better one
+// Returns true if the search space was fully explored within time_limit_ms, i.e. the returned selection is optimal
+bool select_transactions_optimal(const std::vector<TxMempoolData>& txs, uint64_t base_reward, uint64_t median_weight, uint64_t miner_tx_weight, uint64_t time_limit_ms, TxSelection& result);
+
+} // namespace p2pool
@@ -19,10 +19,12 @@
 #include "util.h"
 #include "uv_util.h"
 #include <map>
+#include <set>
 #include <thread>
 
 #ifndef _WIN32
 #include <sched.h>
+#include <pthread.h>
 #endif
 
 static constexpr char log_category_prefix[] = "Util ";
@@ -75,6 +77,183 @@ void make_thread_background()
 #endif
 }
 
+#ifdef __linux__
+// Parses the Linux CPU list format ("0-3,8-11")
+static std::vector<uint32_t> read_cpu_list(const char* path)
+{
+	std::vector<uint32_t> result;
+
+	FILE* f = fopen(path, "r");
+	if (!f) {
+		return result;
+	}
+
+	char buf[4096] = {};
+	const bool ok = (fgets(buf, sizeof(buf), f) != nullptr);
+	fclose(f);
+
+	if (!ok) {
+		return result;
+	}
+
+	for (char* p = buf; *p;) {
+		char* end;
+		const unsigned long a = strtoul(p, &end, 10);
+		if (end == p) {
+			break;
+		}
+		unsigned long b = a;
+		p = end;
+
+		if (*p == '-') {
+			++p;
+			b = strtoul(p, &end, 10);
+			if (end == p) {
+				break;
+			}
+			p = end;
+		}
+
+		for (unsigned long i = a; (i <= b) && (i < 4096); ++i) {
+			result.push_back(static_cast<uint32_t>(i));
+		}
+
+		if (*p != ',') {
+			break;
+		}
+		++p;
+	}
+
+	return result;
+}
+#endif
+
+std::vector<std::vector<uint32_t>> get_numa_nodes()
+{
+	std::vector<std::vector<uint32_t>> nodes;
+
+#ifdef _WIN32
+	ULONG highest_node = 0;
+	if (GetNumaHighestNodeNumber(&highest_node)) {
+		for (ULONG i = 0; i <= highest_node; ++i) {
+			ULONGLONG mask = 0;
+			if (!GetNumaNodeProcessorMask(static_cast<UCHAR>(i), &mask) || !mask) {
+				continue;
+			}
+
+			std::vector<uint32_t> cpus;
+			for (uint32_t j = 0; j < 64; ++j) {
+				if (mask & (1ULL << j)) {
+					cpus.push_back(j);
+				}
+			}
+			nodes.emplace_back(std::move(cpus));
+		}
+	}
+#elif defined(__linux__)
+	for (uint32_t i : read_cpu_list("/sys/devices/system/node/online")) {
+		char path[64];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", i);
+
+		std::vector<uint32_t> cpus = read_cpu_list(path);
+		if (!cpus.empty()) {
+			nodes.emplace_back(std::move(cpus));
+		}
+	}
+#endif
+
+	return nodes;
+}
+
+bool set_thread_affinity(const std::vector<uint32_t>& cpus)
+{
+#ifdef _WIN32
+	DWORD_PTR mask = 0;
+	for (uint32_t i : cpus) {
+		if (i < sizeof(mask) * 8) {
+			mask |= static_cast<DWORD_PTR>(1) << i;
+		}
+	}
+	return mask && (SetThreadAffinityMask(GetCurrentThread(), mask) != 0);
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (uint32_t i : cpus) {
+		if (i < CPU_SETSIZE) {
+			CPU_SET(i, &set);
+		}
+	}
+	return (CPU_COUNT(&set) > 0) && (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0);
+#else
+	(void)cpus;
+	return false;
+#endif
+}
+
+std::vector<L3CacheGroup> get_l3_cache_groups()
+{
+	std::vector<L3CacheGroup> groups;
+
+#ifdef __linux__
+	std::set<std::vector<uint32_t>> known_groups;
+
+	for (uint32_t cpu : read_cpu_list("/sys/devices/system/cpu/online")) {
+		char path[128];
+
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cache/index3/level", cpu);
+		const std::vector<uint32_t> level = read_cpu_list(path);
+		if ((level.size() != 1) || (level[0] != 3)) {
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cache/index3/shared_cpu_list", cpu);
+		std::vector<uint32_t> shared_cpus = read_cpu_list(path);
+		if (shared_cpus.empty() || (known_groups.find(shared_cpus) != known_groups.end())) {
+			continue;
+		}
+
+		L3CacheGroup group;
+		group.m_size = 0;
+
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cache/index3/size", cpu);
+		FILE* f = fopen(path, "r");
+		if (f) {
+			char buf[64] = {};
+			if (fgets(buf, sizeof(buf), f)) {
+				char* end;
+				group.m_size = strtoull(buf, &end, 10);
+				if (*end == 'K') {
+					group.m_size <<= 10;
+				}
+				else if (*end == 'M') {
+					group.m_size <<= 20;
+				}
+			}
+			fclose(f);
+		}
+
+		// First hyperthread of every core, then all other hyperthreads
+		std::vector<uint32_t> other_threads;
+		for (uint32_t i : shared_cpus) {
+			snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/thread_siblings_list", i);
+			const std::vector<uint32_t> siblings = read_cpu_list(path);
+			if (siblings.empty() || (siblings[0] == i)) {
+				group.m_cpus.push_back(i);
+			}
+			else {
+				other_threads.push_back(i);
+			}
+		}
+		group.m_cpus.insert(group.m_cpus.end(), other_threads.begin(), other_threads.end());
+
+		known_groups.emplace(std::move(shared_cpus));
+		groups.emplace_back(std::move(group));
+	}
+#endif
+
+	return groups;
+}
+
 NOINLINE bool difficulty_type::check_pow(const hash& pow_hash) const
 {
 	const uint64_t* a = reinterpret_cast<const uint64_t*>(pow_hash.h);
@@ -340,6 +519,63 @@ void BackgroundJobTracker::print_status()
 
 BackgroundJobTracker bkg_jobs_tracker;
 
+RollingBloomFilter::RollingBloomFilter()
+	: m_bits{}
+	, m_current(0)
+	, m_count(0)
+{
+	static_assert((NUM_BITS & (NUM_BITS - 1)) == 0, "NUM_BITS must be a power of 2");
+	static_assert(NUM_HASHES * sizeof(uint16_t) <= HASH_SIZE, "NUM_HASHES is too big");
+}
+
+// Hashes added here are block/transaction ids, so they're already random and can be used as bit indices directly
+static FORCEINLINE uint32_t bloom_bit_index(const hash& h, uint32_t i)
+{
+	return (h.h[i * 2] | (static_cast<uint32_t>(h.h[i * 2 + 1]) << 8)) & (RollingBloomFilter::NUM_BITS - 1);
+}
+
+void RollingBloomFilter::add(const hash& h)
+{
+	if (m_count >= CAPACITY) {
+		m_current ^= 1;
+		memset(m_bits[m_current], 0, sizeof(m_bits[m_current]));
+		m_count = 0;
+	}
+
+	uint64_t* bits = m_bits[m_current];
+	for (uint32_t i = 0; i < NUM_HASHES; ++i) {
+		const uint32_t k = bloom_bit_index(h, i);
+		bits[k / 64] |= 1ULL << (k % 64);
+	}
+
+	++m_count;
+}
+
+bool RollingBloomFilter::contains(const hash& h) const
+{
+	for (const uint64_t* bits : m_bits) {
+		bool found = true;
+		for (uint32_t i = 0; i < NUM_HASHES; ++i) {
+			const uint32_t k = bloom_bit_index(h, i);
+			if ((bits[k / 64] & (1ULL << (k % 64))) == 0) {
+				found = false;
+				break;
+			}
+		}
+		if (found) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void RollingBloomFilter::clear()
+{
+	memset(m_bits, 0, sizeof(m_bits));
+	m_current = 0;
+	m_count = 0;
+}
+
 static thread_local bool main_thread = false;
 void set_main_thread() { main_thread = true; }
 bool is_main_thread() { return main_thread; }
@@ -116,6 +116,22 @@ template<typename T, typename U, size_t N> FORCEINLINE constexpr size_t array_si
 
 void make_thread_background();
 
+// CPUs of every NUMA node, empty if the topology is unknown on this platform
+std::vector<std::vector<uint32_t>> get_numa_nodes();
+
+// Restricts the current thread to the given CPUs
+bool set_thread_affinity(const std::vector<uint32_t>& cpus);
+
+struct L3CacheGroup
+{
+	// CPUs sharing this L3 cache, one hyperthread of every core goes first
+	std::vector<uint32_t> m_cpus;
+	uint64_t m_size;
+};
+
+// Empty if the cache topology is unknown on this platform
+std::vector<L3CacheGroup> get_l3_cache_groups();
+
 class BackgroundJobTracker : public nocopy_nomove
 {
 public:
@@ -134,6 +150,27 @@ private:
 
 extern BackgroundJobTracker bkg_jobs_tracker;
 
+// Remembers the last 256-512 added hashes in 2 KB of memory: when the current half is full, the older half is cleared and reused
+// contains() never misses a remembered hash, but it can return true for a hash that was never added (less than 0.01% of the time)
+class RollingBloomFilter
+{
+public:
+	RollingBloomFilter();
+
+	void add(const hash& h);
+	bool contains(const hash& h) const;
+	void clear();
+
+	static constexpr uint32_t CAPACITY = 256;
+	static constexpr uint32_t NUM_BITS = 8192;
+	static constexpr uint32_t NUM_HASHES = 6;
+
+private:
+	uint64_t m_bits[2][NUM_BITS / 64];
+	uint32_t m_current;
+	uint32_t m_count;
+};
+
 void set_main_thread();
 bool is_main_thread();
 
@@ -18,6 +18,8 @@
 #include "common.h"
 #include "keccak.h"
 #include "gtest/gtest.h"
+#include <random>
+#include <chrono>
 
 namespace p2pool {
 
@@ -38,7 +40,9 @@ TEST(keccak, hashing)
 		memset(buf, 0, sizeof(buf));
 		s.m_pos = 0;
 
-		keccak_custom([data](int offset) { return data[offset]; }, len, output.h, HASH_SIZE);
+		KeccakStream k;
+		k.absorb(data, size);
+		k.finalize(output.h);
 		s << output;
 		ASSERT_EQ(memcmp(buf, expected_output, HASH_SIZE * 2), 0);
 	};
@@ -55,4 +59,183 @@ TEST(keccak, hashing)
 	check(v.data(), v.size(), "fadae6b49f129bbb812be8407b7b2894f34aecf6dbd1f9b0f0c7e9853098fc96");
 }
 
+TEST(keccak, stream)
+{
+	std::mt19937_64 r(0);
+
+	std::vector<uint8_t> input(2000);
+	for (uint8_t& b : input) {
+		b = static_cast<uint8_t>(r());
+	}
+
+	// Zero some ranges to check absorb_zeros()
+	const std::pair<size_t, size_t> zeros[] = { { 39, 4 }, { 130, 32 }, { 700, 300 } };
+	for (const auto& z : zeros) {
+		memset(input.data() + z.first, 0, z.second);
+	}
+
+	for (int mdlen : { static_cast<int>(HASH_SIZE), 200 }) {
+		uint8_t expected[200];
+		keccak(input.data(), static_cast<int>(input.size()), expected, mdlen);
+
+		// Split the input into segments of different sizes
+		for (size_t step : { 1, 7, 8, 64, 135, 136, 137, 500, 2000 }) {
+			KeccakStream k(mdlen);
+
+			size_t pos = 0;
+			for (const auto& z : zeros) {
+				for (; pos < z.first; pos += std::min(step, z.first - pos)) {
+					k.absorb(input.data() + pos, std::min(step, z.first - pos));
+				}
+				k.absorb_zeros(z.second);
+				pos += z.second;
+			}
+			for (; pos < input.size(); pos += std::min(step, input.size() - pos)) {
+				k.absorb(input.data() + pos, std::min(step, input.size() - pos));
+			}
+
+			uint8_t result[200];
+			k.finalize(result);
+			ASSERT_EQ(memcmp(result, expected, mdlen), 0);
+		}
+	}
+}
+
+TEST(keccak, batch)
+{
+	std::mt19937_64 r(0);
+
+	std::vector<uint8_t> input(1000 * 20);
+	for (uint8_t& b : input) {
+		b = static_cast<uint8_t>(r());
+	}
+
+	const int sizes[] = { 0, 1, 64, 96, 135, 136, 137, 271, 272, 1000 };
+
+	for (int inlen : sizes) {
+		for (int mdlen : { static_cast<int>(HASH_SIZE), 200 }) {
+			for (int count = 1; count <= 20; ++count) {
+				std::vector<uint8_t> result(count * 200);
+				keccak_batch(input.data(), inlen, inlen, result.data(), 200, mdlen, count);
+
+				for (int i = 0; i < count; ++i) {
+					uint8_t expected[200];
+					keccak(input.data() + i * inlen, inlen, expected, mdlen);
+					ASSERT_EQ(memcmp(result.data() + i * 200, expected, mdlen), 0);
+				}
+			}
+		}
+	}
+
+	// In-place merkle tree level
+	std::vector<uint8_t> level(input.begin(), input.begin() + HASH_SIZE * 64);
+	std::vector<uint8_t> expected(HASH_SIZE * 32);
+	for (size_t i = 0; i < 32; ++i) {
+		keccak(level.data() + i * HASH_SIZE * 2, HASH_SIZE * 2, expected.data() + i * HASH_SIZE, HASH_SIZE);
+	}
+	keccak_batch(level.data(), HASH_SIZE * 2, HASH_SIZE * 2, level.data(), HASH_SIZE, HASH_SIZE, 32);
+	ASSERT_EQ(memcmp(level.data(), expected.data(), expected.size()), 0);
+}
+
+#if defined(__x86_64__) || defined(_M_AMD64)
+void keccakf_x4_avx2(uint64_t* st);
+void keccakf_x8_avx512(uint64_t* st);
+
+TEST(keccak, multi_buffer_permutation)
+{
+	const int lanes = keccak_batch_lanes();
+	if (lanes < 4) {
+		return;
+	}
+
+	std::mt19937_64 r(0);
+
+	uint64_t st[25 * 8];
+	for (uint64_t& k : st) {
+		k = r();
+	}
+
+	auto check = [&st](void (*f)(uint64_t*), int n) {
+		uint64_t st_multi[25 * 8];
+		for (int i = 0; i < 25; ++i) {
+			for (int lane = 0; lane < n; ++lane) {
+				st_multi[i * n + lane] = st[lane * 25 + i];
+			}
+		}
+
+		f(st_multi);
+
+		for (int lane = 0; lane < n; ++lane) {
+			uint64_t expected[25];
+			memcpy(expected, st + lane * 25, sizeof(expected));
+			keccakf(expected);
+
+			for (int i = 0; i < 25; ++i) {
+				ASSERT_EQ(st_multi[i * n + lane], expected[i]);
+			}
+		}
+	};
+
+	check(keccakf_x4_avx2, 4);
+
+	if (lanes == 8) {
+		check(keccakf_x8_avx512, 8);
+	}
+}
+#endif
+
+TEST(keccak, batch_large)
+{
+	// Same workload as a merkle tree level: 64-byte inputs, 32-byte outputs
+	constexpr int count = 1 << 16;
+
+	std::vector<uint8_t> input(count * HASH_SIZE * 2);
+	for (size_t i = 0; i < input.size(); ++i) {
+		input[i] = static_cast<uint8_t>(i * 131 + (i >> 8));
+	}
+
+	std::vector<uint8_t> output1(count * HASH_SIZE);
+	std::vector<uint8_t> output2(count * HASH_SIZE);
+
+	for (int i = 0; i < count; ++i) {
+		keccak(input.data() + i * HASH_SIZE * 2, HASH_SIZE * 2, output1.data() + i * HASH_SIZE, HASH_SIZE);
+	}
+
+	keccak_batch(input.data(), HASH_SIZE * 2, HASH_SIZE * 2, output2.data(), HASH_SIZE, HASH_SIZE, count);
+
+	ASSERT_EQ(output1, output2);
+}
+
+// Run with --gtest_also_run_disabled_tests --gtest_filter=keccak.DISABLED_batch_benchmark
+TEST(keccak, DISABLED_batch_benchmark)
+{
+	using namespace std::chrono;
+
+	// Same workload as a merkle tree level: 64-byte inputs, 32-byte outputs
+	constexpr int count = 1 << 20;
+
+	std::vector<uint8_t> input(count * HASH_SIZE * 2, 1);
+	std::vector<uint8_t> output1(count * HASH_SIZE);
+	std::vector<uint8_t> output2(count * HASH_SIZE);
+
+	const auto t0 = high_resolution_clock::now();
+
+	for (int i = 0; i < count; ++i) {
+		keccak(input.data() + i * HASH_SIZE * 2, HASH_SIZE * 2, output1.data() + i * HASH_SIZE, HASH_SIZE);
+	}
+
+	const auto t1 = high_resolution_clock::now();
+
+	keccak_batch(input.data(), HASH_SIZE * 2, HASH_SIZE * 2, output2.data(), HASH_SIZE, HASH_SIZE, count);
+
+	const auto t2 = high_resolution_clock::now();
+
+	ASSERT_EQ(output1, output2);
+
+	const double scalar_ms = duration_cast<nanoseconds>(t1 - t0).count() / 1e6;
+	const double batch_ms = duration_cast<nanoseconds>(t2 - t1).count() / 1e6;
+
+	printf("keccak: %d hashes, scalar %.3f ms, batch (%d lanes) %.3f ms, speedup %.2fx\n", count, scalar_ms, keccak_batch_lanes(), batch_ms, scalar_ms / batch_ms);
+}
+
 }
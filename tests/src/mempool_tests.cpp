@@ -0,0 +1,104 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "mempool.h"
+#include "gtest/gtest.h"
+#include <random>
+
+namespace p2pool {
+
+static TxMempoolData make_tx(uint64_t index, uint64_t fee, uint64_t weight, time_t time_received)
+{
+	TxMempoolData tx;
+	memcpy(tx.id.h, &index, sizeof(index));
+	tx.blob_size = weight;
+	tx.weight = weight;
+	tx.fee = fee;
+	tx.time_received = time_received;
+	return tx;
+}
+
+TEST(mempool, fee_rate_order)
+{
+	const time_t t = time(nullptr) - Mempool::MIN_TX_AGE;
+
+	std::mt19937_64 rng(1);
+
+	Mempool mempool;
+	for (uint64_t i = 0; i < 1000; ++i) {
+		const uint64_t weight = 1500 + rng() % 10000;
+		mempool.add(make_tx(i, weight * (20 + rng() % 300), weight, t));
+	}
+
+	// Duplicates are skipped
+	mempool.add(make_tx(0, 1, 1, t));
+
+	std::vector<TxMempoolData> txs;
+	ASSERT_EQ(mempool.get_best_transactions(time(nullptr), 100, txs), 1000);
+	ASSERT_EQ(txs.size(), 100);
+
+	for (size_t i = 1; i < txs.size(); ++i) {
+		ASSERT_GE(txs[i - 1].fee * txs[i].weight, txs[i].fee * txs[i - 1].weight);
+	}
+
+	// The best 100 transactions from the full sorted list must be the same
+	std::vector<TxMempoolData> all_txs;
+	ASSERT_EQ(mempool.get_best_transactions(time(nullptr), 10000, all_txs), 1000);
+	ASSERT_EQ(all_txs.size(), 1000);
+
+	for (size_t i = 0; i < txs.size(); ++i) {
+		ASSERT_EQ(txs[i].id, all_txs[i].id);
+	}
+}
+
+TEST(mempool, min_tx_age)
+{
+	const time_t t = time(nullptr);
+
+	Mempool mempool;
+	mempool.add(make_tx(1, 1000, 1000, t - Mempool::MIN_TX_AGE));
+	mempool.add(make_tx(2, 5000, 1000, t - Mempool::MIN_TX_AGE + 1));
+	mempool.add(make_tx(3, 3000, 1000, t));
+
+	std::vector<TxMempoolData> txs;
+	ASSERT_EQ(mempool.get_best_transactions(t, 10, txs), 3);
+	ASSERT_EQ(txs.size(), 1);
+
+	ASSERT_EQ(mempool.get_best_transactions(t + 1, 10, txs), 3);
+	ASSERT_EQ(txs.size(), 2);
+	ASSERT_EQ(txs[0].fee, 5000);
+	ASSERT_EQ(txs[1].fee, 1000);
+
+	ASSERT_EQ(mempool.get_best_transactions(t + Mempool::MIN_TX_AGE, 10, txs), 3);
+	ASSERT_EQ(txs.size(), 3);
+	ASSERT_EQ(txs[0].fee, 5000);
+	ASSERT_EQ(txs[1].fee, 3000);
+	ASSERT_EQ(txs[2].fee, 1000);
+
+	// swap() keeps time_received for known transactions
+	std::vector<TxMempoolData> backlog;
+	backlog.push_back(make_tx(1, 1000, 1000, 0));
+	backlog.push_back(make_tx(4, 9000, 1000, 0));
+	mempool.swap(backlog);
+
+	ASSERT_EQ(mempool.get_best_transactions(t, 10, txs), 2);
+	ASSERT_EQ(txs.size(), 1);
+	ASSERT_EQ(txs[0].fee, 1000);
+}
+
+}
@@ -0,0 +1,1842 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// P2P network simulator: runs a network of p2pool nodes on loopback and measures how fast sidechain blocks propagate through it
+//
+// - every node is a separate p2pool process (p2pool uses the default event loop and global state, so it can't run more than one instance per process)
+// - the simulator is the Monero node for all of them: it answers RPC requests, publishes ZMQ notifications and advances the main chain on a timer
+// - PoW is fake: nodes run with --no-randomx, so they ask the simulator (calc_pow RPC) which always returns the same hash.
+//   This hash passes sidechain difficulty, but never passes main chain difficulty
+// - nodes use a custom sidechain (random name and password) and never talk to the real network
+// - every connection between two nodes goes through a proxy which adds latency and limits bandwidth in each direction
+// - blocks are found by the simulator's miner which submits shares with the fake PoW hash over stratum, with Poisson-distributed block times
+//
+// Every node has its own loopback addresses, so this only works on Linux where all of 127.0.0.0/8 is routed to lo:
+// - 127.1.x.y: node's P2P and stratum ports
+// - 127.2.x.y: incoming side of proxies for links from this node to other nodes
+// - 127.3.x.y: outgoing side of these proxies. p2pool allows only one connection per IP, so nodes learning these addresses
+//   from peer lists can't bypass the proxies and the network topology stays fixed
+//
+// Reports:
+// - block propagation latency: time from a block being found to it being added on each other node
+// - time for each block to reach 50% and 100% of nodes
+// - uncle and orphan rates in the PPLNS window
+// - sync time: how long it takes a fresh node to download the sidechain from the network
+
+#include <uv.h>
+#include <zmq.hpp>
+#include "rapidjson/document.h"
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace p2pool {
+
+static constexpr char DEFAULT_WALLET[] = "49ccoSmrBTPJd5yf8VYCULh4J5rHQaXP1TeC8Cnqhd5H9Y2cMwkJ9w42euLmMghKtCiQcgZEiGYW1K6Ae4biZ7w1HLSexS6";
+
+// Top 64 bits of the fake PoW hash (the rest is 0). It passes any sidechain difficulty up to 2^44
+static constexpr char FAKE_POW_HASH[] = "0000000000000000000000000000000000000000000000000000100000000000";
+
+// Fake PoW hash * main chain difficulty is always >= 2^64, so nodes never try to submit main chain blocks
+static constexpr uint64_t MAINCHAIN_DIFFICULTY = 1ULL << 50;
+static constexpr uint64_t MAINCHAIN_REWARD = 600000000000ULL;
+static constexpr uint64_t MAINCHAIN_START_HEIGHT = 4196;
+
+static constexpr uint64_t SIDECHAIN_MIN_DIFF = 100000;
+static constexpr uint64_t SIDECHAIN_PPLNS_WINDOW = 2160;
+static constexpr uint64_t SIDECHAIN_UNCLE_PENALTY = 20;
+
+static constexpr uint32_t TICK_INTERVAL_MS = 100;
+static constexpr uint32_t NODE_START_TIMEOUT = 300;
+static constexpr uint32_t SETTLE_TIME = 10;
+static constexpr uint32_t STATUS_WAIT_TIME = 3;
+static constexpr uint32_t SYNC_TIMEOUT = 300;
+static constexpr uint32_t EXIT_TIMEOUT = 30;
+
+struct Range
+{
+	double m_min;
+	double m_max;
+};
+
+struct Options
+{
+	std::string m_p2pool;
+	std::string m_dataDir = "p2pool_sim";
+	std::string m_wallet = DEFAULT_WALLET;
+	uint32_t m_nodes = 10;
+	uint32_t m_peers = 4;
+	Range m_latency = { 20.0, 100.0 };
+	Range m_bandwidth = { 0.0, 0.0 };
+	uint32_t m_duration = 300;
+	double m_blockTime = 10.0;
+	uint32_t m_mainchainBlockTime = 120;
+	int m_basePort = 40000;
+	bool m_sync = true;
+};
+
+static void usage()
+{
+	printf("Usage: p2pool_p2p_sim --p2pool <path> [options]\n\n"
+		"--p2pool           Path to the p2pool binary\n"
+		"--nodes            Number of nodes, default 10\n"
+		"--peers            Number of outgoing connections per node, default 4\n"
+		"--latency          One-way latency of each link in ms, min:max to pick randomly for each link, default 20:100\n"
+		"--bandwidth        Bandwidth of each link in KB/s, min:max to pick randomly for each link, 0 for unlimited, default 0\n"
+		"--duration         How long to mine in seconds, default 300\n"
+		"--block-time       Average time between sidechain blocks in seconds, default 10\n"
+		"--mainchain-block-time Time between main chain blocks in seconds, default 120\n"
+		"--data-dir         Directory for nodes' data, default p2pool_sim\n"
+		"--base-port        First port to use, default 40000. Nodes use it for P2P and the next one for stratum, the simulator uses the ports after them\n"
+		"--wallet           Wallet address for all nodes\n"
+		"--no-sync          Don't measure sync time of a fresh node\n"
+		"--help             Show this help message\n"
+	);
+}
+
+static int64_t wall_time_us()
+{
+	using namespace std::chrono;
+	return duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+}
+
+// Days since 1970-01-01 for a date in the proleptic Gregorian calendar
+static int64_t days_from_civil(int64_t y, uint32_t m, uint32_t d)
+{
+	y -= (m <= 2) ? 1 : 0;
+	const int64_t era = (y >= 0 ? y : y - 399) / 400;
+	const uint32_t yoe = static_cast<uint32_t>(y - era * 400);
+	const uint32_t doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	const uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + static_cast<int64_t>(doe) - 719468;
+}
+
+// p2pool log lines start with "YYYY-MM-DD HH:MM:SS.ffff " in UTC, returns time in microseconds since the epoch
+static bool parse_log_time(const std::string& line, size_t pos, int64_t& t)
+{
+	int year, month, day, hour, minute, second, fraction;
+	if (sscanf(line.c_str() + pos, "%d-%d-%d %d:%d:%d.%d", &year, &month, &day, &hour, &minute, &second, &fraction) != 7) {
+		return false;
+	}
+
+	const int64_t days = days_from_civil(year, static_cast<uint32_t>(month), static_cast<uint32_t>(day));
+	t = (((days * 24 + hour) * 60 + minute) * 60 + second) * 1000000 + static_cast<int64_t>(fraction) * 100;
+	return true;
+}
+
+static bool parse_range(const char* s, Range& range)
+{
+	char* end;
+	range.m_min = strtod(s, &end);
+	range.m_max = (*end == ':') ? strtod(end + 1, nullptr) : range.m_min;
+	return (range.m_min >= 0.0) && (range.m_min <= range.m_max);
+}
+
+static std::string loopback_ip(uint32_t net, uint32_t index)
+{
+	++index;
+	return "127." + std::to_string(net) + '.' + std::to_string((index >> 8) & 255) + '.' + std::to_string(index & 255);
+}
+
+static double percentile(std::vector<int64_t>& samples, double p)
+{
+	if (samples.empty()) {
+		return 0.0;
+	}
+
+	const size_t index = std::min(static_cast<size_t>(p * samples.size()), samples.size() - 1);
+	std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+	return samples[index] / 1e3;
+}
+
+static void print_latency(const char* name, std::vector<int64_t>& samples)
+{
+	if (samples.empty()) {
+		printf("%-28s no samples\n", name);
+		return;
+	}
+
+	const double p50 = percentile(samples, 0.5);
+	const double p90 = percentile(samples, 0.9);
+	const double p99 = percentile(samples, 0.99);
+	const double max = percentile(samples, 1.0);
+
+	printf("%-28s p50 %.1f ms, p90 %.1f ms, p99 %.1f ms, max %.1f ms (%zu samples)\n", name, p50, p90, p99, max, samples.size());
+}
+
+struct WriteReq
+{
+	uv_write_t m_req;
+	std::string m_data;
+};
+
+static bool write_string(uv_stream_t* stream, std::string&& data, uv_write_cb cb = nullptr)
+{
+	WriteReq* req = new WriteReq();
+	req->m_data = std::move(data);
+	req->m_req.data = req;
+
+	const uv_buf_t buf = uv_buf_init(&req->m_data[0], static_cast<unsigned int>(req->m_data.size()));
+
+	const int err = uv_write(&req->m_req, stream, &buf, 1,
+		cb ? cb : [](uv_write_t* req, int)
+		{
+			delete reinterpret_cast<WriteReq*>(req->data);
+		});
+
+	if (err) {
+		delete req;
+		return false;
+	}
+	return true;
+}
+
+static void alloc_buffer(uv_handle_t*, size_t suggested_size, uv_buf_t* buf)
+{
+	buf->base = static_cast<char*>(malloc(suggested_size));
+	buf->len = buf->base ? static_cast<decltype(buf->len)>(suggested_size) : 0;
+}
+
+// Answers RPC requests of all nodes and publishes ZMQ notifications about the fake main chain
+class FakeMonerod
+{
+public:
+	FakeMonerod(uv_loop_t* loop, uint32_t block_time)
+		: m_loop(loop)
+		, m_server{}
+		, m_timer{}
+		, m_blockTime(block_time)
+		, m_height(MAINCHAIN_START_HEIGHT)
+		, m_startTimestamp(static_cast<uint64_t>(time(nullptr)))
+		, m_zmqContext(1)
+		, m_publisher(m_zmqContext, ZMQ_PUB)
+		, m_numSubmittedBlocks(0)
+	{
+	}
+
+	bool start(const std::string& host, int rpc_port, int zmq_port)
+	{
+		sockaddr_in addr;
+		uv_ip4_addr(host.c_str(), rpc_port, &addr);
+
+		uv_tcp_init(m_loop, &m_server);
+		m_server.data = this;
+
+		int err = uv_tcp_bind(&m_server, reinterpret_cast<const sockaddr*>(&addr), 0);
+		if (!err) {
+			err = uv_listen(reinterpret_cast<uv_stream_t*>(&m_server), 512, on_new_connection);
+		}
+		if (err) {
+			fprintf(stderr, "Failed to start RPC server on %s:%d, error %s\n", host.c_str(), rpc_port, uv_err_name(err));
+			return false;
+		}
+
+		try {
+			const std::string addr_str = "tcp://" + host + ':' + std::to_string(zmq_port);
+			m_publisher.bind(addr_str.c_str());
+		}
+		catch (const std::exception& e) {
+			fprintf(stderr, "Failed to start ZMQ publisher on %s:%d, error %s\n", host.c_str(), zmq_port, e.what());
+			return false;
+		}
+
+		uv_timer_init(m_loop, &m_timer);
+		m_timer.data = this;
+		uv_timer_start(&m_timer, [](uv_timer_t* h) { reinterpret_cast<FakeMonerod*>(h->data)->add_block(); }, m_blockTime * 1000ULL, m_blockTime * 1000ULL);
+
+		return true;
+	}
+
+	void stop()
+	{
+		uv_close(reinterpret_cast<uv_handle_t*>(&m_server), nullptr);
+		uv_close(reinterpret_cast<uv_handle_t*>(&m_timer), nullptr);
+
+		// Don't block in zmq_ctx_term() on messages nobody will receive
+		m_publisher.set(zmq::sockopt::linger, 0);
+		m_publisher.close();
+	}
+
+	uint64_t num_submitted_blocks() const { return m_numSubmittedBlocks; }
+
+private:
+	struct Connection
+	{
+		FakeMonerod* m_owner;
+		uv_tcp_t m_socket;
+		std::string m_request;
+	};
+
+	static std::string block_id(uint64_t height)
+	{
+		char buf[17];
+		snprintf(buf, sizeof(buf), "%016" PRIx64, height);
+		return std::string(buf) + std::string(48, 'a');
+	}
+
+	static uint64_t seed_height(uint64_t height)
+	{
+		return (height > 64) ? ((height - 65) & ~2047ULL) : 0;
+	}
+
+	uint64_t timestamp(uint64_t height) const
+	{
+		const uint64_t k = m_height - 1 - std::min(height, m_height - 1);
+		return m_startTimestamp + (m_height - MAINCHAIN_START_HEIGHT) * m_blockTime - k * m_blockTime;
+	}
+
+	std::string block_header(uint64_t height) const
+	{
+		return "{\"difficulty\":" + std::to_string(MAINCHAIN_DIFFICULTY) +
+			",\"difficulty_top64\":0,\"hash\":\"" + block_id(height) +
+			"\",\"height\":" + std::to_string(height) +
+			",\"reward\":" + std::to_string(MAINCHAIN_REWARD) +
+			",\"timestamp\":" + std::to_string(timestamp(height)) + '}';
+	}
+
+	std::string miner_data() const
+	{
+		char difficulty[32];
+		snprintf(difficulty, sizeof(difficulty), "0x%" PRIx64, MAINCHAIN_DIFFICULTY);
+
+		return "{\"major_version\":14,\"height\":" + std::to_string(m_height) +
+			",\"prev_id\":\"" + block_id(m_height - 1) +
+			"\",\"seed_hash\":\"" + block_id(seed_height(m_height)) +
+			"\",\"difficulty\":\"" + difficulty +
+			"\",\"median_weight\":300000,\"already_generated_coins\":18400000000000000000,\"tx_backlog\":[]}";
+	}
+
+	void add_block()
+	{
+		const uint64_t height = m_height++;
+
+		std::string s = "json-full-miner_data:" + miner_data();
+		m_publisher.send(zmq::const_buffer(s.data(), s.size()));
+
+		s = "json-full-chain_main:[{\"major_version\":14,\"minor_version\":14,\"timestamp\":" + std::to_string(timestamp(height)) +
+			",\"prev_id\":\"" + block_id(height - 1) +
+			"\",\"nonce\":0,\"miner_tx\":{\"version\":2,\"unlock_time\":" + std::to_string(height + 60) +
+			",\"inputs\":[{\"gen\":{\"height\":" + std::to_string(height) +
+			"}}],\"outputs\":[{\"amount\":" + std::to_string(MAINCHAIN_REWARD) +
+			",\"to_key\":{\"key\":\"" + block_id(height) +
+			"\"}}],\"extra\":\"\",\"signatures\":[]},\"tx_hashes\":[]}]";
+		m_publisher.send(zmq::const_buffer(s.data(), s.size()));
+	}
+
+	static void on_new_connection(uv_stream_t* server, int status)
+	{
+		if (status) {
+			return;
+		}
+
+		FakeMonerod* owner = reinterpret_cast<FakeMonerod*>(server->data);
+
+		Connection* c = new Connection();
+		c->m_owner = owner;
+		uv_tcp_init(owner->m_loop, &c->m_socket);
+		c->m_socket.data = c;
+
+		if (uv_accept(server, reinterpret_cast<uv_stream_t*>(&c->m_socket)) || uv_read_start(reinterpret_cast<uv_stream_t*>(&c->m_socket), alloc_buffer, on_read)) {
+			close(c);
+		}
+	}
+
+	static void close(Connection* c)
+	{
+		uv_handle_t* h = reinterpret_cast<uv_handle_t*>(&c->m_socket);
+		if (!uv_is_closing(h)) {
+			uv_close(h, [](uv_handle_t* h) { delete reinterpret_cast<Connection*>(h->data); });
+		}
+	}
+
+	static void on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf)
+	{
+		Connection* c = reinterpret_cast<Connection*>(stream->data);
+
+		if (nread > 0) {
+			c->m_request.append(buf->base, static_cast<size_t>(nread));
+		}
+		free(buf->base);
+
+		if (nread < 0) {
+			close(c);
+			return;
+		}
+
+		// Headers end with an empty line, with or without '\r'
+		size_t body_pos = c->m_request.find("\n\n");
+		if (body_pos != std::string::npos) {
+			body_pos += 2;
+		}
+		else if ((body_pos = c->m_request.find("\r\n\r\n")) != std::string::npos) {
+			body_pos += 4;
+		}
+		else {
+			return;
+		}
+
+		size_t content_length = 0;
+		const size_t k = c->m_request.find("Content-Length:");
+		if ((k != std::string::npos) && (k < body_pos)) {
+			content_length = strtoul(c->m_request.c_str() + k + 15, nullptr, 10);
+		}
+
+		if (c->m_request.size() < body_pos + content_length) {
+			return;
+		}
+
+		const size_t uri_begin = c->m_request.find(' ') + 1;
+		const std::string uri = c->m_request.substr(uri_begin, c->m_request.find(' ', uri_begin) - uri_begin);
+		const std::string body = c->m_request.substr(body_pos, content_length);
+
+		const std::string response = c->m_owner->handle_request(uri, body);
+
+		std::string s = "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: " + std::to_string(response.size()) + "\r\nConnection: close\r\n\r\n";
+		s += response;
+
+		uv_read_stop(stream);
+		write_string(stream, std::move(s),
+			[](uv_write_t* req, int)
+			{
+				Connection* c = reinterpret_cast<Connection*>(req->handle->data);
+				delete reinterpret_cast<WriteReq*>(req->data);
+				close(c);
+			});
+	}
+
+	std::string handle_request(const std::string& uri, const std::string& body)
+	{
+		if (uri == "/get_peer_list") {
+			return "{\"status\":\"OK\",\"white_list\":[],\"gray_list\":[]}";
+		}
+
+		rapidjson::Document doc;
+		if ((uri != "/json_rpc") || doc.Parse(body.c_str(), body.size()).HasParseError() || !doc.IsObject() || !doc.HasMember("method") || !doc["method"].IsString()) {
+			return "{\"jsonrpc\":\"2.0\",\"id\":\"0\",\"error\":{\"code\":-32600,\"message\":\"Invalid request\"}}";
+		}
+
+		const std::string method = doc["method"].GetString();
+		std::string result;
+
+		auto param = [&doc](const char* name) -> uint64_t
+		{
+			if (doc.HasMember("params") && doc["params"].IsObject() && doc["params"].HasMember(name) && doc["params"][name].IsUint64()) {
+				return doc["params"][name].GetUint64();
+			}
+			return 0;
+		};
+
+		if (method == "get_info") {
+			result = "{\"busy_syncing\":false,\"synchronized\":true,\"mainnet\":true,\"testnet\":false,\"stagenet\":false,\"height\":" + std::to_string(m_height) + ",\"status\":\"OK\"}";
+		}
+		else if (method == "get_version") {
+			result = "{\"version\":196618,\"status\":\"OK\"}";
+		}
+		else if (method == "get_miner_data") {
+			result = miner_data();
+		}
+		else if (method == "get_block_header_by_height") {
+			const uint64_t height = param("height");
+			if (height >= m_height) {
+				return "{\"jsonrpc\":\"2.0\",\"id\":\"0\",\"error\":{\"code\":-2,\"message\":\"Requested block height is greater than the current height\"}}";
+			}
+			result = "{\"block_header\":" + block_header(height) + ",\"status\":\"OK\"}";
+		}
+		else if (method == "get_block_headers_range") {
+			const uint64_t start_height = param("start_height");
+			const uint64_t end_height = std::min(param("end_height"), m_height - 1);
+
+			result = "{\"headers\":[";
+			for (uint64_t height = start_height; height <= end_height; ++height) {
+				if (height > start_height) {
+					result += ',';
+				}
+				result += block_header(height);
+			}
+			result += "],\"status\":\"OK\"}";
+		}
+		else if (method == "calc_pow") {
+			result = std::string("\"") + FAKE_POW_HASH + '"';
+		}
+		else if (method == "submit_block") {
+			++m_numSubmittedBlocks;
+			result = "{\"status\":\"OK\"}";
+		}
+		else {
+			return "{\"jsonrpc\":\"2.0\",\"id\":\"0\",\"error\":{\"code\":-32601,\"message\":\"Method not found\"}}";
+		}
+
+		return "{\"jsonrpc\":\"2.0\",\"id\":\"0\",\"result\":" + result + '}';
+	}
+
+	uv_loop_t* m_loop;
+	uv_tcp_t m_server;
+	uv_timer_t m_timer;
+
+	uint64_t m_blockTime;
+
+	// Height of the next main chain block
+	uint64_t m_height;
+	uint64_t m_startTimestamp;
+
+	zmq::context_t m_zmqContext;
+	zmq::socket_t m_publisher;
+
+	uint64_t m_numSubmittedBlocks;
+};
+
+// Directed link between two nodes: the source node connects to the proxy, the proxy connects to the destination node
+// Data in each direction is delayed by the link's latency and limited by its bandwidth
+class Link
+{
+public:
+	Link(uv_loop_t* loop, uint32_t from, uint32_t to, double latency_ms, double bandwidth_kbs)
+		: m_loop(loop)
+		, m_from(from)
+		, m_to(to)
+		, m_server{}
+		, m_connectAddr{}
+		, m_bindAddr{}
+		, m_latency(static_cast<int64_t>(latency_ms * 1e3))
+		, m_bandwidth(bandwidth_kbs * 1024.0)
+		, m_numConnections(0)
+		, m_bytesSent(0)
+	{
+	}
+
+	bool start(const std::string& listen_ip, int listen_port, const std::string& bind_ip, const std::string& connect_ip, int connect_port)
+	{
+		sockaddr_in addr;
+		uv_ip4_addr(listen_ip.c_str(), listen_port, &addr);
+		uv_ip4_addr(bind_ip.c_str(), 0, &m_bindAddr);
+		uv_ip4_addr(connect_ip.c_str(), connect_port, &m_connectAddr);
+
+		uv_tcp_init(m_loop, &m_server);
+		m_server.data = this;
+
+		int err = uv_tcp_bind(&m_server, reinterpret_cast<const sockaddr*>(&addr), 0);
+		if (!err) {
+			err = uv_listen(reinterpret_cast<uv_stream_t*>(&m_server), 16, on_new_connection);
+		}
+		if (err) {
+			fprintf(stderr, "Failed to start proxy on %s:%d, error %s\n", listen_ip.c_str(), listen_port, uv_err_name(err));
+			return false;
+		}
+
+		m_address = listen_ip + ':' + std::to_string(listen_port);
+		return true;
+	}
+
+	void stop()
+	{
+		uv_close(reinterpret_cast<uv_handle_t*>(&m_server), nullptr);
+	}
+
+	const std::string& address() const { return m_address; }
+	uint32_t from() const { return m_from; }
+	uint32_t to() const { return m_to; }
+	double latency() const { return m_latency / 1e3; }
+	double bandwidth() const { return m_bandwidth / 1024.0; }
+	uint64_t num_connections() const { return m_numConnections; }
+	uint64_t bytes_sent() const { return m_bytesSent; }
+
+private:
+	struct Chunk
+	{
+		int64_t m_deliveryTime;
+		std::string m_data;
+	};
+
+	// One proxied TCP connection: socket 0 is accepted from the source node, socket 1 is connected to the destination node
+	// Data read from socket i goes through m_queues[i] and is written to the other socket
+	struct Connection
+	{
+		Link* m_link;
+		uv_tcp_t m_sockets[2];
+		uv_timer_t m_timers[2];
+		uv_connect_t m_connect;
+		std::deque<Chunk> m_queues[2];
+		int64_t m_busyUntil[2];
+		bool m_connected;
+		bool m_closing;
+		uint32_t m_numOpenHandles;
+	};
+
+	static int64_t now_us() { return static_cast<int64_t>(uv_hrtime() / 1000); }
+
+	static void on_new_connection(uv_stream_t* server, int status)
+	{
+		if (status) {
+			return;
+		}
+
+		Link* link = reinterpret_cast<Link*>(server->data);
+
+		Connection* c = new Connection();
+		c->m_link = link;
+		c->m_busyUntil[0] = 0;
+		c->m_busyUntil[1] = 0;
+		c->m_connected = false;
+		c->m_closing = false;
+		c->m_numOpenHandles = 4;
+
+		for (int i = 0; i < 2; ++i) {
+			uv_tcp_init(link->m_loop, &c->m_sockets[i]);
+			c->m_sockets[i].data = c;
+			uv_tcp_nodelay(&c->m_sockets[i], 1);
+			uv_timer_init(link->m_loop, &c->m_timers[i]);
+			c->m_timers[i].data = c;
+		}
+		c->m_connect.data = c;
+
+		if (uv_accept(server, reinterpret_cast<uv_stream_t*>(&c->m_sockets[0])) ||
+			uv_read_start(reinterpret_cast<uv_stream_t*>(&c->m_sockets[0]), alloc_buffer, on_read) ||
+			uv_tcp_bind(&c->m_sockets[1], reinterpret_cast<const sockaddr*>(&link->m_bindAddr), 0) ||
+			uv_tcp_connect(&c->m_connect, &c->m_sockets[1], reinterpret_cast<const sockaddr*>(&link->m_connectAddr), on_connect)) {
+			close(c);
+			return;
+		}
+
+		++link->m_numConnections;
+	}
+
+	static void on_connect(uv_connect_t* req, int status)
+	{
+		Connection* c = reinterpret_cast<Connection*>(req->data);
+
+		if (status || c->m_closing || uv_read_start(reinterpret_cast<uv_stream_t*>(&c->m_sockets[1]), alloc_buffer, on_read)) {
+			close(c);
+			return;
+		}
+
+		c->m_connected = true;
+		schedule(c, 0);
+	}
+
+	static void close(Connection* c)
+	{
+		if (c->m_closing) {
+			return;
+		}
+		c->m_closing = true;
+
+		auto on_close = [](uv_handle_t* h)
+		{
+			Connection* c = reinterpret_cast<Connection*>(h->data);
+			if (--c->m_numOpenHandles == 0) {
+				delete c;
+			}
+		};
+
+		for (int i = 0; i < 2; ++i) {
+			uv_close(reinterpret_cast<uv_handle_t*>(&c->m_sockets[i]), on_close);
+			uv_close(reinterpret_cast<uv_handle_t*>(&c->m_timers[i]), on_close);
+		}
+	}
+
+	static void on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf)
+	{
+		Connection* c = reinterpret_cast<Connection*>(stream->data);
+		const int i = (stream == reinterpret_cast<uv_stream_t*>(&c->m_sockets[0])) ? 0 : 1;
+
+		if (nread > 0) {
+			const Link* link = c->m_link;
+
+			// The data leaves after everything queued before it, at the link's bandwidth, and arrives "latency" later
+			int64_t departure = std::max(now_us(), c->m_busyUntil[i]);
+			if (link->m_bandwidth > 0.0) {
+				departure += static_cast<int64_t>(nread * 1e6 / link->m_bandwidth);
+			}
+			c->m_busyUntil[i] = departure;
+
+			c->m_queues[i].push_back({ departure + link->m_latency, std::string(buf->base, static_cast<size_t>(nread)) });
+			schedule(c, i);
+		}
+		free(buf->base);
+
+		if (nread < 0) {
+			close(c);
+		}
+	}
+
+	static void schedule(Connection* c, int i)
+	{
+		if (c->m_closing || c->m_queues[i].empty() || ((i == 0) && !c->m_connected)) {
+			return;
+		}
+
+		const int64_t delay = c->m_queues[i].front().m_deliveryTime - now_us();
+		const uint64_t timeout = (delay > 0) ? static_cast<uint64_t>((delay + 999) / 1000) : 0;
+
+		uv_timer_start(&c->m_timers[i], on_timer, timeout, 0);
+	}
+
+	static void on_timer(uv_timer_t* handle)
+	{
+		Connection* c = reinterpret_cast<Connection*>(handle->data);
+		const int i = (handle == &c->m_timers[0]) ? 0 : 1;
+
+		// uv timers have 1 ms resolution
+		const int64_t t = now_us() + 500;
+
+		std::deque<Chunk>& queue = c->m_queues[i];
+		while (!queue.empty() && (queue.front().m_deliveryTime <= t)) {
+			c->m_link->m_bytesSent += queue.front().m_data.size();
+			if (!write_string(reinterpret_cast<uv_stream_t*>(&c->m_sockets[1 - i]), std::move(queue.front().m_data))) {
+				close(c);
+				return;
+			}
+			queue.pop_front();
+		}
+
+		schedule(c, i);
+	}
+
+	uv_loop_t* m_loop;
+	uint32_t m_from;
+	uint32_t m_to;
+
+	uv_tcp_t m_server;
+	sockaddr_in m_connectAddr;
+	sockaddr_in m_bindAddr;
+	std::string m_address;
+
+	int64_t m_latency;
+	double m_bandwidth;
+
+	uint64_t m_numConnections;
+	uint64_t m_bytesSent;
+};
+
+class Simulator;
+
+// A p2pool process and a stratum connection to it which is used to submit blocks
+class Node
+{
+public:
+	Node(Simulator* sim, uv_loop_t* loop, uint32_t index, const std::string& dir, const std::string& ip, int p2p_port, int stratum_port)
+		: m_sim(sim)
+		, m_loop(loop)
+		, m_index(index)
+		, m_dir(dir)
+		, m_ip(ip)
+		, m_p2pPort(p2p_port)
+		, m_stratumPort(stratum_port)
+		, m_process{}
+		, m_stdin{}
+		, m_running(false)
+		, m_logFile(-1)
+		, m_logOffset(0)
+		, m_consensusReady(false)
+		, m_tipHeight(0)
+		, m_tipTime(0)
+		, m_statusReceived(false)
+		, m_pplnsBlocks(0)
+		, m_pplnsUncles(0)
+		, m_pplnsOrphans(0)
+		, m_stratum{}
+		, m_stratumConnect{}
+		, m_stratumState(StratumState::IDLE)
+		, m_nonce(0)
+		, m_submitId(2)
+		, m_numAccepted(0)
+		, m_numRejected(0)
+	{
+	}
+
+	~Node()
+	{
+		if (m_logFile >= 0) {
+			uv_fs_t req;
+			uv_fs_close(nullptr, &req, m_logFile, nullptr);
+			uv_fs_req_cleanup(&req);
+		}
+	}
+
+	bool start(const std::string& p2pool, const Options& options, int rpc_port, int zmq_port, const std::vector<std::string>& peers);
+	void send_command(const char* command);
+	void kill();
+	void poll_log();
+	void update_stratum();
+	void close_stratum();
+	bool submit();
+
+	uint32_t index() const { return m_index; }
+	bool running() const { return m_running; }
+	bool consensus_ready() const { return m_consensusReady; }
+	bool mining() const { return !m_jobId.empty(); }
+	uint64_t tip_height() const { return m_tipHeight; }
+	int64_t tip_time() const { return m_tipTime; }
+	bool status_received() const { return m_statusReceived; }
+	uint32_t pplns_blocks() const { return m_pplnsBlocks; }
+	uint32_t pplns_uncles() const { return m_pplnsUncles; }
+	uint32_t pplns_orphans() const { return m_pplnsOrphans; }
+	uint64_t num_accepted() const { return m_numAccepted; }
+	uint64_t num_rejected() const { return m_numRejected; }
+
+private:
+	enum class StratumState
+	{
+		IDLE,
+		CONNECTING,
+		CONNECTED,
+		CLOSING,
+	};
+
+	void on_log_line(const std::string& line);
+	void on_stratum_line(const std::string& line);
+
+	Simulator* m_sim;
+	uv_loop_t* m_loop;
+	uint32_t m_index;
+	std::string m_dir;
+	std::string m_ip;
+	int m_p2pPort;
+	int m_stratumPort;
+
+	uv_process_t m_process;
+	uv_pipe_t m_stdin;
+	bool m_running;
+
+	// p2pool writes to stdout with full buffering when it's a pipe, but p2pool.log is flushed after every line
+	uv_file m_logFile;
+	int64_t m_logOffset;
+	std::string m_logBuf;
+
+	bool m_consensusReady;
+	uint64_t m_tipHeight;
+	int64_t m_tipTime;
+
+	bool m_statusReceived;
+	uint32_t m_pplnsBlocks;
+	uint32_t m_pplnsUncles;
+	uint32_t m_pplnsOrphans;
+
+	uv_tcp_t m_stratum;
+	uv_connect_t m_stratumConnect;
+	StratumState m_stratumState;
+	std::string m_stratumBuf;
+	std::string m_rpcId;
+	std::string m_jobId;
+	uint32_t m_nonce;
+	uint64_t m_submitId;
+	uint64_t m_numAccepted;
+	uint64_t m_numRejected;
+};
+
+class Simulator
+{
+public:
+	explicit Simulator(const Options& options)
+		: m_options(options)
+		, m_loop{}
+		, m_tickTimer{}
+		, m_blockTimer{}
+		, m_phase(Phase::STARTING)
+		, m_phaseStartTime(0)
+		, m_rng(uv_hrtime())
+		, m_monerod(nullptr)
+		, m_numNodesStarted(0)
+		, m_nodeStartTime(0)
+		, m_numBlocksSubmitted(0)
+		, m_syncTarget(0)
+		, m_syncStartTime(0)
+		, m_syncTime(-1)
+		, m_exitCode(0)
+	{
+		uv_loop_init(&m_loop);
+		uv_timer_init(&m_loop, &m_tickTimer);
+		m_tickTimer.data = this;
+		uv_timer_init(&m_loop, &m_blockTimer);
+		m_blockTimer.data = this;
+	}
+
+	~Simulator()
+	{
+		for (Node* node : m_nodes) {
+			delete node;
+		}
+		for (Link* link : m_links) {
+			delete link;
+		}
+		delete m_monerod;
+
+		uv_loop_close(&m_loop);
+	}
+
+	int run();
+
+	// Called by nodes when they parse their logs
+	void on_block_found(uint32_t node, const std::string& id, uint64_t height, int64_t t);
+	void on_block_added(uint32_t node, const std::string& id, int64_t t);
+	void on_node_exit(uint32_t node);
+
+	bool mining() const { return m_phase == Phase::MINING; }
+
+private:
+	enum class Phase
+	{
+		STARTING,
+		MINING,
+		SETTLING,
+		STATUS,
+		SYNC,
+		STOPPING,
+	};
+
+	struct BlockInfo
+	{
+		uint32_t m_origin;
+		uint64_t m_height;
+		int64_t m_foundTime;
+		std::vector<int64_t> m_arrivalTimes;
+	};
+
+	bool prepare();
+	bool create_links(uint32_t from, const std::vector<uint32_t>& to, std::vector<std::string>& peers);
+	bool start_node(uint32_t index, const std::vector<std::string>& peers);
+	void set_phase(Phase phase);
+	void on_tick();
+	void schedule_block();
+	void on_block_timer();
+	void stop();
+	void report();
+
+	int64_t phase_time() const { return static_cast<int64_t>(uv_now(&m_loop) - m_phaseStartTime); }
+
+	int rpc_port() const { return m_options.m_basePort + 2; }
+	int zmq_port() const { return m_options.m_basePort + 3; }
+	int proxy_port() const { return m_options.m_basePort + 4; }
+
+	Options m_options;
+	std::string m_p2pool;
+
+	uv_loop_t m_loop;
+	uv_timer_t m_tickTimer;
+	uv_timer_t m_blockTimer;
+
+	Phase m_phase;
+	uint64_t m_phaseStartTime;
+
+	std::mt19937_64 m_rng;
+
+	FakeMonerod* m_monerod;
+	std::vector<Node*> m_nodes;
+	std::vector<Link*> m_links;
+	std::vector<std::vector<std::string>> m_nodePeers;
+
+	uint32_t m_numNodesStarted;
+	uint64_t m_nodeStartTime;
+
+	uint64_t m_numBlocksSubmitted;
+	std::unordered_map<std::string, BlockInfo> m_blocks;
+	std::unordered_map<std::string, std::vector<std::pair<uint32_t, int64_t>>> m_earlyArrivals;
+
+	uint64_t m_syncTarget;
+	int64_t m_syncStartTime;
+	int64_t m_syncTime;
+
+	int m_exitCode;
+};
+
+bool Node::start(const std::string& p2pool, const Options& options, int rpc_port, int zmq_port, const std::vector<std::string>& peers)
+{
+	uv_fs_t req;
+	uv_fs_mkdir(nullptr, &req, m_dir.c_str(), 0755, nullptr);
+	uv_fs_req_cleanup(&req);
+
+	// Start with an empty log
+	const std::string log_path = m_dir + "/p2pool.log";
+	uv_fs_unlink(nullptr, &req, log_path.c_str(), nullptr);
+	uv_fs_req_cleanup(&req);
+
+	const std::string rpc_port_str = std::to_string(rpc_port);
+	const std::string zmq_port_str = std::to_string(zmq_port);
+	const std::string p2p_addr = m_ip + ':' + std::to_string(m_p2pPort);
+	const std::string stratum_addr = m_ip + ':' + std::to_string(m_stratumPort);
+
+	std::string peers_str;
+	for (const std::string& peer : peers) {
+		if (!peers_str.empty()) {
+			peers_str += ',';
+		}
+		peers_str += peer;
+	}
+
+	std::vector<const char*> args = {
+		p2pool.c_str(),
+		"--host", "127.0.0.1",
+		"--rpc-port", rpc_port_str.c_str(),
+		"--zmq-port", zmq_port_str.c_str(),
+		"--wallet", options.m_wallet.c_str(),
+		"--config", "../sim.json",
+		"--p2p", p2p_addr.c_str(),
+		"--stratum", stratum_addr.c_str(),
+		"--no-randomx",
+		"--no-cache",
+		"--no-color",
+		"--loglevel", "3",
+	};
+
+	if (!peers_str.empty()) {
+		args.push_back("--addpeers");
+		args.push_back(peers_str.c_str());
+	}
+	args.push_back(nullptr);
+
+	uv_pipe_init(m_loop, &m_stdin, 0);
+	m_stdin.data = this;
+
+	uv_stdio_container_t stdio[3];
+	stdio[0].flags = static_cast<uv_stdio_flags>(UV_CREATE_PIPE | UV_READABLE_PIPE);
+	stdio[0].data.stream = reinterpret_cast<uv_stream_t*>(&m_stdin);
+	stdio[1].flags = UV_IGNORE;
+	stdio[2].flags = UV_IGNORE;
+
+	uv_process_options_t process_options = {};
+	process_options.file = p2pool.c_str();
+	process_options.args = const_cast<char**>(args.data());
+	process_options.cwd = m_dir.c_str();
+	process_options.stdio = stdio;
+	process_options.stdio_count = 3;
+	process_options.exit_cb = [](uv_process_t* process, int64_t, int)
+	{
+		Node* node = reinterpret_cast<Node*>(process->data);
+		node->m_running = false;
+		node->poll_log();
+		node->close_stratum();
+		uv_close(reinterpret_cast<uv_handle_t*>(&node->m_stdin), nullptr);
+		uv_close(reinterpret_cast<uv_handle_t*>(process), nullptr);
+		node->m_sim->on_node_exit(node->m_index);
+	};
+
+	m_process.data = this;
+
+	const int err = uv_spawn(m_loop, &m_process, &process_options);
+	if (err) {
+		fprintf(stderr, "Failed to start %s, error %s\n", p2pool.c_str(), uv_err_name(err));
+		uv_close(reinterpret_cast<uv_handle_t*>(&m_stdin), nullptr);
+		return false;
+	}
+
+	m_running = true;
+	return true;
+}
+
+void Node::send_command(const char* command)
+{
+	if (m_running) {
+		write_string(reinterpret_cast<uv_stream_t*>(&m_stdin), std::string(command) + '\n');
+	}
+}
+
+void Node::kill()
+{
+	if (m_running) {
+		uv_process_kill(&m_process, SIGKILL);
+	}
+}
+
+void Node::poll_log()
+{
+	if (m_logFile < 0) {
+		const std::string log_path = m_dir + "/p2pool.log";
+
+		uv_fs_t req;
+		m_logFile = uv_fs_open(nullptr, &req, log_path.c_str(), O_RDONLY, 0, nullptr);
+		uv_fs_req_cleanup(&req);
+
+		if (m_logFile < 0) {
+			return;
+		}
+	}
+
+	char buf[65536];
+
+	for (;;) {
+		uv_buf_t b = uv_buf_init(buf, sizeof(buf));
+
+		uv_fs_t req;
+		const int n = uv_fs_read(nullptr, &req, m_logFile, &b, 1, m_logOffset, nullptr);
+		uv_fs_req_cleanup(&req);
+
+		if (n <= 0) {
+			break;
+		}
+
+		m_logOffset += n;
+		m_logBuf.append(buf, static_cast<size_t>(n));
+
+		size_t line_begin = 0;
+		for (size_t k; (k = m_logBuf.find('\n', line_begin)) != std::string::npos; line_begin = k + 1) {
+			on_log_line(m_logBuf.substr(line_begin, k - line_begin));
+		}
+		m_logBuf.erase(0, line_begin);
+	}
+}
+
+void Node::on_log_line(const std::string& line)
+{
+	// Lines in p2pool.log start with an 8 character severity field: "NOTICE  ", "WARNING " or "ERROR   "
+	constexpr size_t time_pos = 8;
+
+	int64_t t;
+	if ((line.size() <= time_pos) || !parse_log_time(line, time_pos, t)) {
+		// Multiline messages (like "status" output) continue without a timestamp
+		if (line.find("PPLNS window              = ") != std::string::npos) {
+			const char* s = strchr(line.c_str(), '=') + 1;
+			if (sscanf(s, "%u blocks (+%u uncles, %u orphans)", &m_pplnsBlocks, &m_pplnsUncles, &m_pplnsOrphans) == 3) {
+				m_statusReceived = true;
+			}
+		}
+		return;
+	}
+
+	auto find_id = [&line](size_t pos) -> std::string
+	{
+		const size_t k = line.find(", id = ", pos);
+		return (k != std::string::npos) ? line.substr(k + 7, 64) : std::string();
+	};
+
+	size_t k;
+
+	if ((k = line.find("add_local_block: height = ")) != std::string::npos) {
+		const uint64_t height = strtoull(line.c_str() + k + 26, nullptr, 10);
+		m_sim->on_block_found(m_index, find_id(k), height, t);
+	}
+	else if ((k = line.find("add_block: height = ")) != std::string::npos) {
+		m_sim->on_block_added(m_index, find_id(k), t);
+	}
+	else if ((k = line.find("new chain tip: next height = ")) != std::string::npos) {
+		m_tipHeight = strtoull(line.c_str() + k + 29, nullptr, 10) - 1;
+		m_tipTime = t;
+	}
+	else if (line.find("consensus ID = ") != std::string::npos) {
+		m_consensusReady = true;
+	}
+}
+
+void Node::update_stratum()
+{
+	if (!m_running || (m_stratumState != StratumState::IDLE)) {
+		return;
+	}
+
+	sockaddr_in addr;
+	uv_ip4_addr(m_ip.c_str(), m_stratumPort, &addr);
+
+	uv_tcp_init(m_loop, &m_stratum);
+	m_stratum.data = this;
+	m_stratumConnect.data = this;
+	m_stratumState = StratumState::CONNECTING;
+
+	const int err = uv_tcp_connect(&m_stratumConnect, &m_stratum, reinterpret_cast<const sockaddr*>(&addr),
+		[](uv_connect_t* req, int status)
+		{
+			Node* node = reinterpret_cast<Node*>(req->data);
+
+			if (status || (node->m_stratumState != StratumState::CONNECTING)) {
+				node->close_stratum();
+				return;
+			}
+
+			node->m_stratumState = StratumState::CONNECTED;
+
+			const int err = uv_read_start(reinterpret_cast<uv_stream_t*>(&node->m_stratum), alloc_buffer,
+				[](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf)
+				{
+					Node* node = reinterpret_cast<Node*>(stream->data);
+
+					if (nread > 0) {
+						node->m_stratumBuf.append(buf->base, static_cast<size_t>(nread));
+					}
+					free(buf->base);
+
+					if (nread < 0) {
+						node->close_stratum();
+						return;
+					}
+
+					size_t line_begin = 0;
+					for (size_t k; (k = node->m_stratumBuf.find('\n', line_begin)) != std::string::npos; line_begin = k + 1) {
+						node->on_stratum_line(node->m_stratumBuf.substr(line_begin, k - line_begin));
+					}
+					node->m_stratumBuf.erase(0, line_begin);
+				});
+
+			if (err || !write_string(reinterpret_cast<uv_stream_t*>(&node->m_stratum),
+				"{\"id\":1,\"jsonrpc\":\"2.0\",\"method\":\"login\",\"params\":{\"login\":\"x\",\"pass\":\"x\",\"agent\":\"p2pool_p2p_sim\"}}\n")) {
+				node->close_stratum();
+			}
+		});
+
+	if (err) {
+		close_stratum();
+	}
+}
+
+void Node::close_stratum()
+{
+	if ((m_stratumState != StratumState::CONNECTING) && (m_stratumState != StratumState::CONNECTED)) {
+		return;
+	}
+
+	m_stratumState = StratumState::CLOSING;
+	m_jobId.clear();
+	m_stratumBuf.clear();
+
+	uv_close(reinterpret_cast<uv_handle_t*>(&m_stratum),
+		[](uv_handle_t* h)
+		{
+			reinterpret_cast<Node*>(h->data)->m_stratumState = StratumState::IDLE;
+		});
+}
+
+void Node::on_stratum_line(const std::string& line)
+{
+	rapidjson::Document doc;
+	if (doc.Parse(line.c_str(), line.size()).HasParseError() || !doc.IsObject()) {
+		return;
+	}
+
+	if (doc.HasMember("result") && doc["result"].IsObject()) {
+		const auto& result = doc["result"];
+
+		// Login response
+		if (result.HasMember("id") && result["id"].IsString() && result.HasMember("job") && result["job"].IsObject()) {
+			m_rpcId = result["id"].GetString();
+
+			const auto& job = result["job"];
+			if (job.HasMember("job_id") && job["job_id"].IsString()) {
+				m_jobId = job["job_id"].GetString();
+			}
+			return;
+		}
+
+		if (result.HasMember("status") && result["status"].IsString() && (strcmp(result["status"].GetString(), "OK") == 0)) {
+			++m_numAccepted;
+		}
+		return;
+	}
+
+	if (doc.HasMember("error") && doc["error"].IsObject()) {
+		++m_numRejected;
+		return;
+	}
+
+	// Job notification
+	if (doc.HasMember("method") && doc["method"].IsString() && (strcmp(doc["method"].GetString(), "job") == 0) &&
+		doc.HasMember("params") && doc["params"].IsObject() && doc["params"].HasMember("job_id") && doc["params"]["job_id"].IsString()) {
+		m_jobId = doc["params"]["job_id"].GetString();
+	}
+}
+
+bool Node::submit()
+{
+	if ((m_stratumState != StratumState::CONNECTED) || m_jobId.empty()) {
+		return false;
+	}
+
+	char nonce[9];
+	snprintf(nonce, sizeof(nonce), "%08x", m_nonce++);
+
+	std::string s = "{\"id\":" + std::to_string(m_submitId++) +
+		",\"jsonrpc\":\"2.0\",\"method\":\"submit\",\"params\":{\"id\":\"" + m_rpcId +
+		"\",\"job_id\":\"" + m_jobId +
+		"\",\"nonce\":\"" + nonce +
+		"\",\"result\":\"" + FAKE_POW_HASH + "\"}}\n";
+
+	return write_string(reinterpret_cast<uv_stream_t*>(&m_stratum), std::move(s));
+}
+
+int Simulator::run()
+{
+	if (!prepare()) {
+		return 1;
+	}
+
+	uv_timer_start(&m_tickTimer, [](uv_timer_t* h) { reinterpret_cast<Simulator*>(h->data)->on_tick(); }, TICK_INTERVAL_MS, TICK_INTERVAL_MS);
+	set_phase(Phase::STARTING);
+
+	uv_run(&m_loop, UV_RUN_DEFAULT);
+
+	report();
+	return m_exitCode;
+}
+
+bool Simulator::prepare()
+{
+	if (m_options.m_nodes < 2) {
+		fprintf(stderr, "Need at least 2 nodes\n");
+		return false;
+	}
+
+	if (m_options.m_nodes > 65534) {
+		fprintf(stderr, "Too many nodes\n");
+		return false;
+	}
+
+	// Nodes run in their own directories, so the binary's path must be absolute
+	uv_fs_t req;
+	if (uv_fs_realpath(nullptr, &req, m_options.m_p2pool.c_str(), nullptr) != 0) {
+		uv_fs_req_cleanup(&req);
+		fprintf(stderr, "Can't find %s\n", m_options.m_p2pool.c_str());
+		return false;
+	}
+	m_p2pool = static_cast<const char*>(req.ptr);
+	uv_fs_req_cleanup(&req);
+
+	uv_fs_mkdir(nullptr, &req, m_options.m_dataDir.c_str(), 0755, nullptr);
+	uv_fs_req_cleanup(&req);
+
+	// Random name and password give a new sidechain every time, so the nodes never connect to anything outside of the simulation
+	{
+		const std::string path = m_options.m_dataDir + "/sim.json";
+		std::ofstream f(path, std::ios::binary | std::ios::trunc);
+		if (!f.is_open()) {
+			fprintf(stderr, "Can't write %s\n", path.c_str());
+			return false;
+		}
+
+		const uint32_t block_time = std::min<uint32_t>(std::max<uint32_t>(static_cast<uint32_t>(m_options.m_blockTime + 0.5), 1), 120);
+
+		f << "{\"name\":\"p2pool_sim_" << m_rng() << "\",\"password\":\"" << m_rng() <<
+			"\",\"block_time\":" << block_time <<
+			",\"min_diff\":" << SIDECHAIN_MIN_DIFF <<
+			",\"pplns_window\":" << SIDECHAIN_PPLNS_WINDOW <<
+			",\"uncle_penalty\":" << SIDECHAIN_UNCLE_PENALTY << "}\n";
+	}
+
+	m_monerod = new FakeMonerod(&m_loop, m_options.m_mainchainBlockTime);
+	if (!m_monerod->start("127.0.0.1", rpc_port(), zmq_port())) {
+		return false;
+	}
+
+	const uint32_t n = m_options.m_nodes;
+
+	// Topology: a ring to make sure the network is connected, plus random outgoing links up to --peers per node
+	std::vector<std::vector<uint32_t>> links(n);
+	std::vector<std::vector<bool>> connected(n, std::vector<bool>(n, false));
+
+	auto add_link = [&links, &connected](uint32_t a, uint32_t b)
+	{
+		links[a].push_back(b);
+		connected[a][b] = true;
+		connected[b][a] = true;
+	};
+
+	for (uint32_t i = 0; i < n; ++i) {
+		const uint32_t j = (i + 1) % n;
+		if (!connected[i][j]) {
+			add_link(i, j);
+		}
+	}
+
+	const uint32_t peers = std::min(m_options.m_peers, n - 1);
+
+	for (uint32_t i = 0; i < n; ++i) {
+		std::vector<uint32_t> candidates;
+		for (uint32_t j = 0; j < n; ++j) {
+			if ((j != i) && !connected[i][j]) {
+				candidates.push_back(j);
+			}
+		}
+		std::shuffle(candidates.begin(), candidates.end(), m_rng);
+
+		for (size_t k = 0; (links[i].size() < peers) && (k < candidates.size()); ++k) {
+			if (!connected[i][candidates[k]]) {
+				add_link(i, candidates[k]);
+			}
+		}
+	}
+
+	m_nodePeers.resize(n);
+	for (uint32_t i = 0; i < n; ++i) {
+		if (!create_links(i, links[i], m_nodePeers[i])) {
+			return false;
+		}
+	}
+
+	for (uint32_t i = 0; i < n; ++i) {
+		m_nodes.push_back(new Node(this, &m_loop, i, m_options.m_dataDir + "/node" + std::to_string(i), loopback_ip(1, i), m_options.m_basePort, m_options.m_basePort + 1));
+	}
+
+	printf("%u nodes, %zu links, latency %.0f-%.0f ms, bandwidth ", n, m_links.size(), m_options.m_latency.m_min, m_options.m_latency.m_max);
+	if (m_options.m_bandwidth.m_max > 0.0) {
+		printf("%.0f-%.0f KB/s\n", m_options.m_bandwidth.m_min, m_options.m_bandwidth.m_max);
+	}
+	else {
+		printf("unlimited\n");
+	}
+
+	return true;
+}
+
+bool Simulator::create_links(uint32_t from, const std::vector<uint32_t>& to, std::vector<std::string>& peers)
+{
+	std::uniform_real_distribution<double> latency(m_options.m_latency.m_min, m_options.m_latency.m_max);
+	std::uniform_real_distribution<double> bandwidth(m_options.m_bandwidth.m_min, m_options.m_bandwidth.m_max);
+
+	for (uint32_t k : to) {
+		// Each link from the same node needs its own listening port because all of them use this node's 127.2.x.y address
+		const int port = proxy_port() + static_cast<int>(peers.size());
+
+		Link* link = new Link(&m_loop, from, k, latency(m_rng), bandwidth(m_rng));
+		m_links.push_back(link);
+
+		if (!link->start(loopback_ip(2, from), port, loopback_ip(3, from), loopback_ip(1, k), m_options.m_basePort)) {
+			return false;
+		}
+
+		peers.push_back(link->address());
+	}
+
+	return true;
+}
+
+bool Simulator::start_node(uint32_t index, const std::vector<std::string>& peers)
+{
+	if (!m_nodes[index]->start(m_p2pool, m_options, rpc_port(), zmq_port(), peers)) {
+		m_exitCode = 1;
+		stop();
+		return false;
+	}
+
+	m_nodeStartTime = uv_now(&m_loop);
+	return true;
+}
+
+void Simulator::set_phase(Phase phase)
+{
+	m_phase = phase;
+	m_phaseStartTime = uv_now(&m_loop);
+
+	switch (phase) {
+	case Phase::STARTING:
+		printf("Starting nodes\n");
+		break;
+
+	case Phase::MINING:
+		printf("All nodes are ready, mining for %u seconds\n", m_options.m_duration);
+		schedule_block();
+		break;
+
+	case Phase::SETTLING:
+		printf("Mining stopped, waiting %u seconds for the network to settle\n", SETTLE_TIME);
+		uv_timer_stop(&m_blockTimer);
+		break;
+
+	case Phase::STATUS:
+		for (Node* node : m_nodes) {
+			node->send_command("status");
+		}
+		break;
+
+	case Phase::SYNC:
+		{
+			// Fresh node with a single link to node 0: it has to download the whole sidechain through this link
+			const uint32_t index = static_cast<uint32_t>(m_nodes.size());
+			m_nodes.push_back(new Node(this, &m_loop, index, m_options.m_dataDir + "/node" + std::to_string(index), loopback_ip(1, index), m_options.m_basePort, m_options.m_basePort + 1));
+			m_nodePeers.emplace_back();
+
+			m_syncTarget = m_nodes[0]->tip_height();
+			printf("Starting a fresh node to measure sync time, target height %" PRIu64 "\n", m_syncTarget);
+
+			if (create_links(index, { 0 }, m_nodePeers[index])) {
+				m_syncStartTime = wall_time_us();
+				start_node(index, m_nodePeers[index]);
+			}
+		}
+		break;
+
+	case Phase::STOPPING:
+		printf("Stopping nodes\n");
+		uv_timer_stop(&m_blockTimer);
+		for (Node* node : m_nodes) {
+			node->close_stratum();
+			node->send_command("exit");
+		}
+		break;
+	}
+}
+
+void Simulator::on_tick()
+{
+	for (Node* node : m_nodes) {
+		node->poll_log();
+		if (m_phase <= Phase::MINING) {
+			node->update_stratum();
+		}
+	}
+
+	switch (m_phase) {
+	case Phase::STARTING:
+		// Start nodes one by one because each one allocates a RandomX cache to calculate the consensus ID
+		if ((m_numNodesStarted == 0) || m_nodes[m_numNodesStarted - 1]->consensus_ready() || (uv_now(&m_loop) - m_nodeStartTime > 10000)) {
+			if (m_numNodesStarted < m_options.m_nodes) {
+				const uint32_t index = m_numNodesStarted++;
+				if (!start_node(index, m_nodePeers[index])) {
+					return;
+				}
+			}
+		}
+
+		if ((m_numNodesStarted == m_options.m_nodes) && std::all_of(m_nodes.begin(), m_nodes.end(), [](const Node* node) { return node->mining(); })) {
+			set_phase(Phase::MINING);
+		}
+		else if (phase_time() > NODE_START_TIMEOUT * 1000) {
+			fprintf(stderr, "Nodes didn't start in %u seconds\n", NODE_START_TIMEOUT);
+			m_exitCode = 1;
+			stop();
+		}
+		break;
+
+	case Phase::MINING:
+		if (phase_time() >= m_options.m_duration * 1000LL) {
+			set_phase(Phase::SETTLING);
+		}
+		break;
+
+	case Phase::SETTLING:
+		if (phase_time() >= SETTLE_TIME * 1000) {
+			set_phase(Phase::STATUS);
+		}
+		break;
+
+	case Phase::STATUS:
+		if (std::all_of(m_nodes.begin(), m_nodes.end(), [](const Node* node) { return node->status_received(); }) || (phase_time() >= STATUS_WAIT_TIME * 1000)) {
+			if (m_options.m_sync) {
+				set_phase(Phase::SYNC);
+			}
+			else {
+				stop();
+			}
+		}
+		break;
+
+	case Phase::SYNC:
+		{
+			const Node* node = m_nodes.back();
+			if ((node->tip_height() >= m_syncTarget) && (node->tip_time() > 0)) {
+				m_syncTime = node->tip_time() - m_syncStartTime;
+				stop();
+			}
+			else if (!node->running() || (phase_time() >= SYNC_TIMEOUT * 1000)) {
+				fprintf(stderr, "Fresh node didn't sync in %u seconds\n", SYNC_TIMEOUT);
+				stop();
+			}
+		}
+		break;
+
+	case Phase::STOPPING:
+		if (phase_time() >= EXIT_TIMEOUT * 1000) {
+			for (Node* node : m_nodes) {
+				node->kill();
+			}
+		}
+		break;
+	}
+}
+
+void Simulator::schedule_block()
+{
+	// Exponentially distributed time between blocks
+	std::exponential_distribution<double> d(1.0 / m_options.m_blockTime);
+	const uint64_t timeout = static_cast<uint64_t>(d(m_rng) * 1e3);
+
+	uv_timer_start(&m_blockTimer, [](uv_timer_t* h) { reinterpret_cast<Simulator*>(h->data)->on_block_timer(); }, timeout, 0);
+}
+
+void Simulator::on_block_timer()
+{
+	if (m_phase != Phase::MINING) {
+		return;
+	}
+
+	std::vector<Node*> candidates;
+	for (uint32_t i = 0; i < m_options.m_nodes; ++i) {
+		if (m_nodes[i]->mining()) {
+			candidates.push_back(m_nodes[i]);
+		}
+	}
+
+	if (!candidates.empty() && candidates[m_rng() % candidates.size()]->submit()) {
+		++m_numBlocksSubmitted;
+	}
+
+	schedule_block();
+}
+
+void Simulator::on_block_found(uint32_t node, const std::string& id, uint64_t height, int64_t t)
+{
+	if (id.empty() || (node >= m_options.m_nodes)) {
+		return;
+	}
+
+	BlockInfo& info = m_blocks[id];
+	info.m_origin = node;
+	info.m_height = height;
+	info.m_foundTime = t;
+	info.m_arrivalTimes.assign(m_options.m_nodes, -1);
+	info.m_arrivalTimes[node] = t;
+
+	// Logs are polled node by node, so other nodes' logs can mention the block before its origin's log is read
+	auto it = m_earlyArrivals.find(id);
+	if (it != m_earlyArrivals.end()) {
+		for (const auto& arrival : it->second) {
+			on_block_added(arrival.first, id, arrival.second);
+		}
+		m_earlyArrivals.erase(it);
+	}
+}
+
+void Simulator::on_block_added(uint32_t node, const std::string& id, int64_t t)
+{
+	if (id.empty() || (node >= m_options.m_nodes)) {
+		return;
+	}
+
+	auto it = m_blocks.find(id);
+	if (it == m_blocks.end()) {
+		m_earlyArrivals[id].emplace_back(node, t);
+		return;
+	}
+
+	int64_t& arrival_time = it->second.m_arrivalTimes[node];
+	if (arrival_time < 0) {
+		arrival_time = t;
+	}
+}
+
+void Simulator::on_node_exit(uint32_t node)
+{
+	if (m_phase != Phase::STOPPING) {
+		fprintf(stderr, "Node %u exited unexpectedly, check %s/node%u/p2pool.log\n", node, m_options.m_dataDir.c_str(), node);
+		m_exitCode = 1;
+		stop();
+		return;
+	}
+
+	if (std::none_of(m_nodes.begin(), m_nodes.end(), [](const Node* node) { return node->running(); })) {
+		uv_close(reinterpret_cast<uv_handle_t*>(&m_tickTimer), nullptr);
+		uv_close(reinterpret_cast<uv_handle_t*>(&m_blockTimer), nullptr);
+		for (Link* link : m_links) {
+			link->stop();
+		}
+		m_monerod->stop();
+	}
+}
+
+void Simulator::stop()
+{
+	if (m_phase == Phase::STOPPING) {
+		return;
+	}
+
+	set_phase(Phase::STOPPING);
+
+	// Nothing to wait for
+	if (std::none_of(m_nodes.begin(), m_nodes.end(), [](const Node* node) { return node->running(); })) {
+		on_node_exit(0);
+	}
+}
+
+void Simulator::report()
+{
+	const uint32_t n = m_options.m_nodes;
+
+	std::vector<int64_t> propagation;
+	std::vector<int64_t> reach_half;
+	std::vector<int64_t> reach_all;
+	uint64_t num_incomplete = 0;
+
+	for (auto& it : m_blocks) {
+		BlockInfo& info = it.second;
+
+		std::vector<int64_t> delays;
+		for (uint32_t i = 0; i < n; ++i) {
+			if ((i != info.m_origin) && (info.m_arrivalTimes[i] >= 0)) {
+				delays.push_back(std::max<int64_t>(info.m_arrivalTimes[i] - info.m_foundTime, 0));
+			}
+		}
+		propagation.insert(propagation.end(), delays.begin(), delays.end());
+
+		std::sort(delays.begin(), delays.end());
+
+		// The origin node counts as reached
+		const size_t half = (n + 1) / 2;
+		if (delays.size() + 1 >= half) {
+			reach_half.push_back((half > 1) ? delays[half - 2] : 0);
+		}
+
+		if (delays.size() + 1 == n) {
+			reach_all.push_back(delays.back());
+		}
+		else {
+			++num_incomplete;
+		}
+	}
+
+	uint64_t num_accepted = 0;
+	uint64_t num_rejected = 0;
+	for (uint32_t i = 0; i < n; ++i) {
+		num_accepted += m_nodes[i]->num_accepted();
+		num_rejected += m_nodes[i]->num_rejected();
+	}
+
+	uint64_t total_bytes = 0;
+	for (const Link* link : m_links) {
+		total_bytes += link->bytes_sent();
+	}
+
+	printf("\n");
+	printf("Blocks submitted            %" PRIu64 " (%" PRIu64 " accepted, %" PRIu64 " rejected)\n", m_numBlocksSubmitted, num_accepted, num_rejected);
+	printf("Blocks found                %zu\n", m_blocks.size());
+	printf("Blocks not reaching all nodes %" PRIu64 "\n", num_incomplete);
+	printf("Data sent over links        %.3f MB\n", total_bytes / 1048576.0);
+	print_latency("Block propagation", propagation);
+	print_latency("Time to reach 50% of nodes", reach_half);
+	print_latency("Time to reach all nodes", reach_all);
+
+	uint64_t blocks = 0;
+	uint64_t uncles = 0;
+	uint64_t orphans = 0;
+	uint32_t num_status = 0;
+
+	for (uint32_t i = 0; i < n; ++i) {
+		const Node* node = m_nodes[i];
+		if (node->status_received()) {
+			blocks += node->pplns_blocks();
+			uncles += node->pplns_uncles();
+			orphans += node->pplns_orphans();
+			++num_status;
+		}
+	}
+
+	if (num_status > 0) {
+		const uint64_t total = blocks + uncles + orphans;
+		printf("PPLNS window (avg per node) %.1f blocks, %.1f uncles, %.1f orphans\n", static_cast<double>(blocks) / num_status, static_cast<double>(uncles) / num_status, static_cast<double>(orphans) / num_status);
+		if (total > 0) {
+			printf("Uncle rate                  %.2f%%\n", uncles * 100.0 / total);
+			printf("Orphan rate                 %.2f%%\n", orphans * 100.0 / total);
+		}
+	}
+	else {
+		printf("PPLNS window                no data\n");
+	}
+
+	if (m_syncTime >= 0) {
+		printf("Sync time                   %.3f s (%" PRIu64 " blocks)\n", m_syncTime / 1e6, m_syncTarget + 1);
+	}
+	else if (m_options.m_sync) {
+		printf("Sync time                   no data\n");
+	}
+
+	printf("Main chain blocks submitted %" PRIu64 " (must be 0)\n", m_monerod ? m_monerod->num_submitted_blocks() : 0);
+}
+
+} // namespace p2pool
+
+int main(int argc, char* argv[])
+{
+	p2pool::Options options;
+
+	for (int i = 1; i < argc; ++i) {
+		bool ok = false;
+
+		if ((strcmp(argv[i], "--p2pool") == 0) && (i + 1 < argc)) {
+			options.m_p2pool = argv[++i];
+			ok = true;
+		}
+
+		if ((strcmp(argv[i], "--nodes") == 0) && (i + 1 < argc)) {
+			options.m_nodes = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+			ok = true;
+		}
+
+		if ((strcmp(argv[i], "--peers") == 0) && (i + 1 < argc)) {
+			options.m_peers = std::max<uint32_t>(strtoul(argv[++i], nullptr, 10), 1);
+			ok = true;
+		}
+
+		if ((strcmp(argv[i], "--latency") == 0) && (i + 1 < argc)) {
+			ok = p2pool::parse_range(argv[++i], options.m_latency);
+		}
+
+		if ((strcmp(argv[i], "--bandwidth") == 0) && (i + 1 < argc)) {
+			ok = p2pool::parse_range(argv[++i], options.m_bandwidth);
+		}
+
+		if ((strcmp(argv[i], "--duration") == 0) && (i + 1 < argc)) {
+			options.m_duration = std::max<uint32_t>(strtoul(argv[++i], nullptr, 10), 1);
+			ok = true;
+		}
+
+		if ((strcmp(argv[i], "--block-time") == 0) && (i + 1 < argc)) {
+			options.m_blockTime = std::max(strtod(argv[++i], nullptr), 0.1);
+			ok = true;
+		}
+
+		if ((strcmp(argv[i], "--mainchain-block-time") == 0) && (i + 1 < argc)) {
+			options.m_mainchainBlockTime = std::max<uint32_t>(strtoul(argv[++i], nullptr, 10), 1);
+			ok = true;
+		}
+
+		if ((strcmp(argv[i], "--data-dir") == 0) && (i + 1 < argc)) {
+			options.m_dataDir = argv[++i];
+			ok = true;
+		}
+
+		if ((strcmp(argv[i], "--base-port") == 0) && (i + 1 < argc)) {
+			options.m_basePort = static_cast<int>(strtoul(argv[++i], nullptr, 10));
+			ok = true;
+		}
+
+		if ((strcmp(argv[i], "--wallet") == 0) && (i + 1 < argc)) {
+			options.m_wallet = argv[++i];
+			ok = true;
+		}
+
+		if (strcmp(argv[i], "--no-sync") == 0) {
+			options.m_sync = false;
+			ok = true;
+		}
+
+		if (!ok) {
+			p2pool::usage();
+			return (strcmp(argv[i], "--help") == 0) ? 0 : 1;
+		}
+	}
+
+	if (options.m_p2pool.empty()) {
+		p2pool::usage();
+		return 1;
+	}
+
+	p2pool::Simulator sim(options);
+	return sim.run();
+}
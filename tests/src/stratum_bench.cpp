@@ -0,0 +1,695 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Stratum load generator: opens a lot of loopback connections to a running p2pool, logs in, receives jobs and submits synthetic shares
+//
+// Synthetic shares have random PoW hashes which are just below the job's target. Use a custom difficulty well below the sidechain difficulty
+// (--diff, it's the default) and p2pool will accept them without checking PoW. With --diff 0 some shares will reach the sidechain difficulty,
+// so p2pool must be built with -DWITH_STRATUM_BENCHMARK=ON which skips PoW checks, or it will ban the benchmark's connections.
+//
+// Reports:
+// - job fan-out latency: how long after the first connection each other connection got the same job (p2pool logs the time from on_block() itself)
+// - submit round-trip latency
+// - max sustainable submits/s: the submit rate is raised every --step seconds until responses can't keep up with it
+
+#include <uv.h>
+#include "rapidjson/document.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace p2pool {
+
+struct Options
+{
+	std::string m_host = "127.0.0.1";
+	int m_port = 3333;
+	uint32_t m_connections = 1000;
+	uint64_t m_diff = 10000;
+	double m_submitRate = 0.0;
+	uint32_t m_duration = 60;
+	uint32_t m_step = 5;
+	double m_maxLatency = 100.0;
+};
+
+static void usage()
+{
+	printf("Usage: p2pool_stratum_bench [options]\n\n"
+		"--host             IP address of the stratum server, default 127.0.0.1\n"
+		"--port             Stratum port, default 3333\n"
+		"--connections      Number of connections, default 1000\n"
+		"--diff             Custom difficulty to request at login, 0 to use the pool's difficulty, default 10000\n"
+		"--rate             Submit this many shares per second, 0 to find the max sustainable rate, default 0\n"
+		"--duration         Benchmark duration in seconds, default 60\n"
+		"--step             Length of each rate step in seconds when looking for the max sustainable rate, default 5\n"
+		"--max-latency      Max p99 submit round-trip latency in ms for a submit rate to be sustainable, default 100\n"
+		"--help             Show this help message\n"
+	);
+}
+
+static double percentile(std::vector<uint64_t>& samples, double p)
+{
+	if (samples.empty()) {
+		return 0.0;
+	}
+
+	const size_t index = std::min(static_cast<size_t>(p * samples.size()), samples.size() - 1);
+	std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+	return samples[index] / 1e6;
+}
+
+static void print_latency(const char* name, std::vector<uint64_t>& samples)
+{
+	if (samples.empty()) {
+		printf("%-24s no samples\n", name);
+		return;
+	}
+
+	const double p50 = percentile(samples, 0.5);
+	const double p90 = percentile(samples, 0.9);
+	const double p99 = percentile(samples, 0.99);
+	const double max = percentile(samples, 1.0);
+
+	printf("%-24s p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms (%zu samples)\n", name, p50, p90, p99, max, samples.size());
+}
+
+class LoadGenerator
+{
+public:
+	explicit LoadGenerator(const Options& options)
+		: m_options(options)
+		, m_loop{}
+		, m_timer{}
+		, m_addr{}
+		, m_connections(options.m_connections)
+		, m_numConnecting(0)
+		, m_nextConnection(0)
+		, m_numConnected(0)
+		, m_numFailed(0)
+		, m_numLoggedIn(0)
+		, m_numClosed(0)
+		, m_rng(uv_hrtime())
+		, m_nextSubmitId(2)
+		, m_nextSubmitter(0)
+		, m_submitRate(options.m_submitRate > 0.0 ? options.m_submitRate : 1000.0)
+		, m_submitBudget(0.0)
+		, m_lastTick(0)
+		, m_startTime(0)
+		, m_stepStartTime(0)
+		, m_stepSent(0)
+		, m_stepAccepted(0)
+		, m_maxSustainableRate(0.0)
+		, m_rampFinished(false)
+		, m_numSent(0)
+		, m_numAccepted(0)
+		, m_numStale(0)
+		, m_numRejected(0)
+	{
+		uv_loop_init(&m_loop);
+		uv_timer_init(&m_loop, &m_timer);
+		m_timer.data = this;
+	}
+
+	~LoadGenerator()
+	{
+		uv_loop_close(&m_loop);
+	}
+
+	int run()
+	{
+		if (uv_ip4_addr(m_options.m_host.c_str(), m_options.m_port, reinterpret_cast<sockaddr_in*>(&m_addr)) &&
+			uv_ip6_addr(m_options.m_host.c_str(), m_options.m_port, reinterpret_cast<sockaddr_in6*>(&m_addr))) {
+			fprintf(stderr, "invalid host %s\n", m_options.m_host.c_str());
+			return 1;
+		}
+
+		for (uint32_t i = 0; i < m_connections.size(); ++i) {
+			m_connections[i].m_owner = this;
+			m_connections[i].m_index = i;
+		}
+
+		printf("connecting %u clients to %s:%d\n", m_options.m_connections, m_options.m_host.c_str(), m_options.m_port);
+		connect_more();
+
+		uv_timer_start(&m_timer, on_timer, TICK_MS, TICK_MS);
+		uv_run(&m_loop, UV_RUN_DEFAULT);
+
+		report();
+		return (m_numLoggedIn > 0) ? 0 : 1;
+	}
+
+private:
+	static constexpr uint64_t TICK_MS = 10;
+	static constexpr uint32_t MAX_PENDING_CONNECTS = 128;
+
+	struct Connection
+	{
+		LoadGenerator* m_owner = nullptr;
+		uint32_t m_index = 0;
+		uv_tcp_t m_socket = {};
+		uv_connect_t m_connect = {};
+		bool m_loggedIn = false;
+		bool m_closing = false;
+		std::string m_jobId;
+		uint64_t m_target = 0;
+		uint32_t m_nonce = 0;
+		uint32_t m_readBufSize = 0;
+		char m_readBuf[16384];
+	};
+
+	struct WriteReq
+	{
+		uv_write_t m_req;
+		std::string m_data;
+	};
+
+	Options m_options;
+
+	uv_loop_t m_loop;
+	uv_timer_t m_timer;
+	sockaddr_storage m_addr;
+
+	std::vector<Connection> m_connections;
+	uint32_t m_numConnecting;
+	uint32_t m_nextConnection;
+	uint32_t m_numConnected;
+	uint32_t m_numFailed;
+	uint32_t m_numLoggedIn;
+	uint32_t m_numClosed;
+
+	std::mt19937_64 m_rng;
+
+	// Submit id -> time it was sent
+	std::unordered_map<uint32_t, uint64_t> m_pendingSubmits;
+	uint32_t m_nextSubmitId;
+	uint32_t m_nextSubmitter;
+
+	double m_submitRate;
+	double m_submitBudget;
+	uint64_t m_lastTick;
+	uint64_t m_startTime;
+
+	uint64_t m_stepStartTime;
+	uint64_t m_stepSent;
+	uint64_t m_stepAccepted;
+	std::vector<uint64_t> m_stepLatencies;
+	double m_maxSustainableRate;
+	bool m_rampFinished;
+
+	uint64_t m_numSent;
+	uint64_t m_numAccepted;
+	uint64_t m_numStale;
+	uint64_t m_numRejected;
+
+	// Job template (blob without nonce and Merkle root) -> time when the first connection received it
+	std::unordered_map<std::string, uint64_t> m_jobRounds;
+
+	std::vector<uint64_t> m_fanoutLatencies;
+	std::vector<uint64_t> m_submitLatencies;
+
+	void connect_more()
+	{
+		while ((m_numConnecting < MAX_PENDING_CONNECTS) && (m_nextConnection < m_connections.size())) {
+			Connection& c = m_connections[m_nextConnection++];
+
+			uv_tcp_init(&m_loop, &c.m_socket);
+			uv_tcp_nodelay(&c.m_socket, 1);
+			c.m_socket.data = &c;
+			c.m_connect.data = &c;
+
+			const int err = uv_tcp_connect(&c.m_connect, &c.m_socket, reinterpret_cast<const sockaddr*>(&m_addr), on_connect);
+			if (err) {
+				fprintf(stderr, "uv_tcp_connect failed, error %s\n", uv_err_name(err));
+				++m_numFailed;
+				close(c);
+				continue;
+			}
+
+			++m_numConnecting;
+		}
+	}
+
+	static void on_connect(uv_connect_t* req, int status)
+	{
+		Connection* c = reinterpret_cast<Connection*>(req->data);
+		LoadGenerator* owner = c->m_owner;
+
+		--owner->m_numConnecting;
+		owner->connect_more();
+
+		if (status != 0) {
+			if (owner->m_numFailed == 0) {
+				fprintf(stderr, "failed to connect, error %s\n", uv_err_name(status));
+			}
+			++owner->m_numFailed;
+			owner->close(*c);
+			return;
+		}
+
+		++owner->m_numConnected;
+
+		uv_read_start(reinterpret_cast<uv_stream_t*>(&c->m_socket), on_alloc, on_read);
+
+		std::string login = "x";
+		if (owner->m_options.m_diff) {
+			login += '+' + std::to_string(owner->m_options.m_diff);
+		}
+
+		owner->send(*c, "{\"id\":1,\"jsonrpc\":\"2.0\",\"method\":\"login\",\"params\":{\"login\":\"" + login + "\",\"pass\":\"x\",\"agent\":\"p2pool_stratum_bench\"}}\n");
+	}
+
+	static void on_alloc(uv_handle_t* handle, size_t /*suggested_size*/, uv_buf_t* buf)
+	{
+		Connection* c = reinterpret_cast<Connection*>(handle->data);
+		buf->base = c->m_readBuf + c->m_readBufSize;
+		buf->len = static_cast<uint32_t>(sizeof(c->m_readBuf) - c->m_readBufSize);
+	}
+
+	static void on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* /*buf*/)
+	{
+		Connection* c = reinterpret_cast<Connection*>(stream->data);
+		LoadGenerator* owner = c->m_owner;
+
+		if (nread < 0) {
+			owner->close(*c);
+			return;
+		}
+
+		c->m_readBufSize += static_cast<uint32_t>(nread);
+
+		const uint64_t t = uv_hrtime();
+
+		char* line_start = c->m_readBuf;
+		char* buf_end = c->m_readBuf + c->m_readBufSize;
+
+		for (char* p = line_start; p < buf_end; ++p) {
+			if (*p == '\n') {
+				owner->on_message(*c, line_start, static_cast<size_t>(p - line_start), t);
+				line_start = p + 1;
+			}
+		}
+
+		c->m_readBufSize = static_cast<uint32_t>(buf_end - line_start);
+		if (c->m_readBufSize >= sizeof(c->m_readBuf)) {
+			fprintf(stderr, "message is too long, closing connection\n");
+			owner->close(*c);
+			return;
+		}
+		memmove(c->m_readBuf, line_start, c->m_readBufSize);
+	}
+
+	void on_message(Connection& c, const char* data, size_t size, uint64_t t)
+	{
+		rapidjson::Document doc;
+		if (doc.Parse(data, size).HasParseError() || !doc.IsObject()) {
+			return;
+		}
+
+		// Job notification
+		if (doc.HasMember("method")) {
+			if (doc.HasMember("params")) {
+				on_job(c, doc["params"], t, true);
+			}
+			return;
+		}
+
+		if (!doc.HasMember("id") || !doc["id"].IsUint()) {
+			return;
+		}
+
+		const uint32_t id = doc["id"].GetUint();
+
+		// Login response
+		if (id == 1) {
+			if (doc.HasMember("result") && doc["result"].IsObject() && doc["result"].HasMember("job")) {
+				if (!c.m_loggedIn) {
+					c.m_loggedIn = true;
+					++m_numLoggedIn;
+				}
+				on_job(c, doc["result"]["job"], t, false);
+			}
+			else {
+				fprintf(stderr, "login failed\n");
+				close(c);
+			}
+			return;
+		}
+
+		// Submit response
+		auto it = m_pendingSubmits.find(id);
+		if (it == m_pendingSubmits.end()) {
+			return;
+		}
+
+		const uint64_t dt = t - it->second;
+		m_pendingSubmits.erase(it);
+
+		m_submitLatencies.push_back(dt);
+
+		if (doc.HasMember("error") && doc["error"].IsObject()) {
+			const rapidjson::Value& error = doc["error"];
+			if (error.HasMember("message") && error["message"].IsString() && (strcmp(error["message"].GetString(), "Stale share") == 0)) {
+				++m_numStale;
+			}
+			else {
+				++m_numRejected;
+			}
+			return;
+		}
+
+		++m_numAccepted;
+		++m_stepAccepted;
+		m_stepLatencies.push_back(dt);
+	}
+
+	void on_job(Connection& c, const rapidjson::Value& job, uint64_t t, bool notification)
+	{
+		if (!job.IsObject() || !job.HasMember("blob") || !job.HasMember("job_id") || !job.HasMember("target")) {
+			return;
+		}
+
+		const rapidjson::Value& blob = job["blob"];
+		const rapidjson::Value& job_id = job["job_id"];
+		const rapidjson::Value& target = job["target"];
+
+		if (!blob.IsString() || !job_id.IsString() || !target.IsString()) {
+			return;
+		}
+
+		c.m_jobId = job_id.GetString();
+
+		// Target is sent as 4 or 8 little-endian bytes, 4 bytes are the upper half of the 64-bit target
+		const char* s = target.GetString();
+		const size_t n = target.GetStringLength();
+		uint64_t value = 0;
+		for (size_t i = 0; (i + 1 < n) && (i < 16); i += 2) {
+			const char b[3] = { s[i], s[i + 1], '\0' };
+			value |= strtoull(b, nullptr, 16) << (i * 4);
+		}
+		c.m_target = (n == 8) ? (value << 32) : value;
+
+		// Login responses arrive whenever connections are made, only job notifications are sent by on_block()
+		if (!notification) {
+			return;
+		}
+
+		// Nonce (4 bytes at offset 39) and Merkle root (32 bytes at offset 43) are different for each connection, the rest of the blob is the same
+		std::string key = blob.GetString();
+		if (key.length() < 76 * 2) {
+			return;
+		}
+		key.erase(39 * 2, 36 * 2);
+
+		auto it = m_jobRounds.find(key);
+		if (it == m_jobRounds.end()) {
+			m_jobRounds.emplace(key, t);
+			m_fanoutLatencies.push_back(0);
+		}
+		else {
+			m_fanoutLatencies.push_back(t - it->second);
+		}
+	}
+
+	void submit(Connection& c)
+	{
+		const uint32_t id = m_nextSubmitId++;
+		if (m_nextSubmitId == 0) {
+			m_nextSubmitId = 2;
+		}
+
+		// Random hash with the highest 64 bits in [target / 2, target), it should be below the sidechain difficulty when a custom difficulty is used
+		uint8_t result[32];
+		for (size_t i = 0; i < 24; i += sizeof(uint64_t)) {
+			const uint64_t r = m_rng();
+			memcpy(result + i, &r, sizeof(r));
+		}
+
+		const uint64_t half_target = std::max<uint64_t>(c.m_target / 2, 1);
+		const uint64_t value = half_target + m_rng() % half_target;
+		memcpy(result + 24, &value, sizeof(value));
+
+		static constexpr char hex[] = "0123456789abcdef";
+
+		char nonce_hex[sizeof(uint32_t) * 2 + 1];
+		const uint32_t nonce = c.m_nonce++;
+		for (size_t i = 0; i < sizeof(uint32_t); ++i) {
+			const uint8_t b = static_cast<uint8_t>(nonce >> (i * 8));
+			nonce_hex[i * 2] = hex[b >> 4];
+			nonce_hex[i * 2 + 1] = hex[b & 15];
+		}
+		nonce_hex[sizeof(nonce_hex) - 1] = '\0';
+
+		char result_hex[sizeof(result) * 2 + 1];
+		for (size_t i = 0; i < sizeof(result); ++i) {
+			result_hex[i * 2] = hex[result[i] >> 4];
+			result_hex[i * 2 + 1] = hex[result[i] & 15];
+		}
+		result_hex[sizeof(result_hex) - 1] = '\0';
+
+		m_pendingSubmits[id] = uv_hrtime();
+		++m_numSent;
+		++m_stepSent;
+
+		send(c, "{\"id\":" + std::to_string(id) + ",\"jsonrpc\":\"2.0\",\"method\":\"submit\",\"params\":{\"id\":\"x\",\"job_id\":\"" + c.m_jobId +
+			"\",\"nonce\":\"" + nonce_hex + "\",\"result\":\"" + result_hex + "\"}}\n");
+	}
+
+	static void on_timer(uv_timer_t* handle)
+	{
+		reinterpret_cast<LoadGenerator*>(handle->data)->on_tick();
+	}
+
+	void on_tick()
+	{
+		const uint64_t t = uv_hrtime();
+
+		// Start the benchmark when all connections are made (or failed) and logged in
+		if (!m_startTime) {
+			if ((m_nextConnection < m_connections.size()) || m_numConnecting || (m_numLoggedIn + m_numClosed < m_connections.size())) {
+				return;
+			}
+
+			if (!m_numLoggedIn) {
+				stop();
+				return;
+			}
+
+			printf("%u clients logged in, %u failed to connect\n", m_numLoggedIn, m_numFailed);
+
+			m_startTime = t;
+			m_lastTick = t;
+			start_step(t);
+			return;
+		}
+
+		if (t - m_startTime >= m_options.m_duration * 1000000000ULL) {
+			if (m_options.m_submitRate <= 0.0) {
+				end_step(t);
+			}
+			stop();
+			return;
+		}
+
+		if ((m_options.m_submitRate <= 0.0) && (t - m_stepStartTime >= m_options.m_step * 1000000000ULL)) {
+			end_step(t);
+			if (m_rampFinished) {
+				stop();
+				return;
+			}
+			start_step(t);
+		}
+
+		m_submitBudget += m_submitRate * (t - m_lastTick) / 1e9;
+		m_lastTick = t;
+
+		for (uint32_t i = 0, n = static_cast<uint32_t>(m_connections.size()); (m_submitBudget >= 1.0) && (i < n); ++i) {
+			Connection& c = m_connections[m_nextSubmitter];
+			m_nextSubmitter = (m_nextSubmitter + 1) % n;
+
+			if (c.m_loggedIn && !c.m_closing && !c.m_jobId.empty()) {
+				submit(c);
+				m_submitBudget -= 1.0;
+			}
+		}
+
+		// Don't accumulate budget when there are not enough connections to send it
+		m_submitBudget = std::min(m_submitBudget, m_submitRate);
+	}
+
+	void start_step(uint64_t t)
+	{
+		m_stepStartTime = t;
+		m_stepSent = 0;
+		m_stepAccepted = 0;
+		m_stepLatencies.clear();
+	}
+
+	void end_step(uint64_t t)
+	{
+		if (m_rampFinished) {
+			return;
+		}
+
+		const double dt = (t - m_stepStartTime) / 1e9;
+		const double accepted_rate = m_stepAccepted / dt;
+		const double p99 = percentile(m_stepLatencies, 0.99);
+
+		printf("rate %.0f submits/s: sent %.0f/s, accepted %.0f/s, p99 latency %.3f ms, %zu submits pending\n",
+			m_submitRate, m_stepSent / dt, accepted_rate, p99, m_pendingSubmits.size());
+
+		// Sustainable if (almost) all submits were accepted in time
+		if ((m_stepAccepted > 0) && (accepted_rate >= m_submitRate * 0.95) && (p99 <= m_options.m_maxLatency)) {
+			m_maxSustainableRate = std::max(m_maxSustainableRate, m_submitRate);
+			m_submitRate *= 2.0;
+		}
+		else {
+			m_rampFinished = true;
+		}
+	}
+
+	void stop()
+	{
+		uv_timer_stop(&m_timer);
+		uv_close(reinterpret_cast<uv_handle_t*>(&m_timer), nullptr);
+
+		for (Connection& c : m_connections) {
+			close(c);
+		}
+	}
+
+	void send(Connection& c, std::string&& data)
+	{
+		if (c.m_closing) {
+			return;
+		}
+
+		WriteReq* req = new WriteReq();
+		req->m_req.data = req;
+		req->m_data = std::move(data);
+
+		uv_buf_t buf;
+		buf.base = &req->m_data[0];
+		buf.len = static_cast<uint32_t>(req->m_data.length());
+
+		const int err = uv_write(&req->m_req, reinterpret_cast<uv_stream_t*>(&c.m_socket), &buf, 1, [](uv_write_t* req, int) { delete reinterpret_cast<WriteReq*>(req->data); });
+		if (err) {
+			delete req;
+			close(c);
+		}
+	}
+
+	void close(Connection& c)
+	{
+		if (c.m_closing || !c.m_socket.data) {
+			return;
+		}
+
+		c.m_closing = true;
+		if (!c.m_loggedIn) {
+			++m_numClosed;
+		}
+
+		uv_close(reinterpret_cast<uv_handle_t*>(&c.m_socket), nullptr);
+	}
+
+	void report()
+	{
+		const double dt = m_startTime ? (m_lastTick - m_startTime) / 1e9 : 0.0;
+
+		printf("\n%u connections, %u logged in, %u failed to connect\n", m_options.m_connections, m_numLoggedIn, m_numFailed);
+		printf("%zu job rounds received\n", m_jobRounds.size());
+		print_latency("job fan-out latency", m_fanoutLatencies);
+		print_latency("submit round-trip", m_submitLatencies);
+		printf("%llu shares sent, %llu accepted, %llu stale, %llu rejected, %llu without response\n",
+			static_cast<unsigned long long>(m_numSent),
+			static_cast<unsigned long long>(m_numAccepted),
+			static_cast<unsigned long long>(m_numStale),
+			static_cast<unsigned long long>(m_numRejected),
+			static_cast<unsigned long long>(m_pendingSubmits.size()));
+
+		if (m_options.m_submitRate > 0.0) {
+			printf("accepted %.0f submits/s (target %.0f submits/s)\n", (dt > 0.0) ? (m_numAccepted / dt) : 0.0, m_options.m_submitRate);
+		}
+		else {
+			printf("max sustainable rate: %.0f submits/s\n", m_maxSustainableRate);
+		}
+	}
+};
+
+} // namespace p2pool
+
+int main(int argc, char* argv[])
+{
+	p2pool::Options options;
+
+	for (int i = 1; i < argc; ++i) {
+		bool ok = false;
+
+		if ((strcmp(argv[i], "--host") == 0) && (i + 1 < argc)) {
+			options.m_host = argv[++i];
+			ok = true;
+		}
+
+		if ((strcmp(argv[i], "--port") == 0) && (i + 1 < argc)) {
+			options.m_port = static_cast<int>(strtoul(argv[++i], nullptr, 10));
+			ok = true;
+		}
+
+		if ((strcmp(argv[i], "--connections") == 0) && (i + 1 < argc)) {
+			options.m_connections = std::max<uint32_t>(strtoul(argv[++i], nullptr, 10), 1);
+			ok = true;
+		}
+
+		if ((strcmp(argv[i], "--diff") == 0) && (i + 1 < argc)) {
+			options.m_diff = strtoull(argv[++i], nullptr, 10);
+			ok = true;
+		}
+
+		if ((strcmp(argv[i], "--rate") == 0) && (i + 1 < argc)) {
+			options.m_submitRate = strtod(argv[++i], nullptr);
+			ok = true;
+		}
+
+		if ((strcmp(argv[i], "--duration") == 0) && (i + 1 < argc)) {
+			options.m_duration = std::max<uint32_t>(strtoul(argv[++i], nullptr, 10), 1);
+			ok = true;
+		}
+
+		if ((strcmp(argv[i], "--step") == 0) && (i + 1 < argc)) {
+			options.m_step = std::max<uint32_t>(strtoul(argv[++i], nullptr, 10), 1);
+			ok = true;
+		}
+
+		if ((strcmp(argv[i], "--max-latency") == 0) && (i + 1 < argc)) {
+			options.m_maxLatency = strtod(argv[++i], nullptr);
+			ok = true;
+		}
+
+		if (!ok) {
+			p2pool::usage();
+			return (strcmp(argv[i], "--help") == 0) ? 0 : 1;
+		}
+	}
+
+	p2pool::LoadGenerator generator(options);
+	return generator.run();
+}
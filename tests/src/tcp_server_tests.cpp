@@ -0,0 +1,692 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "tcp_server.h"
+#include "gtest/gtest.h"
+#include <chrono>
+#include <functional>
+#include <thread>
+
+static constexpr char log_category_prefix[] = "TCPServerTest ";
+
+static constexpr int DEFAULT_BACKLOG = 512;
+
+#include "tcp_server.inl"
+
+namespace p2pool {
+
+// Roughly the size of a stratum job notification
+static constexpr uint32_t JOB_SIZE = 512;
+
+// Sends jobs to all connected clients from the event loop thread, the same way StratumServer::on_blobs_ready() does
+class FanoutServer : public TCPServer<1024, 64 * 1024>
+{
+public:
+	explicit FanoutServer(int port)
+		: TCPServer(FanoutClient::allocate, 256 * 1024, 1024 * 1024)
+		, m_fanoutAsync{}
+		, m_numJobsRequested(0)
+		, m_jobCounter(0)
+	{
+		uv_async_init(&m_loop, &m_fanoutAsync, on_fanout);
+		m_fanoutAsync.data = this;
+
+		start_listening("127.0.0.1:" + std::to_string(port));
+	}
+
+	~FanoutServer()
+	{
+		shutdown_tcp();
+	}
+
+	void on_shutdown() override
+	{
+		uv_close(reinterpret_cast<uv_handle_t*>(&m_fanoutAsync), nullptr);
+	}
+
+	struct FanoutClient : public Client
+	{
+		static Client* allocate() { return new FanoutClient(); }
+
+		bool on_connect() override { return true; }
+		bool on_read(char*, uint32_t) override { return true; }
+	};
+
+	uint32_t num_connections() const { return m_numConnections; }
+
+	void send_jobs(uint32_t count)
+	{
+		m_numJobsRequested += count;
+		uv_async_send(&m_fanoutAsync);
+	}
+
+private:
+	uv_async_t m_fanoutAsync;
+	std::atomic<uint32_t> m_numJobsRequested;
+	uint32_t m_jobCounter;
+
+	static void on_fanout(uv_async_t* handle)
+	{
+		FanoutServer* server = reinterpret_cast<FanoutServer*>(handle->data);
+
+		std::vector<Client*> clients;
+		server->get_clients(clients, false);
+
+		for (uint32_t n = server->m_numJobsRequested.exchange(0); n > 0; --n, ++server->m_jobCounter) {
+			const uint8_t value = static_cast<uint8_t>(server->m_jobCounter);
+			for (Client* client : clients) {
+				server->send(client, [value](void* buf) { memset(buf, value, JOB_SIZE); return JOB_SIZE; });
+			}
+		}
+	}
+};
+
+// Simulated miners: plain libuv connections which check that every byte of every job arrives in order
+class Miners
+{
+public:
+	explicit Miners(uint32_t count)
+		: m_loop{}
+		, m_timer{}
+		, m_miners(count)
+		, m_numConnected(0)
+		, m_numFailed(0)
+		, m_totalReceived(0)
+	{
+		uv_loop_init(&m_loop);
+
+		// Wakes up uv_run() regularly, so timeouts can be checked
+		uv_timer_init(&m_loop, &m_timer);
+		uv_timer_start(&m_timer, [](uv_timer_t*) {}, 10, 10);
+	}
+
+	~Miners()
+	{
+		for (Miner& m : m_miners) {
+			uv_handle_t* h = reinterpret_cast<uv_handle_t*>(&m.m_socket);
+			if (m.m_socket.data && !uv_is_closing(h)) {
+				uv_close(h, nullptr);
+			}
+		}
+		uv_close(reinterpret_cast<uv_handle_t*>(&m_timer), nullptr);
+		uv_run(&m_loop, UV_RUN_DEFAULT);
+		uv_loop_close(&m_loop);
+	}
+
+	bool connect(int port, const FanoutServer& server)
+	{
+		sockaddr_in addr;
+		uv_ip4_addr("127.0.0.1", port, &addr);
+
+		for (Miner& m : m_miners) {
+			m.m_owner = this;
+			uv_tcp_init(&m_loop, &m.m_socket);
+			m.m_socket.data = &m;
+			m.m_connect.data = &m;
+			uv_tcp_connect(&m.m_connect, &m.m_socket, reinterpret_cast<const sockaddr*>(&addr), on_connect);
+		}
+
+		return run_until([this, &server]() { return (m_numConnected + m_numFailed == m_miners.size()) && (server.num_connections() == m_miners.size()); }) && (m_numFailed == 0);
+	}
+
+	bool receive(uint64_t bytes_per_miner)
+	{
+		const uint64_t total = bytes_per_miner * m_miners.size();
+		return run_until([this, total]() { return m_totalReceived >= total; });
+	}
+
+	template<typename T>
+	bool run_until(T&& condition)
+	{
+		using namespace std::chrono;
+		const auto deadline = steady_clock::now() + seconds(30);
+
+		while (!condition()) {
+			if (steady_clock::now() >= deadline) {
+				return false;
+			}
+			uv_run(&m_loop, UV_RUN_ONCE);
+		}
+		return true;
+	}
+
+	struct Miner
+	{
+		Miners* m_owner = nullptr;
+		uv_tcp_t m_socket = {};
+		uv_connect_t m_connect = {};
+		uint64_t m_received = 0;
+		bool m_valid = true;
+		char m_buf[16384];
+	};
+
+	std::vector<Miner>& miners() { return m_miners; }
+
+private:
+	static void on_connect(uv_connect_t* req, int status)
+	{
+		Miner* m = reinterpret_cast<Miner*>(req->data);
+		if (status != 0) {
+			++m->m_owner->m_numFailed;
+			return;
+		}
+
+		++m->m_owner->m_numConnected;
+
+		uv_read_start(reinterpret_cast<uv_stream_t*>(&m->m_socket),
+			[](uv_handle_t* handle, size_t, uv_buf_t* buf)
+			{
+				Miner* m = reinterpret_cast<Miner*>(handle->data);
+				buf->base = m->m_buf;
+				buf->len = sizeof(m->m_buf);
+			},
+			[](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf)
+			{
+				Miner* m = reinterpret_cast<Miner*>(stream->data);
+				if (nread <= 0) {
+					return;
+				}
+
+				for (ssize_t i = 0; i < nread; ++i, ++m->m_received) {
+					if (static_cast<uint8_t>(buf->base[i]) != static_cast<uint8_t>(m->m_received / JOB_SIZE)) {
+						m->m_valid = false;
+					}
+				}
+
+				m->m_owner->m_totalReceived += static_cast<uint64_t>(nread);
+			});
+	}
+
+	uv_loop_t m_loop;
+	uv_timer_t m_timer;
+
+	std::vector<Miner> m_miners;
+	size_t m_numConnected;
+	size_t m_numFailed;
+	uint64_t m_totalReceived;
+};
+
+static void fanout(int port, uint32_t num_miners, uint32_t num_jobs)
+{
+	FanoutServer server(port);
+	Miners miners(num_miners);
+
+	EXPECT_TRUE(miners.connect(port, server));
+
+	server.send_jobs(num_jobs);
+	EXPECT_TRUE(miners.receive(static_cast<uint64_t>(num_jobs) * JOB_SIZE));
+
+	for (const Miners::Miner& m : miners.miners()) {
+		EXPECT_EQ(m.m_received, static_cast<uint64_t>(num_jobs) * JOB_SIZE);
+		EXPECT_TRUE(m.m_valid);
+	}
+}
+
+TEST(tcp_server, fanout)
+{
+	fanout(37891, 32, 100);
+}
+
+TEST(tcp_server, fanout_many_clients)
+{
+	fanout(37892, 256, 200);
+}
+
+
+// Every byte of a test stream is a function of its offset, so lost, duplicated or reordered data is detected
+static FORCEINLINE uint8_t stream_byte(uint64_t offset)
+{
+	return static_cast<uint8_t>(offset ^ (offset >> 8) ^ (offset >> 16));
+}
+
+static void fill_stream(uint8_t* p, size_t size, uint64_t offset)
+{
+	for (size_t i = 0; i < size; ++i) {
+		p[i] = stream_byte(offset + i);
+	}
+}
+
+static constexpr uint32_t TEST_READ_BUF_SIZE = 64 * 1024;
+
+// Runs tasks in its event loop thread and receives length-prefixed messages
+class TestServer : public TCPServer<TEST_READ_BUF_SIZE, 64 * 1024>
+{
+public:
+	TestServer(int port, size_t write_queue_high_water_mark, size_t write_queue_max_size)
+		: TCPServer(TestClient::allocate, write_queue_high_water_mark, write_queue_max_size)
+		, m_taskAsync{}
+		, m_taskDone(true)
+		, m_messagesLock{}
+	{
+		uv_mutex_init_checked(&m_messagesLock);
+
+		uv_async_init(&m_loop, &m_taskAsync, on_task);
+		m_taskAsync.data = this;
+
+		start_listening("127.0.0.1:" + std::to_string(port));
+	}
+
+	~TestServer()
+	{
+		shutdown_tcp();
+		uv_mutex_destroy(&m_messagesLock);
+	}
+
+	void on_shutdown() override
+	{
+		uv_close(reinterpret_cast<uv_handle_t*>(&m_taskAsync), nullptr);
+	}
+
+	// A message is a 4-byte size followed by the stream bytes, it's checked and its size is saved along with the read buffer it was parsed from
+	struct Message
+	{
+		uint32_t m_size;
+		bool m_valid;
+		bool m_bigReadBuf;
+	};
+
+	struct TestClient : public Client
+	{
+		static Client* allocate() { return new TestClient(); }
+
+		bool on_connect() override { return true; }
+
+		bool on_read(char* data, uint32_t size) override
+		{
+			if ((data != m_readBuf + m_numRead) || (data + size > m_readBuf + m_readBufSize)) {
+				return false;
+			}
+
+			m_numRead += size;
+
+			const uint8_t* p = reinterpret_cast<uint8_t*>(m_readBuf);
+			uint32_t bytes_left = m_numRead;
+
+			while (bytes_left >= sizeof(uint32_t)) {
+				uint32_t n;
+				memcpy(&n, p, sizeof(n));
+
+				if (bytes_left < sizeof(uint32_t) + n) {
+					break;
+				}
+
+				Message msg{ n, true, m_readBuf != m_smallReadBuf };
+				for (uint32_t i = 0; i < n; ++i) {
+					if (p[sizeof(uint32_t) + i] != stream_byte(i)) {
+						msg.m_valid = false;
+					}
+				}
+
+				TestServer* server = static_cast<TestServer*>(m_owner);
+				{
+					MutexLock lock(server->m_messagesLock);
+					server->m_messages.push_back(msg);
+				}
+
+				p += sizeof(uint32_t) + n;
+				bytes_left -= sizeof(uint32_t) + n;
+			}
+
+			memmove(m_readBuf, p, bytes_left);
+			m_numRead = bytes_left;
+
+			return true;
+		}
+	};
+
+	uint32_t num_connections() const { return m_numConnections; }
+
+	// Runs "task" in the event loop thread, task_done() becomes true when it's finished
+	void post(std::function<void(TestServer*)>&& task)
+	{
+		m_task = std::move(task);
+		m_taskDone = false;
+		uv_async_send(&m_taskAsync);
+	}
+
+	bool task_done() const { return m_taskDone.load(); }
+
+	TestClient* get_client()
+	{
+		std::vector<TestClient*> clients;
+		get_clients(clients, false);
+		return clients.empty() ? nullptr : clients.front();
+	}
+
+	std::vector<Message> messages()
+	{
+		MutexLock lock(m_messagesLock);
+		return m_messages;
+	}
+
+private:
+	uv_async_t m_taskAsync;
+	std::function<void(TestServer*)> m_task;
+	std::atomic<bool> m_taskDone;
+
+	uv_mutex_t m_messagesLock;
+	std::vector<Message> m_messages;
+
+	static void on_task(uv_async_t* handle)
+	{
+		TestServer* server = reinterpret_cast<TestServer*>(handle->data);
+		if (!server->m_taskDone.load()) {
+			server->m_task(server);
+			server->m_taskDone = true;
+		}
+	}
+};
+
+// Plain libuv connection to TestServer
+class Peer
+{
+public:
+	Peer()
+		: m_loop{}
+		, m_timer{}
+		, m_socket{}
+		, m_connect{}
+		, m_write{}
+		, m_connected(false)
+		, m_failed(false)
+		, m_writeDone(false)
+		, m_eof(false)
+		, m_received(0)
+		, m_valid(true)
+	{
+		uv_loop_init(&m_loop);
+
+		// Wakes up uv_run() regularly, so timeouts can be checked
+		uv_timer_init(&m_loop, &m_timer);
+		uv_timer_start(&m_timer, [](uv_timer_t*) {}, 10, 10);
+	}
+
+	~Peer()
+	{
+		uv_handle_t* h = reinterpret_cast<uv_handle_t*>(&m_socket);
+		if (m_socket.data && !uv_is_closing(h)) {
+			uv_close(h, nullptr);
+		}
+		uv_close(reinterpret_cast<uv_handle_t*>(&m_timer), nullptr);
+		uv_run(&m_loop, UV_RUN_DEFAULT);
+		uv_loop_close(&m_loop);
+	}
+
+	bool connect(int port, const TestServer& server)
+	{
+		sockaddr_in addr;
+		uv_ip4_addr("127.0.0.1", port, &addr);
+
+		uv_tcp_init(&m_loop, &m_socket);
+		m_socket.data = this;
+		m_connect.data = this;
+
+		uv_tcp_connect(&m_connect, &m_socket, reinterpret_cast<const sockaddr*>(&addr),
+			[](uv_connect_t* req, int status)
+			{
+				Peer* pThis = reinterpret_cast<Peer*>(req->data);
+				if (status == 0) {
+					pThis->m_connected = true;
+				}
+				else {
+					pThis->m_failed = true;
+				}
+			});
+
+		return run_until([this, &server]() { return m_failed || (m_connected && (server.num_connections() == 1)); }) && m_connected;
+	}
+
+	// Received data is checked against the test stream
+	void start_reading()
+	{
+		uv_read_start(reinterpret_cast<uv_stream_t*>(&m_socket),
+			[](uv_handle_t* handle, size_t, uv_buf_t* buf)
+			{
+				Peer* pThis = reinterpret_cast<Peer*>(handle->data);
+				buf->base = pThis->m_buf;
+				buf->len = sizeof(pThis->m_buf);
+			},
+			[](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf)
+			{
+				Peer* pThis = reinterpret_cast<Peer*>(stream->data);
+				if (nread < 0) {
+					pThis->m_eof = true;
+					return;
+				}
+
+				for (ssize_t i = 0; i < nread; ++i, ++pThis->m_received) {
+					if (static_cast<uint8_t>(buf->base[i]) != stream_byte(pThis->m_received)) {
+						pThis->m_valid = false;
+					}
+				}
+			});
+	}
+
+	// Sends a message for TestServer::TestClient::on_read()
+	bool write_message(uint32_t size)
+	{
+		m_writeData.resize(sizeof(uint32_t) + size);
+		memcpy(m_writeData.data(), &size, sizeof(uint32_t));
+		fill_stream(m_writeData.data() + sizeof(uint32_t), size, 0);
+
+		uv_buf_t buf = uv_buf_init(reinterpret_cast<char*>(m_writeData.data()), static_cast<uint32_t>(m_writeData.size()));
+
+		m_writeDone = false;
+		m_write.data = this;
+
+		const int err = uv_write(&m_write, reinterpret_cast<uv_stream_t*>(&m_socket), &buf, 1,
+			[](uv_write_t* req, int)
+			{
+				reinterpret_cast<Peer*>(req->data)->m_writeDone = true;
+			});
+
+		return (err == 0) && run_until([this]() { return m_writeDone; });
+	}
+
+	template<typename T>
+	bool run_until(T&& condition)
+	{
+		using namespace std::chrono;
+		const auto deadline = steady_clock::now() + seconds(30);
+
+		while (!condition()) {
+			if (steady_clock::now() >= deadline) {
+				return false;
+			}
+			uv_run(&m_loop, UV_RUN_ONCE);
+		}
+		return true;
+	}
+
+	uint64_t received() const { return m_received; }
+	bool valid() const { return m_valid; }
+
+private:
+	uv_loop_t m_loop;
+	uv_timer_t m_timer;
+	uv_tcp_t m_socket;
+	uv_connect_t m_connect;
+	uv_write_t m_write;
+
+	bool m_connected;
+	bool m_failed;
+	bool m_writeDone;
+	bool m_eof;
+
+	uint64_t m_received;
+	bool m_valid;
+
+	std::vector<uint8_t> m_writeData;
+	char m_buf[16384];
+};
+
+// The peer doesn't read anything: broadcasts are dropped above the high-water mark, and the peer is disconnected when the write queue goes above the limit
+TEST(tcp_server, write_queue_limits)
+{
+	constexpr int port = 37893;
+	constexpr size_t high_water_mark = 64 * 1024;
+	constexpr size_t max_size = 256 * 1024;
+	constexpr uint32_t message_size = 32 * 1024;
+
+	TestServer server(port, high_water_mark, max_size);
+	Peer peer;
+
+	ASSERT_TRUE(peer.connect(port, server));
+
+	uint32_t num_sent = 0;
+	bool dropped = false;
+	bool connected_after_drop = false;
+	uint32_t num_sent_after_drop = 0;
+	bool disconnected = false;
+
+	server.post([&](TestServer* s)
+		{
+			TestServer::TestClient* client = s->get_client();
+			if (!client) {
+				return;
+			}
+
+			auto payload = std::make_shared<std::vector<uint8_t>>(message_size);
+			const uv_buf_t buf = uv_buf_init(reinterpret_cast<char*>(payload->data()), message_size);
+
+			// Kernel socket buffers take some data first, the write queue grows only when they're full
+			for (uint32_t i = 0; (i < 16384) && !dropped; ++i) {
+				if (s->send(client, [](void*) { return 0; }, { buf }, payload, true)) {
+					++num_sent;
+				}
+				else {
+					dropped = true;
+					connected_after_drop = (client->m_owner != nullptr) && !uv_is_closing(reinterpret_cast<uv_handle_t*>(&client->m_socket));
+				}
+			}
+
+			// Messages which can't be dropped are still queued until the write queue is full
+			for (uint32_t i = 0; (i < 64) && dropped && !disconnected; ++i) {
+				if (s->send(client, [](void*) { return 0; }, { buf }, payload)) {
+					++num_sent_after_drop;
+				}
+				else {
+					disconnected = true;
+				}
+			}
+		});
+
+	ASSERT_TRUE(peer.run_until([&server]() { return server.task_done() && (server.num_connections() == 0); }));
+
+	EXPECT_GT(num_sent, 0U);
+	EXPECT_TRUE(dropped);
+	EXPECT_TRUE(connected_after_drop);
+	EXPECT_TRUE(disconnected);
+
+	// At least one message fits between the high-water mark and the limit, but no more than the difference between them
+	EXPECT_GE(num_sent_after_drop, 1U);
+	EXPECT_LE(num_sent_after_drop, (max_size - high_water_mark) / message_size + 1);
+}
+
+// Coalesced small messages and scatter-gather messages with payload must arrive in the order they were sent
+TEST(tcp_server, mixed_send_order)
+{
+	constexpr int port = 37894;
+	constexpr uint32_t num_messages = 1000;
+
+	TestServer server(port, 64 << 20, 64 << 20);
+	Peer peer;
+
+	ASSERT_TRUE(peer.connect(port, server));
+	peer.start_reading();
+
+	uint64_t total_size = 0;
+	bool all_sent = true;
+
+	server.post([&](TestServer* s)
+		{
+			TestServer::TestClient* client = s->get_client();
+			if (!client) {
+				all_sent = false;
+				return;
+			}
+
+			for (uint32_t i = 0; i < num_messages; ++i) {
+				const uint64_t offset = total_size;
+
+				if (i % 3 != 2) {
+					const uint32_t size = 50 + (i % 200);
+					all_sent &= s->send(client, [offset, size](void* buf) { fill_stream(reinterpret_cast<uint8_t*>(buf), size, offset); return size; });
+					total_size += size;
+					continue;
+				}
+
+				// 8-byte header from the callback and two payload segments
+				constexpr uint32_t header_size = 8;
+				const uint32_t size1 = 1000 + (i % 3000);
+				const uint32_t size2 = 5000;
+
+				auto payload = std::make_shared<std::vector<uint8_t>>(size1 + size2);
+				fill_stream(payload->data(), payload->size(), offset + header_size);
+
+				all_sent &= s->send(client, [offset](void* buf) { fill_stream(reinterpret_cast<uint8_t*>(buf), header_size, offset); return header_size; },
+					{
+						uv_buf_init(reinterpret_cast<char*>(payload->data()), size1),
+						uv_buf_init(reinterpret_cast<char*>(payload->data() + size1), size2),
+					},
+					payload);
+
+				total_size += header_size + size1 + size2;
+			}
+		});
+
+	ASSERT_TRUE(peer.run_until([&]() { return server.task_done() && (peer.received() >= total_size); }));
+
+	EXPECT_TRUE(all_sent);
+	EXPECT_EQ(peer.received(), total_size);
+	EXPECT_TRUE(peer.valid());
+}
+
+// Messages bigger than the small read buffer are read into a full size buffer, and it's given back when the connection is idle again
+TEST(tcp_server, read_buffer_grow_shrink)
+{
+	constexpr int port = 37895;
+
+	TestServer server(port, 1 << 20, 4 << 20);
+	Peer peer;
+
+	ASSERT_TRUE(peer.connect(port, server));
+
+	constexpr uint32_t small_size = TestServer::SMALL_READ_BUF_SIZE / 4;
+	constexpr uint32_t big_size = TEST_READ_BUF_SIZE - 1024;
+
+	static_assert(big_size > TestServer::SMALL_READ_BUF_SIZE, "message must not fit in the small read buffer");
+
+	const uint32_t sizes[] = { small_size, big_size, small_size, TestServer::SMALL_READ_BUF_SIZE * 2, small_size, small_size };
+
+	for (size_t i = 0; i < array_size(sizes); ++i) {
+		ASSERT_TRUE(peer.write_message(sizes[i]));
+		ASSERT_TRUE(peer.run_until([&server, i]() { return server.messages().size() > i; }));
+	}
+
+	const std::vector<TestServer::Message> messages = server.messages();
+	ASSERT_EQ(messages.size(), array_size(sizes));
+
+	for (size_t i = 0; i < array_size(sizes); ++i) {
+		EXPECT_EQ(messages[i].m_size, sizes[i]);
+		EXPECT_TRUE(messages[i].m_valid);
+		EXPECT_EQ(messages[i].m_bigReadBuf, sizes[i] + sizeof(uint32_t) > TestServer::SMALL_READ_BUF_SIZE);
+	}
+}
+
+}
@@ -0,0 +1,134 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "tx_selection.h"
+#include "gtest/gtest.h"
+#include <random>
+
+namespace p2pool {
+
+static constexpr uint64_t BASE_REWARD = 600000000000ULL;
+static constexpr uint64_t MEDIAN_WEIGHT = 300000;
+static constexpr uint64_t MINER_TX_WEIGHT = 2000;
+
+static std::vector<TxMempoolData> random_transactions(std::mt19937_64& rng, size_t count, uint64_t min_weight, uint64_t max_weight)
+{
+	std::vector<TxMempoolData> txs(count);
+
+	for (size_t i = 0; i < count; ++i) {
+		TxMempoolData& tx = txs[i];
+		memcpy(tx.id.h, &i, sizeof(i));
+		tx.weight = min_weight + rng() % (max_weight - min_weight + 1);
+
+		// 20-320 piconero per byte, roughly what the network has when blocks get into the penalty zone
+		tx.fee = tx.weight * (20 + rng() % 301) + rng() % 1000;
+	}
+
+	return txs;
+}
+
+static void check_selection(const std::vector<TxMempoolData>& txs, const TxSelection& s)
+{
+	uint64_t fees = 0;
+	uint64_t weight = MINER_TX_WEIGHT;
+	for (int i : s.txs) {
+		fees += txs[i].fee;
+		weight += txs[i].weight;
+	}
+
+	ASSERT_EQ(fees, s.fees);
+	ASSERT_EQ(weight, s.weight);
+	ASSERT_EQ(get_block_reward(BASE_REWARD, MEDIAN_WEIGHT, fees, weight), s.reward);
+}
+
+TEST(tx_selection, block_reward)
+{
+	ASSERT_EQ(get_block_reward(BASE_REWARD, MEDIAN_WEIGHT, 12345, MEDIAN_WEIGHT), BASE_REWARD + 12345);
+	ASSERT_EQ(get_block_reward(BASE_REWARD, MEDIAN_WEIGHT, 12345, MEDIAN_WEIGHT * 2), 12345);
+	ASSERT_EQ(get_block_reward(BASE_REWARD, MEDIAN_WEIGHT, 12345, MEDIAN_WEIGHT * 2 + 1), 0);
+
+	// 1.5 * median weight = 25% penalty
+	ASSERT_EQ(get_block_reward(BASE_REWARD, MEDIAN_WEIGHT, 0, MEDIAN_WEIGHT * 3 / 2), BASE_REWARD / 4 * 3);
+}
+
+TEST(tx_selection, no_penalty)
+{
+	std::mt19937_64 rng(1);
+	const std::vector<TxMempoolData> txs = random_transactions(rng, 100, 1000, 2000);
+
+	TxSelection s;
+	select_transactions_greedy(txs, BASE_REWARD, MEDIAN_WEIGHT, MINER_TX_WEIGHT, s);
+	check_selection(txs, s);
+	ASSERT_EQ(s.txs.size(), txs.size());
+
+	TxSelection s2 = s;
+	ASSERT_TRUE(select_transactions_optimal(txs, BASE_REWARD, MEDIAN_WEIGHT, MINER_TX_WEIGHT, 1000, s2));
+	ASSERT_EQ(s2.reward, s.reward);
+}
+
+TEST(tx_selection, brute_force)
+{
+	std::mt19937_64 rng(2);
+
+	for (int iter = 0; iter < 200; ++iter) {
+		// Few big transactions that don't all fit under the median weight
+		const size_t n = 4 + rng() % 11;
+		const std::vector<TxMempoolData> txs = random_transactions(rng, n, MEDIAN_WEIGHT / 8, MEDIAN_WEIGHT / 3);
+
+		uint64_t best = 0;
+		for (uint32_t mask = 0; mask < (1U << n); ++mask) {
+			uint64_t fees = 0;
+			uint64_t weight = MINER_TX_WEIGHT;
+			for (size_t i = 0; i < n; ++i) {
+				if (mask & (1U << i)) {
+					fees += txs[i].fee;
+					weight += txs[i].weight;
+				}
+			}
+			best = std::max(best, get_block_reward(BASE_REWARD, MEDIAN_WEIGHT, fees, weight));
+		}
+
+		TxSelection s;
+		select_transactions_greedy(txs, BASE_REWARD, MEDIAN_WEIGHT, MINER_TX_WEIGHT, s);
+		check_selection(txs, s);
+		ASSERT_LE(s.reward, best);
+
+		ASSERT_TRUE(select_transactions_optimal(txs, BASE_REWARD, MEDIAN_WEIGHT, MINER_TX_WEIGHT, 10000, s));
+		check_selection(txs, s);
+		ASSERT_EQ(s.reward, best);
+	}
+}
+
+TEST(tx_selection, full_mempool)
+{
+	std::mt19937_64 rng(3);
+
+	// 1000 transactions (the limit used by BlockTemplate) with total weight well above 2x median weight
+	const std::vector<TxMempoolData> txs = random_transactions(rng, 1000, 1500, 3000);
+
+	TxSelection greedy;
+	select_transactions_greedy(txs, BASE_REWARD, MEDIAN_WEIGHT, MINER_TX_WEIGHT, greedy);
+	check_selection(txs, greedy);
+
+	TxSelection s = greedy;
+	select_transactions_optimal(txs, BASE_REWARD, MEDIAN_WEIGHT, MINER_TX_WEIGHT, 500, s);
+	check_selection(txs, s);
+	ASSERT_GE(s.reward, greedy.reward);
+}
+
+}
@@ -0,0 +1,78 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "keccak.h"
+#include "gtest/gtest.h"
+
+namespace p2pool {
+
+static hash test_hash(uint64_t i)
+{
+	hash h;
+	keccak(reinterpret_cast<const uint8_t*>(&i), sizeof(i), h.h, HASH_SIZE);
+	return h;
+}
+
+TEST(util, rolling_bloom_filter)
+{
+	RollingBloomFilter filter;
+
+	constexpr uint64_t N = RollingBloomFilter::CAPACITY;
+
+	for (uint64_t i = 0; i < N * 2; ++i) {
+		ASSERT_FALSE(filter.contains(test_hash(i)));
+		filter.add(test_hash(i));
+		ASSERT_TRUE(filter.contains(test_hash(i)));
+	}
+
+	// The last 2 generations are remembered
+	for (uint64_t i = 0; i < N * 2; ++i) {
+		ASSERT_TRUE(filter.contains(test_hash(i)));
+	}
+
+	// Adding one more hash starts a new generation, the oldest one is forgotten
+	filter.add(test_hash(N * 2));
+
+	uint64_t num_found = 0;
+	for (uint64_t i = 0; i < N; ++i) {
+		if (filter.contains(test_hash(i))) {
+			++num_found;
+		}
+	}
+	ASSERT_LE(num_found, 1U);
+
+	for (uint64_t i = N; i <= N * 2; ++i) {
+		ASSERT_TRUE(filter.contains(test_hash(i)));
+	}
+
+	// False positive rate must be low
+	uint64_t num_false_positives = 0;
+	for (uint64_t i = N * 4; i < N * 4 + 100000; ++i) {
+		if (filter.contains(test_hash(i))) {
+			++num_false_positives;
+		}
+	}
+	ASSERT_LT(num_false_positives, 10U);
+
+	filter.clear();
+	for (uint64_t i = 0; i <= N * 2; ++i) {
+		ASSERT_FALSE(filter.contains(test_hash(i)));
+	}
+}
+
+}